@@ -491,7 +491,24 @@ bool ApEaselMetadataManager::tryAddingApEaselMetadataLocked(
 void ApEaselMetadataManager::addEaselTimestamp(int64_t easelTimestampNs,
         std::shared_ptr<pbcamera::FrameMetadata> *frameMetadata) {
     Mutex::Autolock l(mLock);
+    addEaselTimestampLocked(easelTimestampNs, frameMetadata);
+}
+
+void ApEaselMetadataManager::addEaselTimestamps(const std::vector<int64_t> &easelTimestampsNs,
+        std::vector<std::shared_ptr<pbcamera::FrameMetadata>> *frameMetadata) {
+    Mutex::Autolock l(mLock);
+
+    for (int64_t easelTimestampNs : easelTimestampsNs) {
+        std::shared_ptr<pbcamera::FrameMetadata> matchingFrameMetadata;
+        addEaselTimestampLocked(easelTimestampNs, &matchingFrameMetadata);
+        if (matchingFrameMetadata != nullptr && frameMetadata != nullptr) {
+            frameMetadata->push_back(matchingFrameMetadata);
+        }
+    }
+}
 
+void ApEaselMetadataManager::addEaselTimestampLocked(int64_t easelTimestampNs,
+        std::shared_ptr<pbcamera::FrameMetadata> *frameMetadata) {
     // Look for a matching CameraMetadata.
     auto cameraMetadata = mPendingCameraMetadata.begin();
     while (cameraMetadata != mPendingCameraMetadata.end()) {
@@ -18,6 +18,7 @@
 
 #include <deque>
 #include <map>
+#include <vector>
 #include <utils/Errors.h>
 #include <utils/Mutex.h>
 
@@ -76,6 +77,17 @@ public:
     void addEaselTimestamp(int64_t easelTimestampNs,
             std::shared_ptr<pbcamera::FrameMetadata> *frameMetadata);
 
+    /*
+     * Add a batch of new Easel timestamps under one lock acquisition, and output a
+     * pbcamera::FrameMetadata for each of them that has a matching CameraMetadata.
+     *
+     * easelTimestampsNs are the new Easel timestamps to add, in capture order.
+     * frameMetadata is an output parameter and will be appended with the matching
+     *               pbcamera::FrameMetadata for the Easel timestamps, in the same order.
+     */
+    void addEaselTimestamps(const std::vector<int64_t> &easelTimestampsNs,
+            std::vector<std::shared_ptr<pbcamera::FrameMetadata>> *frameMetadata);
+
     /*
      * Add a new CameraMetadata and if a matching Easel timestamp is found, output a
      * pbcamera::FrameMetadata.
@@ -138,6 +150,10 @@ private:
     bool tryAddingApEaselMetadataLocked(std::shared_ptr<CameraMetadata> cameraMetadata,
             int64_t easelTimestamp, std::shared_ptr<pbcamera::FrameMetadata> *frameMetadata);
 
+    // Add a new Easel timestamp. Must be called with mLock held.
+    void addEaselTimestampLocked(int64_t easelTimestampNs,
+            std::shared_ptr<pbcamera::FrameMetadata> *frameMetadata);
+
     // Protecting the follow containers.
     Mutex mLock;
 
@@ -427,6 +427,26 @@ void HdrPlusClientImpl::notifyFrameEaselTimestamp(int64_t easelTimestampNs) {
     }
 }
 
+void HdrPlusClientImpl::notifyFrameEaselTimestamps(const std::vector<int64_t> &easelTimestampsNs) {
+    ALOGV("%s: Got %zu Easel timestamps", __FUNCTION__, easelTimestampsNs.size());
+
+    std::vector<std::shared_ptr<pbcamera::FrameMetadata>> frameMetadata;
+
+    // Add all Easel timestamps to metadata manager at once and send the PB frame metadata that
+    // are ready to the HDR+ service.
+    mApEaselMetadataManager.addEaselTimestamps(easelTimestampsNs, &frameMetadata);
+    if (frameMetadata.size() == 0) return;
+
+    if (mNotifyFrameMetadataThread == nullptr) {
+        ALOGE("%s: Notify frame metadata thread is not initialized.", __FUNCTION__);
+        return;
+    }
+
+    for (auto &metadata : frameMetadata) {
+        mNotifyFrameMetadataThread->queueFrameMetadata(metadata);
+    }
+}
+
 void HdrPlusClientImpl::notifyServiceClosed() {
     // Return all pending requests.
     if (!mDisconnecting) {
@@ -796,6 +816,39 @@ void HdrPlusClientImpl::notifyAtrace(const std::string &trace, int32_t cookie, i
     }
 }
 
+void HdrPlusClientImpl::notifyAtraceEvents(const std::vector<pbcamera::AtraceEvent> &events,
+        uint32_t dropped) {
+    if (dropped > 0) {
+        ALOGW("%s: Easel dropped %u trace events.", __FUNCTION__, dropped);
+    }
+
+    if (!ATRACE_ENABLED() || events.empty()) return;
+
+    // How long the oldest event of the batch took to get here. Easel slices are this much later
+    // in the trace than they happened.
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    int64_t nowNs = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    ATRACE_INT64("EaselTraceDelayUs", (nowNs - events.front().apTimestampNs) / 1000);
+
+    for (auto &event : events) {
+        switch (event.type) {
+            case pbcamera::kAtraceBegin:
+                ATRACE_ASYNC_BEGIN(event.name, static_cast<int32_t>(event.value));
+                break;
+            case pbcamera::kAtraceEnd:
+                ATRACE_ASYNC_END(event.name, static_cast<int32_t>(event.value));
+                break;
+            case pbcamera::kAtraceCounter:
+                ATRACE_INT64(event.name, event.value);
+                break;
+            default:
+                ALOGE("%s: Unknown trace event type %d.", __FUNCTION__, event.type);
+                break;
+        }
+    }
+}
+
 NotifyFrameMetadataThread::NotifyFrameMetadataThread(
         pbcamera::MessengerToHdrPlusService* messenger) : mMessenger(messenger),
         mExitRequested(false) {
@@ -164,6 +164,16 @@ public:
      */
     void notifyAtrace(const std::string &trace, int32_t cookie, int32_t begin) override;
 
+    /*
+     * Notify atrace / systrace about a batch of events from Easel. atrace stamps events when they
+     * are emitted and cannot backdate them, so the events of a batch land when the batch arrives,
+     * up to one batch period after they happened on Easel. The delay of the oldest event of each
+     * batch, from its timestamp remapped to AP's clock, is traced as the EaselTraceDelayUs
+     * counter.
+     */
+    void notifyAtraceEvents(const std::vector<pbcamera::AtraceEvent> &events,
+            uint32_t dropped) override;
+
     /*
      * Notify Easel has encountered a fatal error and HDR+ client should stop sending messages
      * to Easel.
@@ -179,6 +189,7 @@ private:
     // Callbacks from HDR+ service start here.
     // Override pbcamera::MessengerListenerFromHdrPlusService
     void notifyFrameEaselTimestamp(int64_t easelTimestampNs) override;
+    void notifyFrameEaselTimestamps(const std::vector<int64_t> &easelTimestampsNs) override;
     void notifyDmaCaptureResult(pbcamera::DmaCaptureResult *result) override;
     void notifyServiceClosed() override;
     void notifyShutter(uint32_t requestId, int64_t apSensorTimestampNs) override;
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AtraceBatch"
+#include <log/log.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "AtraceBatch.h"
+
+namespace pbcamera {
+
+// Flags of a batch.
+static const uint32_t kBatchFlagNamesReset = 0x1;       // The reader must clear its string table.
+static const uint32_t kBatchFlagClockOffsetValid = 0x2; // The AP clock offset is valid.
+
+// An event as written in a batch.
+struct PackedAtraceEvent {
+    int64_t timestampNs;
+    int64_t value;
+    uint16_t nameId;
+    uint8_t type;
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(PackedAtraceEvent) == 24, "PackedAtraceEvent must not have padding.");
+
+AtraceBuffer::AtraceBuffer(size_t capacity) :
+        mEvents(std::max<size_t>(capacity, 1)),
+        mHead(0),
+        mCount(0),
+        mDropped(0),
+        mNumSentNames(0),
+        mNamesReset(true) {
+}
+
+AtraceBuffer::~AtraceBuffer() {
+}
+
+int64_t AtraceBuffer::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+size_t AtraceBuffer::record(const std::string &name, int32_t type, int64_t value) {
+    int64_t timestampNs = now();
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    // Look up the name, interning it if it's new.
+    uint16_t nameId;
+    auto nameIdIter = name.size() > kMaxNameLength ?
+            mNameIds.find(name.substr(0, kMaxNameLength)) : mNameIds.find(name);
+    if (nameIdIter != mNameIds.end()) {
+        nameId = nameIdIter->second;
+    } else if (mNames.size() < kMaxNames) {
+        nameId = mNames.size();
+        mNames.push_back(name.substr(0, kMaxNameLength));
+        mNameIds.emplace(mNames.back(), nameId);
+    } else {
+        mDropped++;
+        return mCount;
+    }
+
+    // Overwrite the oldest event if the ring is full.
+    if (mCount == mEvents.size()) {
+        mHead = (mHead + 1) % mEvents.size();
+        mCount--;
+        mDropped++;
+    }
+
+    Event &event = mEvents[(mHead + mCount) % mEvents.size()];
+    event.timestampNs = timestampNs;
+    event.value = value;
+    event.nameId = nameId;
+    event.type = static_cast<uint8_t>(type);
+    return ++mCount;
+}
+
+size_t AtraceBuffer::size() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mCount;
+}
+
+status_t AtraceBuffer::writeBatch(Message *message, int64_t apClockOffsetNs,
+        bool apClockOffsetValid) {
+    if (message == nullptr) return -EINVAL;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    uint32_t flags = (mNamesReset ? kBatchFlagNamesReset : 0) |
+            (apClockOffsetValid ? kBatchFlagClockOffsetValid : 0);
+    status_t res = message->writeUint32(flags);
+    if (res != 0) return res;
+    res = message->writeInt64(now());
+    if (res != 0) return res;
+    res = message->writeInt64(apClockOffsetNs);
+    if (res != 0) return res;
+    res = message->writeUint32(mDropped);
+    if (res != 0) return res;
+
+    // Write the names that have not been sent.
+    uint32_t numNames = std::min<size_t>(mNames.size() - mNumSentNames, kMaxNamesPerBatch);
+    res = message->writeUint32(numNames);
+    if (res != 0) return res;
+    for (uint32_t i = 0; i < numNames; i++) {
+        res = message->writeString(mNames[mNumSentNames + i]);
+        if (res != 0) return res;
+    }
+    size_t numKnownNames = mNumSentNames + numNames;
+
+    // Write the events up to the first one whose name will only be sent in a later batch.
+    uint32_t numEvents = 0;
+    while (numEvents < std::min<size_t>(mCount, kMaxEventsPerBatch) &&
+            mEvents[(mHead + numEvents) % mEvents.size()].nameId < numKnownNames) {
+        numEvents++;
+    }
+
+    res = message->writeUint32(numEvents);
+    if (res != 0) return res;
+    PackedAtraceEvent *packed = reinterpret_cast<PackedAtraceEvent*>(
+            message->reserveWrite(numEvents * sizeof(PackedAtraceEvent)));
+    if (packed == nullptr) return -ENOMEM;
+
+    for (uint32_t i = 0; i < numEvents; i++) {
+        const Event &event = mEvents[(mHead + i) % mEvents.size()];
+        PackedAtraceEvent packedEvent = {};
+        packedEvent.timestampNs = event.timestampNs;
+        packedEvent.value = event.value;
+        packedEvent.nameId = event.nameId;
+        packedEvent.type = event.type;
+        memcpy(&packed[i], &packedEvent, sizeof(packedEvent));
+    }
+
+    // The batch is complete. Remove what it contains.
+    mHead = (mHead + numEvents) % mEvents.size();
+    mCount -= numEvents;
+    mNumSentNames = numKnownNames;
+    mDropped = 0;
+    mNamesReset = false;
+    return 0;
+}
+
+void AtraceBuffer::reset() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mHead = 0;
+    mCount = 0;
+    mDropped = 0;
+    mNames.clear();
+    mNameIds.clear();
+    mNumSentNames = 0;
+    mNamesReset = true;
+}
+
+status_t AtraceBatchReader::read(Message *message, std::vector<AtraceEvent> *events,
+        uint32_t *dropped) {
+    if (message == nullptr || events == nullptr || dropped == nullptr) return -EINVAL;
+
+    uint32_t flags = 0;
+    int64_t batchTimeNs = 0;
+    int64_t apClockOffsetNs = 0;
+    status_t res = message->readUint32(&flags);
+    if (res != 0) return res;
+    res = message->readInt64(&batchTimeNs);
+    if (res != 0) return res;
+    res = message->readInt64(&apClockOffsetNs);
+    if (res != 0) return res;
+    res = message->readUint32(dropped);
+    if (res != 0) return res;
+
+    if (flags & kBatchFlagNamesReset) {
+        mNames.clear();
+    }
+
+    uint32_t numNames = 0;
+    res = message->readUint32(&numNames);
+    if (res != 0) return res;
+    for (uint32_t i = 0; i < numNames; i++) {
+        std::string name;
+        res = message->readString(&name);
+        if (res != 0) return res;
+        mNames.push_back(name);
+    }
+
+    uint32_t numEvents = 0;
+    res = message->readUint32(&numEvents);
+    if (res != 0) return res;
+    const uint8_t *packed = message->consumeRead(
+            static_cast<size_t>(numEvents) * sizeof(PackedAtraceEvent));
+    if (packed == nullptr) return -ENODATA;
+
+    // Without a synchronized clock, assume the batch was written right now in AP's clock. This
+    // is off by the transport latency but keeps the events of a batch correctly spaced.
+    if (!(flags & kBatchFlagClockOffsetValid)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_BOOTTIME, &ts);
+        apClockOffsetNs = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec -
+                batchTimeNs;
+    }
+
+    events->clear();
+    events->reserve(numEvents);
+    for (uint32_t i = 0; i < numEvents; i++) {
+        PackedAtraceEvent packedEvent;
+        memcpy(&packedEvent, packed + i * sizeof(PackedAtraceEvent), sizeof(packedEvent));
+        if (packedEvent.nameId >= mNames.size()) {
+            ALOGE("%s: Event %u refers to unknown name %u.", __FUNCTION__, i,
+                    packedEvent.nameId);
+            events->clear();
+            return -EPROTO;
+        }
+
+        AtraceEvent event = {};
+        event.name = mNames[packedEvent.nameId].c_str();
+        event.type = packedEvent.type;
+        event.value = packedEvent.value;
+        event.apTimestampNs = packedEvent.timestampNs + apClockOffsetNs;
+        events->push_back(event);
+    }
+
+    return 0;
+}
+
+void AtraceBatchReader::reset() {
+    mNames.clear();
+}
+
+} // namespace pbcamera
@@ -26,6 +26,8 @@
 namespace pbcamera {
 
 const int messageWaitReplyTimeoutMs = 5000;  // 5 seconds
+// Time disconnect() waits for messages being sent to be returned.
+const int messageDrainTimeoutMs = messageWaitReplyTimeoutMs + 1000;
 
 Message::Message() : mData(nullptr), mDataPos(0), mDataSize(0), mCapacity(0) {
 }
@@ -80,6 +82,23 @@ status_t Message::setData(void *data, size_t size) {
     return 0;
 }
 
+uint8_t* Message::reserveWrite(size_t size) {
+    if (size > mCapacity - mDataPos) return nullptr;
+
+    uint8_t *dst = mData + mDataPos;
+    mDataPos += size;
+    mDataSize = mDataPos;
+    return dst;
+}
+
+const uint8_t* Message::consumeRead(size_t size) {
+    if (size > mDataSize - mDataPos) return nullptr;
+
+    const uint8_t *src = mData + mDataPos;
+    mDataPos += size;
+    return src;
+}
+
 status_t Message::writeInt32(int32_t value) {
     return write(value);
 }
@@ -230,6 +249,7 @@ status_t Message::readString(std::string *str) {
 }
 
 EaselMessenger::EaselMessenger() :
+        mMaxMessages(kDefaultMaxMessages),
         mListener(nullptr),
         mListenerThread(nullptr),
         mEaselComm(nullptr) {
@@ -256,19 +276,16 @@ status_t EaselMessenger::connect(EaselMessengerListener &listener, int maxMessag
         if (mEaselComm != nullptr) return -EEXIST;
 
         // Initialize messages.
-        for (int i = 0; i < kNumMessages; i++) {
-            Message *message = new Message();
-            status_t res = message->create(maxMessageSize);
-            if (res != 0) {
-                ALOGE("%s: Creating a message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
-                delete message;
-                cleanupEaselCommLocked();
-                return -ENODEV;
-            }
-            std::lock_guard<std::mutex> messageLock(mAvailableMessagesLock);
-            mAvailableMessages.push_back(message);
+        status_t res = mMessagePool.create(maxMessageSize, kNumMessages, mMaxMessages);
+        if (res != 0) {
+            ALOGE("%s: Creating messages failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+            cleanupEaselCommLocked();
+            return -ENODEV;
         }
 
+        // Received message buffers are only consumed by listenerThreadLoop, which releases them
+        // back to EaselComm's receive buffer pool.
+        easelComm->setReceiveBufferPooling(true);
         mEaselComm = easelComm;
     }
 
@@ -297,45 +314,49 @@ void EaselMessenger::disconnect(bool) {
         mListener = nullptr;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mEaselCommLock);
+        mEaselComm = nullptr;
+    }
+
+    // Let messages being sent finish, which fail fast once EaselComm is closed.
+    if (!mMessagePool.waitForReturns(messageDrainTimeoutMs)) {
+        ALOGE("%s: Messages are still in use after %d ms.", __FUNCTION__,
+                messageDrainTimeoutMs);
+    }
+
     std::lock_guard<std::mutex> lock(mEaselCommLock);
     cleanupEaselCommLocked();
 }
 
 void EaselMessenger::cleanupEaselCommLocked() {
-    std::lock_guard<std::mutex> messageLock(mAvailableMessagesLock);
-    for (auto message : mAvailableMessages) {
-        delete message;
-    }
-    mAvailableMessages.clear();
-
+    mMessagePool.destroy();
     mEaselComm = nullptr;
 }
 
+status_t EaselMessenger::setMaxMessages(int maxMessages) {
+    if (maxMessages < kNumMessages) return -EINVAL;
+    mMaxMessages = maxMessages;
+    return 0;
+}
+
+void EaselMessenger::getMessagePoolStats(MessagePool::Stats *stats) {
+    mMessagePool.getStats(stats);
+}
+
 status_t EaselMessenger::getEmptyMessage(Message **message) {
     if (message == nullptr) return -EINVAL;
 
-    std::lock_guard<std::mutex> messageLock(mAvailableMessagesLock);
-    if (mAvailableMessages.size() == 0) {
-        // TODO: wait for it to be available.
-        return -ENOENT;
+    status_t res = mMessagePool.get(message, kMessageWaitMs);
+    if (res == -ENOENT) {
+        ALOGW("%s: No empty message after waiting %d ms.", __FUNCTION__, kMessageWaitMs);
     }
-
-    *message = mAvailableMessages.back();
-    (*message)->clear();
-    mAvailableMessages.pop_back();
-
-    return 0;
+    return res;
 }
 
 status_t EaselMessenger::returnMessage(Message *message) {
-    std::lock_guard<std::mutex> messageLock(mAvailableMessagesLock);
-    return returnMessageLocked(message);
-}
-
-status_t EaselMessenger::returnMessageLocked(Message *message) {
     if (message == nullptr) return -EINVAL;
-    mAvailableMessages.push_back(message);
-    return 0;
+    return mMessagePool.put(message);
 }
 
 status_t EaselMessenger::sendMessage(Message *message, bool async) {
@@ -352,23 +373,38 @@ status_t EaselMessenger::sendMessageInternal(Message *message, void* dmaBufferSr
             uint32_t dmaBufferSrcSize, int dmaBufferSrcFd, bool async) {
     if (message == nullptr) return -EINVAL;
 
-    std::lock_guard<std::mutex> lock(mEaselCommLock);
-
     if (async && dmaBufferSrc != nullptr) {
         // Sending a DMA buffer asynchronously is not supported because the caller doesn't know
         // when the DMA buffer transfer completes (i.e. when the caller can safely destroy the
         // buffer being transferred.)
         ALOGE("%s: Sending a DMA buffer asynchronously is not supported.", __FUNCTION__);
+        returnMessage(message);
         return -EINVAL;
     }
 
     if (dmaBufferSrc != nullptr && dmaBufferSrcFd != -1) {
         ALOGE("%s: Both dmaBufferSrc and dmaBufferSrcFd are valid.", __FUNCTION__);
+        returnMessage(message);
         return -EINVAL;
     }
 
+    /*
+     * mEaselCommLock is only held to check the connection. EaselComm is thread safe and matches
+     * each reply to the message ID of its request, so sync calls from several threads can wait
+     * for their replies at once without blocking other sends. disconnect() waits for the message
+     * to be returned before tearing down.
+     */
+    EaselComm *easelComm;
+    {
+        std::lock_guard<std::mutex> lock(mEaselCommLock);
+        easelComm = mEaselComm;
+    }
+
     // Check if it's connected.
-    if (mEaselComm == nullptr) return -ENODEV;
+    if (easelComm == nullptr) {
+        returnMessage(message);
+        return -ENODEV;
+    }
 
     EaselComm::EaselMessage easelMessage = {};
     easelMessage.message_buf = message->data();
@@ -382,14 +418,18 @@ status_t EaselMessenger::sendMessageInternal(Message *message, void* dmaBufferSr
     } else {
         easelMessage.dma_buf_type = EASELCOMM_DMA_BUFFER_USER;
     }
+    // Image and metadata transfers yield to heartbeats and notifications.
+    if (dmaBufferSrcSize > 0) {
+        easelMessage.priority = EaselComm::PRIORITY_BULK;
+    }
 
     status_t res = 0;
     if (async) {
-        res = mEaselComm->sendMessage(&easelMessage);
+        res = easelComm->sendMessage(&easelMessage);
     } else {
         status_t replycode = 0;
         easelMessage.timeout_ms = messageWaitReplyTimeoutMs;
-        res = mEaselComm->sendMessageReceiveReply(&easelMessage, &replycode, nullptr);
+        res = easelComm->sendMessageReceiveReply(&easelMessage, &replycode, nullptr);
         if (res == 0) {
             res = replycode;
         }
@@ -401,7 +441,7 @@ status_t EaselMessenger::sendMessageInternal(Message *message, void* dmaBufferSr
     }
 
     // Return message to message queue.
-    returnMessageLocked(message);
+    returnMessage(message);
 
     return res;
 }
@@ -471,9 +511,8 @@ void EaselMessenger::listenerThreadLoop() {
                     mEaselComm->sendReply(&easelMessage, res, nullptr);
                 }
 
-                // Free easel message buffer.
-                free(easelMessage.message_buf);
-                easelMessage.message_buf = nullptr;
+                // Release easel message buffer.
+                mEaselComm->releaseMessageBuffer(&easelMessage);
                 continue;
             }
 
@@ -507,9 +546,8 @@ void EaselMessenger::listenerThreadLoop() {
                 }
             }
 
-            // Free easel message buffer.
-            free(easelMessage.message_buf);
-            easelMessage.message_buf = nullptr;
+            // Release easel message buffer.
+            mEaselComm->releaseMessageBuffer(&easelMessage);
 
             // Return message to message queue.
             returnMessage(message);
@@ -0,0 +1,275 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// #define LOG_NDEBUG 0
+#define LOG_TAG "MessagePool"
+#include <log/log.h>
+
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+
+#include "EaselMessenger.h"
+#include "MessagePool.h"
+
+namespace pbcamera {
+
+// How long the pool must stay within its minimum before extra messages are freed.
+static const int64_t kIdleTrimNs = 1000000000LL; // 1 second
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MessagePool::SlotStack::push(uint32_t slot, std::atomic<uint32_t> *next) {
+    uint64_t head = mHead.load();
+    do {
+        next[slot].store(static_cast<uint32_t>(head));
+    } while (!mHead.compare_exchange_weak(head, (head & ~0xFFFFFFFFULL) | slot));
+}
+
+uint32_t MessagePool::SlotStack::pop(std::atomic<uint32_t> *next) {
+    uint64_t head = mHead.load();
+    while (1) {
+        uint32_t slot = static_cast<uint32_t>(head);
+        if (slot == kNoSlot) return kNoSlot;
+
+        uint64_t tag = (head >> 32) + 1;
+        if (mHead.compare_exchange_weak(head, (tag << 32) | next[slot].load())) {
+            return slot;
+        }
+    }
+}
+
+MessagePool::MessagePool() :
+        mCapacity(0),
+        mMinMessages(0),
+        mMaxMessages(0),
+        mUsedSlots(0),
+        mCreated(false),
+        mAllocated(0),
+        mInUse(0),
+        mHighWaterMark(0),
+        mStalls(0),
+        mFailures(0),
+        mLastBusyNs(0),
+        mWaiters(0) {
+    mTrimming.clear();
+}
+
+MessagePool::~MessagePool() {
+    destroy();
+}
+
+status_t MessagePool::create(int capacity, int minMessages, int maxMessages) {
+    if (minMessages <= 0 || maxMessages < minMessages) return -EINVAL;
+    if (mInUse > 0) {
+        ALOGE("%s: %d messages are still in use.", __FUNCTION__, mInUse.load());
+        return -EBUSY;
+    }
+
+    mMessages.reset(new Message[maxMessages]);
+    mNext.reset(new std::atomic<uint32_t>[maxMessages]);
+    mSlotInUse.reset(new std::atomic<bool>[maxMessages]);
+    for (int i = 0; i < maxMessages; i++) {
+        mSlotInUse[i] = false;
+    }
+    mFree.reset();
+    mUnallocated.reset();
+    mCapacity = capacity;
+    mMinMessages = minMessages;
+    mMaxMessages = maxMessages;
+    mAllocated = 0;
+    mHighWaterMark = 0;
+    mLastBusyNs = 0;
+
+    for (int i = 0; i < minMessages; i++) {
+        status_t res = mMessages[i].create(capacity);
+        if (res != 0) {
+            mMessages.reset();
+            mNext.reset();
+            mSlotInUse.reset();
+            mUsedSlots = 0;
+            mAllocated = 0;
+            return res;
+        }
+        mAllocated++;
+    }
+
+    // Push in reverse so the first slots are got first.
+    for (int i = minMessages - 1; i >= 0; i--) {
+        mFree.push(i, mNext.get());
+    }
+    mUsedSlots = minMessages;
+    mCreated = true;
+    return 0;
+}
+
+void MessagePool::destroy() {
+    if (!mCreated.exchange(false)) return;
+
+    uint32_t slot;
+    while ((slot = mFree.pop(mNext.get())) != kNoSlot) {
+        mMessages[slot].destroy();
+        mAllocated--;
+    }
+
+    // Wake up gets so they fail.
+    std::lock_guard<std::mutex> lock(mWaitLock);
+    mWaitCond.notify_all();
+}
+
+uint32_t MessagePool::tryGet(status_t *res) {
+    *res = 0;
+    uint32_t slot = mFree.pop(mNext.get());
+    if (slot != kNoSlot) return slot;
+
+    // Allocate a message in a trimmed slot or in a slot never used.
+    slot = mUnallocated.pop(mNext.get());
+    if (slot == kNoSlot) {
+        uint32_t used = mUsedSlots.load();
+        do {
+            if (used >= mMaxMessages) return kNoSlot;
+        } while (!mUsedSlots.compare_exchange_weak(used, used + 1));
+        slot = used;
+    }
+
+    *res = mMessages[slot].create(mCapacity);
+    if (*res != 0) {
+        ALOGE("%s: Creating a message failed: %s (%d).", __FUNCTION__, strerror(-*res), *res);
+        mUnallocated.push(slot, mNext.get());
+        return kNoSlot;
+    }
+    mAllocated++;
+    ALOGV("%s: Grew to %d messages.", __FUNCTION__, mAllocated.load());
+    return slot;
+}
+
+status_t MessagePool::get(Message **message, int32_t timeoutMs) {
+    if (!mCreated) return -ENODEV;
+
+    status_t res;
+    uint32_t slot = tryGet(&res);
+    if (res != 0) return res;
+
+    if (slot == kNoSlot) {
+        // The pool is at its maximum: wait for a message to be returned.
+        mStalls++;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        std::unique_lock<std::mutex> lock(mWaitLock);
+        mWaiters++;
+        while ((slot = tryGet(&res)) == kNoSlot && res == 0 && mCreated) {
+            if (mWaitCond.wait_until(lock, deadline) == std::cv_status::timeout) {
+                slot = tryGet(&res);
+                break;
+            }
+        }
+        mWaiters--;
+        if (slot == kNoSlot) {
+            if (res == 0) {
+                mFailures++;
+                res = mCreated ? -ENOENT : -ENODEV;
+            }
+            return res;
+        }
+    }
+
+    mSlotInUse[slot] = true;
+    int inUse = ++mInUse;
+    int highWaterMark = mHighWaterMark.load();
+    while (inUse > highWaterMark &&
+            !mHighWaterMark.compare_exchange_weak(highWaterMark, inUse)) {
+    }
+    if (inUse > mMinMessages) {
+        mLastBusyNs = nowNs();
+    }
+
+    *message = &mMessages[slot];
+    (*message)->clear();
+    return 0;
+}
+
+status_t MessagePool::put(Message *message) {
+    if (message == nullptr || mMessages == nullptr || message < &mMessages[0] ||
+            message >= &mMessages[mMaxMessages]) {
+        return -EINVAL;
+    }
+    uint32_t slot = message - &mMessages[0];
+
+    if (!mSlotInUse[slot].exchange(false)) {
+        ALOGE("%s: Message %u is already in the pool.", __FUNCTION__, slot);
+        return -EINVAL;
+    }
+
+    if (!mCreated) {
+        // Returned after destroy().
+        message->destroy();
+        mAllocated--;
+        mInUse--;
+        return 0;
+    }
+
+    mFree.push(slot, mNext.get());
+    if (--mInUse == 0) {
+        trimIfIdle();
+    }
+
+    if (mWaiters > 0) {
+        std::lock_guard<std::mutex> lock(mWaitLock);
+        mWaitCond.notify_all();
+    }
+    return 0;
+}
+
+bool MessagePool::waitForReturns(int32_t timeoutMs) {
+    if (mInUse == 0) return true;
+
+    std::unique_lock<std::mutex> lock(mWaitLock);
+    mWaiters++;
+    bool returned = mWaitCond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+            [this] { return mInUse == 0; });
+    mWaiters--;
+    return returned;
+}
+
+void MessagePool::trimIfIdle() {
+    if (mAllocated <= mMinMessages || nowNs() - mLastBusyNs < kIdleTrimNs) return;
+    if (mTrimming.test_and_set()) return;
+
+    while (mAllocated > mMinMessages) {
+        uint32_t slot = mFree.pop(mNext.get());
+        if (slot == kNoSlot) break;
+        mMessages[slot].destroy();
+        mAllocated--;
+        mUnallocated.push(slot, mNext.get());
+    }
+    ALOGV("%s: Shrank to %d messages.", __FUNCTION__, mAllocated.load());
+    mTrimming.clear();
+}
+
+void MessagePool::getStats(Stats *stats) {
+    if (stats == nullptr) return;
+
+    stats->allocated = mAllocated;
+    stats->inUse = mInUse;
+    stats->highWaterMark = mHighWaterMark;
+    stats->maxMessages = mMaxMessages;
+    stats->stalls = mStalls;
+    stats->failures = mFailures;
+}
+
+} // namespace pbcamera
@@ -19,6 +19,7 @@
 #include <log/log.h>
 
 #include "HdrPlusMessageTypes.h"
+#include "HdrPlusMetadataCodec.h"
 #include "MessengerListenerFromHdrPlusClient.h"
 
 namespace pbcamera {
@@ -52,6 +53,8 @@ status_t MessengerListenerFromHdrPlusClient::onMessage(Message *message) {
     ALOGV("%s: Got message %u", __FUNCTION__, type);
     switch(type) {
         case MESSAGE_CONNECT:
+            // HDR+ client starts over with a frame metadata keyframe.
+            mFrameMetadataKeyframeValid = false;
             return connect();
         case MESSAGE_DISCONNECT:
             disconnect();
@@ -64,6 +67,8 @@ status_t MessengerListenerFromHdrPlusClient::onMessage(Message *message) {
             return deserializeSetZslHdrPlusMode(message);
         case MESSAGE_SUBMIT_CAPTURE_REQUEST:
             return deserializeSubmitCaptureRequest(message);
+        case MESSAGE_NOTIFY_FRAME_METADATA_KEYFRAME:
+            return deserializeNotifyFrameMetadataKeyframe(message);
         case MESSAGE_NOTIFY_FRAME_METADATA_ASYNC:
             deserializeNotifyFrameMetadata(message);
             return 0;
@@ -109,42 +114,8 @@ status_t MessengerListenerFromHdrPlusClient::deserializeConnect(Message *message
 status_t MessengerListenerFromHdrPlusClient::deserializeSetStaticMetadata(Message *message) {
     StaticMetadata metadata = {};
 
-    // Serialize StaticMetadata
-    RETURN_ERROR_ON_READ_ERROR(message->readByte(&metadata.flashInfoAvailable));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.sensitivityRange));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32(&metadata.maxAnalogSensitivity));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.pixelArraySize));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.activeArraySize));
-
-    uint32_t vectorSize;
-    RETURN_ERROR_ON_READ_ERROR(message->readUint32(&vectorSize));
-    metadata.opticalBlackRegions.resize(vectorSize);
-    for (size_t i = 0; i < vectorSize; i++) {
-        RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.opticalBlackRegions[i]));
-    }
-
-    RETURN_ERROR_ON_READ_ERROR(message->readUint32(&vectorSize));
-    metadata.availableStreamConfigurations.resize(vectorSize);
-    for (size_t i = 0; i < vectorSize; i++) {
-        RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(
-                &metadata.availableStreamConfigurations[i]));
-    }
-
-    RETURN_ERROR_ON_READ_ERROR(message->readByte(&metadata.referenceIlluminant1));
-    RETURN_ERROR_ON_READ_ERROR(message->readByte(&metadata.referenceIlluminant2));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatArray(&metadata.calibrationTransform1));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatArray(&metadata.calibrationTransform2));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatArray(&metadata.colorTransform1));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatArray(&metadata.colorTransform2));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32(&metadata.whiteLevel));
-    RETURN_ERROR_ON_READ_ERROR(message->readByte(&metadata.colorFilterArrangement));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatVector(&metadata.availableApertures));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloatVector(&metadata.availableFocalLengths));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.shadingMapSize));
-    RETURN_ERROR_ON_READ_ERROR(message->readByte(&metadata.focusDistanceCalibration));
-    RETURN_ERROR_ON_READ_ERROR(message->readInt32Array(&metadata.aeCompensationRange));
-    RETURN_ERROR_ON_READ_ERROR(message->readFloat(&metadata.aeCompensationStep));
-    RETURN_ERROR_ON_READ_ERROR(message->readUint32(&metadata.debugParams));
+    // Deserialize StaticMetadata
+    RETURN_ERROR_ON_READ_ERROR(MetadataCodec<StaticMetadata>::decode(message, &metadata));
 
     return setStaticMetadata(metadata);
 }
@@ -267,58 +238,37 @@ void MessengerListenerFromHdrPlusClient::deserializeNotifyDmaInputBuffer(Message
     notifyDmaInputBuffer(dmaImageBuffer, timestampNs);
 }
 
-void MessengerListenerFromHdrPlusClient::deserializeNotifyFrameMetadata(Message *message) {
-    FrameMetadata metadata = {};
+status_t MessengerListenerFromHdrPlusClient::deserializeNotifyFrameMetadataKeyframe(
+        Message *message) {
+    uint32_t keyframeId = 0;
+    RETURN_ERROR_ON_READ_ERROR(message->readUint32(&keyframeId));
 
     // Deserialize FrameMetadata
-    RETURN_ON_READ_ERROR(message->readInt64(&metadata.easelTimestamp));
-    RETURN_ON_READ_ERROR(message->readInt64(&metadata.exposureTime));
-    RETURN_ON_READ_ERROR(message->readInt32(&metadata.sensitivity));
-    RETURN_ON_READ_ERROR(message->readInt32(&metadata.postRawSensitivityBoost));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.flashMode));
-    RETURN_ON_READ_ERROR(message->readFloatArray(&metadata.colorCorrectionGains));
-    RETURN_ON_READ_ERROR(message->readFloatArray(&metadata.colorCorrectionTransform));
-    RETURN_ON_READ_ERROR(message->readFloatArray(&metadata.neutralColorPoint));
-    RETURN_ON_READ_ERROR(message->readInt64(&metadata.timestamp));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.blackLevelLock));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.faceDetectMode));
-    RETURN_ON_READ_ERROR(message->readInt32Vector(&metadata.faceIds));
-
-    uint32_t vectorSize = 0;
-    RETURN_ON_READ_ERROR(message->readUint32(&vectorSize));
-    metadata.faceLandmarks.resize(vectorSize);
-    for (size_t i = 0; i < metadata.faceLandmarks.size(); i++) {
-        RETURN_ON_READ_ERROR(message->readInt32Array(&metadata.faceLandmarks[i]));
-    }
+    mFrameMetadataKeyframeValid = false;
+    RETURN_ERROR_ON_READ_ERROR(MetadataCodec<FrameMetadata>::decode(message,
+            &mFrameMetadataKeyframe));
+    mFrameMetadataKeyframeId = keyframeId;
+    mFrameMetadataKeyframeValid = true;
 
-    RETURN_ON_READ_ERROR(message->readUint32(&vectorSize));
-    metadata.faceRectangles.resize(vectorSize);
-    for (size_t i = 0; i < metadata.faceRectangles.size(); i++) {
-        RETURN_ON_READ_ERROR(message->readInt32Array(&metadata.faceRectangles[i]));
-    }
-
-    RETURN_ON_READ_ERROR(message->readByteVector(&metadata.faceScores));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.sceneFlicker));
+    notifyFrameMetadata(mFrameMetadataKeyframe);
+    return 0;
+}
 
-    RETURN_ON_READ_ERROR(message->readUint32(&vectorSize));
-    for (size_t i = 0; i < metadata.noiseProfile.size(); i++) {
-        RETURN_ON_READ_ERROR(message->readDoubleArray(&metadata.noiseProfile[i]));
+void MessengerListenerFromHdrPlusClient::deserializeNotifyFrameMetadata(Message *message) {
+    uint32_t keyframeId = 0;
+    RETURN_ON_READ_ERROR(message->readUint32(&keyframeId));
+
+    if (!mFrameMetadataKeyframeValid || keyframeId != mFrameMetadataKeyframeId) {
+        // HDR+ client sends a keyframe after a failure, so drop deltas until then.
+        ALOGE("%s: Dropping frame metadata for keyframe %u. Current keyframe: %u (%s).",
+                __FUNCTION__, keyframeId, mFrameMetadataKeyframeId,
+                mFrameMetadataKeyframeValid ? "valid" : "invalid");
+        return;
     }
 
-    RETURN_ON_READ_ERROR(message->readFloatArray(&metadata.dynamicBlackLevel));
-    RETURN_ON_READ_ERROR(message->readFloatVector(&metadata.lensShadingMap));
-    RETURN_ON_READ_ERROR(message->readFloat(&metadata.focusDistance));
-    RETURN_ON_READ_ERROR(message->readInt32(&metadata.aeExposureCompensation));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.aeMode));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.aeLock));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.aeState));
-    RETURN_ON_READ_ERROR(message->readByte(&metadata.aePrecaptureTrigger));
-
-    RETURN_ON_READ_ERROR(message->readUint32(&vectorSize));
-    metadata.aeRegions.resize(vectorSize);
-    for (size_t i = 0; i < metadata.aeRegions.size(); i++) {
-        RETURN_ON_READ_ERROR(message->readInt32Array(&metadata.aeRegions[i]));
-    }
+    // Deserialize the fields of FrameMetadata that differ from the keyframe.
+    FrameMetadata metadata = mFrameMetadataKeyframe;
+    RETURN_ON_READ_ERROR(MetadataDeltaCodec<FrameMetadata>::decode(message, &metadata));
 
     notifyFrameMetadata(metadata);
 }
@@ -18,6 +18,7 @@
 #include <log/log.h>
 
 #include "HdrPlusMessageTypes.h"
+#include "HdrPlusMetadataCodec.h"
 #include "MessengerListenerFromHdrPlusService.h"
 
 namespace pbcamera {
@@ -51,6 +52,9 @@ status_t MessengerListenerFromHdrPlusService::onMessage(Message *message) {
         case MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMP_ASYNC:
             deserializeNotifyFrameEaselTimestamp(message);
             return 0;
+        case MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMPS_ASYNC:
+            deserializeNotifyFrameEaselTimestamps(message);
+            return 0;
         case MESSAGE_NOTIFY_SHUTTER_ASYNC:
             deserializeNotifyShutter(message);
             return 0;
@@ -60,6 +64,9 @@ status_t MessengerListenerFromHdrPlusService::onMessage(Message *message) {
         case MESSAGE_NOTIFY_ATRACE_ASYNC:
             deserializeNotifyAtrace(message);
             return 0;
+        case MESSAGE_NOTIFY_ATRACE_BATCH_ASYNC:
+            deserializeNotifyAtraceBatch(message);
+            return 0;
         default:
             ALOGE("%s: Receive invalid message type %d.", __FUNCTION__, type);
             return -EINVAL;
@@ -107,6 +114,31 @@ void MessengerListenerFromHdrPlusService::deserializeNotifyFrameEaselTimestamp(M
     notifyFrameEaselTimestamp(easelTimestampNs);
 }
 
+void MessengerListenerFromHdrPlusService::deserializeNotifyFrameEaselTimestamps(
+        Message *message) {
+    uint32_t numTimestamps = 0;
+    RETURN_ON_READ_ERROR(message->readUint32(&numTimestamps));
+    if (numTimestamps == 0 || numTimestamps > kMaxEaselTimestampsPerMessage) {
+        ALOGE("%s: Invalid number of timestamps: %u.", __FUNCTION__, numTimestamps);
+        return;
+    }
+
+    const uint8_t *timestamps = message->consumeRead(numTimestamps * sizeof(int64_t));
+    RETURN_ON_READ_ERROR(timestamps == nullptr ? -ENODATA : 0);
+
+    std::vector<int64_t> easelTimestampsNs(numTimestamps);
+    memcpy(easelTimestampsNs.data(), timestamps, numTimestamps * sizeof(int64_t));
+
+    notifyFrameEaselTimestamps(easelTimestampsNs);
+}
+
+void MessengerListenerFromHdrPlusService::notifyFrameEaselTimestamps(
+        const std::vector<int64_t> &easelTimestampsNs) {
+    for (int64_t easelTimestampNs : easelTimestampsNs) {
+        notifyFrameEaselTimestamp(easelTimestampNs);
+    }
+}
+
 void MessengerListenerFromHdrPlusService::deserializeNotifyShutter(Message *message) {
     uint32_t requestId = 0;
     int64_t apSensorTimestampNs = 0;
@@ -134,6 +166,23 @@ void MessengerListenerFromHdrPlusService::deserializeNotifyAtrace(Message *messa
     notifyAtrace(trace, cookie, begin);
 }
 
+void MessengerListenerFromHdrPlusService::deserializeNotifyAtraceBatch(Message *message) {
+    std::vector<AtraceEvent> events;
+    uint32_t dropped = 0;
+    RETURN_ON_READ_ERROR(mAtraceBatchReader.read(message, &events, &dropped));
+
+    notifyAtraceEvents(events, dropped);
+}
+
+void MessengerListenerFromHdrPlusService::notifyAtraceEvents(
+        const std::vector<AtraceEvent> &events, uint32_t) {
+    for (auto &event : events) {
+        if (event.type == kAtraceBegin || event.type == kAtraceEnd) {
+            notifyAtrace(event.name, event.value, event.type);
+        }
+    }
+}
+
 void MessengerListenerFromHdrPlusService::deserializeNotifyDmaCaptureResult(Message *message,
         DmaBufferHandle dmaHandle, int dmaDataSize) {
 
@@ -141,8 +190,7 @@ void MessengerListenerFromHdrPlusService::deserializeNotifyDmaCaptureResult(Mess
 
     RETURN_ON_READ_ERROR(message->readUint32(&result.requestId));
     RETURN_ON_READ_ERROR(message->readUint32(&result.buffer.streamId));
-    RETURN_ON_READ_ERROR(message->readInt64(&result.metadata.easelTimestamp));
-    RETURN_ON_READ_ERROR(message->readInt64(&result.metadata.timestamp));
+    RETURN_ON_READ_ERROR(MetadataCodec<ResultMetadata>::decode(message, &result.metadata));
 
     result.buffer.dmaHandle = dmaHandle;
     result.buffer.dmaDataSize = dmaDataSize;
@@ -18,9 +18,13 @@
 #include <log/log.h>
 
 #include "MessengerToHdrPlusClient.h"
+#include "HdrPlusMetadataCodec.h"
 
 namespace pbcamera {
 
+// Period to send buffered atrace events to HDR+ client.
+static const std::chrono::milliseconds kAtraceFlushPeriod(100);
+
 #define RETURN_ON_WRITE_ERROR(_expr) \
     do { \
         status_t res = (_expr); \
@@ -31,7 +35,11 @@ namespace pbcamera {
         } \
     } while(0)
 
-MessengerToHdrPlusClient::MessengerToHdrPlusClient() : mConnected(false) {
+MessengerToHdrPlusClient::MessengerToHdrPlusClient() :
+        mConnected(false),
+        mAtraceBuffer(kAtraceBufferCapacity),
+        mAtraceThreadExiting(false),
+        mAtraceFlushRequested(false) {
 }
 
 MessengerToHdrPlusClient::~MessengerToHdrPlusClient() {
@@ -58,10 +66,22 @@ status_t MessengerToHdrPlusClient::connect(EaselMessengerListener &listener) {
     }
 
     mConnected = true;
+
+    // Start sending atrace events with a new string table.
+    mAtraceBuffer.reset();
+    {
+        std::lock_guard<std::mutex> threadLock(mAtraceThreadLock);
+        mAtraceThreadExiting = false;
+        mAtraceFlushRequested = false;
+    }
+    mAtraceThread = std::thread(&MessengerToHdrPlusClient::atraceThreadLoop, this);
     return 0;
 }
 
 void MessengerToHdrPlusClient::disconnect(bool) {
+    // Stop the atrace thread before taking mApiLock because it sends events with mApiLock held.
+    stopAtraceThread();
+
     std::lock_guard<std::mutex> lock(mApiLock);
 
     if (!mConnected) return;
@@ -98,6 +118,46 @@ void MessengerToHdrPlusClient::notifyFrameEaselTimestampAsync(int64_t easelTimes
     }
 }
 
+void MessengerToHdrPlusClient::notifyFrameEaselTimestampsAsync(
+        const std::vector<int64_t> &easelTimestampsNs) {
+    if (easelTimestampsNs.size() == 0) return;
+    if (easelTimestampsNs.size() > kMaxEaselTimestampsPerMessage) {
+        ALOGE("%s: %zu timestamps exceed the maximum of %u per message.", __FUNCTION__,
+                easelTimestampsNs.size(), kMaxEaselTimestampsPerMessage);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mApiLock);
+
+    if (!mConnected) {
+        ALOGE("%s: Messenger not connected.", __FUNCTION__);
+        return;
+    }
+
+    // Prepare the message.
+    Message *message = nullptr;
+    status_t res = getEmptyMessage(&message);
+    if (res != 0) {
+        ALOGE("%s: Getting empty message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+        return;
+    }
+
+    RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMPS_ASYNC));
+
+    // Serialize the timestamps as a count followed by the packed timestamps.
+    size_t size = easelTimestampsNs.size() * sizeof(int64_t);
+    RETURN_ON_WRITE_ERROR(message->writeUint32(easelTimestampsNs.size()));
+    uint8_t *timestamps = message->reserveWrite(size);
+    RETURN_ON_WRITE_ERROR(timestamps == nullptr ? -ENOBUFS : 0);
+    memcpy(timestamps, easelTimestampsNs.data(), size);
+
+    // Send to client.
+    res = sendMessage(message, /*async*/true);
+    if (res != 0) {
+        ALOGE("%s: Sending message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+    }
+}
+
 void MessengerToHdrPlusClient::notifyCaptureResult(CaptureResult *result) {
     std::lock_guard<std::mutex> lock(mApiLock);
 
@@ -124,8 +184,6 @@ void MessengerToHdrPlusClient::notifyCaptureResult(CaptureResult *result) {
                 strerror(-res), res);
     }
 
-    returnMessage(message);
-
     // Only one buffer can be transferred via DMA each time so sending a message for every output
     // buffer.
     for (auto buffer : result->outputBuffers) {
@@ -140,8 +198,7 @@ void MessengerToHdrPlusClient::notifyCaptureResult(CaptureResult *result) {
 
         RETURN_ON_WRITE_ERROR(message->writeUint32(result->requestId));
         RETURN_ON_WRITE_ERROR(message->writeUint32(buffer.streamId));
-        RETURN_ON_WRITE_ERROR(message->writeInt64(result->metadata.easelTimestamp));
-        RETURN_ON_WRITE_ERROR(message->writeInt64(result->metadata.timestamp));
+        RETURN_ON_WRITE_ERROR(MetadataCodec<ResultMetadata>::encode(result->metadata, message));
 
         // Send to client.
         res = sendMessageWithDmaBuffer(message, buffer.data, buffer.dataSize, buffer.dmaBufFd);
@@ -270,28 +327,87 @@ void MessengerToHdrPlusClient::notifyPostview(uint32_t requestId, uint8_t *data,
 }
 
 void MessengerToHdrPlusClient::notifyAtraceAsync(const std::string &trace, int32_t cookie, int32_t begin) {
-    if (!mConnected) {
-        ALOGE("%s: Messenger not connected.", __FUNCTION__);
-        return;
+    recordAtrace(trace, begin == kAtraceBegin ? kAtraceBegin : kAtraceEnd, cookie);
+}
+
+void MessengerToHdrPlusClient::notifyAtraceCounterAsync(const std::string &trace, int64_t value) {
+    recordAtrace(trace, kAtraceCounter, value);
+}
+
+void MessengerToHdrPlusClient::setAtraceClockConverter(
+        std::function<int(int64_t, int64_t*)> converter) {
+    std::lock_guard<std::mutex> lock(mApiLock);
+    mAtraceClockConverter = converter;
+}
+
+void MessengerToHdrPlusClient::recordAtrace(const std::string &trace, int32_t type,
+        int64_t value) {
+    if (mAtraceBuffer.record(trace, type, value) < kAtraceFlushThreshold) return;
+
+    std::lock_guard<std::mutex> lock(mAtraceThreadLock);
+    mAtraceFlushRequested = true;
+    mAtraceThreadCond.notify_one();
+}
+
+void MessengerToHdrPlusClient::atraceThreadLoop() {
+    std::unique_lock<std::mutex> threadLock(mAtraceThreadLock);
+    while (1) {
+        mAtraceThreadCond.wait_for(threadLock, kAtraceFlushPeriod,
+                [&] { return mAtraceThreadExiting || mAtraceFlushRequested; });
+        bool exiting = mAtraceThreadExiting;
+        mAtraceFlushRequested = false;
+        threadLock.unlock();
+
+        {
+            std::lock_guard<std::mutex> lock(mApiLock);
+            flushAtraceEventsLocked();
+        }
+
+        if (exiting) return;
+        threadLock.lock();
     }
+}
 
-    // Prepare the message.
-    Message *message = nullptr;
-    status_t res = getEmptyMessage(&message);
-    if (res != 0) {
-        ALOGE("%s: Getting empty message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
-        return;
+void MessengerToHdrPlusClient::stopAtraceThread() {
+    if (!mAtraceThread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> threadLock(mAtraceThreadLock);
+        mAtraceThreadExiting = true;
+        mAtraceThreadCond.notify_one();
     }
+    mAtraceThread.join();
+}
 
-    RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_ATRACE_ASYNC));
-    RETURN_ON_WRITE_ERROR(message->writeString(trace));
-    RETURN_ON_WRITE_ERROR(message->writeInt32(cookie));
-    RETURN_ON_WRITE_ERROR(message->writeInt32(begin));
+void MessengerToHdrPlusClient::flushAtraceEventsLocked() {
+    if (!mConnected) return;
 
-    // Send to client.
-    res = sendMessage(message, /*async*/true);
-    if (res != 0) {
-        ALOGE("%s: Sending message failed: %s (%d).", __FUNCTION__, strerror(-res), res);;
+    // Get the offset to AP's clock once for all batches.
+    int64_t localClockNs = AtraceBuffer::now();
+    int64_t apClockNs = 0;
+    bool apClockOffsetValid = mAtraceClockConverter != nullptr &&
+            mAtraceClockConverter(localClockNs, &apClockNs) == 0;
+    int64_t apClockOffsetNs = apClockOffsetValid ? apClockNs - localClockNs : 0;
+
+    while (mAtraceBuffer.size() > 0) {
+        Message *message = nullptr;
+        status_t res = getEmptyMessage(&message);
+        if (res != 0) {
+            ALOGE("%s: Getting empty message failed: %s (%d).", __FUNCTION__, strerror(-res),
+                    res);
+            return;
+        }
+
+        RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_ATRACE_BATCH_ASYNC));
+        RETURN_ON_WRITE_ERROR(mAtraceBuffer.writeBatch(message, apClockOffsetNs,
+                apClockOffsetValid));
+
+        // Send to client.
+        res = sendMessage(message, /*async*/true);
+        if (res != 0) {
+            ALOGE("%s: Sending message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+            return;
+        }
     }
 }
 
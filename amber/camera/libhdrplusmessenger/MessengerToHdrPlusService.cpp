@@ -20,10 +20,13 @@
 
 #include "MessengerToHdrPlusService.h"
 #include "HdrPlusMessageTypes.h"
+#include "HdrPlusMetadataCodec.h"
 
 namespace pbcamera {
 
-MessengerToHdrPlusService::MessengerToHdrPlusService() : mConnected(false) {
+MessengerToHdrPlusService::MessengerToHdrPlusService() : mConnected(false),
+        mFrameMetadataKeyframeId(0), mFrameMetadataKeyframeValid(false), mFrameMetadataDeltas(0),
+        mFrameMetadataKeyframeInterval(0), mFrameMetadataResync(true) {
 }
 
 MessengerToHdrPlusService::~MessengerToHdrPlusService() {
@@ -72,6 +75,7 @@ status_t MessengerToHdrPlusService::connect(EaselMessengerListener &listener) {
     }
 
     mConnected = true;
+    mFrameMetadataResync = true;
 
     // Connect to HDR+ Service
     res = connectToService();
@@ -133,7 +137,7 @@ void MessengerToHdrPlusService::disconnectLocked(bool isErrorState) {
 }
 
 status_t MessengerToHdrPlusService::setStaticMetadata(const StaticMetadata& metadata) {
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) {
         ALOGE("%s: Not connected to service.", __FUNCTION__);
         return -ENODEV;
@@ -147,41 +151,10 @@ status_t MessengerToHdrPlusService::setStaticMetadata(const StaticMetadata& meta
     RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(MESSAGE_SET_STATIC_METADATA));
 
     // Serialize StaticMetadata
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeByte(metadata.flashInfoAvailable));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.sensitivityRange));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32(metadata.maxAnalogSensitivity));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.pixelArraySize));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.activeArraySize));
-
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(metadata.opticalBlackRegions.size()));
-    for (size_t i = 0; i < metadata.opticalBlackRegions.size(); i++) {
-        RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.opticalBlackRegions[i]));
-    }
-
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(
-        metadata.availableStreamConfigurations.size()));
-    for (size_t i = 0; i < metadata.availableStreamConfigurations.size(); i++) {
-        RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(
-                metadata.availableStreamConfigurations[i]));
-    }
-
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeByte(metadata.referenceIlluminant1));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeByte(metadata.referenceIlluminant2));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatArray(metadata.calibrationTransform1));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatArray(metadata.calibrationTransform2));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatArray(metadata.colorTransform1));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatArray(metadata.colorTransform2));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32(metadata.whiteLevel));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeByte(metadata.colorFilterArrangement));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatVector(metadata.availableApertures));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloatVector(metadata.availableFocalLengths));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.shadingMapSize));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeByte(metadata.focusDistanceCalibration));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeInt32Array(metadata.aeCompensationRange));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeFloat(metadata.aeCompensationStep));
-    RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(metadata.debugParams));
+    RETURN_ERROR_ON_WRITE_ERROR(MetadataCodec<StaticMetadata>::encode(metadata, message));
 
-    // Send to service.
+    // Send to service without blocking other API calls while waiting for the reply.
+    lock.unlock();
     return sendMessage(message);
 }
 
@@ -211,7 +184,7 @@ status_t MessengerToHdrPlusService::configureStreams(
 
     if (outputConfigs.size() == 0) return -EINVAL;
 
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) return -ENODEV;
 
     // Prepare the message.
@@ -251,12 +224,16 @@ status_t MessengerToHdrPlusService::configureStreams(
         if (res != 0) return res;
     }
 
-    // Send to service.
+    // HDR+ service restarts its pipeline, so start frame metadata over from a keyframe.
+    mFrameMetadataResync = true;
+
+    // Send to service without blocking other API calls while waiting for the reply.
+    lock.unlock();
     return sendMessage(message);
 }
 
 status_t MessengerToHdrPlusService::setZslHdrPlusMode(bool enabled) {
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) return -ENODEV;
 
     // Prepare the message.
@@ -269,6 +246,7 @@ status_t MessengerToHdrPlusService::setZslHdrPlusMode(bool enabled) {
     // Serialize ZSl HDR+ mode.
     RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(enabled));
 
+    lock.unlock();
     return sendMessage(message);
 }
 
@@ -276,7 +254,7 @@ status_t MessengerToHdrPlusService::submitCaptureRequest(CaptureRequest *request
         const RequestMetadata &metadata) {
     if (request == nullptr) return -EINVAL;
 
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) return -ENODEV;
 
     // Prepare the message.
@@ -300,12 +278,13 @@ status_t MessengerToHdrPlusService::submitCaptureRequest(CaptureRequest *request
     RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(metadata.postviewEnable));
     RETURN_ERROR_ON_WRITE_ERROR(message->writeUint32(metadata.continuousCapturing));
 
+    lock.unlock();
     return sendMessage(message);
 }
 
 void MessengerToHdrPlusService::notifyInputBuffer(const StreamBuffer &inputBuffer,
         int64_t timestampNs) {
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) {
         ALOGE("%s: Not connected to service.", __FUNCTION__);
         return;
@@ -325,6 +304,7 @@ void MessengerToHdrPlusService::notifyInputBuffer(const StreamBuffer &inputBuffe
     RETURN_ON_WRITE_ERROR(message->writeUint32(inputBuffer.streamId));
     RETURN_ON_WRITE_ERROR(message->writeInt64(timestampNs));
 
+    lock.unlock();
     res = sendMessageWithDmaBuffer(message, inputBuffer.data, inputBuffer.dataSize,
             inputBuffer.dmaBufFd);
     if (res != 0) {
@@ -334,12 +314,17 @@ void MessengerToHdrPlusService::notifyInputBuffer(const StreamBuffer &inputBuffe
 }
 
 void MessengerToHdrPlusService::notifyFrameMetadataAsync(const FrameMetadata &metadata) {
-    std::lock_guard<std::mutex> lock(mApiLock);
+    std::lock_guard<std::mutex> frameMetadataLock(mFrameMetadataLock);
+    std::unique_lock<std::mutex> lock(mApiLock);
     if (!mConnected) {
         ALOGE("%s: Not connected to service.", __FUNCTION__);
         return;
     }
 
+    if (mFrameMetadataResync.exchange(false)) {
+        mFrameMetadataKeyframeValid = false;
+    }
+
     // Prepare the message.
     Message *message = nullptr;
     status_t res = getEmptyMessage(&message);
@@ -348,57 +333,49 @@ void MessengerToHdrPlusService::notifyFrameMetadataAsync(const FrameMetadata &me
         return;
     }
 
-    RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_FRAME_METADATA_ASYNC));
-
-    // Serialize FrameMetadata
-    RETURN_ON_WRITE_ERROR(message->writeInt64(metadata.easelTimestamp));
-    RETURN_ON_WRITE_ERROR(message->writeInt64(metadata.exposureTime));
-    RETURN_ON_WRITE_ERROR(message->writeInt32(metadata.sensitivity));
-    RETURN_ON_WRITE_ERROR(message->writeInt32(metadata.postRawSensitivityBoost));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.flashMode));
-    RETURN_ON_WRITE_ERROR(message->writeFloatArray(metadata.colorCorrectionGains));
-    RETURN_ON_WRITE_ERROR(message->writeFloatArray(metadata.colorCorrectionTransform));
-    RETURN_ON_WRITE_ERROR(message->writeFloatArray(metadata.neutralColorPoint));
-    RETURN_ON_WRITE_ERROR(message->writeInt64(metadata.timestamp));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.blackLevelLock));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.faceDetectMode));
-    RETURN_ON_WRITE_ERROR(message->writeInt32Vector(metadata.faceIds));
-
-    RETURN_ON_WRITE_ERROR(message->writeUint32(metadata.faceLandmarks.size()));
-    for (size_t i = 0; i < metadata.faceLandmarks.size(); i++) {
-        RETURN_ON_WRITE_ERROR(message->writeInt32Array(metadata.faceLandmarks[i]));
+    if (mFrameMetadataKeyframeValid && (mFrameMetadataKeyframeInterval == 0 ||
+            mFrameMetadataDeltas < mFrameMetadataKeyframeInterval)) {
+        // Serialize the fields of FrameMetadata that differ from the keyframe.
+        RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_FRAME_METADATA_ASYNC));
+        RETURN_ON_WRITE_ERROR(message->writeUint32(mFrameMetadataKeyframeId));
+        RETURN_ON_WRITE_ERROR(MetadataDeltaCodec<FrameMetadata>::encode(mFrameMetadataKeyframe,
+                metadata, message));
+        mFrameMetadataDeltas++;
+
+        lock.unlock();
+        res = sendMessage(message, /*async*/true);
+        if (res != 0) {
+            ALOGE("%s: Sending a message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+            // HDR+ service may have missed the delta; start over from a keyframe.
+            mFrameMetadataKeyframeValid = false;
+        }
+        return;
     }
 
-    RETURN_ON_WRITE_ERROR(message->writeUint32(metadata.faceRectangles.size()));
-    for (size_t i = 0; i < metadata.faceRectangles.size(); i++) {
-        RETURN_ON_WRITE_ERROR(message->writeInt32Array(metadata.faceRectangles[i]));
-    }
-    RETURN_ON_WRITE_ERROR(message->writeByteVector(metadata.faceScores));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.sceneFlicker));
+    // Serialize FrameMetadata as a new keyframe.
+    uint32_t keyframeId = mFrameMetadataKeyframeId + 1;
+    RETURN_ON_WRITE_ERROR(message->writeUint32(MESSAGE_NOTIFY_FRAME_METADATA_KEYFRAME));
+    RETURN_ON_WRITE_ERROR(message->writeUint32(keyframeId));
+    RETURN_ON_WRITE_ERROR(MetadataCodec<FrameMetadata>::encode(metadata, message));
 
-    RETURN_ON_WRITE_ERROR(message->writeUint32(metadata.noiseProfile.size()));
-    for (size_t i = 0; i < metadata.noiseProfile.size(); i++) {
-        RETURN_ON_WRITE_ERROR(message->writeDoubleArray(metadata.noiseProfile[i]));
+    // Send synchronously so the keyframe is acknowledged before deltas refer to it.
+    lock.unlock();
+    res = sendMessage(message);
+    if (res != 0) {
+        ALOGE("%s: Sending a keyframe failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+        mFrameMetadataKeyframeValid = false;
+        return;
     }
 
-    RETURN_ON_WRITE_ERROR(message->writeFloatArray(metadata.dynamicBlackLevel));
-    RETURN_ON_WRITE_ERROR(message->writeFloatVector(metadata.lensShadingMap));
-    RETURN_ON_WRITE_ERROR(message->writeFloat(metadata.focusDistance));
-    RETURN_ON_WRITE_ERROR(message->writeInt32(metadata.aeExposureCompensation));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.aeMode));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.aeLock));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.aeState));
-    RETURN_ON_WRITE_ERROR(message->writeByte(metadata.aePrecaptureTrigger));
-
-    RETURN_ON_WRITE_ERROR(message->writeUint32(metadata.aeRegions.size()));
-    for (size_t i = 0; i < metadata.aeRegions.size(); i++) {
-        RETURN_ON_WRITE_ERROR(message->writeInt32Array(metadata.aeRegions[i]));
-    }
+    mFrameMetadataKeyframe = metadata;
+    mFrameMetadataKeyframeId = keyframeId;
+    mFrameMetadataKeyframeValid = true;
+    mFrameMetadataDeltas = 0;
+}
 
-    res = sendMessage(message, /*async*/true);
-    if (res != 0) {
-        ALOGE("%s: Sending a message failed: %s (%d).", __FUNCTION__, strerror(-res), res);
-    }
+void MessengerToHdrPlusService::setFrameMetadataKeyframeInterval(uint32_t interval) {
+    std::lock_guard<std::mutex> frameMetadataLock(mFrameMetadataLock);
+    mFrameMetadataKeyframeInterval = interval;
 }
 
 } // namespace pbcamera
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PAINTBOX_ATRACE_BATCH_H
+#define PAINTBOX_ATRACE_BATCH_H
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EaselMessenger.h"
+
+namespace pbcamera {
+
+// Types of trace events.
+const int32_t kAtraceBegin = 1;
+const int32_t kAtraceEnd = 0;
+const int32_t kAtraceCounter = 2;
+
+// A trace event from HDR+ service, as delivered to HDR+ client.
+struct AtraceEvent {
+    // Name of the event. Valid until the callback delivering the event returns.
+    const char *name;
+    // kAtraceBegin, kAtraceEnd or kAtraceCounter.
+    int32_t type;
+    // Cookie of a begin or end event, or value of a counter event.
+    int64_t value;
+    // Time of the event in AP's CLOCK_BOOTTIME, in nanoseconds.
+    int64_t apTimestampNs;
+};
+
+/*
+ * AtraceBuffer
+ *
+ * A ring buffer of trace events recorded in HDR+ service. Events are stamped with Easel's
+ * CLOCK_BOOTTIME and their names are interned, so recording an event does not allocate once its
+ * name has been seen. The buffered events are written into messages in batches by writeBatch().
+ * Each name is sent once in a string table and events refer to names by their index. If the
+ * buffer is full, the oldest events are dropped.
+ *
+ * A batch message contains:
+ *  uint32 flags: whether the reader's string table is reset and whether the offset is valid,
+ *  int64  Easel's CLOCK_BOOTTIME when the batch was written,
+ *  int64  offset from Easel's CLOCK_BOOTTIME to AP's CLOCK_BOOTTIME,
+ *  uint32 number of events dropped since the previous batch,
+ *  uint32 number of new names, followed by the new names as strings,
+ *  uint32 number of events, followed by the packed events.
+ *
+ * This class is thread safe.
+ */
+class AtraceBuffer {
+public:
+    // capacity is the maximal number of events to buffer.
+    AtraceBuffer(size_t capacity);
+    virtual ~AtraceBuffer();
+
+    /*
+     * Record an event.
+     *
+     * name is the name of the event. It is truncated to kMaxNameLength characters.
+     * type is kAtraceBegin, kAtraceEnd or kAtraceCounter.
+     * value is the cookie of a begin or end event, or the value of a counter event.
+     *
+     * Returns the number of events buffered.
+     */
+    size_t record(const std::string &name, int32_t type, int64_t value);
+
+    // Returns the number of events buffered.
+    size_t size();
+
+    /*
+     * Write a batch of buffered events to a message and remove them from the buffer. Call it
+     * repeatedly until size() returns 0 to drain the buffer.
+     *
+     * message is the message to write the batch to.
+     * apClockOffsetNs is the offset from Easel's CLOCK_BOOTTIME to AP's CLOCK_BOOTTIME.
+     * apClockOffsetValid is false if the offset is unknown.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOMEM:    if the message is too small for a batch.
+     */
+    status_t writeBatch(Message *message, int64_t apClockOffsetNs, bool apClockOffsetValid);
+
+    /*
+     * Clear buffered events and the string table. The next batch tells the reader to clear its
+     * string table. Must be called whenever the reader may have been reset, e.g. on a new
+     * connection.
+     */
+    void reset();
+
+    // Returns Easel's CLOCK_BOOTTIME in nanoseconds.
+    static int64_t now();
+
+    // Maximal number of characters of an event name.
+    static const size_t kMaxNameLength = 64;
+
+private:
+    // Maximal number of events and new names in a batch. These keep a batch below
+    // kMaxHdrPlusMessageSize.
+    static const uint32_t kMaxEventsPerBatch = 128;
+    static const uint32_t kMaxNamesPerBatch = 16;
+
+    // Maximal number of distinct event names. Events with more names are dropped.
+    static const size_t kMaxNames = 1024;
+
+    struct Event {
+        int64_t timestampNs;
+        int64_t value;
+        uint16_t nameId;
+        uint8_t type;
+    };
+
+    std::mutex mLock;
+
+    // The following variables are protected by mLock.
+    std::vector<Event> mEvents;     // Ring of mEvents.size() events.
+    size_t mHead;                   // Index of the oldest event.
+    size_t mCount;                  // Number of buffered events.
+    uint32_t mDropped;              // Events dropped since the last batch.
+    std::vector<std::string> mNames;                    // Interned names by index.
+    std::unordered_map<std::string, uint16_t> mNameIds; // Index of each interned name.
+    size_t mNumSentNames;           // Names already written to batches.
+    bool mNamesReset;               // If the next batch must reset the reader's string table.
+};
+
+/*
+ * AtraceBatchReader
+ *
+ * Reads batches written by AtraceBuffer::writeBatch() in HDR+ client. It keeps the string table of
+ * the batches and remaps event timestamps to AP's CLOCK_BOOTTIME. This class is not thread safe.
+ */
+class AtraceBatchReader {
+public:
+    /*
+     * Read a batch from a message.
+     *
+     * message is the message to read the batch from.
+     * events will be filled with the events in the batch. Event names stay valid until the next
+     *        read().
+     * dropped will be filled with the number of events dropped in HDR+ service before the batch.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENODATA:   if the message is truncated.
+     *  -EPROTO:    if an event refers to an unknown name.
+     */
+    status_t read(Message *message, std::vector<AtraceEvent> *events, uint32_t *dropped);
+
+    // Clear the string table.
+    void reset();
+
+private:
+    std::vector<std::string> mNames;
+};
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_ATRACE_BATCH_H
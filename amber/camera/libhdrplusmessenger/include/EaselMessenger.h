@@ -17,12 +17,14 @@
 #define EASEL_MESSENGER_H
 
 #include <array>
+#include <atomic>
 #include <mutex>
 #include <stdint.h>
 #include <thread>
 #include <vector>
 
 #include "easelcomm.h"
+#include "MessagePool.h"
 
 namespace pbcamera {
 
@@ -105,6 +107,22 @@ public:
     template<size_t SIZE>
     status_t readDoubleArray(std::array<double, SIZE> *values);
 
+    /*
+     * Reserve size bytes at the write position for the caller to fill in, e.g. by memcpy.
+     *
+     * Returns the pointer to the reserved bytes, or nullptr if there is no space left in the
+     * message for size bytes.
+     */
+    uint8_t* reserveWrite(size_t size);
+
+    /*
+     * Consume size bytes at the read position for the caller to copy out.
+     *
+     * Returns the pointer to the consumed bytes, or nullptr if there are less than size bytes
+     * left to read.
+     */
+    const uint8_t* consumeRead(size_t size);
+
     // Clear the message. This will not free message data.
     void clear();
 
@@ -272,6 +290,19 @@ public:
     status_t transferDmaBuffer(EaselMessengerListener::DmaBufferHandle handle, int32_t dmaBufFd,
             void* dest, uint32_t bufferSize);
 
+    /*
+     * Set the most messages the message pool may grow to. The pool starts with kNumMessages
+     * messages and grows on demand when all are in use. Takes effect on the next connect().
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if maxMessages is less than kNumMessages.
+     */
+    status_t setMaxMessages(int maxMessages);
+
+    // Get counters of the message pool, see MessagePool::Stats.
+    void getMessagePoolStats(MessagePool::Stats *stats);
+
 protected:
     /*
      * Connect to the other EaselMessenger.
@@ -289,7 +320,8 @@ protected:
     status_t connect(EaselMessengerListener &listener, int messageSize, EaselComm* easelComm);
 
     /*
-     * Get an empty message to write data to.
+     * Get an empty message to write data to. If all messages are in use and the pool is at its
+     * maximum, waits up to kMessageWaitMs for one to be returned.
      *
      * message must be returned by sendMessage or returnMessage.
      *
@@ -297,6 +329,7 @@ protected:
      *  0:          on success.
      *  -ENOENT:    if there is no empty message available.
      *  -EINVAL:    if message is null.
+     *  -ENODEV:    if messenger is not connected.
      */
     status_t getEmptyMessage(Message **message);
 
@@ -304,7 +337,8 @@ protected:
      * Send a message to connected listener. If async is true, this method will not be blocking,
      * i.e. it will send a message and return without waiting for the listener to receive it. If
      * async is false, this method will be blocking, i.e. it will not return until the listener
-     * receives and processes it.
+     * receives and processes it. Several threads may send at once, including sync calls waiting
+     * for their replies. message is given back to the messenger whether or not sending succeeds.
      *
      * async is the flag indicating sending the message asynchronously.
      *
@@ -351,6 +385,12 @@ private:
     // Default number of messages.
     const int kNumMessages = 32;
 
+    // Default maximum number of messages.
+    static const int kDefaultMaxMessages = 128;
+
+    // Time to wait for a message when the pool is at its maximum.
+    static const int32_t kMessageWaitMs = 100;
+
     // Invalid DMA buffer fd.
     static const int32_t kInvalidDmaBufFd = -1;
 
@@ -365,14 +405,6 @@ private:
     // Clean up Easel comm with mEaselCommLock held.
     void cleanupEaselCommLocked();
 
-    /*
-     * Return a message with mAvailableMessagesLock held.
-     * Returns:
-     *  0:          on success.
-     * -EINVAL:     if message is null.
-     */
-    status_t returnMessageLocked(Message *message);
-
     /*
      * Send a message to connected listener with a DMA buffer if specified. If async is true, this
      * method will not be blocking, i.e. it will send a message and return without waiting for
@@ -398,20 +430,20 @@ private:
     status_t sendMessageInternal(Message *message, void* dmaBufferSrc,
             uint32_t dmaBufferSrcSize, int dmaBufferFd, bool async);
 
-    // Protect mAvailableMessages from being accessed simultaneously.
-    std::mutex mAvailableMessagesLock;
     /*
      * Messages that are available to get via getEmptyMessage(). Messages are created
-     * in connect() to avoid repeated new/delete.
+     * in connect() and as the pool grows to avoid repeated new/delete.
      */
-    std::vector<Message*> mAvailableMessages;
+    MessagePool mMessagePool;
+    // Most messages mMessagePool may grow to, applied on connect().
+    std::atomic<int> mMaxMessages;
 
     // Listener to invoke callbacks when received messages from the connected messenger.
     std::mutex mListenerLock;
     EaselMessengerListener *mListener; // Protected by mListenerLock.
     std::thread *mListenerThread; // Protected by mListenerLock.
 
-    // Protect mEaselComm from being accessed simultaneously.
+    // Protect mEaselComm from being accessed simultaneously. Not held while sending.
     std::mutex mEaselCommLock;
     // Instance of EaselComm object to send and receive messages. Protected by mEaselCommLock.
     EaselComm *mEaselComm;
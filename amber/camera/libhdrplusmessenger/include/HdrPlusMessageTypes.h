@@ -69,6 +69,9 @@ struct DmaMakernote {
 // Maximum message size passed between HDR+ client and service. 5KB for metadata.
 const int kMaxHdrPlusMessageSize = 5120;
 
+// Maximum number of Easel timestamps in a MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMPS_ASYNC message.
+const uint32_t kMaxEaselTimestampsPerMessage = 64;
+
 /*
  * HdrPlusMessageType defines the message types that can be passed between HDR+ service and
  * HDR+ client.
@@ -83,6 +86,7 @@ enum HdrPlusMessageType {
     MESSAGE_NOTIFY_DMA_INPUT_BUFFER,
     MESSAGE_NOTIFY_FRAME_METADATA_ASYNC,
     MESSAGE_SET_ZSL_HDR_PLUS_MODE,
+    MESSAGE_NOTIFY_FRAME_METADATA_KEYFRAME,
 
     // Messages from HDR+ service to HDR+ client
     MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMP_ASYNC = 0x10000,
@@ -93,6 +97,8 @@ enum HdrPlusMessageType {
     MESSAGE_NOTIFY_DMA_FILE_DUMP,
     MESSAGE_NOTIFY_NEXT_CAPTURE_READY_ASYNC,
     MESSAGE_NOTIFY_ATRACE_ASYNC,
+    MESSAGE_NOTIFY_FRAME_EASEL_TIMESTAMPS_ASYNC,
+    MESSAGE_NOTIFY_ATRACE_BATCH_ASYNC,
 };
 
 } // namespace pbcamera
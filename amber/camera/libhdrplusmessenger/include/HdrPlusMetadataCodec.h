@@ -0,0 +1,524 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PAINTBOX_HDR_PLUS_METADATA_CODEC_H
+#define PAINTBOX_HDR_PLUS_METADATA_CODEC_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#include "EaselMessenger.h"
+#include "HdrPlusTypes.h"
+
+namespace pbcamera {
+
+/*
+ * Metadata schemas
+ *
+ * The fields of each metadata struct sent in messages, in the order they are encoded. A field is
+ * either trivially copyable (a scalar, or a std::array of them) or a std::vector of trivially
+ * copyable elements. Bump the version of a schema whenever its fields change.
+ *
+ * ResultMetadata only lists the fields sent with each capture result; the makernote is
+ * transferred separately by DMA.
+ */
+#define PBCAMERA_STATIC_METADATA_VERSION 1
+#define PBCAMERA_STATIC_METADATA_FIELDS(FIELD) \
+    FIELD(flashInfoAvailable) \
+    FIELD(sensitivityRange) \
+    FIELD(maxAnalogSensitivity) \
+    FIELD(pixelArraySize) \
+    FIELD(activeArraySize) \
+    FIELD(opticalBlackRegions) \
+    FIELD(availableStreamConfigurations) \
+    FIELD(referenceIlluminant1) \
+    FIELD(referenceIlluminant2) \
+    FIELD(calibrationTransform1) \
+    FIELD(calibrationTransform2) \
+    FIELD(colorTransform1) \
+    FIELD(colorTransform2) \
+    FIELD(whiteLevel) \
+    FIELD(colorFilterArrangement) \
+    FIELD(availableApertures) \
+    FIELD(availableFocalLengths) \
+    FIELD(shadingMapSize) \
+    FIELD(focusDistanceCalibration) \
+    FIELD(aeCompensationRange) \
+    FIELD(aeCompensationStep) \
+    FIELD(debugParams)
+
+#define PBCAMERA_FRAME_METADATA_VERSION 1
+#define PBCAMERA_FRAME_METADATA_FIELDS(FIELD) \
+    FIELD(easelTimestamp) \
+    FIELD(exposureTime) \
+    FIELD(sensitivity) \
+    FIELD(postRawSensitivityBoost) \
+    FIELD(flashMode) \
+    FIELD(colorCorrectionGains) \
+    FIELD(colorCorrectionTransform) \
+    FIELD(neutralColorPoint) \
+    FIELD(timestamp) \
+    FIELD(blackLevelLock) \
+    FIELD(faceDetectMode) \
+    FIELD(faceIds) \
+    FIELD(faceLandmarks) \
+    FIELD(faceRectangles) \
+    FIELD(faceScores) \
+    FIELD(sceneFlicker) \
+    FIELD(noiseProfile) \
+    FIELD(dynamicBlackLevel) \
+    FIELD(lensShadingMap) \
+    FIELD(focusDistance) \
+    FIELD(aeExposureCompensation) \
+    FIELD(aeMode) \
+    FIELD(aeLock) \
+    FIELD(aeState) \
+    FIELD(aePrecaptureTrigger) \
+    FIELD(aeRegions)
+
+#define PBCAMERA_RESULT_METADATA_VERSION 1
+#define PBCAMERA_RESULT_METADATA_FIELDS(FIELD) \
+    FIELD(easelTimestamp) \
+    FIELD(timestamp)
+
+template<typename T>
+struct IsMetadataVector : std::false_type {};
+
+template<typename T>
+struct IsMetadataVector<std::vector<T>> : std::true_type {};
+
+/*
+ * MetadataSchema<T> has the version, the number of fields, the number of vector fields and the
+ * total size of the other fields of T. MetadataSchema<T>::visit(metadata, visitor) calls
+ * visitor(field) for each field of T in order, and visitPair(a, b, visitor) calls
+ * visitor(aField, bField).
+ */
+template<typename T>
+struct MetadataSchema;
+
+#define PBCAMERA_COUNT_METADATA_FIELD(_field) + 1
+#define PBCAMERA_COUNT_METADATA_VECTOR(_field) \
+    + (IsMetadataVector<decltype(Type::_field)>::value ? 1 : 0)
+#define PBCAMERA_SIZE_METADATA_FIXED_FIELD(_field) \
+    + (IsMetadataVector<decltype(Type::_field)>::value ? 0 : sizeof(Type::_field))
+#define PBCAMERA_VISIT_METADATA_FIELD(_field) visitor(metadata._field);
+#define PBCAMERA_VISIT_METADATA_FIELD_PAIR(_field) visitor(a._field, b._field);
+
+#define PBCAMERA_DEFINE_METADATA_SCHEMA(_type, _version, _fields) \
+    template<> \
+    struct MetadataSchema<_type> { \
+        typedef _type Type; \
+        static const uint32_t kVersion = _version; \
+        static const uint32_t kNumFields = 0 _fields(PBCAMERA_COUNT_METADATA_FIELD); \
+        static const uint32_t kNumVectors = 0 _fields(PBCAMERA_COUNT_METADATA_VECTOR); \
+        static const uint32_t kFixedSize = 0 _fields(PBCAMERA_SIZE_METADATA_FIXED_FIELD); \
+        template<typename M, typename Visitor> \
+        static void visit(M &metadata, Visitor &visitor) { \
+            _fields(PBCAMERA_VISIT_METADATA_FIELD) \
+        } \
+        template<typename M, typename Visitor> \
+        static void visitPair(M &a, M &b, Visitor &visitor) { \
+            _fields(PBCAMERA_VISIT_METADATA_FIELD_PAIR) \
+        } \
+    }
+
+PBCAMERA_DEFINE_METADATA_SCHEMA(StaticMetadata, PBCAMERA_STATIC_METADATA_VERSION,
+        PBCAMERA_STATIC_METADATA_FIELDS);
+PBCAMERA_DEFINE_METADATA_SCHEMA(FrameMetadata, PBCAMERA_FRAME_METADATA_VERSION,
+        PBCAMERA_FRAME_METADATA_FIELDS);
+PBCAMERA_DEFINE_METADATA_SCHEMA(ResultMetadata, PBCAMERA_RESULT_METADATA_VERSION,
+        PBCAMERA_RESULT_METADATA_FIELDS);
+
+#undef PBCAMERA_DEFINE_METADATA_SCHEMA
+#undef PBCAMERA_VISIT_METADATA_FIELD_PAIR
+#undef PBCAMERA_VISIT_METADATA_FIELD
+#undef PBCAMERA_SIZE_METADATA_FIXED_FIELD
+#undef PBCAMERA_COUNT_METADATA_VECTOR
+#undef PBCAMERA_COUNT_METADATA_FIELD
+
+/*
+ * MetadataField<T> copies a metadata field of type T: a trivially copyable field as one element,
+ * or a vector as its elements.
+ */
+template<typename T>
+struct MetadataField {
+    static_assert(std::is_trivially_copyable<T>::value,
+            "Metadata fields must be trivially copyable or vectors of them.");
+    static const bool kIsVector = false;
+    static const size_t kElementSize = sizeof(T);
+    static size_t count(const T&) { return 1; }
+    static const void* data(const T &value) { return &value; }
+    static void* resize(T *value, size_t) { return value; }
+    static bool equal(const T &a, const T &b) { return memcmp(&a, &b, sizeof(T)) == 0; }
+};
+
+template<typename T>
+struct MetadataField<std::vector<T>> {
+    static_assert(std::is_trivially_copyable<T>::value,
+            "Metadata vector elements must be trivially copyable.");
+    static const bool kIsVector = true;
+    static const size_t kElementSize = sizeof(T);
+    static size_t count(const std::vector<T> &value) { return value.size(); }
+    static const void* data(const std::vector<T> &value) { return value.data(); }
+    static void* resize(std::vector<T> *value, size_t count) {
+        value->resize(count);
+        return value->data();
+    }
+    static bool equal(const std::vector<T> &a, const std::vector<T> &b) {
+        return a.size() == b.size() &&
+                (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+    }
+};
+
+/*
+ * MetadataCodec class
+ *
+ * Encodes and decodes a metadata struct described by MetadataSchema. An encoded struct is packed
+ * without alignment or padding:
+ *
+ *  uint32_t version            Schema version.
+ *  uint32_t fixedSize          Bytes of all trivially copyable fields, to catch a schema change
+ *                              without a version bump.
+ *  uint32_t count[numVectors]  Number of elements of each vector field.
+ *  fields                      Bytes of each field, or of each vector's elements, in order.
+ *
+ * The encoder sizes the whole struct once against the message capacity and the decoder sizes it
+ * once from the header against the message data. Fields are then copied with memcpy without
+ * checking each of them.
+ */
+template<typename Metadata>
+class MetadataCodec {
+public:
+    /*
+     * Write metadata to message.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOMEM:    if there is no space left in the message for the metadata.
+     */
+    static status_t encode(const Metadata &metadata, Message *message);
+
+    /*
+     * Read metadata from message.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENODATA:   if the message is shorter than the encoded metadata.
+     *  -EPROTO:    if the metadata was encoded with a different schema.
+     */
+    static status_t decode(Message *message, Metadata *metadata);
+
+    // Returns the number of bytes encode() writes for metadata.
+    static size_t encodedSize(const Metadata &metadata);
+
+private:
+    typedef MetadataSchema<Metadata> Schema;
+
+    template<typename T>
+    using Field = MetadataField<T>;
+
+    // Sizes the vector fields, from the given element counts if not nullptr.
+    struct VectorSizeVisitor {
+        const uint32_t *counts;
+        uint32_t index;
+        uint64_t size;
+
+        template<typename T>
+        void operator()(const T &value) {
+            if (!Field<T>::kIsVector) return;
+            uint64_t count = counts != nullptr ? counts[index] : Field<T>::count(value);
+            size += count * Field<T>::kElementSize;
+            index++;
+        }
+    };
+
+    struct EncodeVisitor {
+        uint8_t *counts;
+        uint8_t *fields;
+
+        template<typename T>
+        void operator()(const T &value) {
+            size_t size = Field<T>::count(value) * Field<T>::kElementSize;
+            if (Field<T>::kIsVector) {
+                uint32_t count = Field<T>::count(value);
+                memcpy(counts, &count, sizeof(count));
+                counts += sizeof(count);
+            }
+            if (size > 0) {
+                memcpy(fields, Field<T>::data(value), size);
+                fields += size;
+            }
+        }
+    };
+
+    struct DecodeVisitor {
+        const uint32_t *counts;
+        const uint8_t *fields;
+
+        template<typename T>
+        void operator()(T &value) {
+            size_t count = Field<T>::kIsVector ? *counts++ : 1;
+            size_t size = count * Field<T>::kElementSize;
+            void *dst = Field<T>::resize(&value, count);
+            if (size > 0) {
+                memcpy(dst, fields, size);
+                fields += size;
+            }
+        }
+    };
+
+    // Size of the header: version, fixed size and vector counts.
+    static const size_t kHeaderSize = (2 + Schema::kNumVectors) * sizeof(uint32_t);
+};
+
+template<typename Metadata>
+size_t MetadataCodec<Metadata>::encodedSize(const Metadata &metadata) {
+    VectorSizeVisitor sizer = { nullptr, 0, 0 };
+    Schema::visit(metadata, sizer);
+    return kHeaderSize + Schema::kFixedSize + sizer.size;
+}
+
+template<typename Metadata>
+status_t MetadataCodec<Metadata>::encode(const Metadata &metadata, Message *message) {
+    if (message == nullptr) return -EINVAL;
+
+    uint8_t *dst = message->reserveWrite(encodedSize(metadata));
+    if (dst == nullptr) return -ENOMEM;
+
+    uint32_t header[2] = { Schema::kVersion, Schema::kFixedSize };
+    memcpy(dst, header, sizeof(header));
+
+    EncodeVisitor encoder = { dst + sizeof(header), dst + kHeaderSize };
+    Schema::visit(metadata, encoder);
+    return 0;
+}
+
+template<typename Metadata>
+status_t MetadataCodec<Metadata>::decode(Message *message, Metadata *metadata) {
+    if (message == nullptr || metadata == nullptr) return -EINVAL;
+
+    const uint8_t *src = message->consumeRead(kHeaderSize);
+    if (src == nullptr) return -ENODATA;
+
+    uint32_t header[2 + Schema::kNumVectors];
+    memcpy(header, src, kHeaderSize);
+    if (header[0] != Schema::kVersion || header[1] != Schema::kFixedSize) return -EPROTO;
+    const uint32_t *counts = header + 2;
+
+    VectorSizeVisitor sizer = { counts, 0, 0 };
+    Schema::visit(*metadata, sizer);
+    if (sizer.size > UINT32_MAX - Schema::kFixedSize) return -ENODATA;
+
+    const uint8_t *fields = message->consumeRead(Schema::kFixedSize + sizer.size);
+    if (fields == nullptr) return -ENODATA;
+
+    DecodeVisitor decoder = { counts, fields };
+    Schema::visit(*metadata, decoder);
+    return 0;
+}
+
+/*
+ * MetadataDeltaCodec class
+ *
+ * Encodes a metadata struct as the fields that differ from a keyframe, an earlier struct that
+ * both sides have. A delta is packed like MetadataCodec:
+ *
+ *  uint32_t version            Schema version.
+ *  uint32_t changed            Bit i is set if field i of the schema differs from the keyframe.
+ *  uint32_t count[n]           Number of elements of each changed vector field.
+ *  fields                      Bytes of each changed field, or of its elements, in order.
+ */
+template<typename Metadata>
+class MetadataDeltaCodec {
+public:
+    /*
+     * Write the fields of metadata that differ from keyframe to message.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOMEM:    if there is no space left in the message for the delta.
+     */
+    static status_t encode(const Metadata &keyframe, const Metadata &metadata, Message *message);
+
+    /*
+     * Read a delta from message into metadata, which must hold the keyframe the delta was
+     * encoded against. Changed fields are overwritten; the others keep the keyframe's values.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENODATA:   if the message is shorter than the encoded delta.
+     *  -EPROTO:    if the delta was encoded with a different schema.
+     */
+    static status_t decode(Message *message, Metadata *metadata);
+
+private:
+    typedef MetadataSchema<Metadata> Schema;
+
+    template<typename T>
+    using Field = MetadataField<T>;
+
+    static_assert(Schema::kNumFields <= 32, "The changed mask holds up to 32 fields.");
+
+    // Finds the changed fields and sizes them.
+    struct DiffVisitor {
+        uint32_t index;
+        uint32_t changed;
+        uint32_t numVectors;
+        uint64_t size;
+
+        template<typename T>
+        void operator()(const T &keyframe, const T &value) {
+            if (!Field<T>::equal(keyframe, value)) {
+                changed |= 1U << index;
+                numVectors += Field<T>::kIsVector ? 1 : 0;
+                size += Field<T>::count(value) * Field<T>::kElementSize;
+            }
+            index++;
+        }
+    };
+
+    struct EncodeVisitor {
+        uint32_t index;
+        uint32_t changed;
+        uint8_t *counts;
+        uint8_t *fields;
+
+        template<typename T>
+        void operator()(const T&, const T &value) {
+            if (changed & (1U << index++)) {
+                size_t size = Field<T>::count(value) * Field<T>::kElementSize;
+                if (Field<T>::kIsVector) {
+                    uint32_t count = Field<T>::count(value);
+                    memcpy(counts, &count, sizeof(count));
+                    counts += sizeof(count);
+                }
+                if (size > 0) {
+                    memcpy(fields, Field<T>::data(value), size);
+                    fields += size;
+                }
+            }
+        }
+    };
+
+    // Counts the changed vectors, then sizes the changed fields from their element counts.
+    struct SizeVisitor {
+        uint32_t index;
+        uint32_t changed;
+        const uint32_t *counts;
+        uint32_t numVectors;
+        uint64_t size;
+
+        template<typename T>
+        void operator()(const T&) {
+            if (changed & (1U << index++)) {
+                uint64_t count = 1;
+                if (Field<T>::kIsVector) {
+                    count = counts != nullptr ? counts[numVectors] : 0;
+                    numVectors++;
+                }
+                size += count * Field<T>::kElementSize;
+            }
+        }
+    };
+
+    struct DecodeVisitor {
+        uint32_t index;
+        uint32_t changed;
+        const uint32_t *counts;
+        const uint8_t *fields;
+
+        template<typename T>
+        void operator()(T &value) {
+            if (changed & (1U << index++)) {
+                size_t count = Field<T>::kIsVector ? *counts++ : 1;
+                size_t size = count * Field<T>::kElementSize;
+                void *dst = Field<T>::resize(&value, count);
+                if (size > 0) {
+                    memcpy(dst, fields, size);
+                    fields += size;
+                }
+            }
+        }
+    };
+
+    // Size of the header before the vector counts: version and changed mask.
+    static const size_t kHeaderSize = 2 * sizeof(uint32_t);
+
+    // Bits of the changed mask that map to a field.
+    static const uint32_t kFieldMask =
+            Schema::kNumFields == 32 ? UINT32_MAX : (1U << Schema::kNumFields) - 1;
+};
+
+template<typename Metadata>
+status_t MetadataDeltaCodec<Metadata>::encode(const Metadata &keyframe, const Metadata &metadata,
+        Message *message) {
+    if (message == nullptr) return -EINVAL;
+
+    DiffVisitor differ = { 0, 0, 0, 0 };
+    Schema::visitPair(keyframe, metadata, differ);
+    size_t countsSize = differ.numVectors * sizeof(uint32_t);
+
+    uint8_t *dst = message->reserveWrite(kHeaderSize + countsSize + differ.size);
+    if (dst == nullptr) return -ENOMEM;
+
+    uint32_t header[2] = { Schema::kVersion, differ.changed };
+    memcpy(dst, header, kHeaderSize);
+
+    EncodeVisitor encoder = { 0, differ.changed, dst + kHeaderSize,
+            dst + kHeaderSize + countsSize };
+    Schema::visitPair(keyframe, metadata, encoder);
+    return 0;
+}
+
+template<typename Metadata>
+status_t MetadataDeltaCodec<Metadata>::decode(Message *message, Metadata *metadata) {
+    if (message == nullptr || metadata == nullptr) return -EINVAL;
+
+    const uint8_t *src = message->consumeRead(kHeaderSize);
+    if (src == nullptr) return -ENODATA;
+
+    uint32_t header[2];
+    memcpy(header, src, kHeaderSize);
+    if (header[0] != Schema::kVersion || (header[1] & ~kFieldMask) != 0) return -EPROTO;
+    uint32_t changed = header[1];
+
+    // Count the changed vectors to read their element counts.
+    SizeVisitor sizer = { 0, changed, nullptr, 0, 0 };
+    Schema::visit(*metadata, sizer);
+
+    src = message->consumeRead(sizer.numVectors * sizeof(uint32_t));
+    if (src == nullptr) return -ENODATA;
+
+    uint32_t counts[Schema::kNumVectors > 0 ? Schema::kNumVectors : 1];
+    memcpy(counts, src, sizer.numVectors * sizeof(uint32_t));
+
+    sizer = { 0, changed, counts, 0, 0 };
+    Schema::visit(*metadata, sizer);
+    if (sizer.size > UINT32_MAX) return -ENODATA;
+
+    const uint8_t *fields = message->consumeRead(sizer.size);
+    if (fields == nullptr) return -ENODATA;
+
+    DecodeVisitor decoder = { 0, changed, counts, fields };
+    Schema::visit(*metadata, decoder);
+    return 0;
+}
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_HDR_PLUS_METADATA_CODEC_H
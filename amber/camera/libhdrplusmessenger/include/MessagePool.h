@@ -0,0 +1,160 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PBCAMERA_MESSAGE_POOL_H
+#define PBCAMERA_MESSAGE_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+namespace pbcamera {
+
+typedef int32_t status_t;
+
+class Message;
+
+/*
+ * MessagePool class
+ *
+ * A pool of messages of the same capacity shared by the threads of an EaselMessenger. Getting and
+ * returning a message is lock-free: free messages are kept on a lock-free stack. The pool starts
+ * with a minimum number of messages and grows on demand up to a maximum. Once no message has been
+ * in use beyond the minimum for a while, the pool frees the data of the extra messages when it
+ * becomes idle. Only a caller finding the pool at its maximum takes a lock, to wait for a message
+ * to be returned.
+ */
+class MessagePool {
+public:
+    struct Stats {
+        int allocated;          // Messages with allocated message data.
+        int inUse;              // Messages out of the pool right now.
+        int highWaterMark;      // Most messages out of the pool at once.
+        int maxMessages;        // Ceiling of allocated.
+        uint64_t stalls;        // Gets that had to wait for a message to be returned.
+        uint64_t failures;      // Gets that timed out waiting.
+    };
+
+    MessagePool();
+    virtual ~MessagePool();
+
+    /*
+     * Create the pool with minMessages messages of capacity bytes each, growing up to maxMessages.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if minMessages or maxMessages is invalid.
+     *  -EBUSY:     if messages of a previous create() are still out of the pool.
+     *  -ENOMEM:    if allocating the messages failed.
+     */
+    status_t create(int capacity, int minMessages, int maxMessages);
+
+    /*
+     * Free the messages in the pool. Messages still out of the pool are freed when returned, and
+     * gets fail until the pool is created again.
+     */
+    void destroy();
+
+    /*
+     * Get an empty message, waiting up to timeoutMs for one to be returned if the pool is at its
+     * maximum.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOENT:    if no message was available in time.
+     *  -ENODEV:    if the pool is not created.
+     *  -ENOMEM:    if allocating a new message failed.
+     */
+    status_t get(Message **message, int32_t timeoutMs);
+
+    /*
+     * Return a message from get().
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if message is not from this pool or was already returned.
+     */
+    status_t put(Message *message);
+
+    /*
+     * Wait up to timeoutMs for all messages to be returned to the pool.
+     *
+     * Returns:
+     *  true:       if no message is out of the pool.
+     *  false:      if messages are still out of the pool after timeoutMs.
+     */
+    bool waitForReturns(int32_t timeoutMs);
+
+    void getStats(Stats *stats);
+
+private:
+    // Slot index of an empty stack.
+    static const uint32_t kNoSlot = UINT32_MAX;
+
+    /*
+     * A lock-free stack of slot indices, linked through mNext. The head packs a tag, bumped on
+     * every pop, with the top slot index so a pop racing with a pop and push of the same slot
+     * fails instead of corrupting the stack.
+     */
+    class SlotStack {
+    public:
+        SlotStack() : mHead(kNoSlot) {}
+        void reset() { mHead = kNoSlot; }
+        void push(uint32_t slot, std::atomic<uint32_t> *next);
+        // Returns the top slot or kNoSlot if empty.
+        uint32_t pop(std::atomic<uint32_t> *next);
+    private:
+        std::atomic<uint64_t> mHead;
+    };
+
+    // Pop a free message, or allocate one if below the maximum. Returns kNoSlot if neither.
+    uint32_t tryGet(status_t *res);
+
+    // Free the data of free messages beyond the minimum if the pool has been idle long enough.
+    void trimIfIdle();
+
+    int mCapacity;
+    int mMinMessages;
+    uint32_t mMaxMessages;
+
+    std::unique_ptr<Message[]> mMessages;           // mMaxMessages messages.
+    std::unique_ptr<std::atomic<uint32_t>[]> mNext; // Next slot on a stack, per slot.
+    // Whether each slot is out of the pool, so a message returned twice is not pushed twice.
+    std::unique_ptr<std::atomic<bool>[]> mSlotInUse;
+    SlotStack mFree;        // Slots with message data, ready to get.
+    SlotStack mUnallocated; // Slots whose message data was freed by trimming.
+    std::atomic<uint32_t> mUsedSlots;       // Slots ever handed out since create().
+
+    std::atomic<bool> mCreated;
+    std::atomic<int> mAllocated;
+    std::atomic<int> mInUse;
+    std::atomic<int> mHighWaterMark;
+    std::atomic<uint64_t> mStalls;
+    std::atomic<uint64_t> mFailures;
+    // Last time more than mMinMessages messages were out of the pool, in nanoseconds.
+    std::atomic<int64_t> mLastBusyNs;
+    std::atomic_flag mTrimming;
+
+    // Wakes up gets and waitForReturns() waiting for messages to be returned.
+    std::mutex mWaitLock;
+    std::condition_variable mWaitCond;
+    std::atomic<int> mWaiters;
+};
+
+} // namespace pbcamera
+
+#endif // PBCAMERA_MESSAGE_POOL_H
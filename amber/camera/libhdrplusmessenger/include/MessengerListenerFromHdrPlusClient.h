@@ -169,10 +169,19 @@ private:
     status_t deserializeSubmitCaptureRequest(Message *message);
     void deserializeNotifyDmaInputBuffer(Message *message, DmaBufferHandle dmaHandle,
             int dmaDataSize);
+    status_t deserializeNotifyFrameMetadataKeyframe(Message *message);
     void deserializeNotifyFrameMetadata(Message *message);
 
     // Read a stream configuration from a message.
     status_t readStreamConfiguration(Message *message, StreamConfiguration *config);
+
+    /*
+     * The last frame metadata keyframe from HDR+ client and its ID, that frame metadata deltas
+     * are applied to. Only accessed in the thread calling onMessage().
+     */
+    FrameMetadata mFrameMetadataKeyframe = {};
+    uint32_t mFrameMetadataKeyframeId = 0;
+    bool mFrameMetadataKeyframeValid = false;
 };
 
 } // namespace pbcamera
@@ -17,7 +17,9 @@
 #define PAINTBOX_HDR_PLUS_SERVICE_MESSENGER_LISTENER_H
 
 #include <stdint.h>
+#include <vector>
 
+#include "AtraceBatch.h"
 #include "EaselMessenger.h"
 #include "HdrPlusMessageTypes.h"
 
@@ -37,6 +39,12 @@ public:
     // Invoked when a frame was captured with a framestamp.
     virtual void notifyFrameEaselTimestamp(int64_t easelTimestampNs) = 0;
 
+    /*
+     * Invoked when a batch of frames were captured, with their Easel timestamps in capture order.
+     * The default implementation invokes notifyFrameEaselTimestamp() for each timestamp.
+     */
+    virtual void notifyFrameEaselTimestamps(const std::vector<int64_t> &easelTimestampsNs);
+
     /*
      * Invoked when a capture result with a DMA buffer is received. If the callback function wants
      * to transfer the DMA buffer to a local buffer, it must call
@@ -83,6 +91,13 @@ public:
      */
     virtual void notifyAtrace(const std::string &trace, int32_t cookie, int32_t begin) = 0;
 
+    /*
+     * Invoked when HDR+ service reports a batch of trace events, in the order they happened.
+     * dropped is the number of events HDR+ service dropped before this batch. The default
+     * implementation invokes notifyAtrace() for each begin and end event.
+     */
+    virtual void notifyAtraceEvents(const std::vector<AtraceEvent> &events, uint32_t dropped);
+
 private:
     /*
      * Override EaselMessengerListener::onMessage
@@ -113,6 +128,7 @@ private:
 
     // Functions to deserialize messages.
     void deserializeNotifyFrameEaselTimestamp(Message *message);
+    void deserializeNotifyFrameEaselTimestamps(Message *message);
     void deserializeNotifyDmaCaptureResult(Message *message, DmaBufferHandle handle,
             int dmaDataSize);
     void deserializeNotifyShutter(Message *message);
@@ -124,6 +140,10 @@ private:
             int dmaDataSize);
     void deserializeNotifyNextCaptureReady(Message *message);
     void deserializeNotifyAtrace(Message *message);
+    void deserializeNotifyAtraceBatch(Message *message);
+
+    // Reader of atrace batches. Only accessed in onMessage().
+    AtraceBatchReader mAtraceBatchReader;
 };
 
 } // namespace pbcamera
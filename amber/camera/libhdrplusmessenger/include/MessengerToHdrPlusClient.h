@@ -16,6 +16,11 @@
 #ifndef PAINTBOX_MESSENGER_TO_HDR_PLUS_CLIENT_H
 #define PAINTBOX_MESSENGER_TO_HDR_PLUS_CLIENT_H
 
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+#include "AtraceBatch.h"
 #include "EaselMessenger.h"
 #include "easelcomm.h"
 #include "HdrPlusMessageTypes.h"
@@ -23,9 +28,6 @@
 
 namespace pbcamera {
 
-const int32_t kAtraceBegin = 1;
-const int32_t kAtraceEnd = 0;
-
 /*
  * MessengerToHdrPlusClient
  *
@@ -62,6 +64,14 @@ public:
      */
     void notifyFrameEaselTimestampAsync(int64_t easelTimestampNs);
 
+    /*
+     * Send a batch of frame timestamps to HDR+ client in one message.
+     *
+     * easelTimestampsNs are the Easel timestamps in the order the frames were captured. At most
+     *                   kMaxEaselTimestampsPerMessage timestamps can be sent in one message.
+     */
+    void notifyFrameEaselTimestampsAsync(const std::vector<int64_t> &easelTimestampsNs);
+
     /*
      * Send a capture result to HDR+ client.
      */
@@ -100,7 +110,8 @@ public:
     void notifyNextCaptureReadyAsync(uint32_t requestId);
 
     /*
-     * Invoked when pbserver want to send an atrace event to client
+     * Invoked when pbserver want to send an atrace event to client. Events are buffered and sent
+     * to the client in batches.
      *
      * trace is the name of the event
      * cookie is the id of the event
@@ -108,7 +119,40 @@ public:
      */
     void notifyAtraceAsync(const std::string &trace, int32_t cookie, int32_t begin);
 
+    /*
+     * Invoked when pbserver want to send an atrace counter value to client. Events are buffered
+     * and sent to the client in batches.
+     *
+     * trace is the name of the counter.
+     * value is the value of the counter.
+     */
+    void notifyAtraceCounterAsync(const std::string &trace, int64_t value);
+
+    /*
+     * Set the function to convert Easel's CLOCK_BOOTTIME to AP's CLOCK_BOOTTIME, used to remap
+     * the timestamps of atrace events. It returns 0 on success. If it's not set or it fails, HDR+
+     * client estimates the offset when it receives the events.
+     */
+    void setAtraceClockConverter(std::function<int(int64_t, int64_t*)> converter);
+
 private:
+    // Number of atrace events buffered before they are dropped.
+    static const size_t kAtraceBufferCapacity = 1024;
+
+    // Number of buffered atrace events that triggers sending them before the period elapses.
+    static const size_t kAtraceFlushThreshold = kAtraceBufferCapacity / 2;
+
+    // Buffer an atrace event and wake up the atrace thread if the buffer is filling up.
+    void recordAtrace(const std::string &trace, int32_t type, int64_t value);
+
+    // Thread loop that sends buffered atrace events to HDR+ client periodically.
+    void atraceThreadLoop();
+
+    // Stop the atrace thread after it sends the remaining events.
+    void stopAtraceThread();
+
+    // Send all buffered atrace events to HDR+ client. Must be called with mApiLock held.
+    void flushAtraceEventsLocked();
 
     // Protect API methods from being called simultaneously.
     std::mutex mApiLock;
@@ -117,6 +161,18 @@ private:
     bool mConnected;
 
     EaselCommServer mEaselCommServer;
+
+    // Converts Easel's clock to AP's clock for atrace events. Protected by mApiLock.
+    std::function<int(int64_t, int64_t*)> mAtraceClockConverter;
+
+    AtraceBuffer mAtraceBuffer;
+
+    // Thread to send atrace events and the variables to control it.
+    std::thread mAtraceThread;
+    std::mutex mAtraceThreadLock;
+    std::condition_variable mAtraceThreadCond;
+    bool mAtraceThreadExiting; // Protected by mAtraceThreadLock.
+    bool mAtraceFlushRequested; // Protected by mAtraceThreadLock.
 };
 
 } // namespace pbcamera
@@ -16,6 +16,7 @@
 #ifndef PAINTBOX_MESSENGER_TO_HDR_PLUS_SERVICE_H
 #define PAINTBOX_MESSENGER_TO_HDR_PLUS_SERVICE_H
 
+#include <atomic>
 #include <stdint.h>
 
 #include "EaselMessenger.h"
@@ -132,10 +133,21 @@ public:
      * Send a frame metadata to HDR+ service asynchronously. This may return before HDR+ service
      * receives the frame metadata.
      *
+     * Frame metadata is sent as the fields that changed since the last keyframe HDR+ service
+     * acknowledged. After connecting, after streams are configured and after a send fails, the
+     * whole frame metadata is sent synchronously as the next keyframe. A delta HDR+ service fails
+     * to decode only loses that frame, since every delta refers to the keyframe.
+     *
      * metadata is the metadata that will be copied and sent to HDR+ service.
      */
     void notifyFrameMetadataAsync(const FrameMetadata &metadata);
 
+    /*
+     * Set the number of frame metadata sent as deltas before another keyframe is sent, or 0 to
+     * only send keyframes when needed (the default).
+     */
+    void setFrameMetadataKeyframeInterval(uint32_t interval);
+
 private:
     // Disconnect with mApiLock held.
     void disconnectLocked(bool isErrorState);
@@ -156,13 +168,30 @@ private:
     // Write a stream configuration to a message.
     status_t writeStreamConfiguration(Message *message, const StreamConfiguration &config);
 
-    // Protect API methods from being called simultaneously.
+    // Protect API methods from being called simultaneously. Released before a message is sent so
+    // several API calls can wait for their replies at once.
     std::mutex mApiLock;
 
     // If it's currently connected to HDR+ service.
     bool mConnected;
 
     EaselCommClient mEaselCommClient;
+
+    // Protect the frame metadata keyframe state below. Held while sending a keyframe so deltas
+    // are only encoded against a keyframe HDR+ service has acknowledged.
+    std::mutex mFrameMetadataLock;
+    // The last keyframe HDR+ service acknowledged and its ID.
+    FrameMetadata mFrameMetadataKeyframe;
+    uint32_t mFrameMetadataKeyframeId;
+    // If mFrameMetadataKeyframe can be used for deltas.
+    bool mFrameMetadataKeyframeValid;
+    // Number of deltas sent against mFrameMetadataKeyframe.
+    uint32_t mFrameMetadataDeltas;
+    // Number of deltas to send between two keyframes, 0 for no limit.
+    uint32_t mFrameMetadataKeyframeInterval;
+    // Set to send a keyframe next. Not protected by mFrameMetadataLock so it can be set while
+    // holding mApiLock.
+    std::atomic<bool> mFrameMetadataResync;
 };
 
 } // namespace pbcamera
@@ -236,6 +236,12 @@ status_t HdrPlusPipeline::stopPipelineLocked() {
 
     mState = STATE_STOPPED;
 
+    // Return idle output buffers to Easel while HDR+ is not running.
+    if (mOutputBufferPool != nullptr) {
+        mOutputBufferPool->logStats();
+        mOutputBufferPool->freeIdleBuffers();
+    }
+
     ALOGI("%s: HDR+ pipeline is stopped.", __FUNCTION__);
     return 0;
 }
@@ -302,6 +308,21 @@ void HdrPlusPipeline::destroyLocked() {
     mHdrPlusProcessingBlock = nullptr;
     mCaptureResultBlock = nullptr;
 
+    // Pooled PipelineImxBuffers keep the pool alive, so free its buffers explicitly before the
+    // allocator is deleted. All buffers should have been released with the streams and blocks.
+    if (mOutputBufferPool != nullptr) {
+        mOutputBufferPool->freeIdleBuffers();
+        uint32_t usedBuffers = 0;
+        for (auto &classStats : mOutputBufferPool->getStats().classes) {
+            usedBuffers += classStats.usedBuffers;
+        }
+        if (usedBuffers > 0) {
+            ALOGE("%s: %u output buffers are still in use when deleting the allocator.",
+                    __FUNCTION__, usedBuffers);
+        }
+        mOutputBufferPool = nullptr;
+    }
+
     if (mImxMemoryAllocatorHandle != nullptr) {
         ImxError err = ImxDeleteMemoryAllocator(mImxMemoryAllocatorHandle);
         if (err != IMX_SUCCESS) {
@@ -344,6 +365,7 @@ status_t HdrPlusPipeline::createStreamsLocked(const InputConfiguration &inputCon
     mOutputStreams.clear();
 
     // Allocate output streams.
+    std::vector<uint64_t> outputBufferSizes;
     for (auto outputConfig : outputConfigs) {
         std::shared_ptr<PipelineStream> stream = PipelineStream::newPipelineStream(
                 mImxMemoryAllocatorHandle, outputConfig, kDefaultNumOutputBuffers);
@@ -352,6 +374,17 @@ status_t HdrPlusPipeline::createStreamsLocked(const InputConfiguration &inputCon
             return -ENODEV;
         }
         mOutputStreams.push_back(stream);
+        outputBufferSizes.push_back(PipelineImxBuffer::getImxBufferSize(outputConfig));
+    }
+
+    // Create a pool of output stream buffers so they are not allocated for every request.
+    mOutputBufferPool = std::make_shared<ImxBufferPool>(mImxMemoryAllocatorHandle,
+            kOutputBufferPoolBudgetBytes);
+    status_t res = mOutputBufferPool->configure(outputBufferSizes, kNumPreallocatedOutputBuffers);
+    if (res != 0) {
+        // Buffers that couldn't be allocated up front are allocated when needed.
+        ALOGW("%s: Preallocating output buffers failed: %s (%d).", __FUNCTION__, strerror(-res),
+                res);
     }
 
     return 0;
@@ -417,7 +450,7 @@ status_t HdrPlusPipeline::createBlocksAndStreamRouteLocked(const SensorMode *sen
     // Create an HDR+ processing block for HDR+ processing.
     mHdrPlusProcessingBlock = HdrPlusProcessingBlock::newHdrPlusProcessingBlock(shared_from_this(),
             mStaticMetadata, sourceCaptureBlock, sensorMode == nullptr, cameraId,
-            mImxMemoryAllocatorHandle, mMessengerToClient);
+            mImxMemoryAllocatorHandle, mOutputBufferPool, mMessengerToClient);
     if (mHdrPlusProcessingBlock == nullptr) {
         ALOGE("%s: Creating HdrPlusProcessingBlock failed.", __FUNCTION__);
         return -ENODEV;
@@ -491,6 +524,13 @@ status_t HdrPlusPipeline::submitCaptureRequest(const CaptureRequest &request,
         return -EINVAL;
     }
 
+    // The base frames of the request may have been captured already. Send their Easel timestamps
+    // now so the client can match their frame metadata without waiting for the batch window.
+    if (mSourceCaptureBlock != nullptr) {
+        std::static_pointer_cast<SourceCaptureBlock>(mSourceCaptureBlock)->
+                flushTimestampNotifications();
+    }
+
     outputRequest.route = mOutputStreamRoute;
     std::shared_ptr<PipelineBlock> startingBlock = getNextBlockLocked(outputRequest);
     if (startingBlock == nullptr) {
@@ -160,6 +160,13 @@ private:
     // Default number of buffers in output streams.
     const int kDefaultNumOutputBuffers = 3;
 
+    // Max bytes of IMX buffers the output buffer pool keeps for output streams, enough for the
+    // outputs of kMaxPendingShotCaptures 12MP shots with a postview and a thumbnail.
+    const int64_t kOutputBufferPoolBudgetBytes = 48 * 1024 * 1024;
+
+    // Number of buffers allocated up front for each output stream when streams are configured.
+    const uint32_t kNumPreallocatedOutputBuffers = 1;
+
     // Time to wait when getting a buffer from a stream.
     const uint32_t kGetBufferTimeoutMs = 5000;
 
@@ -255,6 +262,9 @@ private:
     // IMX memory allocate handle to allocate IMX buffers.
     ImxMemoryAllocatorHandle mImxMemoryAllocatorHandle;
 
+    // Pool of IMX buffers for output stream buffers, recreated when streams are configured.
+    std::shared_ptr<ImxBufferPool> mOutputBufferPool;
+
     // IMX IPU Device (mock device to setup easel side when data is from client)
     ImxDeviceHandle mImxIpuDevice;
 
@@ -35,6 +35,10 @@ status_t HdrPlusService::start() {
         return -ENODEV;
     }
 
+    // Trace events are stamped with Easel's clock. Let the client remap them to AP's clock.
+    mMessengerToClient->setAtraceClockConverter(
+            EaselControlServer::localToApSynchronizedClockBoottime);
+
     res = mMessengerToClient->connect(*this);
     if (res != 0) {
         ALOGE("%s: Connecting to messenger failed: %s (%d).", __FUNCTION__, strerror(-res), res);
@@ -0,0 +1,281 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ImxBufferPool"
+#include <log/log.h>
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "ImxBufferPool.h"
+
+namespace pbcamera {
+
+namespace {
+int64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+}  // namespace
+
+ImxBufferPool::ImxBufferPool(ImxMemoryAllocatorHandle allocator, int64_t budgetBytes) :
+        mAllocator(allocator),
+        mBudgetBytes(budgetBytes),
+        mPooledBytes(0),
+        mUnpooledAcquires(0) {
+}
+
+ImxBufferPool::~ImxBufferPool() {
+    std::unique_lock<std::mutex> lock(mLock);
+    logStatsLocked();
+
+    if (!mUsedBuffers.empty()) {
+        ALOGE("%s: %zu buffers are still in use.", __FUNCTION__, mUsedBuffers.size());
+    }
+
+    for (auto &entry : mClasses) {
+        freeIdleBuffersLocked(&entry.second);
+    }
+}
+
+status_t ImxBufferPool::allocateLocked(uint64_t bufferBytes, ClassStats *stats,
+        ImxDeviceBufferHandle *buffer) {
+    auto start = std::chrono::steady_clock::now();
+    ImxError err = ImxCreateDeviceBufferManaged(mAllocator, bufferBytes,
+            kImxDefaultDeviceBufferAlignment, kImxDefaultDeviceBufferHeap, /*flags*/0, buffer);
+    if (err != 0) {
+        ALOGE("%s: Allocate %" PRIu64 " bytes failed: %d", __FUNCTION__, bufferBytes, err);
+        *buffer = nullptr;
+        return -ENOMEM;
+    }
+
+    if (stats != nullptr) {
+        int64_t allocationNs = elapsedNs(start);
+        stats->allocations++;
+        stats->totalAllocationNs += allocationNs;
+        stats->maxAllocationNs = std::max(stats->maxAllocationNs, allocationNs);
+    }
+
+    return 0;
+}
+
+void ImxBufferPool::freeBufferLocked(ImxDeviceBufferHandle buffer) {
+    ImxError err = ImxDeleteDeviceBuffer(buffer);
+    if (err != 0) {
+        ALOGE("%s: Deleting buffer %p failed: %d", __FUNCTION__, buffer, err);
+    }
+}
+
+void ImxBufferPool::freeIdleBuffersLocked(SizeClass *sizeClass) {
+    for (auto buffer : sizeClass->idleBuffers) {
+        freeBufferLocked(buffer);
+        mPooledBytes -= sizeClass->stats.bufferBytes;
+    }
+    sizeClass->idleBuffers.clear();
+    sizeClass->stats.idleBuffers = 0;
+}
+
+void ImxBufferPool::removeUnusedClassesLocked() {
+    for (auto entry = mClasses.begin(); entry != mClasses.end();) {
+        SizeClass &sizeClass = entry->second;
+        if (!sizeClass.configured && sizeClass.idleBuffers.empty() &&
+                sizeClass.stats.usedBuffers == 0) {
+            entry = mClasses.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+}
+
+bool ImxBufferPool::makeRoomLocked(uint64_t bufferBytes, const SizeClass *keepClass) {
+    // Evict idle buffers of classes that are no longer configured first.
+    for (bool configured : { false, true }) {
+        for (auto &entry : mClasses) {
+            SizeClass &sizeClass = entry.second;
+            if (&sizeClass == keepClass || sizeClass.configured != configured) continue;
+
+            while (mPooledBytes + static_cast<int64_t>(bufferBytes) > mBudgetBytes &&
+                    !sizeClass.idleBuffers.empty()) {
+                freeBufferLocked(sizeClass.idleBuffers.back());
+                sizeClass.idleBuffers.pop_back();
+                sizeClass.stats.idleBuffers--;
+                mPooledBytes -= sizeClass.stats.bufferBytes;
+            }
+        }
+    }
+
+    removeUnusedClassesLocked();
+    return mPooledBytes + static_cast<int64_t>(bufferBytes) <= mBudgetBytes;
+}
+
+status_t ImxBufferPool::configure(const std::vector<uint64_t> &bufferBytes,
+        uint32_t buffersPerClass) {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    // Count the streams of each size.
+    std::map<uint64_t, uint32_t> numStreams;
+    for (auto bytes : bufferBytes) {
+        numStreams[bytes]++;
+    }
+
+    for (auto &entry : mClasses) {
+        entry.second.configured = numStreams.find(entry.first) != numStreams.end();
+        if (!entry.second.configured) {
+            freeIdleBuffersLocked(&entry.second);
+        }
+    }
+    removeUnusedClassesLocked();
+
+    status_t res = 0;
+    for (auto &streams : numStreams) {
+        uint64_t bytes = streams.first;
+        SizeClass &sizeClass = mClasses[bytes];
+        if (!sizeClass.configured) {
+            sizeClass.configured = true;
+            sizeClass.stats = {};
+            sizeClass.stats.bufferBytes = bytes;
+        }
+
+        uint32_t numBuffers = streams.second * buffersPerClass;
+        while (sizeClass.stats.idleBuffers + sizeClass.stats.usedBuffers < numBuffers) {
+            if (mPooledBytes + static_cast<int64_t>(bytes) > mBudgetBytes) {
+                ALOGW("%s: Budget %" PRId64 " bytes allows %u of %u buffers of %" PRIu64
+                        " bytes.", __FUNCTION__, mBudgetBytes,
+                        sizeClass.stats.idleBuffers + sizeClass.stats.usedBuffers, numBuffers,
+                        bytes);
+                break;
+            }
+
+            ImxDeviceBufferHandle buffer;
+            res = allocateLocked(bytes, &sizeClass.stats, &buffer);
+            if (res != 0) break;
+
+            sizeClass.idleBuffers.push_back(buffer);
+            sizeClass.stats.idleBuffers++;
+            mPooledBytes += bytes;
+        }
+        if (res != 0) break;
+    }
+
+    logStatsLocked();
+    return res;
+}
+
+status_t ImxBufferPool::acquire(uint64_t bufferBytes, ImxDeviceBufferHandle *buffer) {
+    if (buffer == nullptr) return -EINVAL;
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mLock);
+
+    auto entry = mClasses.find(bufferBytes);
+    SizeClass *sizeClass = (entry != mClasses.end() && entry->second.configured) ?
+            &entry->second : nullptr;
+    ClassStats *stats = sizeClass != nullptr ? &sizeClass->stats : nullptr;
+
+    if (sizeClass != nullptr && !sizeClass->idleBuffers.empty()) {
+        *buffer = sizeClass->idleBuffers.back();
+        sizeClass->idleBuffers.pop_back();
+        stats->idleBuffers--;
+    } else {
+        // Evict idle buffers before allocating so the new buffer can use their memory.
+        bool pooled = sizeClass != nullptr && makeRoomLocked(bufferBytes, sizeClass);
+        status_t res = allocateLocked(bufferBytes, stats, buffer);
+        if (res != 0) return res;
+
+        if (pooled) {
+            // Grow the class with the new buffer.
+            mPooledBytes += bufferBytes;
+        } else {
+            mUnpooledAcquires++;
+            if (stats != nullptr) {
+                stats->acquires++;
+                stats->totalAcquireNs += elapsedNs(start);
+            }
+            ALOGD("%s: Allocated %" PRIu64 " bytes outside of the pool (%" PRId64 " of %" PRId64
+                    " bytes pooled).", __FUNCTION__, bufferBytes, mPooledBytes, mBudgetBytes);
+            return 0;
+        }
+    }
+
+    mUsedBuffers[*buffer] = bufferBytes;
+    stats->usedBuffers++;
+    stats->acquires++;
+    stats->totalAcquireNs += elapsedNs(start);
+
+    ALOGV("%s: Acquired %" PRIu64 " bytes: %u idle, %u used, %" PRIu64 " allocations in %"
+            PRIu64 " acquires.", __FUNCTION__, bufferBytes, stats->idleBuffers,
+            stats->usedBuffers, stats->allocations, stats->acquires);
+    return 0;
+}
+
+void ImxBufferPool::release(ImxDeviceBufferHandle buffer) {
+    if (buffer == nullptr) return;
+
+    std::unique_lock<std::mutex> lock(mLock);
+
+    auto used = mUsedBuffers.find(buffer);
+    if (used == mUsedBuffers.end()) {
+        // The buffer didn't fit in the pool.
+        freeBufferLocked(buffer);
+        return;
+    }
+
+    SizeClass &sizeClass = mClasses[used->second];
+    mUsedBuffers.erase(used);
+    sizeClass.stats.usedBuffers--;
+
+    if (!sizeClass.configured) {
+        freeBufferLocked(buffer);
+        mPooledBytes -= sizeClass.stats.bufferBytes;
+        removeUnusedClassesLocked();
+        return;
+    }
+
+    sizeClass.idleBuffers.push_back(buffer);
+    sizeClass.stats.idleBuffers++;
+}
+
+void ImxBufferPool::freeIdleBuffers() {
+    std::unique_lock<std::mutex> lock(mLock);
+    for (auto &entry : mClasses) {
+        freeIdleBuffersLocked(&entry.second);
+    }
+    removeUnusedClassesLocked();
+}
+
+ImxBufferPool::Stats ImxBufferPool::getStats() {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    Stats stats = {};
+    stats.budgetBytes = mBudgetBytes;
+    stats.pooledBytes = mPooledBytes;
+    stats.unpooledAcquires = mUnpooledAcquires;
+    for (auto &entry : mClasses) {
+        stats.classes.push_back(entry.second.stats);
+    }
+    return stats;
+}
+
+void ImxBufferPool::logStats() {
+    std::unique_lock<std::mutex> lock(mLock);
+    logStatsLocked();
+}
+
+void ImxBufferPool::logStatsLocked() {
+    ALOGI("%s: %" PRId64 " of %" PRId64 " bytes pooled, %" PRIu64 " acquires outside of the pool.",
+            __FUNCTION__, mPooledBytes, mBudgetBytes, mUnpooledAcquires);
+    for (auto &entry : mClasses) {
+        const ClassStats &stats = entry.second.stats;
+        ALOGI("%s: %" PRIu64 " bytes: %u idle, %u used, %" PRIu64 " acquires, %" PRIu64
+                " allocations (avg %" PRId64 " us, max %" PRId64 " us), avg acquire %" PRId64
+                " us.", __FUNCTION__, stats.bufferBytes, stats.idleBuffers, stats.usedBuffers,
+                stats.acquires, stats.allocations,
+                stats.allocations > 0 ? stats.totalAllocationNs / 1000 /
+                        static_cast<int64_t>(stats.allocations) : 0,
+                stats.maxAllocationNs / 1000,
+                stats.acquires > 0 ? stats.totalAcquireNs / 1000 /
+                        static_cast<int64_t>(stats.acquires) : 0);
+    }
+}
+
+} // namespace pbcamera
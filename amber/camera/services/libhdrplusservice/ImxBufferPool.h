@@ -0,0 +1,141 @@
+#ifndef PAINTBOX_HDR_PLUS_PIPELINE_IMX_BUFFER_POOL_H
+#define PAINTBOX_HDR_PLUS_PIPELINE_IMX_BUFFER_POOL_H
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "third_party/halide/paintbox/src/runtime/imx.h"
+
+namespace pbcamera {
+
+typedef int32_t status_t;
+
+/*
+ * ImxBufferPool
+ *
+ * ImxBufferPool recycles IMX device buffers of request output streams. Allocating an IMX buffer
+ * is slow and fragments Easel DRAM over a long session, so buffers released by output streams are
+ * kept in a slab for each size class and handed out again. A size class is the buffer size of
+ * configured output streams; streams of the same size share a class.
+ *
+ * The pool holds at most budgetBytes of IMX memory in buffers it owns, whether idle or handed out.
+ * A class grows when all its buffers are in use, evicting idle buffers of other classes if needed
+ * to stay within the budget. A buffer that doesn't fit in the budget, or whose size has no class,
+ * is still allocated but freed when it is released.
+ *
+ * This class is thread safe.
+ */
+class ImxBufferPool {
+public:
+    // Statistics of a size class.
+    struct ClassStats {
+        uint64_t bufferBytes;
+        uint32_t idleBuffers;       // Buffers in the pool.
+        uint32_t usedBuffers;       // Buffers handed out that return to the pool when released.
+        uint64_t acquires;          // Acquired buffers, including ones not returning to the pool.
+        uint64_t allocations;       // Acquires that allocated a new IMX buffer.
+        int64_t totalAllocationNs;  // Time spent allocating new IMX buffers.
+        int64_t maxAllocationNs;
+        int64_t totalAcquireNs;     // Time spent in acquire(), including allocations.
+    };
+
+    struct Stats {
+        int64_t budgetBytes;
+        int64_t pooledBytes;        // Bytes of idle and used buffers.
+        uint64_t unpooledAcquires;  // Acquires of buffers that didn't fit in the pool.
+        std::vector<ClassStats> classes;
+    };
+
+    // allocator is the handle to allocate IMX buffers. Pooled buffers can keep the pool alive, so
+    // release all buffers and call freeIdleBuffers() before deleting the allocator.
+    ImxBufferPool(ImxMemoryAllocatorHandle allocator, int64_t budgetBytes);
+    virtual ~ImxBufferPool();
+
+    /*
+     * Set the size classes of the pool, e.g. when output streams are configured. Idle buffers of
+     * previous classes that are not in bufferBytes are freed. Up to buffersPerClass buffers are
+     * allocated up front for each class, within the budget.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOMEM:    if allocating a buffer failed.
+     */
+    status_t configure(const std::vector<uint64_t> &bufferBytes, uint32_t buffersPerClass);
+
+    /*
+     * Acquire a buffer of bufferBytes. The buffer must be returned with release().
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if buffer is nullptr.
+     *  -ENOMEM:    if allocating a buffer failed.
+     */
+    status_t acquire(uint64_t bufferBytes, ImxDeviceBufferHandle *buffer);
+
+    // Release a buffer acquired from acquire(). The buffer must be unlocked.
+    void release(ImxDeviceBufferHandle buffer);
+
+    // Free all idle buffers, e.g. when IMX memory is needed for processing.
+    void freeIdleBuffers();
+
+    // Return the statistics of the pool.
+    Stats getStats();
+
+    // Log the statistics of the pool.
+    void logStats();
+
+private:
+    struct SizeClass {
+        // Whether the class is in the current configuration. Buffers of a class that is no longer
+        // configured are freed when released.
+        bool configured;
+        std::vector<ImxDeviceBufferHandle> idleBuffers;
+        ClassStats stats;
+    };
+
+    // Allocate a new IMX buffer and add the allocation time to stats if it's not nullptr. Must be
+    // called with mLock locked.
+    status_t allocateLocked(uint64_t bufferBytes, ClassStats *stats,
+            ImxDeviceBufferHandle *buffer);
+
+    // Free idle buffers of classes other than keepClass until bufferBytes more fit in the budget.
+    // Return if they fit. Must be called with mLock locked.
+    bool makeRoomLocked(uint64_t bufferBytes, const SizeClass *keepClass);
+
+    // Free a buffer. Must be called with mLock locked.
+    void freeBufferLocked(ImxDeviceBufferHandle buffer);
+
+    // Free the idle buffers of a class. Must be called with mLock locked.
+    void freeIdleBuffersLocked(SizeClass *sizeClass);
+
+    // Remove classes that are no longer configured and have no buffers. Must be called with mLock
+    // locked.
+    void removeUnusedClassesLocked();
+
+    // Log the statistics of the pool. Must be called with mLock locked.
+    void logStatsLocked();
+
+    std::mutex mLock;
+
+    ImxMemoryAllocatorHandle mAllocator;
+    const int64_t mBudgetBytes;
+
+    // Bytes of idle and used buffers. Must be protected by mLock.
+    int64_t mPooledBytes;
+
+    // Number of acquired buffers that didn't fit in the pool. Must be protected by mLock.
+    uint64_t mUnpooledAcquires;
+
+    // Size classes by buffer size. Must be protected by mLock.
+    std::map<uint64_t, SizeClass> mClasses;
+
+    // Size of each used buffer that returns to the pool when released. Must be protected by mLock.
+    std::unordered_map<ImxDeviceBufferHandle, uint64_t> mUsedBuffers;
+};
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_HDR_PLUS_PIPELINE_IMX_BUFFER_POOL_H
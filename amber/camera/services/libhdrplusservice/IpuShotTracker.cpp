@@ -0,0 +1,52 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "IpuShotTracker"
+#include <log/log.h>
+
+#include "IpuShotTracker.h"
+
+namespace pbcamera {
+
+IpuShotTracker::IpuShotTracker() : mShotsInFlight(0), mAddingPayloadFrames(false) {
+}
+
+IpuShotTracker::~IpuShotTracker() {
+}
+
+void IpuShotTracker::startShot() {
+    if (mAddingPayloadFrames) {
+        ALOGW("%s: Previous shot's payload frames were not added.", __FUNCTION__);
+    }
+
+    mShotsInFlight++;
+    mAddingPayloadFrames = true;
+    ALOGV("%s: %u shots in flight.", __FUNCTION__, mShotsInFlight);
+}
+
+bool IpuShotTracker::payloadFramesAdded() {
+    if (!mAddingPayloadFrames) {
+        ALOGE("%s: No shot is starting.", __FUNCTION__);
+        return false;
+    }
+
+    mAddingPayloadFrames = false;
+    return true;
+}
+
+bool IpuShotTracker::finishShot() {
+    if (mShotsInFlight == 0) {
+        ALOGE("%s: No shot is in flight.", __FUNCTION__);
+        return false;
+    }
+
+    mShotsInFlight--;
+    ALOGV("%s: %u shots in flight.", __FUNCTION__, mShotsInFlight);
+
+    // A starting shot keeps capture paused until its payload frames are added.
+    return mShotsInFlight == 0;
+}
+
+uint32_t IpuShotTracker::getShotsInFlight() const {
+    return mShotsInFlight;
+}
+
+} // namespace pbcamera
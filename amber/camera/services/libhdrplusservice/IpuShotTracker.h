@@ -0,0 +1,60 @@
+#ifndef PAINTBOX_HDR_PLUS_PIPELINE_IPU_SHOT_TRACKER_H
+#define PAINTBOX_HDR_PLUS_PIPELINE_IPU_SHOT_TRACKER_H
+
+#include <stdint.h>
+
+namespace pbcamera {
+
+/*
+ * IpuShotTracker
+ *
+ * Tracks the HDR+ shots in flight on the IPU to decide when MIPI capture can run. Capture pauses
+ * while a shot's payload frames are handed to gcam and resumes as soon as they are, so the frames
+ * of the next shot are captured while earlier shots are still processed. The clock stays in
+ * functional mode until the last shot in flight is done.
+ *
+ * Shots are started one at a time: a shot's payload frames are added before the next shot starts.
+ * Shots can finish in any order.
+ *
+ * This class is not thread safe.
+ */
+class IpuShotTracker {
+public:
+    IpuShotTracker();
+    virtual ~IpuShotTracker();
+
+    // A shot is starting. Capture must be paused until its payload frames are added.
+    void startShot();
+
+    /*
+     * The payload frames of the starting shot have been handed to gcam. A shot that fails to start
+     * must also call this before finishShot().
+     *
+     * Returns:
+     *  true:   if capture can resume while the shots in flight are processed.
+     *  false:  if no shot is starting.
+     */
+    bool payloadFramesAdded();
+
+    /*
+     * A shot is done.
+     *
+     * Returns:
+     *  true:   if it was the last shot in flight, so capture can resume and the clock can go back
+     *          to capture mode.
+     *  false:  if other shots are still in flight, or if no shot is in flight.
+     */
+    bool finishShot();
+
+    // Return the number of shots that have started and are not done.
+    uint32_t getShotsInFlight() const;
+
+private:
+    uint32_t mShotsInFlight;
+    // Whether a started shot's payload frames have not been added yet.
+    bool mAddingPayloadFrames;
+};
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_HDR_PLUS_PIPELINE_IPU_SHOT_TRACKER_H
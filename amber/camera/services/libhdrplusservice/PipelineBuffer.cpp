@@ -3,7 +3,9 @@
 #include <log/log.h>
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <system/graphics.h>
 
@@ -186,7 +188,8 @@ PipelineImxBuffer::PipelineImxBuffer(const std::weak_ptr<PipelineStream> &stream
     PipelineBuffer(stream, config),
     mImxDeviceBufferHandle(nullptr),
     mLockedData(nullptr),
-    mDataSize(0) {
+    mDataSize(0),
+    mSharedFd(-1) {
 }
 
 PipelineImxBuffer::~PipelineImxBuffer() {
@@ -199,8 +202,20 @@ status_t PipelineImxBuffer::allocate() {
 }
 
 void PipelineImxBuffer::destroy() {
+    if (mSharedFd >= 0) {
+        close(mSharedFd);
+        mSharedFd = -1;
+    }
+
     if (mImxDeviceBufferHandle != nullptr) {
-        ImxDeleteDeviceBuffer(mImxDeviceBufferHandle);
+        if (mBufferPool != nullptr) {
+            // Buffers must be unlocked before they are handed out again.
+            unlockData();
+            mBufferPool->release(mImxDeviceBufferHandle);
+            mBufferPool = nullptr;
+        } else {
+            ImxDeleteDeviceBuffer(mImxDeviceBufferHandle);
+        }
         mImxDeviceBufferHandle = nullptr;
     }
 
@@ -221,11 +236,7 @@ status_t PipelineImxBuffer::allocate(ImxMemoryAllocatorHandle imxMemoryAllocator
         return res;
     }
 
-    size_t numBytes = mRequestedConfig.image.padding;
-
-    for (auto plane : mRequestedConfig.image.planes) {
-        numBytes += plane.stride * plane.scanline;
-    }
+    size_t numBytes = getImxBufferSize(mRequestedConfig);
 
     ImxError err = ImxCreateDeviceBufferManaged(imxMemoryAllocatorHandle,
             numBytes,
@@ -243,6 +254,44 @@ status_t PipelineImxBuffer::allocate(ImxMemoryAllocatorHandle imxMemoryAllocator
     return 0;
 }
 
+status_t PipelineImxBuffer::allocate(const std::shared_ptr<ImxBufferPool> &bufferPool) {
+    if (bufferPool == nullptr) return -EINVAL;
+
+    // Check if buffer is already allocated.
+    if (mImxDeviceBufferHandle != nullptr || mYuvImage != nullptr) return -EEXIST;
+
+    status_t res = validateConfig(mRequestedConfig);
+    if (res != 0) {
+        ALOGE("%s: Requested configuration is invalid: %s (%d).", __FUNCTION__, strerror(-res),
+                res);
+        return res;
+    }
+
+    uint64_t numBytes = getImxBufferSize(mRequestedConfig);
+    res = bufferPool->acquire(numBytes, &mImxDeviceBufferHandle);
+    if (res != 0) {
+        ALOGE("%s: Acquiring %" PRIu64 " bytes failed: %s (%d).", __FUNCTION__, numBytes,
+                strerror(-res), res);
+        mImxDeviceBufferHandle = nullptr;
+        return res;
+    }
+
+    mBufferPool = bufferPool;
+    mDataSize = numBytes;
+    mAllocatedConfig = mRequestedConfig;
+    return 0;
+}
+
+uint64_t PipelineImxBuffer::getImxBufferSize(const StreamConfiguration &config) {
+    uint64_t numBytes = config.image.padding;
+
+    for (auto plane : config.image.planes) {
+        numBytes += plane.stride * plane.scanline;
+    }
+
+    return numBytes;
+}
+
 uint8_t* PipelineImxBuffer::getPlaneData(uint32_t planeNum) {
     if (mImxDeviceBufferHandle == nullptr && mYuvImage == nullptr) {
         ALOGE("%s: Buffer is not allocated.", __FUNCTION__);
@@ -266,6 +315,9 @@ uint8_t* PipelineImxBuffer::getPlaneData(uint32_t planeNum) {
 }
 
 int PipelineImxBuffer::getFd() {
+    // Sharing creates a new file descriptor each time, so share the buffer only once.
+    if (mSharedFd >= 0) return mSharedFd;
+
     ImxDeviceBufferHandle handle = nullptr;
     int fd = -1;
 
@@ -280,8 +332,14 @@ int PipelineImxBuffer::getFd() {
         handle = mImxDeviceBufferHandle;
     }
 
-    ImxShareDeviceBuffer(handle, &fd);
-    return fd;
+    ImxError err = ImxShareDeviceBuffer(handle, &fd);
+    if (err != 0) {
+        ALOGE("%s: Sharing the buffer failed: %d", __FUNCTION__, err);
+        return -1;
+    }
+
+    mSharedFd = fd;
+    return mSharedFd;
 }
 
 
@@ -9,6 +9,7 @@
 #include "hardware/gchips/paintbox/system/include/capture.h"
 
 #include "HdrPlusTypes.h"
+#include "ImxBufferPool.h"
 
 namespace pbcamera {
 
@@ -133,13 +134,20 @@ public:
      // Allocate a IMX buffer.
     status_t allocate(ImxMemoryAllocatorHandle imxMemoryAllocatorHandle);
 
+    // Acquire a IMX buffer from a buffer pool. destroy() releases the buffer back to the pool.
+    status_t allocate(const std::shared_ptr<ImxBufferPool> &bufferPool);
+
+    // Return the size of the IMX buffer to allocate for a stream configuration.
+    static uint64_t getImxBufferSize(const StreamConfiguration &config);
+
     // Return the pointer to the raw data of an image plane.
     virtual uint8_t* getPlaneData(uint32_t planeNum) override;
 
     // Return the size of the data.
     virtual uint32_t getDataSize() const override;
 
-    // Get the file descriptor for this buffer.
+    // Get the dma-buf file descriptor for this buffer. The buffer is shared on the first call and
+    // the file descriptor is owned by the buffer until destroy().
     virtual int getFd() override;
 
     // Lock data of the frame buffer. It must be called before calling getPlaneData() to access
@@ -165,6 +173,12 @@ private:
 
     // Attached YuvImage.
     std::unique_ptr<gcam::YuvImage> mYuvImage;
+
+    // Pool that mImxDeviceBufferHandle was acquired from, or nullptr if it was allocated directly.
+    std::shared_ptr<ImxBufferPool> mBufferPool;
+
+    // File descriptor returned by getFd(), or -1 if the buffer hasn't been shared.
+    int mSharedFd;
 };
 
 /**
@@ -0,0 +1,229 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "YuvCopier"
+#include <log/log.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_COPIER_NEON 1
+#endif
+
+#include "YuvCopier.h"
+
+namespace pbcamera {
+
+namespace {
+
+// Copy a row.
+void copyRowScalar(const uint8_t *src, uint8_t *dst, size_t bytes) {
+    memcpy(dst, src, bytes);
+}
+
+// Copy a row of byte pairs, swapping the bytes of each pair. bytes must be even.
+void swapPairsRowScalar(const uint8_t *src, uint8_t *dst, size_t bytes) {
+    // Swap 4 pairs at a time in a 64-bit word.
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t pairs;
+        memcpy(&pairs, src + i, sizeof(pairs));
+        pairs = ((pairs & 0x00FF00FF00FF00FFull) << 8) | ((pairs >> 8) & 0x00FF00FF00FF00FFull);
+        memcpy(dst + i, &pairs, sizeof(pairs));
+    }
+    for (; i + 1 < bytes; i += 2) {
+        uint8_t first = src[i];
+        dst[i] = src[i + 1];
+        dst[i + 1] = first;
+    }
+}
+
+#ifdef YUV_COPIER_NEON
+// Distance ahead of the current position to prefetch source rows from.
+const size_t kNeonPrefetchBytes = 256;
+
+void copyRowNeon(const uint8_t *src, uint8_t *dst, size_t bytes) {
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __builtin_prefetch(src + i + kNeonPrefetchBytes);
+        uint8x16_t v0 = vld1q_u8(src + i);
+        uint8x16_t v1 = vld1q_u8(src + i + 16);
+        uint8x16_t v2 = vld1q_u8(src + i + 32);
+        uint8x16_t v3 = vld1q_u8(src + i + 48);
+        vst1q_u8(dst + i, v0);
+        vst1q_u8(dst + i + 16, v1);
+        vst1q_u8(dst + i + 32, v2);
+        vst1q_u8(dst + i + 48, v3);
+    }
+    for (; i + 16 <= bytes; i += 16) {
+        vst1q_u8(dst + i, vld1q_u8(src + i));
+    }
+    if (i < bytes) {
+        memcpy(dst + i, src + i, bytes - i);
+    }
+}
+
+// vrev16 reverses the bytes in each 16-bit lane, i.e. swaps every pair of chroma samples.
+void swapPairsRowNeon(const uint8_t *src, uint8_t *dst, size_t bytes) {
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __builtin_prefetch(src + i + kNeonPrefetchBytes);
+        uint8x16_t v0 = vrev16q_u8(vld1q_u8(src + i));
+        uint8x16_t v1 = vrev16q_u8(vld1q_u8(src + i + 16));
+        uint8x16_t v2 = vrev16q_u8(vld1q_u8(src + i + 32));
+        uint8x16_t v3 = vrev16q_u8(vld1q_u8(src + i + 48));
+        vst1q_u8(dst + i, v0);
+        vst1q_u8(dst + i + 16, v1);
+        vst1q_u8(dst + i + 32, v2);
+        vst1q_u8(dst + i + 48, v3);
+    }
+    for (; i + 16 <= bytes; i += 16) {
+        vst1q_u8(dst + i, vrev16q_u8(vld1q_u8(src + i)));
+    }
+    swapPairsRowScalar(src + i, dst + i, bytes - i);
+}
+#endif // YUV_COPIER_NEON
+
+} // anonymous namespace
+
+YuvCopier::YuvCopier(uint32_t threadCount, bool useNeon) :
+        mThreadCount(std::max<uint32_t>(threadCount, 1)),
+        mUseNeon(useNeon && isNeonAvailable()),
+        mExiting(false) {
+    for (uint32_t i = 1; i < mThreadCount; i++) {
+        mWorkers.emplace_back(&YuvCopier::workerLoop, this);
+    }
+}
+
+YuvCopier::~YuvCopier() {
+    {
+        std::unique_lock<std::mutex> lock(mChunkLock);
+        mExiting = true;
+    }
+    mChunkQueuedCond.notify_all();
+
+    for (auto &worker : mWorkers) {
+        worker.join();
+    }
+}
+
+void YuvCopier::workerLoop() {
+    std::unique_lock<std::mutex> lock(mChunkLock);
+    while (true) {
+        mChunkQueuedCond.wait(lock, [&] { return mExiting || !mChunks.empty(); });
+        if (mExiting) {
+            return;
+        }
+
+        std::function<void()> chunk = std::move(mChunks.front());
+        mChunks.pop_front();
+        lock.unlock();
+        chunk();
+        lock.lock();
+    }
+}
+
+bool YuvCopier::isNeonAvailable() {
+#ifdef YUV_COPIER_NEON
+    return true;
+#else
+    return false;
+#endif
+}
+
+void YuvCopier::copyRows(const uint8_t *src, size_t srcStride, uint8_t *dst, size_t dstStride,
+        size_t rowBytes, uint32_t startRow, uint32_t endRow, bool swapPairs) const {
+    void (*copyRow)(const uint8_t*, uint8_t*, size_t) =
+            swapPairs ? swapPairsRowScalar : copyRowScalar;
+#ifdef YUV_COPIER_NEON
+    if (mUseNeon) {
+        copyRow = swapPairs ? swapPairsRowNeon : copyRowNeon;
+    }
+#endif
+
+    for (uint32_t y = startRow; y < endRow; y++) {
+        copyRow(src + y * srcStride, dst + y * dstStride, rowBytes);
+    }
+}
+
+status_t YuvCopier::copy(const YuvCopySource &src, const YuvCopyDest &dst, bool swapChroma) {
+    if (src.luma == nullptr || src.chroma == nullptr || dst.luma == nullptr ||
+            dst.chroma == nullptr) {
+        ALOGE("%s: Image planes cannot be nullptr.", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    // Each row of the chroma plane has a pair of samples for every 2 pixels.
+    size_t srcChromaRowBytes = (src.width + 1) / 2 * 2;
+    size_t dstChromaRowBytes = (dst.width + 1) / 2 * 2;
+    if (src.lumaStride < src.width || src.chromaStride < srcChromaRowBytes ||
+            dst.lumaStride < dst.width || dst.chromaStride < dstChromaRowBytes) {
+        ALOGE("%s: Strides (src %zu/%zu dst %zu/%zu) are too small for widths (src %u dst %u).",
+                __FUNCTION__, src.lumaStride, src.chromaStride, dst.lumaStride, dst.chromaStride,
+                src.width, dst.width);
+        return -EINVAL;
+    }
+
+    uint32_t width = std::min(src.width, dst.width);
+    uint32_t height = std::min(src.height, dst.height);
+    size_t chromaRowBytes = (width + 1) / 2 * 2;
+
+    // Split luma rows into chunks of an even number of rows so each chunk covers whole chroma
+    // rows.
+    uint32_t threadCount = std::min(mThreadCount,
+            std::max<uint32_t>(height / kMinRowsPerThread, 1));
+    uint32_t rowsPerThread = ((height + threadCount - 1) / threadCount + 1) & ~1u;
+
+    // The chroma plane has height / 2 rows, so the chunk with the last, odd luma row has no chroma
+    // row for it.
+    uint32_t chromaHeight = height / 2;
+    auto copyChunk = [&](uint32_t startRow, uint32_t endRow) {
+        copyRows(src.luma, src.lumaStride, dst.luma, dst.lumaStride, width, startRow, endRow,
+                /*swapPairs*/false);
+        copyRows(src.chroma, src.chromaStride, dst.chroma, dst.chromaStride, chromaRowBytes,
+                startRow / 2, std::min((endRow + 1) / 2, chromaHeight), swapChroma);
+    };
+
+    // Queue all chunks but the first for the workers and copy the first chunk on the calling
+    // thread. The chunks refer to locals of this call, so wait for all of them before
+    // returning.
+    uint32_t pendingChunks = 0;
+    {
+        std::unique_lock<std::mutex> lock(mChunkLock);
+        for (uint32_t startRow = rowsPerThread; startRow < height; startRow += rowsPerThread) {
+            uint32_t endRow = std::min(startRow + rowsPerThread, height);
+            mChunks.push_back([&, startRow, endRow] {
+                copyChunk(startRow, endRow);
+
+                std::unique_lock<std::mutex> chunkLock(mChunkLock);
+                pendingChunks--;
+                mChunkDoneCond.notify_all();
+            });
+            pendingChunks++;
+        }
+    }
+    mChunkQueuedCond.notify_all();
+
+    copyChunk(0, std::min(rowsPerThread, height));
+
+    // Help with queued chunks while waiting, so concurrent copies do not wait for each other's
+    // chunks when all workers are busy.
+    std::unique_lock<std::mutex> lock(mChunkLock);
+    while (pendingChunks > 0) {
+        if (mChunks.empty()) {
+            mChunkDoneCond.wait(lock);
+            continue;
+        }
+
+        std::function<void()> chunk = std::move(mChunks.front());
+        mChunks.pop_front();
+        lock.unlock();
+        chunk();
+        lock.lock();
+    }
+
+    return 0;
+}
+
+} // namespace pbcamera
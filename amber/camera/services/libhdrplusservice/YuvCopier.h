@@ -0,0 +1,104 @@
+#ifndef PAINTBOX_HDR_PLUS_PIPELINE_YUV_COPIER_H
+#define PAINTBOX_HDR_PLUS_PIPELINE_YUV_COPIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pbcamera {
+
+typedef int32_t status_t;
+
+// A semi-planar YUV 4:2:0 image (NV12 or NV21) to copy from.
+struct YuvCopySource {
+    uint32_t width;             // Width of the luma plane in pixels.
+    uint32_t height;            // Height of the luma plane in pixels.
+    const uint8_t *luma;
+    size_t lumaStride;          // Stride of the luma plane in bytes.
+    const uint8_t *chroma;      // Interleaved chroma plane of height / 2 rows of
+                                // (width + 1) / 2 pairs.
+    size_t chromaStride;        // Stride of the chroma plane in bytes.
+};
+
+// A semi-planar YUV 4:2:0 image (NV12 or NV21) to copy to.
+struct YuvCopyDest {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *luma;
+    size_t lumaStride;
+    uint8_t *chroma;
+    size_t chromaStride;
+};
+
+/*
+ * YuvCopier
+ *
+ * Copies semi-planar YUV 4:2:0 images between buffers of different strides, optionally swapping
+ * the order of the interleaved chroma samples to convert between NV12 and NV21 in the same pass.
+ * Rows are split across a number of threads, and rows are copied with NEON when available. The
+ * worker threads are started when the copier is created and live until it is destroyed.
+ *
+ * This class is thread safe.
+ */
+class YuvCopier {
+public:
+    /*
+     * threadCount is the max number of threads to copy an image with, including the calling
+     * thread. 0 is treated as 1. threadCount - 1 worker threads are started.
+     * useNeon is whether to use NEON kernels if they are available. If false, scalar kernels are
+     * used.
+     */
+    YuvCopier(uint32_t threadCount, bool useNeon = true);
+    virtual ~YuvCopier();
+
+    /*
+     * Copy the top-left min(src.width, dst.width) x min(src.height, dst.height) pixels of src to
+     * dst.
+     *
+     * swapChroma is whether to swap each pair of chroma samples, e.g. to copy an NV12 image to
+     * an NV21 buffer.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if a plane is nullptr or a stride is smaller than the width of its plane.
+     */
+    status_t copy(const YuvCopySource &src, const YuvCopyDest &dst, bool swapChroma);
+
+    // Return if NEON kernels are compiled in.
+    static bool isNeonAvailable();
+
+private:
+    // Images with fewer luma rows than this for each thread are copied with fewer threads.
+    static const uint32_t kMinRowsPerThread = 64;
+
+    // Copy rows [startRow, endRow) of a plane.
+    void copyRows(const uint8_t *src, size_t srcStride, uint8_t *dst, size_t dstStride,
+            size_t rowBytes, uint32_t startRow, uint32_t endRow, bool swapPairs) const;
+
+    // Run chunks from mChunks until the copier is destroyed.
+    void workerLoop();
+
+    uint32_t mThreadCount;
+    bool mUseNeon;
+
+    std::vector<std::thread> mWorkers;
+
+    std::mutex mChunkLock;
+    // Chunks of pending copies. Protected by mChunkLock.
+    std::deque<std::function<void()>> mChunks;
+    // Signaled when a chunk is queued or mExiting is set.
+    std::condition_variable mChunkQueuedCond;
+    // Signaled when a chunk is done.
+    std::condition_variable mChunkDoneCond;
+    // Whether workers should exit. Protected by mChunkLock.
+    bool mExiting;
+};
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_HDR_PLUS_PIPELINE_YUV_COPIER_H
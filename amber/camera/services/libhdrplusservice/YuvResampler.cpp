@@ -0,0 +1,286 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "YuvResampler"
+#include <log/log.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_RESAMPLER_NEON 1
+#endif
+
+#include "YuvResampler.h"
+
+namespace pbcamera {
+
+namespace {
+
+// Interpolation weights are fixed point with this many fractional bits. 7 bits keep a blended
+// row in 16 bits (255 * 128) and allow the weights in 8-bit NEON lanes.
+const uint32_t kWeightBits = 7;
+const uint32_t kWeightOne = 1 << kWeightBits;
+
+// Average a row pair over 2x2 samples for outputs [start, count), repeating the last column.
+void downscaleRowScalar(const uint8_t *row0, const uint8_t *row1, uint32_t srcWidth,
+        uint32_t channels, uint8_t *dst, uint32_t start, uint32_t count) {
+    for (uint32_t x = start; x < count; x++) {
+        uint32_t x0 = 2 * x;
+        uint32_t x1 = std::min(2 * x + 1, srcWidth - 1);
+        for (uint32_t c = 0; c < channels; c++) {
+            uint32_t sum = row0[x0 * channels + c] + row0[x1 * channels + c] +
+                    row1[x0 * channels + c] + row1[x1 * channels + c];
+            dst[x * channels + c] = static_cast<uint8_t>((sum + 2) >> 2);
+        }
+    }
+}
+
+// Blend bytes [start, bytes) of two rows: dst = row0 * (kWeightOne - weight) + row1 * weight.
+void blendRowsScalar(const uint8_t *row0, const uint8_t *row1, uint32_t weight, uint16_t *dst,
+        size_t start, size_t bytes) {
+    for (size_t i = start; i < bytes; i++) {
+        dst[i] = static_cast<uint16_t>(row0[i] * (kWeightOne - weight) + row1[i] * weight);
+    }
+}
+
+#ifdef YUV_RESAMPLER_NEON
+// Average 2x2 luma samples, 16 outputs at a time. Returns the number of outputs written.
+uint32_t downscaleLumaRowNeon(const uint8_t *row0, const uint8_t *row1, uint8_t *dst,
+        uint32_t count) {
+    uint32_t x = 0;
+    for (; x + 16 <= count; x += 16) {
+        // Pairwise add horizontally neighbouring samples of row0, then accumulate row1's.
+        uint16x8_t sumLo = vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x)),
+                vld1q_u8(row1 + 2 * x));
+        uint16x8_t sumHi = vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x + 16)),
+                vld1q_u8(row1 + 2 * x + 16));
+        vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(sumLo, 2), vrshrn_n_u16(sumHi, 2)));
+    }
+    return x;
+}
+
+// Average 2x2 chroma pairs, 8 output pairs at a time. Returns the number of pairs written.
+uint32_t downscaleChromaRowNeon(const uint8_t *row0, const uint8_t *row1, uint8_t *dst,
+        uint32_t count) {
+    uint32_t x = 0;
+    for (; x + 8 <= count; x += 8) {
+        // De-interleave 16 pairs into 16 first and 16 second samples.
+        uint8x16x2_t top = vld2q_u8(row0 + 4 * x);
+        uint8x16x2_t bottom = vld2q_u8(row1 + 4 * x);
+        uint8x8x2_t result;
+        result.val[0] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(top.val[0]), bottom.val[0]), 2);
+        result.val[1] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(top.val[1]), bottom.val[1]), 2);
+        vst2_u8(dst + 2 * x, result);
+    }
+    return x;
+}
+
+// Blend two rows 8 bytes at a time. Returns the number of bytes written.
+size_t blendRowsNeon(const uint8_t *row0, const uint8_t *row1, uint32_t weight, uint16_t *dst,
+        size_t bytes) {
+    uint8x8_t weight0 = vdup_n_u8(static_cast<uint8_t>(kWeightOne - weight));
+    uint8x8_t weight1 = vdup_n_u8(static_cast<uint8_t>(weight));
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint16x8_t blended = vmull_u8(vld1_u8(row0 + i), weight0);
+        blended = vmlal_u8(blended, vld1_u8(row1 + i), weight1);
+        vst1q_u16(dst + i, blended);
+    }
+    return i;
+}
+#endif // YUV_RESAMPLER_NEON
+
+} // anonymous namespace
+
+YuvResampler::YuvResampler(bool useNeon) : mUseNeon(useNeon && YuvCopier::isNeonAvailable()) {
+}
+
+YuvResampler::~YuvResampler() {
+}
+
+void YuvResampler::downscalePlane(const Plane &src, uint32_t channels, uint8_t *dst,
+        size_t dstStride, uint32_t dstWidth, uint32_t dstHeight) {
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        const uint8_t *row0 = src.data + std::min(2 * y, src.height - 1) * src.stride;
+        const uint8_t *row1 = src.data + std::min(2 * y + 1, src.height - 1) * src.stride;
+        uint8_t *dstRow = dst + y * dstStride;
+
+        // Outputs whose 2 source columns are both inside src. The rest repeat the last column.
+        uint32_t start = 0;
+#ifdef YUV_RESAMPLER_NEON
+        if (mUseNeon) {
+            uint32_t fullCount = std::min(src.width / 2, dstWidth);
+            start = channels == 1 ? downscaleLumaRowNeon(row0, row1, dstRow, fullCount) :
+                    downscaleChromaRowNeon(row0, row1, dstRow, fullCount);
+        }
+#endif
+        downscaleRowScalar(row0, row1, src.width, channels, dstRow, start, dstWidth);
+    }
+}
+
+void YuvResampler::buildLevel(size_t index) {
+    const Level &prev = mLevels[index - 1];
+
+    Level level;
+    uint32_t width = (prev.luma.width + 1) / 2;
+    uint32_t height = (prev.luma.height + 1) / 2;
+    uint32_t chromaWidth = (width + 1) / 2;
+    uint32_t chromaHeight = (height + 1) / 2;
+    level.buffer.resize(width * height + chromaWidth * 2 * chromaHeight);
+
+    uint8_t *luma = level.buffer.data();
+    uint8_t *chroma = luma + width * height;
+    level.luma = { luma, width, width, height };
+    level.chroma = { chroma, chromaWidth * 2, chromaWidth, chromaHeight };
+
+    downscalePlane(prev.luma, /*channels*/1, luma, width, width, height);
+    downscalePlane(prev.chroma, /*channels*/2, chroma, chromaWidth * 2, chromaWidth,
+            chromaHeight);
+
+    mLevels.push_back(std::move(level));
+}
+
+void YuvResampler::interpolatePlane(const Plane &src, uint32_t channels, float cropX,
+        float cropY, float scaleX, float scaleY, uint8_t *dst, size_t dstStride,
+        uint32_t dstWidth, uint32_t dstHeight, bool swapPairs) {
+    // Map the center of each output sample to src and split it into an integer column and a
+    // fixed point weight of the next column.
+    auto mapSample = [](float position, uint32_t size, uint32_t *index, uint32_t *weight) {
+        position = std::min(std::max(position, 0.0f), static_cast<float>(size - 1));
+        uint32_t i = static_cast<uint32_t>(position);
+        uint32_t w = static_cast<uint32_t>(lroundf((position - i) * kWeightOne));
+        if (w == kWeightOne) {
+            i++;
+            w = 0;
+        }
+        *index = i;
+        *weight = w;
+    };
+
+    mColumnIndices.resize(dstWidth);
+    mColumnWeights.resize(dstWidth);
+    for (uint32_t x = 0; x < dstWidth; x++) {
+        uint32_t weight;
+        mapSample(cropX + (x + 0.5f) * scaleX - 0.5f, src.width, &mColumnIndices[x], &weight);
+        mColumnWeights[x] = static_cast<uint8_t>(weight);
+    }
+
+    // Only the columns the outputs read are blended vertically.
+    uint32_t firstColumn = mColumnIndices[0];
+    uint32_t lastColumn = std::min(mColumnIndices[dstWidth - 1] + 1, src.width - 1);
+    size_t blendedBytes = (lastColumn - firstColumn + 1) * channels;
+    mBlendedRow.resize(blendedBytes);
+
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        uint32_t y0, weightY;
+        mapSample(cropY + (y + 0.5f) * scaleY - 0.5f, src.height, &y0, &weightY);
+        uint32_t y1 = std::min(y0 + 1, src.height - 1);
+        const uint8_t *row0 = src.data + y0 * src.stride + firstColumn * channels;
+        const uint8_t *row1 = src.data + y1 * src.stride + firstColumn * channels;
+
+        size_t start = 0;
+#ifdef YUV_RESAMPLER_NEON
+        if (mUseNeon) {
+            start = blendRowsNeon(row0, row1, weightY, mBlendedRow.data(), blendedBytes);
+        }
+#endif
+        blendRowsScalar(row0, row1, weightY, mBlendedRow.data(), start, blendedBytes);
+
+        uint8_t *dstRow = dst + y * dstStride;
+        for (uint32_t x = 0; x < dstWidth; x++) {
+            uint32_t x0 = mColumnIndices[x];
+            uint32_t x1 = std::min(x0 + 1, src.width - 1);
+            uint32_t weightX = mColumnWeights[x];
+            const uint16_t *left = &mBlendedRow[(x0 - firstColumn) * channels];
+            const uint16_t *right = &mBlendedRow[(x1 - firstColumn) * channels];
+            for (uint32_t c = 0; c < channels; c++) {
+                uint32_t srcC = swapPairs ? (c ^ 1) : c;
+                uint32_t value = left[srcC] * (kWeightOne - weightX) + right[srcC] * weightX;
+                dstRow[x * channels + c] = static_cast<uint8_t>(
+                        (value + (1 << (2 * kWeightBits - 1))) >> (2 * kWeightBits));
+            }
+        }
+    }
+}
+
+status_t YuvResampler::resample(const YuvCopySource &src,
+        const std::vector<YuvResampleOutput> &outputs) {
+    // The chroma plane of the source has height / 2 rows, so it needs at least one.
+    if (src.luma == nullptr || src.chroma == nullptr || src.width == 0 || src.height < 2 ||
+            src.lumaStride < src.width || src.chromaStride < (src.width + 1) / 2 * 2) {
+        ALOGE("%s: Source (%ux%u, strides %zu/%zu) is invalid.", __FUNCTION__, src.width,
+                src.height, src.lumaStride, src.chromaStride);
+        return -EINVAL;
+    }
+
+    for (auto &output : outputs) {
+        const YuvCopyDest &image = output.image;
+        if (image.luma == nullptr || image.chroma == nullptr || image.width == 0 ||
+                image.height == 0 || image.lumaStride < image.width ||
+                image.chromaStride < (image.width + 1) / 2 * 2) {
+            ALOGE("%s: Output (%ux%u, strides %zu/%zu) is invalid.", __FUNCTION__, image.width,
+                    image.height, image.lumaStride, image.chromaStride);
+            return -EINVAL;
+        }
+
+        if (output.cropX0 < 0 || output.cropY0 < 0 || output.cropX0 >= output.cropX1 ||
+                output.cropY0 >= output.cropY1 ||
+                output.cropX1 > static_cast<int32_t>(src.width) ||
+                output.cropY1 > static_cast<int32_t>(src.height)) {
+            ALOGE("%s: Crop (%d, %d, %d, %d) is outside of source (%ux%u).", __FUNCTION__,
+                    output.cropX0, output.cropY0, output.cropX1, output.cropY1, src.width,
+                    src.height);
+            return -EINVAL;
+        }
+    }
+
+    mLevels.clear();
+    mLevels.resize(1);
+    mLevels[0].luma = { src.luma, src.lumaStride, src.width, src.height };
+    mLevels[0].chroma = { src.chroma, src.chromaStride, (src.width + 1) / 2, src.height / 2 };
+
+    for (auto &output : outputs) {
+        const YuvCopyDest &image = output.image;
+        float cropWidth = output.cropX1 - output.cropX0;
+        float cropHeight = output.cropY1 - output.cropY0;
+
+        // Pick the smallest level that is still at least as large as the output.
+        float ratio = std::min(cropWidth / image.width, cropHeight / image.height);
+        size_t levelIndex = 0;
+        while (ratio >= 2.0f) {
+            ratio /= 2;
+            levelIndex++;
+        }
+
+        while (mLevels.size() <= levelIndex) {
+            buildLevel(mLevels.size());
+        }
+
+        // Chroma planes are scaled by the same factors as luma planes even if the output has an
+        // odd size, so the chroma samples stay aligned with their luma pixels.
+        const Level &level = mLevels[levelIndex];
+        float levelScale = 1 << levelIndex;
+        float scaleX = cropWidth / levelScale / image.width;
+        float scaleY = cropHeight / levelScale / image.height;
+        interpolatePlane(level.luma, /*channels*/1, output.cropX0 / levelScale,
+                output.cropY0 / levelScale, scaleX, scaleY, image.luma, image.lumaStride,
+                image.width, image.height, /*swapPairs*/false);
+
+        // Chroma samples are 2x2 luma pixels.
+        interpolatePlane(level.chroma, /*channels*/2, output.cropX0 / levelScale / 2,
+                output.cropY0 / levelScale / 2, scaleX, scaleY, image.chroma,
+                image.chromaStride, (image.width + 1) / 2, image.height / 2, output.swapChroma);
+
+        ALOGV("%s: Resampled (%d, %d, %d, %d) to %ux%u from level %zu.", __FUNCTION__,
+                output.cropX0, output.cropY0, output.cropX1, output.cropY1, image.width,
+                image.height, levelIndex);
+    }
+
+    // Free the levels so they don't hold memory between shots.
+    mLevels.clear();
+    mLevels.shrink_to_fit();
+    return 0;
+}
+
+} // namespace pbcamera
@@ -0,0 +1,101 @@
+#ifndef PAINTBOX_HDR_PLUS_PIPELINE_YUV_RESAMPLER_H
+#define PAINTBOX_HDR_PLUS_PIPELINE_YUV_RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "YuvCopier.h"
+
+namespace pbcamera {
+
+// An output of YuvResampler.
+struct YuvResampleOutput {
+    // Image to write.
+    YuvCopyDest image;
+    // Whether to swap the chroma order, e.g. to resample an NV12 source to an NV21 output.
+    bool swapChroma;
+    // Region of the source to resample, in source luma pixels. x1 and y1 are exclusive.
+    int32_t cropX0;
+    int32_t cropY0;
+    int32_t cropX1;
+    int32_t cropY1;
+};
+
+/*
+ * YuvResampler
+ *
+ * Resamples a semi-planar YUV 4:2:0 image (NV12 or NV21) to several outputs of different sizes
+ * on the CPU. Instead of reading the full source for every output, it builds a cascade of
+ * 2x2-averaged levels (like mipmaps) that is shared by all outputs: the source is only read to
+ * build the first level and for outputs larger than half of it. Each output is then bilinearly
+ * interpolated from the smallest level that is still at least as large as the output, so the
+ * interpolation never skips source pixels. Levels are built and interpolated with NEON when
+ * available.
+ *
+ * This class is not thread safe.
+ */
+class YuvResampler {
+public:
+    // useNeon is whether to use NEON kernels if they are available.
+    YuvResampler(bool useNeon = true);
+    virtual ~YuvResampler();
+
+    /*
+     * Resample src to all outputs.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -EINVAL:    if src or an output is invalid, or a crop region is outside of src.
+     */
+    status_t resample(const YuvCopySource &src, const std::vector<YuvResampleOutput> &outputs);
+
+private:
+    // A plane of a level: width x height samples of channels bytes each.
+    struct Plane {
+        const uint8_t *data;
+        size_t stride;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    // A level of the cascade. Level 0 is the source; level k is 2^k times smaller.
+    struct Level {
+        Plane luma;
+        Plane chroma;
+        std::vector<uint8_t> buffer; // Pixel data of levels other than level 0.
+    };
+
+    // Build level index from level index - 1.
+    void buildLevel(size_t index);
+
+    /*
+     * Write src averaged over 2x2 samples to dst. The last column and row of src are repeated for
+     * samples past the end of src, e.g. if src has an odd width or height, or is the height / 2
+     * row chroma plane of an odd-height source.
+     */
+    void downscalePlane(const Plane &src, uint32_t channels, uint8_t *dst, size_t dstStride,
+            uint32_t dstWidth, uint32_t dstHeight);
+
+    /*
+     * Bilinearly interpolate the region of src starting at (cropX, cropY) to dst. Each dst
+     * sample covers scaleX x scaleY src samples.
+     */
+    void interpolatePlane(const Plane &src, uint32_t channels, float cropX, float cropY,
+            float scaleX, float scaleY, uint8_t *dst, size_t dstStride, uint32_t dstWidth,
+            uint32_t dstHeight, bool swapPairs);
+
+    bool mUseNeon;
+
+    // Levels of the current source.
+    std::vector<Level> mLevels;
+
+    // Scratch buffers of interpolatePlane().
+    std::vector<uint16_t> mBlendedRow;
+    std::vector<uint32_t> mColumnIndices;
+    std::vector<uint8_t> mColumnWeights;
+};
+
+} // namespace pbcamera
+
+#endif // PAINTBOX_HDR_PLUS_PIPELINE_YUV_RESAMPLER_H
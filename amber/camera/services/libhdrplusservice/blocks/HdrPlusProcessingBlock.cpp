@@ -39,13 +39,21 @@ std::atomic<bool> gPcgLoaded(false);
 HdrPlusProcessingBlock::HdrPlusProcessingBlock(std::weak_ptr<SourceCaptureBlock> sourceCaptureBlock,
         bool skipTimestampCheck, int32_t cameraId,
         ImxMemoryAllocatorHandle imxMemoryAllocatorHandle,
+        std::shared_ptr<ImxBufferPool> outputBufferPool,
         std::shared_ptr<MessengerToHdrPlusClient> messenger) :
         PipelineBlock("HdrPlusProcessingBlock"),
         mMessengerToClient(messenger),
         mSourceCaptureBlock(sourceCaptureBlock),
         mSkipTimestampCheck(skipTimestampCheck),
         mCameraId(cameraId),
-        mImxMemoryAllocatorHandle(imxMemoryAllocatorHandle) {
+        mImxMemoryAllocatorHandle(imxMemoryAllocatorHandle),
+        mOutputBufferPool(outputBufferPool),
+        mYuvCopier(std::thread::hardware_concurrency()),
+        mIpuResample(false) {
+    char *ipuResample = std::getenv("HDR_PLUS_IPU_RESAMPLE");
+    if (ipuResample != nullptr && strcmp(ipuResample, "true") == 0) {
+        mIpuResample = true;
+    }
 }
 
 HdrPlusProcessingBlock::~HdrPlusProcessingBlock() {
@@ -59,12 +67,13 @@ std::shared_ptr<HdrPlusProcessingBlock> HdrPlusProcessingBlock::newHdrPlusProces
         std::weak_ptr<HdrPlusPipeline> pipeline, std::shared_ptr<StaticMetadata> metadata,
         std::weak_ptr<SourceCaptureBlock> sourceCaptureBlock, bool skipTimestampCheck,
         int32_t cameraId, ImxMemoryAllocatorHandle imxMemoryAllocatorHandle,
+        std::shared_ptr<ImxBufferPool> outputBufferPool,
         std::shared_ptr<MessengerToHdrPlusClient> messenger) {
     ALOGV("%s", __FUNCTION__);
 
     auto block = std::shared_ptr<HdrPlusProcessingBlock>(
             new HdrPlusProcessingBlock(sourceCaptureBlock, skipTimestampCheck, cameraId,
-                    imxMemoryAllocatorHandle, messenger));
+                    imxMemoryAllocatorHandle, outputBufferPool, messenger));
     if (block == nullptr) {
         ALOGE("%s: Failed to create a block instance.", __FUNCTION__);
         return nullptr;
@@ -93,8 +102,8 @@ bool HdrPlusProcessingBlock::isReady() {
             return false;
         }
 
-        if (mPendingShotCapture != nullptr) {
-            ALOGW("%s: HDR+ shot pending", __FUNCTION__);
+        if (!canStartShotCaptureLocked()) {
+            ALOGW("%s: %zu HDR+ shots pending", __FUNCTION__, mPendingShotCaptures.size());
             return false;
         }
     }
@@ -189,6 +198,9 @@ bool HdrPlusProcessingBlock::doWorkLocked() {
     // Notify shutters and postviews that are ready.
     notifyShuttersAndPostviews();
 
+    // Pending shots may have progressed enough for AP to send the next capture request.
+    notifyNextCaptureReady();
+
     std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
 
     // Initialize Gcam if not yet.
@@ -200,9 +212,8 @@ bool HdrPlusProcessingBlock::doWorkLocked() {
         }
     }
 
-    // Check if there is a pending Gcam shot capture.
-    if (mPendingShotCapture != nullptr) {
-        // Only support 1 active processing.
+    // Check if another Gcam shot capture can start while the pending ones are processed.
+    if (!canStartShotCaptureLocked()) {
         return false;
     }
 
@@ -262,16 +273,127 @@ bool HdrPlusProcessingBlock::doWorkLocked() {
         return false;
     }
 
+    lock.unlock();
+
+    // Let AP send the next capture request while this shot is processed if possible.
+    notifyNextCaptureReady();
     return true;
 }
 
 status_t HdrPlusProcessingBlock::flushLocked() {
     // Wait until there is no pending shot.
     std::unique_lock<std::mutex> eventLock(mHdrPlusProcessingLock);
-    mShotCompletedCondition.wait(eventLock, [&] { return mPendingShotCapture == nullptr; });
+    mShotCompletedCondition.wait(eventLock, [&] { return mPendingShotCaptures.empty(); });
     return 0;
 }
 
+bool HdrPlusProcessingBlock::canStartShotCaptureLocked() {
+    if (mPendingShotCaptures.empty()) {
+        return true;
+    } else if (mPendingShotCaptures.size() >= kMaxPendingShotCaptures || mGcam == nullptr) {
+        return false;
+    }
+
+    int64_t peakMemoryBytes = mGcam->PeakMemoryWithNewShotBytes();
+    if (peakMemoryBytes > kMaxGcamPeakMemoryBytes) {
+        ALOGV("%s: Gcam peak memory with a new shot (%" PRId64 " bytes) exceeds the budget.",
+                __FUNCTION__, peakMemoryBytes);
+        return false;
+    }
+
+    return true;
+}
+
+std::shared_ptr<HdrPlusProcessingBlock::ShotCapture>
+        HdrPlusProcessingBlock::getPendingShotCaptureLocked(int32_t shotId) {
+    for (auto &shotCapture : mPendingShotCaptures) {
+        if (shotCapture->shotId == shotId) {
+            return shotCapture;
+        }
+    }
+
+    return nullptr;
+}
+
+void HdrPlusProcessingBlock::notifyNextCaptureReady() {
+    int32_t requestId = 0;
+    {
+        std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
+        if (mPendingShotCaptures.empty()) return;
+
+        // Only the last shot needs to be checked because AP is notified at most once per shot
+        // start.
+        std::shared_ptr<ShotCapture> lastShot = mPendingShotCaptures.back();
+        if (lastShot->nextCaptureReadyNotified || !canStartShotCaptureLocked()) return;
+
+        lastShot->nextCaptureReadyNotified = true;
+        requestId = lastShot->outputRequest.metadata.requestId;
+    }
+
+    // Send it without mHdrPlusProcessingLock so gcam callbacks are not blocked on the messenger.
+    mMessengerToClient->notifyNextCaptureReadyAsync(requestId);
+}
+
+void HdrPlusProcessingBlock::sendFinishedShotResults() {
+    std::unique_lock<std::mutex> resultLock(mShotResultLock);
+
+    // Collect the finished shots that no earlier shot is waiting for.
+    std::vector<std::shared_ptr<ShotCapture>> finishedShots;
+    {
+        std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
+        for (auto &shotCapture : mPendingShotCaptures) {
+            if (!shotCapture->finished) break;
+            finishedShots.push_back(shotCapture);
+        }
+    }
+
+    if (finishedShots.empty()) return;
+
+    auto sourceCaptureBlock = mSourceCaptureBlock.lock();
+    auto pipeline = mPipeline.lock();
+    for (auto &shotCapture : finishedShots) {
+        if (sourceCaptureBlock != nullptr) {
+            sourceCaptureBlock->notifyIpuProcessingDone();
+        }
+
+        if (pipeline == nullptr) {
+            ALOGW("%s: Pipeline is destroyed.", __FUNCTION__);
+            continue;
+        }
+
+        if (!shotCapture->outputBuffersProduced) {
+            // Abort output request.
+            pipeline->outputRequestAbort(shotCapture->outputRequest);
+            // TODO: Notify the client about the failed request.
+        } else if (shotCapture->outputRequest.buffers.size() !=
+                shotCapture->outputResult.buffers.size()) {
+            // Check if we got all output buffers.
+            ALOGE("%s: Processed %zu output buffers but expecting %zu.", __FUNCTION__,
+                    shotCapture->outputResult.buffers.size(),
+                    shotCapture->outputRequest.buffers.size());
+
+            // Abort output request.
+            pipeline->outputRequestAbort(shotCapture->outputRequest);
+            // TODO: Notify the client about the failed request.
+        } else {
+            // Send out output result.
+            pipeline->outputDone(shotCapture->outputResult);
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
+        mPendingShotCaptures.erase(mPendingShotCaptures.begin(),
+                mPendingShotCaptures.begin() + finishedShots.size());
+    }
+
+    // Notify worker thread that it can start next processing.
+    notifyWorkerThreadEvent();
+
+    // Notify shot is completed.
+    mShotCompletedCondition.notify_all();
+}
+
 status_t HdrPlusProcessingBlock::calculateCropRect(int32_t inputCropW, int32_t inputCropH,
     int32_t outputW, int32_t outputH, float *outputCropX0, float *outputCropY0,
     float *outputCropX1, float *outputCropY1) {
@@ -520,14 +642,26 @@ status_t HdrPlusProcessingBlock::handleCaptureRequestLocked(const std::vector<In
     status_t res = IssueShotCapture(shotCapture, inputs, outputRequest);
     if (res != 0) {
         ALOGE("%s: Issuing a HDR+ capture failed: %s (%d).", __FUNCTION__, strerror(-res), res);
-        sourceCaptureBlock->notifyIpuProcessingDone();
+        if (sourceCaptureBlock != nullptr) {
+            sourceCaptureBlock->notifyIpuPayloadFramesAdded();
+            sourceCaptureBlock->notifyIpuProcessingDone();
+        }
 
         return res;
     }
 
+    // All payload frames have been added to gcam. Capture the next shot's frames while this shot
+    // is processed.
+    if (sourceCaptureBlock != nullptr) {
+        sourceCaptureBlock->notifyIpuPayloadFramesAdded();
+    }
+
     shotCapture->outputRequest = outputRequest;
     shotCapture->baseFrameIndex = kInvalidBaseFrameIndex;
-    mPendingShotCapture = shotCapture;
+    shotCapture->nextCaptureReadyNotified = false;
+    shotCapture->finished = false;
+    shotCapture->outputBuffersProduced = false;
+    mPendingShotCaptures.push_back(shotCapture);
     return 0;
 }
 
@@ -733,33 +867,28 @@ void HdrPlusProcessingBlock::notifyShutter(const Shutter &shutter) {
     {
         std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
 
-        if (mPendingShotCapture == nullptr) {
+        std::shared_ptr<ShotCapture> shotCapture = getPendingShotCaptureLocked(shutter.shotId);
+        if (shotCapture == nullptr) {
             ALOGE("%s: There is no pending shot for shot id %d. Dropping a base frame index %d.",
                     __FUNCTION__, shutter.shotId, shutter.baseFrameIndex);
             return;
         }
 
-        if (shutter.shotId != mPendingShotCapture->shotId) {
-            ALOGE("%s: Expecting a base frame index for shot %d but got a final image for shot %d.",
-                    __FUNCTION__, mPendingShotCapture->shotId, shutter.shotId);
-            return;
-        }
-
-        if (shutter.baseFrameIndex >= static_cast<int>(mPendingShotCapture->frames.size())) {
+        if (shutter.baseFrameIndex >= static_cast<int>(shotCapture->frames.size())) {
             ALOGE("%s: baseFrameIndex is %d but there are only %zu frames", __FUNCTION__,
-                    shutter.baseFrameIndex, mPendingShotCapture->frames.size());
+                    shutter.baseFrameIndex, shotCapture->frames.size());
             return;
         }
 
-        if (mPendingShotCapture->baseFrameIndex != kInvalidBaseFrameIndex) {
+        if (shotCapture->baseFrameIndex != kInvalidBaseFrameIndex) {
             ALOGE("%s: baseFrameIndex is already selected for shot %d", __FUNCTION__, shutter.shotId);
             return;
         }
 
-        mPendingShotCapture->baseFrameIndex = shutter.baseFrameIndex;
+        shotCapture->baseFrameIndex = shutter.baseFrameIndex;
 
-        requestId = mPendingShotCapture->outputRequest.metadata.requestId;
-        apSensorTimestampNs = mPendingShotCapture->frames[shutter.baseFrameIndex]->
+        requestId = shotCapture->outputRequest.metadata.requestId;
+        apSensorTimestampNs = shotCapture->frames[shutter.baseFrameIndex]->
                 input.metadata.frameMetadata->timestamp;
 
     }
@@ -778,6 +907,18 @@ bool HdrPlusProcessingBlock::isTheSameYuvFormat(gcam::YuvFormat gcamFormat, int
     }
 }
 
+bool HdrPlusProcessingBlock::isChromaSwappedYuvFormat(gcam::YuvFormat gcamFormat,
+        int halFormat) {
+    switch (gcamFormat) {
+        case gcam::YuvFormat::kNv12:
+            return halFormat == HAL_PIXEL_FORMAT_YCrCb_420_SP;
+        case gcam::YuvFormat::kNv21:
+            return halFormat == HAL_PIXEL_FORMAT_YCbCr_420_SP;
+        default:
+            return false;
+    }
+}
+
 status_t HdrPlusProcessingBlock::copyBuffer(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
         PipelineBuffer *dstBuffer) {
     if (srcYuvImage == nullptr || dstBuffer == nullptr) {
@@ -786,39 +927,100 @@ status_t HdrPlusProcessingBlock::copyBuffer(const std::unique_ptr<gcam::YuvImage
         return -EINVAL;
     }
 
-    if (!isTheSameYuvFormat(srcYuvImage->yuv_format(), dstBuffer->getFormat())) {
+    // NV12 and NV21 only differ in chroma order, which is swapped while copying.
+    bool swapChroma = isChromaSwappedYuvFormat(srcYuvImage->yuv_format(), dstBuffer->getFormat());
+    if (!swapChroma && !isTheSameYuvFormat(srcYuvImage->yuv_format(), dstBuffer->getFormat())) {
         ALOGE("%s: Src image format is %s but dst buffer format is %d.", __FUNCTION__,
                 gcam::ToText(srcYuvImage->yuv_format()), dstBuffer->getFormat());
         return -EINVAL;
     }
 
-    dstBuffer->lockData();
-    uint8_t *lumaDst = dstBuffer->getPlaneData(0);
-
-    // Copy luma line by line from the final image.
-    const gcam::InterleavedReadViewU8 &lumaImageSrc = srcYuvImage->luma_read_view();
-    int32_t lineBytesToCopy = std::min(dstBuffer->getWidth(), lumaImageSrc.width());
-    uint32_t linesToCopy = std::min(dstBuffer->getHeight(), lumaImageSrc.height());
-    for (uint32_t y = 0; y < linesToCopy; y++) {
-        std::memcpy(lumaDst + y * dstBuffer->getStride(0), &lumaImageSrc.at(0, y, 0),
-                lineBytesToCopy);
+    status_t res = dstBuffer->lockData();
+    if (res != 0) {
+        ALOGE("%s: Locking buffer data failed: %s (%d)", __FUNCTION__, strerror(-res), res);
+        return res;
     }
 
-    // Copy chroma line by line from the final image.
+    const gcam::InterleavedReadViewU8 &lumaImageSrc = srcYuvImage->luma_read_view();
     const gcam::InterleavedReadViewU8 &chromaImageSrc = srcYuvImage->chroma_read_view();
-    uint8_t* chromaDst = dstBuffer->getPlaneData(1);
-    lineBytesToCopy = std::min(dstBuffer->getWidth() , chromaImageSrc.width() * 2);
-    linesToCopy = std::min(dstBuffer->getHeight() / 2, chromaImageSrc.height());
-    for (uint32_t y = 0; y < linesToCopy; y++) {
-        std::memcpy(chromaDst + y * dstBuffer->getStride(1), &chromaImageSrc.at(0, y, 0),
-                lineBytesToCopy);
+
+    YuvCopySource src = {};
+    src.width = lumaImageSrc.width();
+    src.height = lumaImageSrc.height();
+    src.luma = &lumaImageSrc.at(0, 0, 0);
+    src.lumaStride = lumaImageSrc.y_stride();
+    src.chroma = &chromaImageSrc.at(0, 0, 0);
+    src.chromaStride = chromaImageSrc.y_stride();
+
+    YuvCopyDest dst = {};
+    dst.width = dstBuffer->getWidth();
+    dst.height = dstBuffer->getHeight();
+    dst.luma = dstBuffer->getPlaneData(0);
+    dst.lumaStride = dstBuffer->getStride(0);
+    dst.chroma = dstBuffer->getPlaneData(1);
+    dst.chromaStride = dstBuffer->getStride(1);
+
+    res = mYuvCopier.copy(src, dst, swapChroma);
+    if (res != 0) {
+        ALOGE("%s: Copying %s image to format %d failed: %s (%d)", __FUNCTION__,
+                gcam::ToText(srcYuvImage->yuv_format()), dstBuffer->getFormat(), strerror(-res),
+                res);
     }
 
     dstBuffer->unlockData();
 
+    return res;
+}
+
+status_t HdrPlusProcessingBlock::calculateResampleCropRect(
+        const std::unique_ptr<gcam::YuvImage> &srcYuvImage, PipelineBuffer *dstBuffer,
+        int32_t *cropX0, int32_t *cropY0, int32_t *cropX1, int32_t *cropY1) {
+    int32_t srcWidth = srcYuvImage->luma_read_view().width();
+    int32_t srcHeight = srcYuvImage->luma_read_view().height();
+
+    // Logically crop source YUV image to match dstBuffer aspect ration.
+    float x0, y0, x1, y1;
+    status_t res = calculateCropRect(srcWidth, srcHeight, dstBuffer->getWidth(),
+            dstBuffer->getHeight(), &x0, &y0, &x1, &y1);
+    if (res != 0) {
+        ALOGE("%s: Calculating crop rect for %dx%d failed: %s (%d).", __FUNCTION__,
+                dstBuffer->getWidth(), dstBuffer->getHeight(), strerror(-res), res);
+        return res;
+    }
+
+    // Snap the cropping to even number to avoid dimension overflow.
+    *cropX0 = static_cast<int32_t>(x0) & ~1;
+    *cropX1 = std::min(static_cast<int32_t>(std::ceil(x1) + 1) & ~1, srcWidth);
+    *cropY0 = static_cast<int32_t>(y0) & ~1;
+    *cropY1 = std::min(static_cast<int32_t>(std::ceil(y1) + 1) & ~1, srcHeight);
+
     return 0;
 }
 
+status_t HdrPlusProcessingBlock::resampleBuffers(
+        const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
+        const std::vector<PipelineBuffer*> &dstBuffers) {
+    if (dstBuffers.empty()) return 0;
+
+    size_t cpuStart = 0;
+    if (mIpuResample) {
+        // The IPU reads the source once for each output.
+        for (; cpuStart < dstBuffers.size(); cpuStart++) {
+            status_t res = resampleBuffer(srcYuvImage, dstBuffers[cpuStart]);
+            if (res != 0) {
+                ALOGW("%s: Resampling on IPU failed: %s (%d). Falling back to CPU.",
+                        __FUNCTION__, strerror(-res), res);
+                break;
+            }
+        }
+    }
+
+    if (cpuStart == dstBuffers.size()) return 0;
+
+    std::vector<PipelineBuffer*> cpuBuffers(dstBuffers.begin() + cpuStart, dstBuffers.end());
+    return resampleBuffersCpu(srcYuvImage, cpuBuffers);
+}
+
 status_t HdrPlusProcessingBlock::resampleBuffer(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
         PipelineBuffer *dstBuffer) {
     if (srcYuvImage == nullptr || dstBuffer == nullptr) {
@@ -830,22 +1032,15 @@ status_t HdrPlusProcessingBlock::resampleBuffer(const std::unique_ptr<gcam::YuvI
     ALOGV("%s: Resampling from %dx%d to %dx%d", __FUNCTION__, srcYuvImage->luma_read_view().width(),
         srcYuvImage->luma_read_view().height(), dstBuffer->getWidth(), dstBuffer->getHeight());
 
-    // Logically crop source YUV image to match dstBuffer aspect ration.
-    float cropX0, cropY0, cropX1, cropY1;
-    status_t res = calculateCropRect(srcYuvImage->luma_read_view().width(),
-            srcYuvImage->luma_read_view().height(), dstBuffer->getWidth(), dstBuffer->getHeight(),
-            &cropX0, &cropY0, &cropX1, &cropY1);
+    int32_t cropX0, cropY0, cropX1, cropY1;
+    status_t res = calculateResampleCropRect(srcYuvImage, dstBuffer, &cropX0, &cropY0, &cropX1,
+            &cropY1);
+    if (res != 0) {
+        return res;
+    }
 
     gcam::YuvReadView croppedSrcYuvImage(*srcYuvImage);
-
-    // Snap the cropping to even number to avoid dimension overflow.
-    int cropX0Int, cropY0Int, cropX1Int, cropY1Int;
-    cropX0Int = static_cast<int>(cropX0) & ~1;
-    cropX1Int = static_cast<int>(std::ceil(cropX1) + 1) & ~1;
-    cropY0Int = static_cast<int>(cropY0) & ~1;
-    cropY1Int = static_cast<int>(std::ceil(cropY1) + 1) & ~1;
-
-    croppedSrcYuvImage.FastCrop(cropX0Int, cropY0Int, cropX1Int, cropY1Int);
+    croppedSrcYuvImage.FastCrop(cropX0, cropY0, cropX1, cropY1);
 
     int32_t format = dstBuffer->getFormat();
     gcam::YuvFormat gcamYuvFormat;
@@ -882,6 +1077,83 @@ status_t HdrPlusProcessingBlock::resampleBuffer(const std::unique_ptr<gcam::YuvI
     return res;
 }
 
+status_t HdrPlusProcessingBlock::resampleBuffersCpu(
+        const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
+        const std::vector<PipelineBuffer*> &dstBuffers) {
+    if (srcYuvImage == nullptr) {
+        ALOGE("%s: srcYuvImage is nullptr.", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    const gcam::InterleavedReadViewU8 &lumaImageSrc = srcYuvImage->luma_read_view();
+    const gcam::InterleavedReadViewU8 &chromaImageSrc = srcYuvImage->chroma_read_view();
+
+    YuvCopySource src = {};
+    src.width = lumaImageSrc.width();
+    src.height = lumaImageSrc.height();
+    src.luma = &lumaImageSrc.at(0, 0, 0);
+    src.lumaStride = lumaImageSrc.y_stride();
+    src.chroma = &chromaImageSrc.at(0, 0, 0);
+    src.chromaStride = chromaImageSrc.y_stride();
+
+    std::vector<YuvResampleOutput> outputs;
+    std::vector<PipelineBuffer*> lockedBuffers;
+    status_t res = 0;
+
+    for (auto dstBuffer : dstBuffers) {
+        if (dstBuffer == nullptr) {
+            ALOGE("%s: dstBuffer is nullptr.", __FUNCTION__);
+            res = -EINVAL;
+            break;
+        }
+
+        YuvResampleOutput output = {};
+        output.swapChroma = isChromaSwappedYuvFormat(srcYuvImage->yuv_format(),
+                dstBuffer->getFormat());
+        if (!output.swapChroma &&
+                !isTheSameYuvFormat(srcYuvImage->yuv_format(), dstBuffer->getFormat())) {
+            ALOGE("%s: dstBuffer format %d is not supported.", __FUNCTION__,
+                    dstBuffer->getFormat());
+            res = -EINVAL;
+            break;
+        }
+
+        res = calculateResampleCropRect(srcYuvImage, dstBuffer, &output.cropX0, &output.cropY0,
+                &output.cropX1, &output.cropY1);
+        if (res != 0) break;
+
+        res = dstBuffer->lockData();
+        if (res != 0) {
+            ALOGE("%s: Locking buffer data failed: %s (%d)", __FUNCTION__, strerror(-res), res);
+            break;
+        }
+        lockedBuffers.push_back(dstBuffer);
+
+        output.image.width = dstBuffer->getWidth();
+        output.image.height = dstBuffer->getHeight();
+        output.image.luma = dstBuffer->getPlaneData(0);
+        output.image.lumaStride = dstBuffer->getStride(0);
+        output.image.chroma = dstBuffer->getPlaneData(1);
+        output.image.chromaStride = dstBuffer->getStride(1);
+        outputs.push_back(output);
+    }
+
+    if (res == 0) {
+        std::unique_lock<std::mutex> lock(mYuvResamplerLock);
+        res = mYuvResampler.resample(src, outputs);
+        if (res != 0) {
+            ALOGE("%s: Resampling %zu outputs failed: %s (%d)", __FUNCTION__, outputs.size(),
+                    strerror(-res), res);
+        }
+    }
+
+    for (auto dstBuffer : lockedBuffers) {
+        dstBuffer->unlockData();
+    }
+
+    return res;
+}
+
 status_t HdrPlusProcessingBlock::produceRequestOutputBuffers(
         std::unique_ptr<gcam::YuvImage> srcYuvImage, PipelineBufferSet *outputBuffers) {
     if (srcYuvImage == nullptr || outputBuffers == nullptr) {
@@ -892,17 +1164,22 @@ status_t HdrPlusProcessingBlock::produceRequestOutputBuffers(
 
     status_t res;
     PipelineBuffer* bufferToAttach = nullptr;
+    std::vector<PipelineBuffer*> buffersToResample;
 
     for (auto outputBuffer : *outputBuffers) {
-        if (srcYuvImage->luma_read_view().width() == outputBuffer->getWidth() &&
-                srcYuvImage->luma_read_view().height() == outputBuffer->getHeight() &&
-                isTheSameYuvFormat(srcYuvImage->yuv_format(), outputBuffer->getFormat())) {
-            if (bufferToAttach == nullptr && outputBuffer->attachable(srcYuvImage)) {
+        bool isSameSize = srcYuvImage->luma_read_view().width() == outputBuffer->getWidth() &&
+                srcYuvImage->luma_read_view().height() == outputBuffer->getHeight();
+        bool isSameFormat = isTheSameYuvFormat(srcYuvImage->yuv_format(),
+                outputBuffer->getFormat());
+        if (isSameSize && (isSameFormat ||
+                isChromaSwappedYuvFormat(srcYuvImage->yuv_format(), outputBuffer->getFormat()))) {
+            if (isSameFormat && bufferToAttach == nullptr &&
+                    outputBuffer->attachable(srcYuvImage)) {
                 bufferToAttach = outputBuffer;
             } else {
                 // If the image cannot be attached, allocate the output buffer and copy the image
-                // content to the buffer.
-                res = ((PipelineImxBuffer*)outputBuffer)->allocate(mImxMemoryAllocatorHandle);
+                // content to the buffer, swapping chroma order if needed.
+                res = ((PipelineImxBuffer*)outputBuffer)->allocate(mOutputBufferPool);
                 if (res != 0) {
                     ALOGE("%s: Allocating buffer failed: %s (%d).", __FUNCTION__, strerror(-res), res);
                     return res;
@@ -916,20 +1193,23 @@ status_t HdrPlusProcessingBlock::produceRequestOutputBuffers(
             }
         } else {
             // Allocate the output buffer for resampling.
-            res = ((PipelineImxBuffer*)outputBuffer)->allocate(mImxMemoryAllocatorHandle);
+            res = ((PipelineImxBuffer*)outputBuffer)->allocate(mOutputBufferPool);
             if (res != 0) {
                 ALOGE("%s: Allocating buffer failed: %s (%d).", __FUNCTION__, strerror(-res), res);
                 return res;
             }
 
-            res = resampleBuffer(srcYuvImage, outputBuffer);
-            if (res != 0) {
-                ALOGE("%s: Resampling buffer failed: %s (%d).", __FUNCTION__, strerror(-res), res);
-                return res;
-            }
+            buffersToResample.push_back(outputBuffer);
         }
     }
 
+    // Resample all outputs together before the image may be attached to a buffer.
+    res = resampleBuffers(srcYuvImage, buffersToResample);
+    if (res != 0) {
+        ALOGE("%s: Resampling buffers failed: %s (%d).", __FUNCTION__, strerror(-res), res);
+        return res;
+    }
+
     if (bufferToAttach != nullptr) {
         res = bufferToAttach->attachImage(&srcYuvImage);
         if (res != 0) {
@@ -963,16 +1243,19 @@ void HdrPlusProcessingBlock::onGcamBaseFrameCallback(int shotId, int baseFrameIn
 }
 
 void HdrPlusProcessingBlock::notifyPostview(const Postview &postview) {
-    if (mPendingShotCapture == nullptr) {
-        ALOGE("%s: There is no pending shot for shot id %d. Dropping a postview.",
-                __FUNCTION__, postview.shotId);
-        return;
-    }
+    uint32_t requestId = 0;
 
-    if (postview.shotId != mPendingShotCapture->shotId) {
-        ALOGE("%s: Expecting a postview for shot %d but got a postview for shot %d.",
-                __FUNCTION__, mPendingShotCapture->shotId, postview.shotId);
-        return;
+    {
+        std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
+
+        std::shared_ptr<ShotCapture> shotCapture = getPendingShotCaptureLocked(postview.shotId);
+        if (shotCapture == nullptr) {
+            ALOGE("%s: There is no pending shot for shot id %d. Dropping a postview.",
+                    __FUNCTION__, postview.shotId);
+            return;
+        }
+
+        requestId = shotCapture->outputRequest.metadata.requestId;
     }
 
     if (postview.rgbImage == nullptr) {
@@ -980,7 +1263,7 @@ void HdrPlusProcessingBlock::notifyPostview(const Postview &postview) {
         return;
     }
 
-    mMessengerToClient->notifyPostview(mPendingShotCapture->outputRequest.metadata.requestId,
+    mMessengerToClient->notifyPostview(requestId,
             postview.rgbImage->base_pointer(), /*fd*/-1, postview.rgbImage->width(),
             postview.rgbImage->height(), postview.rgbImage->y_stride(), HAL_PIXEL_FORMAT_RGB_888);
 }
@@ -1024,44 +1307,64 @@ void HdrPlusProcessingBlock::onGcamInputImageReleased(const int64_t imageId) {
     removeInputReference(imageId);
 }
 
+void HdrPlusProcessingBlock::onGcamMemoryStateChanged(int64_t peakMemoryWithNewShotBytes) {
+    ALOGV("%s: Gcam peak memory with a new shot is %" PRId64 " bytes.", __FUNCTION__,
+            peakMemoryWithNewShotBytes);
+
+    // Notify worker thread in case another shot can start now.
+    notifyWorkerThreadEvent();
+}
+
 void HdrPlusProcessingBlock::onGcamFinalImage(int shotId, std::unique_ptr<gcam::YuvImage> yuvResult,
         gcam::GcamPixelFormat pixelFormat, const gcam::ExifMetadata& exifMetadata) {
     ALOGD("%s: Got a final image (format %d) for request %d.", __FUNCTION__, pixelFormat, shotId);
     mMessengerToClient->notifyAtraceAsync(kFinalImage, shotId, kAtraceEnd);
 
-    if (yuvResult == nullptr) {
-        ALOGE("%s: Expecting a YUV final image but yuvResult is nullptr.", __FUNCTION__);
-        return;
-    }
+    // Send out the shutter, which also sets the base frame index, before the final image.
+    notifyShuttersAndPostviews();
 
     std::shared_ptr<ShotCapture> finishingShot;
+    int32_t baseFrameIndex = kInvalidBaseFrameIndex;
+    bool nextCaptureReady = false;
     {
         std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
 
-        if (mPendingShotCapture == nullptr) {
+        finishingShot = getPendingShotCaptureLocked(shotId);
+        if (finishingShot == nullptr) {
             ALOGE("%s: There is no pending shot for shot id %d. Dropping a final image.",
                     __FUNCTION__, shotId);
             return;
         }
 
-        if (shotId != mPendingShotCapture->shotId) {
-            ALOGE("%s: Expecting a final image for shot %d but got a final image for shot %d.",
-                    __FUNCTION__, mPendingShotCapture->shotId, shotId);
-            return;
+        // Notify AP that it's ready to take another capture request if it hasn't been notified.
+        if (!finishingShot->nextCaptureReadyNotified) {
+            finishingShot->nextCaptureReadyNotified = true;
+            nextCaptureReady = true;
         }
 
-        finishingShot = mPendingShotCapture;
-        mPendingShotCapture = nullptr;
+        baseFrameIndex = finishingShot->baseFrameIndex;
     }
 
-    OutputResult outputResult = finishingShot->outputRequest;
+    if (nextCaptureReady) {
+        mMessengerToClient->notifyNextCaptureReadyAsync(
+                finishingShot->outputRequest.metadata.requestId);
+    }
 
-    // Notify AP that it's ready to take another capture request.
-    mMessengerToClient->notifyNextCaptureReadyAsync(outputResult.metadata.requestId);
+    OutputResult outputResult = finishingShot->outputRequest;
+    status_t res = 0;
 
-    mMessengerToClient->notifyAtraceAsync(kResample, shotId, kAtraceBegin);
-    status_t res = produceRequestOutputBuffers(std::move(yuvResult), &outputResult.buffers);
-    mMessengerToClient->notifyAtraceAsync(kResample, shotId, kAtraceEnd);
+    if (yuvResult == nullptr) {
+        ALOGE("%s: Expecting a YUV final image but yuvResult is nullptr.", __FUNCTION__);
+        res = -EINVAL;
+    } else if (baseFrameIndex < 0 ||
+            baseFrameIndex >= static_cast<int32_t>(finishingShot->frames.size())) {
+        ALOGE("%s: Shot %d has no valid base frame (%d).", __FUNCTION__, shotId, baseFrameIndex);
+        res = -EINVAL;
+    } else {
+        mMessengerToClient->notifyAtraceAsync(kResample, shotId, kAtraceBegin);
+        res = produceRequestOutputBuffers(std::move(yuvResult), &outputResult.buffers);
+        mMessengerToClient->notifyAtraceAsync(kResample, shotId, kAtraceEnd);
+    }
 
     END_PROFILER_TIMER(finishingShot->timer);
 
@@ -1071,56 +1374,34 @@ void HdrPlusProcessingBlock::onGcamFinalImage(int shotId, std::unique_ptr<gcam::
         for (auto buffer : outputResult.buffers) {
             buffer->destroy();
         }
-        return;
-    }
-
-    auto sourceCaptureBlock = mSourceCaptureBlock.lock();
-    if (sourceCaptureBlock != nullptr) {
-        sourceCaptureBlock->notifyIpuProcessingDone();
-    }
-
-    // Set frame metadata.
-    outputResult.metadata.frameMetadata =
-            finishingShot->frames[finishingShot->baseFrameIndex]->input.metadata.frameMetadata;
-
-    // Set the result metadata. GCAM should provide more result metadata. b/32721233.
-    outputResult.metadata.resultMetadata = std::make_shared<ResultMetadata>();
-    outputResult.metadata.resultMetadata->easelTimestamp =
-            outputResult.metadata.frameMetadata->easelTimestamp;
-    outputResult.metadata.resultMetadata->timestamp =
-            outputResult.metadata.frameMetadata->timestamp;
+    } else {
+        // Set frame metadata.
+        outputResult.metadata.frameMetadata =
+                finishingShot->frames[baseFrameIndex]->input.metadata.frameMetadata;
 
-    int makernoteSize = 0;
-    outputResult.metadata.resultMetadata->makernote.resize(gcam::kMaxMakernoteSize);
-    gcam::EncodeMakerNote(exifMetadata.makernote.c_str(),
-            &outputResult.metadata.resultMetadata->makernote[0], &makernoteSize);
-    outputResult.metadata.resultMetadata->makernote.erase(makernoteSize);
+        // Set the result metadata. GCAM should provide more result metadata. b/32721233.
+        outputResult.metadata.resultMetadata = std::make_shared<ResultMetadata>();
+        outputResult.metadata.resultMetadata->easelTimestamp =
+                outputResult.metadata.frameMetadata->easelTimestamp;
+        outputResult.metadata.resultMetadata->timestamp =
+                outputResult.metadata.frameMetadata->timestamp;
 
-    auto pipeline = mPipeline.lock();
-    if (pipeline != nullptr) {
-        // Check if we got all output buffers.
-        if (finishingShot->outputRequest.buffers.size() != outputResult.buffers.size()) {
-            ALOGE("%s: Processed %zu output buffers but expecting %zu.", __FUNCTION__,
-                    outputResult.buffers.size(), finishingShot->outputRequest.buffers.size());
-
-            // Abort output request.
-            pipeline->outputRequestAbort(finishingShot->outputRequest);
-            // TODO: Notify the client about the failed request.
-
-            // Continue to return input buffers.
-        } else {
-            // Send out output result.
-            pipeline->outputDone(outputResult);
-        }
-    } else {
-        ALOGW("%s: Pipeline is destroyed.", __FUNCTION__);
+        int makernoteSize = 0;
+        outputResult.metadata.resultMetadata->makernote.resize(gcam::kMaxMakernoteSize);
+        gcam::EncodeMakerNote(exifMetadata.makernote.c_str(),
+                &outputResult.metadata.resultMetadata->makernote[0], &makernoteSize);
+        outputResult.metadata.resultMetadata->makernote.erase(makernoteSize);
     }
 
-    // Notify worker thread that it can start next processing.
-    notifyWorkerThreadEvent();
+    {
+        std::unique_lock<std::mutex> lock(mHdrPlusProcessingLock);
+        finishingShot->outputResult = outputResult;
+        finishingShot->outputBuffersProduced = (res == 0);
+        finishingShot->finished = true;
+    }
 
-    // Notify shot is completed.
-    mShotCompletedCondition.notify_one();
+    // Gcam may finish shots out of order. Results are sent out in the order shots started.
+    sendFinishedShotResults();
 }
 
 status_t HdrPlusProcessingBlock::convertToGcamStaticMetadata(
@@ -1443,6 +1724,8 @@ status_t HdrPlusProcessingBlock::initGcam() {
             std::make_unique<GcamInputImageReleaseCallback>(shared_from_this());
     mGcamFinalImageCallback =
             std::make_unique<GcamFinalImageCallback>(shared_from_this());
+    mGcamMemoryStateCallback =
+            std::make_unique<GcamMemoryStateCallback>(shared_from_this());
     mGcamBaseFrameCallback =
             std::make_unique<GcamBaseFrameCallback>(shared_from_this());
     mGcamPostviewCallback =
@@ -1452,6 +1735,7 @@ status_t HdrPlusProcessingBlock::initGcam() {
     // Set up gcam init params.
     gcam::InitParams initParams;
     initParams.thread_count = kGcamThreadCounts;
+    initParams.simultaneous_merge_and_finish = kGcamSimultaneousMergeAndFinish;
     initParams.tuning_locked = kGcamTuningLocked;
     initParams.use_hexagon = false;
     initParams.max_full_metering_sweep_frames = kGcamFullMeteringSweepFrames;
@@ -1461,9 +1745,9 @@ status_t HdrPlusProcessingBlock::initGcam() {
     initParams.payload_frame_copy_mode = kGcamPayloadFrameCopyMode;
     initParams.image_release_callback = mGcamInputImageReleaseCallback.get();
     initParams.custom_file_saver = mGcamFileSaver.get();
+    initParams.memory_callback = mGcamMemoryStateCallback.get();
 
     // The following callbacks are not used.
-    initParams.memory_callback = nullptr;
     initParams.merge_queue_empty_callback = nullptr;
     initParams.finish_queue_empty_callback = nullptr;
     initParams.background_ae_results_callback = nullptr;
@@ -1503,6 +1787,7 @@ status_t HdrPlusProcessingBlock::initGcam() {
         ALOGE("%s: Failed to create a Gcam instance.", __FUNCTION__);
         mGcamInputImageReleaseCallback = nullptr;
         mGcamFinalImageCallback = nullptr;
+        mGcamMemoryStateCallback = nullptr;
         mGcamBaseFrameCallback = nullptr;
         return -ENODEV;
     }
@@ -1612,6 +1897,19 @@ void HdrPlusProcessingBlock::GcamInputImageReleaseCallback::Run(const int64_t im
     }
 }
 
+HdrPlusProcessingBlock::GcamMemoryStateCallback::GcamMemoryStateCallback(
+        std::weak_ptr<PipelineBlock> block) : mBlock(block) {
+}
+
+void HdrPlusProcessingBlock::GcamMemoryStateCallback::Run(int64_t peak_memory_bytes,
+        int64_t peak_memory_with_new_shot_bytes) {
+    ALOGV("%s: Gcam peak memory is %" PRId64 " bytes.", __FUNCTION__, peak_memory_bytes);
+    auto block = std::static_pointer_cast<HdrPlusProcessingBlock>(mBlock.lock());
+    if (block != nullptr) {
+        block->onGcamMemoryStateChanged(peak_memory_with_new_shot_bytes);
+    }
+}
+
 HdrPlusProcessingBlock::GcamFinalImageCallback::GcamFinalImageCallback(
         std::weak_ptr<PipelineBlock> block) : mBlock(block) {
 }
@@ -6,6 +6,8 @@
 #include "SourceCaptureBlock.h"
 
 #include "HdrPlusProfiler.h"
+#include "YuvCopier.h"
+#include "YuvResampler.h"
 
 #include <stdlib.h>
 #include <unordered_map>
@@ -37,6 +39,7 @@ public:
                 std::weak_ptr<HdrPlusPipeline> pipeline, std::shared_ptr<StaticMetadata> metadata,
                 std::weak_ptr<SourceCaptureBlock> sourceCaptureBlock, bool skipTimestampCheck,
                 int32_t cameraId, ImxMemoryAllocatorHandle imxMemoryAllocatorHandle,
+                std::shared_ptr<ImxBufferPool> outputBufferPool,
                 std::shared_ptr<MessengerToHdrPlusClient> messenger);
     bool doWorkLocked() override;
     status_t flushLocked() override;
@@ -53,10 +56,13 @@ private:
     HdrPlusProcessingBlock(std::weak_ptr<SourceCaptureBlock> sourceCaptureBlock,
             bool skipTimestampCheck, int32_t cameraId,
             ImxMemoryAllocatorHandle imxMemoryAllocatorHandle,
+            std::shared_ptr<ImxBufferPool> outputBufferPool,
             std::shared_ptr<MessengerToHdrPlusClient> messenger);
 
     // Gcam related constants.
-    static const int32_t kGcamThreadCounts = 1;
+    // Gcam merges a shot while it finishes the previous one, so it needs a thread for each.
+    static const int32_t kGcamThreadCounts = 2;
+    static const bool kGcamSimultaneousMergeAndFinish = true;
     static const bool kGcamTuningLocked = true;
     static const int32_t kGcamFullMeteringSweepFrames = 7;
     static const int32_t kGcamMinPayloadFrames = 3;
@@ -86,6 +92,12 @@ private:
     // The threshold to decide if an input is too old to be used for HDR+.
     static const int64_t kOldInputTimeThresholdNs = 1000000000; // 1 seconds.
 
+    // Max number of shots that can be processed in gcam at the same time.
+    static const size_t kMaxPendingShotCaptures = 2;
+    // A shot can start while other shots are pending only if gcam's peak memory including the new
+    // shot stays within this budget of IMX memory. A shot can always start if none is pending.
+    static const int64_t kMaxGcamPeakMemoryBytes = 512 * 1024 * 1024;
+
     // Callback invoked when Gcam releases an input image.
     class GcamInputImageReleaseCallback : public gcam::ImageReleaseCallback {
     public:
@@ -96,6 +108,16 @@ private:
         std::weak_ptr<PipelineBlock> mBlock;
     };
 
+    // Callback invoked when Gcam's future peak memory changes.
+    class GcamMemoryStateCallback : public gcam::MemoryStateCallback {
+    public:
+        GcamMemoryStateCallback(std::weak_ptr<PipelineBlock> block);
+        virtual ~GcamMemoryStateCallback() = default;
+    private:
+        void Run(int64_t peak_memory_bytes, int64_t peak_memory_with_new_shot_bytes) override;
+        std::weak_ptr<PipelineBlock> mBlock;
+    };
+
     // Callback invoked when Gcam finishes a final processed image.
     class GcamFinalImageCallback : public gcam::FinalImageCallback {
     public:
@@ -201,6 +223,13 @@ private:
         std::deque<std::shared_ptr<PayloadFrame>> frames;
         // Base frame index;
         int32_t baseFrameIndex;
+        // Whether AP has been notified that it can send the next capture request.
+        bool nextCaptureReadyNotified;
+        // Whether gcam has finished the shot. If true, outputResult is the result to send out and
+        // outputBuffersProduced is whether its buffers were produced successfully.
+        bool finished;
+        OutputResult outputResult;
+        bool outputBuffersProduced;
 
         DECLARE_PROFILER_TIMER(timer, "HDR+ Processing");
     };
@@ -225,6 +254,9 @@ private:
     void onGcamFinalImage(int shotId, std::unique_ptr<gcam::YuvImage> yuvResult,
             gcam::GcamPixelFormat pixelFormat, const gcam::ExifMetadata& exifMetadata);
 
+    // Callback invoked when Gcam's future peak memory changes.
+    void onGcamMemoryStateChanged(int64_t peakMemoryWithNewShotBytes);
+
     // Callback invoked when Gcam selects a base frame.
     void onGcamBaseFrameCallback(int shotId, int index, int64_t timestamp);
 
@@ -242,6 +274,21 @@ private:
     status_t convertToGcamStaticMetadata(std::unique_ptr<gcam::StaticMetadata> *gcamStaticMetadata,
             std::shared_ptr<StaticMetadata> metadata);
 
+    // Return if a new shot can start. Must be called with mHdrPlusProcessingLock locked.
+    bool canStartShotCaptureLocked();
+
+    // Return the pending shot with shotId or nullptr if not found. Must be called with
+    // mHdrPlusProcessingLock locked.
+    std::shared_ptr<ShotCapture> getPendingShotCaptureLocked(int32_t shotId);
+
+    // Notify AP that it can send the next capture request if a new shot can start and AP has not
+    // been notified since the last shot started. Must be called with mHdrPlusProcessingLock
+    // unlocked.
+    void notifyNextCaptureReady();
+
+    // Send out results of finished shots in the order the shots were started.
+    void sendFinishedShotResults();
+
     // Handle capture request. Must called with mHdrPlusProcessingLock locked.
     status_t handleCaptureRequestLocked(const std::vector<Input> &inputs,
             const OutputRequest &outputRequest);
@@ -290,17 +337,38 @@ private:
     status_t produceRequestOutputBuffers(std::unique_ptr<gcam::YuvImage> srcYuvImage,
             PipelineBufferSet *outputBuffers);
 
-    // Copy a YUV image to a dst YUV buffer.
+    // Copy a YUV image to a dst YUV buffer of the same format, or of the same format with
+    // swapped chroma order.
     status_t copyBuffer(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
             PipelineBuffer *dstBuffer);
 
-    // Resample a source YUV image to a destination YUV buffer.
+    // Resample a source YUV image to allocated destination YUV buffers. They are resampled in one
+    // pass on the CPU unless mIpuResample is set, in which case outputs that the IPU fails to
+    // resample fall back to the CPU.
+    status_t resampleBuffers(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
+            const std::vector<PipelineBuffer*> &dstBuffers);
+
+    // Resample a source YUV image to a destination YUV buffer on the IPU.
     status_t resampleBuffer(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
             PipelineBuffer *dstBuffer);
 
+    // Resample a source YUV image to destination YUV buffers in one pass on the CPU.
+    status_t resampleBuffersCpu(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
+            const std::vector<PipelineBuffer*> &dstBuffers);
+
+    // Calculate the region of a source YUV image to resample to a destination buffer, snapped to
+    // even coordinates.
+    status_t calculateResampleCropRect(const std::unique_ptr<gcam::YuvImage> &srcYuvImage,
+            PipelineBuffer *dstBuffer, int32_t *cropX0, int32_t *cropY0, int32_t *cropX1,
+            int32_t *cropY1);
+
     // Return if gcam YUV format is the same as HAL format.
     bool isTheSameYuvFormat(gcam::YuvFormat gcamFormat, int halFormat);
 
+    // Return if gcam YUV format is the same as HAL format except the chroma order, e.g. NV12 and
+    // NV21.
+    bool isChromaSwappedYuvFormat(gcam::YuvFormat gcamFormat, int halFormat);
+
     // Notify AP about shutters and postviews that are ready.
     void notifyShuttersAndPostviews();
 
@@ -331,6 +399,9 @@ private:
     // Gcam callback for finishing a final image.
     std::unique_ptr<GcamFinalImageCallback> mGcamFinalImageCallback;
 
+    // Gcam callback for peak memory changes.
+    std::unique_ptr<GcamMemoryStateCallback> mGcamMemoryStateCallback;
+
     // Gcam callback for selecting a base frame.
     std::unique_ptr<GcamBaseFrameCallback> mGcamBaseFrameCallback;
 
@@ -343,12 +414,17 @@ private:
     // Gcam instance.
     std::unique_ptr<gcam::Gcam> mGcam;
 
-    // Pending shot capture that is being processed in gcam.
-    std::shared_ptr<ShotCapture> mPendingShotCapture;
+    // Pending shot captures that are being processed in gcam, in the order they started. A shot
+    // is removed when its result is sent out.
+    std::deque<std::shared_ptr<ShotCapture>> mPendingShotCaptures;
 
     // Condition for shot complete.
     std::condition_variable mShotCompletedCondition;
 
+    // Serializes sending out shot results so they are sent in order. Must be locked before
+    // mHdrPlusProcessingLock if both are locked.
+    std::mutex mShotResultLock;
+
     // Messenger for shutter callback.
     std::shared_ptr<MessengerToHdrPlusClient> mMessengerToClient;
 
@@ -376,10 +452,25 @@ private:
     // IMX memory allocate handle to allocate IMX buffers.
     ImxMemoryAllocatorHandle mImxMemoryAllocatorHandle;
 
+    // Pool to allocate request output buffers from.
+    std::shared_ptr<ImxBufferPool> mOutputBufferPool;
+
     std::mutex mPostviewsLock;
     std::deque<Postview> mPostviews;
 
     std::thread mLoadPcgThread;
+
+    // Copies final images to output buffers, using a thread for each CPU core.
+    YuvCopier mYuvCopier;
+
+    // Whether to resample final images on the IPU instead of the CPU.
+    bool mIpuResample;
+
+    // Protects mYuvResampler.
+    std::mutex mYuvResamplerLock;
+
+    // Resamples final images to all output sizes of a request on the CPU.
+    YuvResampler mYuvResampler;
 };
 
 } // namespace pbcamera
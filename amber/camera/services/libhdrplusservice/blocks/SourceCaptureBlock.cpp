@@ -2,7 +2,9 @@
 #define LOG_TAG "SourceCaptureBlock"
 #include <log/log.h>
 
+#include <algorithm>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <system/graphics.h>
 
 #include <hardware/gchips/paintbox/system/include/dram_controller_settings.h>
@@ -23,11 +25,21 @@ SourceCaptureBlock::SourceCaptureBlock(std::shared_ptr<MessengerToHdrPlusClient>
         const paintbox::CaptureConfig &config = {}) :
         PipelineBlock("SourceCaptureBlock", BLOCK_EVENT_TIMEOUT_MS),
         mMessengerToClient(messenger),
+        mDirectDmaInput(true),
+        mDmaStagingBuffer(nullptr, free),
+        mDmaStagingBufferSize(0),
         mCaptureConfig(config),
+        mTimestampBatchSize(1),
+        mTimestampBatchDelayUs(0),
         mCaptureServicePaused(true),
         mClockMode(EaselControlServer::ClockMode::Max),
         mLastRequestedFrameCounterId(kInvalidFrameCounterId),
         mLastFinishedFrameCounterId(kInvalidFrameCounterId) {
+    char *stagedDmaInput = std::getenv("HDR_PLUS_STAGED_DMA_INPUT");
+    if (stagedDmaInput != nullptr && strcmp(stagedDmaInput, "true") == 0) {
+        mDirectDmaInput = false;
+    }
+
     // Check if capture config is valid.
     if (mCaptureConfig.stream_config_list.size() > 0) {
         mIsMipiInput = true;
@@ -169,6 +181,8 @@ void SourceCaptureBlock::notifyIpuProcessingStart(bool continuousCapturing) {
         continuousCapturing = false;
     }
 
+    mIpuShots.startShot();
+
     {
         // Increment last requested frame counter ID so older frame counter ID will be ignored.
         std::unique_lock<std::mutex> lock(mFrameCounterLock);
@@ -213,18 +227,43 @@ void SourceCaptureBlock::notifyIpuProcessingStart(bool continuousCapturing) {
     }
 }
 
+void SourceCaptureBlock::notifyIpuPayloadFramesAdded() {
+    // For input buffers coming from the client via notifyDmaInputBuffer(), there is nothing to do
+    // here.
+    if (!mIsMipiInput) return;
+
+    std::unique_lock<std::mutex> lock(mSourceCaptureLock);
+    if (!mIpuShots.payloadFramesAdded()) return;
+
+    // Capture the frames of the next shot while the shots in flight are processed, unless
+    // capturing in functional clock mode may heat up Easel.
+    if (!isGoodThermalCondition(EaselControlServer::getThermalCondition())) {
+        ALOGD("%s: Not resuming capture due to bad thermal", __FUNCTION__);
+        return;
+    }
+
+    resumeCaptureServiceLocked(false, kInvalidFrameCounterId);
+    ALOGV("%s: Capture resumed with %u IPU processing in flight", __FUNCTION__,
+            mIpuShots.getShotsInFlight());
+}
+
 void SourceCaptureBlock::notifyIpuProcessingDone() {
     // For input buffers coming from the client via notifyDmaInputBuffer(), there is nothing to do
     // here.
     if (!mIsMipiInput) return;
 
+    std::unique_lock<std::mutex> lock(mSourceCaptureLock);
+
+    // Stay in functional clock mode until the last IPU processing in flight is done.
+    if (!mIpuShots.finishShot()) return;
+
+    // Read it under mSourceCaptureLock so an IPU processing starting now invalidates it.
     int32_t frameCounterId = kInvalidFrameCounterId;
     {
-        std::unique_lock<std::mutex> lock(mFrameCounterLock);
+        std::unique_lock<std::mutex> frameCounterLock(mFrameCounterLock);
         frameCounterId = mLastRequestedFrameCounterId;
     }
 
-    std::unique_lock<std::mutex> lock(mSourceCaptureLock);
     resumeCaptureServiceLocked(true, frameCounterId);
 }
 
@@ -270,9 +309,12 @@ bool SourceCaptureBlock::doWorkLocked() {
     ALOGV("%s", __FUNCTION__);
 
     // Create a timestamp notification thread to send Easel timestamps if it doesn't exist yet.
-    if (mTimestampNotificationThread == nullptr) {
-        mTimestampNotificationThread =
-            std::make_unique<TimestampNotificationThread>(mMessengerToClient);
+    {
+        std::unique_lock<std::mutex> lock(mTimestampNotificationLock);
+        if (mTimestampNotificationThread == nullptr) {
+            mTimestampNotificationThread = std::make_unique<TimestampNotificationThread>(
+                    mMessengerToClient, mTimestampBatchSize, mTimestampBatchDelayUs);
+        }
     }
 
     // For input buffers coming from the client via notifyDmaInputBuffer(), there is nothing to do
@@ -421,17 +463,53 @@ status_t SourceCaptureBlock::transferDmaBuffer(const DmaImageBuffer &dmaInputBuf
         PipelineBuffer *buffer) {
     if (buffer == nullptr) return -EINVAL;
 
-    // Allocate a temporary buffer for DMA transfer. This is to workaround b/62633675.
-    // TODO: Remove this temporary buffer once we can get the fd for the ION buffer.
-    auto temp = std::unique_ptr<void, void (*)(void*)>(malloc(buffer->getDataSize()), free);
-    if (temp == nullptr) {
-        ALOGE("%s: Can't allocate a temporary buffer for DMA transfer.", __FUNCTION__);
-        return -ENOMEM;
+    if (mDirectDmaInput) {
+        status_t res = transferDmaBufferDirect(dmaInputBuffer, buffer);
+        if (res != -ENOTSUP) return res;
+
+        // The buffer can't be shared as a dma-buf, and buffers of the stream are alike.
+        ALOGW("%s: Buffers have no dma-buf. Falling back to staged DMA transfers.",
+                __FUNCTION__);
+        mDirectDmaInput = false;
+    }
+
+    return transferDmaBufferStaged(dmaInputBuffer, buffer);
+}
+
+status_t SourceCaptureBlock::transferDmaBufferDirect(const DmaImageBuffer &dmaInputBuffer,
+        PipelineBuffer *buffer) {
+    // The dma-buf fd is owned by the buffer.
+    int fd = buffer->getFd();
+    if (fd < 0) return -ENOTSUP;
+
+    status_t res = mMessengerToClient->transferDmaBuffer(dmaInputBuffer.dmaHandle, fd,
+            /*dest*/nullptr, buffer->getDataSize());
+    if (res != 0) {
+        ALOGE("%s: transfering DMA buffer failed: %s (%d)", __FUNCTION__, strerror(-res), res);
+        return res;
+    }
+
+    return 0;
+}
+
+status_t SourceCaptureBlock::transferDmaBufferStaged(const DmaImageBuffer &dmaInputBuffer,
+        PipelineBuffer *buffer) {
+    // Grow the staging buffer if it's too small for the buffer.
+    size_t dataSize = buffer->getDataSize();
+    if (mDmaStagingBufferSize < dataSize) {
+        void *staging = nullptr;
+        if (posix_memalign(&staging, kDmaStagingBufferAlignment, dataSize) != 0) {
+            ALOGE("%s: Can't allocate a %zu-byte staging buffer for DMA transfer.", __FUNCTION__,
+                    dataSize);
+            return -ENOMEM;
+        }
+        mDmaStagingBuffer.reset(staging);
+        mDmaStagingBufferSize = dataSize;
     }
 
-    // DMA transfer to the temporary buffer.
+    // DMA transfer to the staging buffer.
     status_t res = mMessengerToClient->transferDmaBuffer(dmaInputBuffer.dmaHandle, /*ionFd*/-1,
-            temp.get(), buffer->getDataSize());
+            mDmaStagingBuffer.get(), dataSize);
     if (res != 0) {
         ALOGE("%s: transfering DMA buffer failed: %s (%d)", __FUNCTION__, strerror(-res), res);
         return res;
@@ -444,7 +522,7 @@ status_t SourceCaptureBlock::transferDmaBuffer(const DmaImageBuffer &dmaInputBuf
     }
 
     // Copy to the actual buffer.
-    memcpy(buffer->getPlaneData(0), temp.get(), buffer->getDataSize());
+    memcpy(buffer->getPlaneData(0), mDmaStagingBuffer.get(), dataSize);
     buffer->unlockData();
 
     return 0;
@@ -518,11 +596,28 @@ void SourceCaptureBlock::handleCompletedCaptureForRequest(const OutputRequest &o
     }
 
     // Notify the client of the Easel timestamp.
+    std::unique_lock<std::mutex> lock(mTimestampNotificationLock);
     if (mTimestampNotificationThread != nullptr) {
         mTimestampNotificationThread->notifyNewEaselTimestampNs(easelTimestamp);
     }
 }
 
+void SourceCaptureBlock::setTimestampBatchWindow(uint32_t maxTimestamps, int64_t maxDelayUs) {
+    std::unique_lock<std::mutex> lock(mTimestampNotificationLock);
+    mTimestampBatchSize = maxTimestamps;
+    mTimestampBatchDelayUs = maxDelayUs;
+    if (mTimestampNotificationThread != nullptr) {
+        mTimestampNotificationThread->setBatchWindow(maxTimestamps, maxDelayUs);
+    }
+}
+
+void SourceCaptureBlock::flushTimestampNotifications() {
+    std::unique_lock<std::mutex> lock(mTimestampNotificationLock);
+    if (mTimestampNotificationThread != nullptr) {
+        mTimestampNotificationThread->flush();
+    }
+}
+
 void SourceCaptureBlock::sendOutputResult(const OutputResult &result) {
     auto pipeline = mPipeline.lock();
     if (pipeline == nullptr) {
@@ -788,9 +883,12 @@ static void timestampNotificationThreadLoop(TimestampNotificationThread *notific
 }
 
 TimestampNotificationThread::TimestampNotificationThread(
-        std::shared_ptr<MessengerToHdrPlusClient> messengerToClient) :
+        std::shared_ptr<MessengerToHdrPlusClient> messengerToClient, uint32_t maxBatchSize,
+        int64_t maxBatchDelayUs) :
         mMessengerToClient(messengerToClient),
-        mExiting(false) {
+        mExiting(false),
+        mFlushing(false) {
+    setBatchWindow(maxBatchSize, maxBatchDelayUs);
     mThread = std::make_unique<std::thread>(timestampNotificationThreadLoop, this);
 }
 
@@ -810,12 +908,36 @@ void TimestampNotificationThread::signalExit() {
 
 void TimestampNotificationThread::notifyNewEaselTimestampNs(int64_t easelTimestampNs) {
     std::unique_lock<std::mutex> lock(mEventLock);
+    if (mEaselTimestamps.size() == 0) {
+        mBatchStartTime = std::chrono::steady_clock::now();
+    }
     mEaselTimestamps.push_back(easelTimestampNs);
     mEventCondition.notify_one();
 }
 
+void TimestampNotificationThread::setBatchWindow(uint32_t maxBatchSize, int64_t maxBatchDelayUs) {
+    std::unique_lock<std::mutex> lock(mEventLock);
+    mMaxBatchSize = std::max(1u, std::min(maxBatchSize, kMaxEaselTimestampsPerMessage));
+    mMaxBatchDelayUs = std::max<int64_t>(0, maxBatchDelayUs);
+    mEventCondition.notify_one();
+}
+
+void TimestampNotificationThread::flush() {
+    std::unique_lock<std::mutex> lock(mEventLock);
+    if (mEaselTimestamps.size() == 0) return;
+
+    mFlushing = true;
+    mEventCondition.notify_one();
+}
+
+bool TimestampNotificationThread::isBatchReadyLocked() {
+    return mFlushing || mEaselTimestamps.size() >= mMaxBatchSize ||
+            std::chrono::steady_clock::now() >=
+            mBatchStartTime + std::chrono::microseconds(mMaxBatchDelayUs);
+}
+
 void TimestampNotificationThread::threadLoop() {
-    int64_t easelTimestampNs = 0;
+    std::vector<int64_t> easelTimestampsNs;
 
     while (1) {
         {
@@ -827,16 +949,33 @@ void TimestampNotificationThread::threadLoop() {
                         [&] { return mEaselTimestamps.size() > 0 || mExiting; });
             }
 
+            // Wait until the batch is full, its window closes, or a flush is requested.
+            while (!mExiting && !isBatchReadyLocked()) {
+                mEventCondition.wait_until(lock,
+                        mBatchStartTime + std::chrono::microseconds(mMaxBatchDelayUs));
+            }
+
             if (mExiting) {
                 ALOGV("%s: Exiting.", __FUNCTION__);
                 return;
             }
 
-            easelTimestampNs = mEaselTimestamps[0];
-            mEaselTimestamps.pop_front();
+            // Timestamps left over a full batch are at least as old as the batch, so they will be
+            // sent right away in the next iteration.
+            size_t batchSize = std::min<size_t>(mEaselTimestamps.size(), mMaxBatchSize);
+            easelTimestampsNs.assign(mEaselTimestamps.begin(),
+                    mEaselTimestamps.begin() + batchSize);
+            mEaselTimestamps.erase(mEaselTimestamps.begin(), mEaselTimestamps.begin() + batchSize);
+            if (mEaselTimestamps.size() == 0) {
+                mFlushing = false;
+            }
         }
 
-        mMessengerToClient->notifyFrameEaselTimestampAsync(easelTimestampNs);
+        if (easelTimestampsNs.size() == 1) {
+            mMessengerToClient->notifyFrameEaselTimestampAsync(easelTimestampsNs[0]);
+        } else {
+            mMessengerToClient->notifyFrameEaselTimestampsAsync(easelTimestampsNs);
+        }
     }
 }
 
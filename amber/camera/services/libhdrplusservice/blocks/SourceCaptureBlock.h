@@ -1,9 +1,12 @@
 #ifndef PAINTBOX_HDR_PLUS_PIPELINE_SOURCE_CAPTURE_BLOCK_H
 #define PAINTBOX_HDR_PLUS_PIPELINE_SOURCE_CAPTURE_BLOCK_H
 
+#include <chrono>
 #include <easelcontrol.h>
+#include <memory>
 
 #include "HdrPlusMessageTypes.h"
+#include "IpuShotTracker.h"
 #include "MessengerToHdrPlusClient.h"
 #include "PipelineBlock.h"
 #include "PipelineBuffer.h"
@@ -69,15 +72,34 @@ public:
     void handleTimeoutLocked() override;
 
     // Notify IPU processing is going to start. If continuousCapturing is true, Source Capture
-    // block will continue capturing. Otherwise, it will stop capturing.
+    // block will continue capturing. Otherwise, it will stop capturing until
+    // notifyIpuPayloadFramesAdded() is called.
     void notifyIpuProcessingStart(bool continuousCapturing);
 
-    // Notify IPU processing is done.
+    // Notify the payload frames of the IPU processing that is starting have been added, so
+    // capture can resume while it is processed. Must be called after each
+    // notifyIpuProcessingStart(), even if the processing failed to start.
+    void notifyIpuPayloadFramesAdded();
+
+    // Notify IPU processing is done. Clock mode changes back to capture when the last IPU
+    // processing in flight is done.
     void notifyIpuProcessingDone();
 
     // Pause capturing.
     void pauseCapture();
 
+    /*
+     * Set the window to batch Easel timestamps sent to the client. Collected timestamps are sent
+     * in one message once maxTimestamps timestamps are collected or the oldest one has waited for
+     * maxDelayUs microseconds, whichever comes first. If maxTimestamps is 1 or maxDelayUs is 0,
+     * every timestamp is sent immediately, which is the default. Batching only saves messages if
+     * maxDelayUs spans several frame intervals, so enable it only where that latency is fine.
+     */
+    void setTimestampBatchWindow(uint32_t maxTimestamps, int64_t maxDelayUs);
+
+    // Send the Easel timestamps collected so far without waiting for the batch window to close.
+    void flushTimestampNotifications();
+
 private:
     // Timeout duration for waiting for events.
     static const int32_t BLOCK_EVENT_TIMEOUT_MS = 500;
@@ -92,6 +114,9 @@ private:
 
     static const int32_t kInvalidFrameCounterId = -1;
 
+    // Alignment of the staging buffer for DMA input buffers.
+    static const size_t kDmaStagingBufferAlignment = 4096;
+
     // Use newSourceCaptureBlock to create a SourceCaptureBlock.
     SourceCaptureBlock(std::shared_ptr<MessengerToHdrPlusClient> messenger,
         const paintbox::CaptureConfig &config);
@@ -119,9 +144,27 @@ private:
     // Request a capture to prevent possible frame drops.
     void requestCaptureToPreventFrameDrop();
 
-    // DMA transfer a buffer.
+    /*
+     * DMA transfer a buffer. It transfers directly into the buffer's dma-buf if possible, and
+     * falls back to transferring via mDmaStagingBuffer otherwise.
+     */
     status_t transferDmaBuffer(const DmaImageBuffer &dmaInputBuffer, PipelineBuffer *buffer);
 
+    /*
+     * DMA transfer a buffer directly into the buffer's dma-buf.
+     *
+     * Returns:
+     *  0:          on success.
+     *  -ENOTSUP:   if the buffer has no dma-buf. Nothing was transferred.
+     *  Other errors if the transfer failed.
+     */
+    status_t transferDmaBufferDirect(const DmaImageBuffer &dmaInputBuffer,
+            PipelineBuffer *buffer);
+
+    // DMA transfer a buffer to mDmaStagingBuffer and copy it to the buffer.
+    status_t transferDmaBufferStaged(const DmaImageBuffer &dmaInputBuffer,
+            PipelineBuffer *buffer);
+
     // Invoked when mDequeueRequestThread has captured some amount of frames after
     // requestFrameCounterNotification() is called.
     // frameCounterId is the frame counter ID passed to requestFrameCounterNotification().
@@ -145,6 +188,16 @@ private:
     // Whether to capture input buffers from MIPI or from AP.
     bool mIsMipiInput;
 
+    // The following variables are only accessed in notifyDmaInputBuffer().
+    // Whether to transfer input buffers from AP directly into pipeline buffers. It's cleared if a
+    // pipeline buffer has no dma-buf, or if the environment variable
+    // HDR_PLUS_STAGED_DMA_INPUT is "true".
+    bool mDirectDmaInput;
+    // Staging buffer for input buffers from AP that cannot be transferred directly. It's kept
+    // across frames and only grows.
+    std::unique_ptr<void, void (*)(void*)> mDmaStagingBuffer;
+    size_t mDmaStagingBufferSize;
+
     // Capture service for MIPI capture.
     std::mutex mCaptureServiceLock;
     std::unique_ptr<paintbox::CaptureService> mCaptureService; // Protected by mCaptureServiceLock.
@@ -156,13 +209,19 @@ private:
     // Protected by mCaptureServiceLock.
     std::unique_ptr<DequeueRequestThread> mDequeueRequestThread;
 
-    // A thread to notify AP about Easel timestmap.
+    // A thread to notify AP about Easel timestmap and its batch window.
+    std::mutex mTimestampNotificationLock;
+    // Protected by mTimestampNotificationLock.
     std::unique_ptr<TimestampNotificationThread> mTimestampNotificationThread;
+    uint32_t mTimestampBatchSize; // Protected by mTimestampNotificationLock.
+    int64_t mTimestampBatchDelayUs; // Protected by mTimestampNotificationLock.
 
     std::mutex mSourceCaptureLock;
     bool mCaptureServicePaused;  // If capture service is paused. Protected by mSourceCaptureLock.
     // Current clock mode. Protected by mSourceCaptureLock.
     EaselControlServer::ClockMode mClockMode;
+    // IPU processing in flight. Protected by mSourceCaptureLock.
+    IpuShotTracker mIpuShots;
 
     std::mutex mFrameCounterLock;
     // Last request frame counter ID that is expected.
@@ -239,15 +298,31 @@ private:
     std::condition_variable mStateChangedCondition; // Used to signal the state change.
 };
 
-// TimestampNotificationThread creates a thread to send Easel timestamps to AP.
+// TimestampNotificationThread creates a thread to send Easel timestamps to AP. Timestamps are
+// collected during a batch window and sent to AP in one message.
 class TimestampNotificationThread {
 public:
-    TimestampNotificationThread(std::shared_ptr<MessengerToHdrPlusClient> messengerToClient);
+    /*
+     * messengerToClient is the messenger to send Easel timestamps to AP.
+     * maxBatchSize and maxBatchDelayUs are the batch window. See setBatchWindow().
+     */
+    TimestampNotificationThread(std::shared_ptr<MessengerToHdrPlusClient> messengerToClient,
+            uint32_t maxBatchSize, int64_t maxBatchDelayUs);
     virtual ~TimestampNotificationThread();
 
     // Notify a new Easel timestamp asynchronously.
     void notifyNewEaselTimestampNs(int64_t easelTimestampNs);
 
+    /*
+     * Set the batch window. Pending timestamps are sent once maxBatchSize of them are collected
+     * or the oldest one has waited for maxBatchDelayUs. maxBatchSize is capped at
+     * kMaxEaselTimestampsPerMessage.
+     */
+    void setBatchWindow(uint32_t maxBatchSize, int64_t maxBatchDelayUs);
+
+    // Send pending timestamps without waiting for the batch window to close.
+    void flush();
+
     // Thread loop that sends Easel timestamps to AP.
     void threadLoop();
 
@@ -255,6 +330,9 @@ public:
     void signalExit();
 
 private:
+    // Return if pending timestamps should be sent now. Must be called with mEventLock held.
+    bool isBatchReadyLocked();
+
     std::unique_ptr<std::thread> mThread;
     std::shared_ptr<MessengerToHdrPlusClient> mMessengerToClient;
 
@@ -263,7 +341,12 @@ private:
 
     // The following variables must be protected by mEventLock.
     bool mExiting; // If requested to exit.
+    bool mFlushing; // If requested to send pending timestamps now.
     std::deque<int64_t> mEaselTimestamps; // A queue of Easel timestamps to send to AP.
+    // Time when the oldest timestamp in mEaselTimestamps was notified.
+    std::chrono::steady_clock::time_point mBatchStartTime;
+    uint32_t mMaxBatchSize;
+    int64_t mMaxBatchDelayUs;
 };
 
 } // namespace pbcamera
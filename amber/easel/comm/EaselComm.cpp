@@ -10,7 +10,14 @@
 #include "easelcomm.h"
 #include "uapi/linux/google-easel-comm.h"
 
+#include "EaselCommEmulator.h"
+#include "EaselCommRegistrationCache.h"
+#include "EaselCommTelemetry.h"
+
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <mutex>
 #include <string>
 #include <assert.h>
 #include <errno.h>
@@ -29,11 +36,118 @@
 
 #define PROFILE_DMA
 
+/*
+ * Gate ordering the messages posted by one EaselComm by priority lane; see
+ * EaselComm::Priority.  Each lane counts its senders that are waiting or
+ * posting, and a sender waits while a more urgent lane has any.  A waiting
+ * sender goes ahead anyway once kMaxOvertakes more urgent messages have been
+ * posted since it started waiting, so urgent traffic cannot starve it.
+ */
+class EaselCommLaneGate {
+public:
+    EaselCommLaneGate() : mBusy(), mPosted(), mStats() {}
+
+    /*
+     * Wait until no more urgent lane is busy, then mark lane busy.
+     * Returns the time waited in nanoseconds.
+     */
+    uint64_t enter(int lane) {
+        std::unique_lock<std::mutex> lock(mLock);
+        EaselComm::LaneStats *stats = &mStats[lane];
+        mBusy[lane]++;
+        stats->messages++;
+        if (!moreUrgentBusy(lane)) {
+            return 0;
+        }
+
+        stats->queue_depth++;
+        stats->max_queue_depth =
+            std::max(stats->max_queue_depth, stats->queue_depth);
+        uint64_t posted = morePosted(lane);
+        auto start = std::chrono::steady_clock::now();
+        mCond.wait(lock, [&] {
+            return !moreUrgentBusy(lane) ||
+                   morePosted(lane) - posted >= kMaxOvertakes;
+        });
+        uint64_t wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stats->queue_depth--;
+        stats->total_wait_ns += wait_ns;
+        stats->max_wait_ns = std::max(stats->max_wait_ns, wait_ns);
+        return wait_ns;
+    }
+
+    // Mark one sender of lane done posting.
+    void leave(int lane) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mBusy[lane]--;
+        mPosted[lane]++;
+        if (lane < EaselComm::PRIORITY_BULK) {
+            mCond.notify_all();
+        }
+    }
+
+    void getStats(int lane, EaselComm::LaneStats *stats) {
+        std::lock_guard<std::mutex> lock(mLock);
+        *stats = mStats[lane];
+    }
+
+private:
+    // More urgent messages posted ahead of a waiting sender before it goes.
+    static const uint64_t kMaxOvertakes = 8;
+
+    bool moreUrgentBusy(int lane) {
+        for (int i = 0; i < lane; i++) {
+            if (mBusy[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the number of messages posted on lanes more urgent than lane.
+    uint64_t morePosted(int lane) {
+        uint64_t posted = 0;
+        for (int i = 0; i < lane; i++) {
+            posted += mPosted[i];
+        }
+        return posted;
+    }
+
+    std::mutex mLock;
+    std::condition_variable mCond;  // Signaled when an urgent post is done.
+    // Waiting plus posting senders per lane.  Guarded by mLock.
+    int mBusy[EaselComm::PRIORITY_COUNT];
+    // Messages posted per lane.  Guarded by mLock.
+    uint64_t mPosted[EaselComm::PRIORITY_COUNT];
+    EaselComm::LaneStats mStats[EaselComm::PRIORITY_COUNT];  // Guarded by mLock
+};
+
 namespace {
 // Device file path
 static const char *kEaselCommDevPathClient = "/dev/easelcomm-client";
 static const char *kEaselCommDevPathServer = "/dev/easelcomm-server";
 static const useconds_t kOpenPollIntervalUs = 1000;  // Poll interval 1 ms
+// Default limit of outstanding asynchronous DMA transfers.
+static const size_t kDefaultMaxAsyncDmaInFlight = 4;
+// Default number of dma-bufs kept registered after a transfer.
+static const size_t kDefaultRegistrationCacheSize = 8;
+// Environment variables starting a recording in open().
+static const char *kRecordDirEnv = "EASELCOMM_RECORD_DIR";
+static const char *kRecordPayloadsEnv = "EASELCOMM_RECORD_PAYLOADS";
+// Smallest receive buffer pool size class; each next class doubles in size
+// until EASELCOMM_MAX_MESSAGE_SIZE is covered.
+static const size_t kRxPoolMinClassSize = 128;
+// Maximum number of idle buffers kept per receive buffer pool size class.
+static const size_t kRxPoolMaxFreePerClass = 16;
+// Message asking the remote for send flow control credits.
+static const char kCreditRequest[] = "EaselComm credit request";
+// Reply timeout of a credit request.
+static const int32_t kCreditRequestTimeoutMs = 1000;
+// Wait before requesting credits again after a failed request.
+static const std::chrono::milliseconds kCreditRetryInterval(100);
+// Wait before requesting credits again after the remote returned none.
+static const std::chrono::milliseconds kCreditPollInterval(2);
 
 enum {
     KBUF_FILL_UNUSED,
@@ -41,6 +155,33 @@ enum {
     KBUF_FILL_DMA,
 };
 
+// Returns the size in bytes of receive buffer pool size class pool_class.
+static size_t rx_pool_class_size(int pool_class) {
+    size_t size = kRxPoolMinClassSize << pool_class;
+    return size < EASELCOMM_MAX_MESSAGE_SIZE ? size : EASELCOMM_MAX_MESSAGE_SIZE;
+}
+
+// Returns the number of receive buffer pool size classes.
+static int rx_pool_class_count() {
+    int count = 1;
+    while (rx_pool_class_size(count - 1) < EASELCOMM_MAX_MESSAGE_SIZE) {
+        count++;
+    }
+    return count;
+}
+
+// Returns the smallest size class fitting size, or -1 if none does.
+static int rx_pool_class_of(size_t size) {
+    if (size > EASELCOMM_MAX_MESSAGE_SIZE) {
+        return -1;
+    }
+    int pool_class = 0;
+    while (rx_pool_class_size(pool_class) < size) {
+        pool_class++;
+    }
+    return pool_class;
+}
+
 static bool is_easelcomm_client() {
     struct stat buffer;
     return (stat(kEaselCommDevPathClient, &buffer) == 0);
@@ -57,6 +198,15 @@ static bool is_server_logging_to_logcat() {
     return !((dest == "CONSOLE") || (dest == "FILE"));
 }
 
+/*
+ * Issue an easelcomm ioctl on fd, handled in userspace if fd is an emulated
+ * device.  Returns 0 for success, or -1 with errno set for failure.
+ */
+static int easelcomm_ioctl(int fd, unsigned long request,
+                           void *arg = nullptr) {
+    return EaselCommEmulator::ioctl(fd, request, arg);
+}
+
 static void fill_kbuf(easelcomm_kbuf_desc *buf_desc,
                       easelcomm_msgid_t message_id,
                       const EaselComm::EaselMessage *msg,
@@ -76,188 +226,1190 @@ static void fill_kbuf(easelcomm_kbuf_desc *buf_desc,
         return;
     }
 
-    // Assign timeout
-    buf_desc->wait.timeout_ms = msg->timeout_ms;
+    // Assign timeout
+    buf_desc->wait.timeout_ms = msg->timeout_ms;
+
+    switch (fill_type) {
+        case KBUF_FILL_MSG:
+            buf_desc->buf = msg->message_buf;
+            buf_desc->dma_buf_fd = msg->dma_buf_fd;
+            // Message data itself is never scattered.
+            buf_desc->buf_type =
+                (msg->dma_buf_type == EASELCOMM_DMA_BUFFER_SG_LIST)
+                    ? EASELCOMM_DMA_BUFFER_USER : msg->dma_buf_type;
+            buf_desc->buf_size = msg->message_buf_size;
+            break;
+        case KBUF_FILL_DMA:
+            if (msg->dma_buf_type == EASELCOMM_DMA_BUFFER_SG_LIST) {
+                buf_desc->buf = const_cast<easelcomm_dma_sg_list *>(
+                    &msg->dma_sg_list);
+                buf_desc->dma_buf_fd = -1;
+            } else {
+                buf_desc->buf = msg->dma_buf;
+                buf_desc->dma_buf_fd = msg->dma_buf_fd;
+            }
+            buf_desc->buf_type = msg->dma_buf_type;
+            buf_desc->buf_size = msg->dma_buf_size;
+            break;
+    }
+}
+
+// Whether the driver supports scatter-gather DMA buffers, learned from the
+// first scatter-gather transfer of the process.
+enum SgDmaSupport {
+    SG_DMA_UNKNOWN,
+    SG_DMA_SUPPORTED,
+    SG_DMA_UNSUPPORTED,
+};
+static std::atomic<int> sg_dma_support(SG_DMA_UNKNOWN);
+
+// Returns true if every segment of msg's scatter-gather list is a user buffer.
+static bool is_user_sg_list(const EaselComm::EaselMessage *msg) {
+    for (uint32_t i = 0; i < msg->dma_sg_list.count; i++) {
+        if (msg->dma_sg_list.segments[i].buf_type != EASELCOMM_DMA_BUFFER_USER) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Issue a SENDDMA or RECVDMA ioctl for the DMA buffer of msg, as filled into
+ * buf_desc by fill_kbuf.  If msg carries a scatter-gather list and the
+ * driver does not support those, segments that are all user buffers are
+ * gathered into or scattered from a temporary bounce buffer instead.
+ *
+ * Returns 0 for success, or -1 with errno set for failure.
+ */
+static int dma_ioctl(int fd, unsigned long request,
+                     easelcomm_kbuf_desc *buf_desc,
+                     const EaselComm::EaselMessage *msg) {
+    bool sg = msg && msg->dma_buf_type == EASELCOMM_DMA_BUFFER_SG_LIST;
+
+    if (!sg || sg_dma_support != SG_DMA_UNSUPPORTED) {
+        int ret = easelcomm_ioctl(fd, request, buf_desc);
+        if (sg && ret == 0) {
+            sg_dma_support = SG_DMA_SUPPORTED;
+        }
+        // Once a scatter-gather transfer went through, EINVAL is about this
+        // transfer rather than the driver.
+        if (!sg || ret == 0 || errno != EINVAL ||
+            sg_dma_support == SG_DMA_SUPPORTED) {
+            return ret;
+        }
+        sg_dma_support = SG_DMA_UNSUPPORTED;
+        if (!is_user_sg_list(msg)) {
+            return ret;
+        }
+    } else if (!is_user_sg_list(msg)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *bounce = static_cast<char *>(malloc(msg->dma_buf_size));
+    if (bounce == nullptr) {
+        return -1;
+    }
+
+    const easelcomm_dma_sg_list *list = &msg->dma_sg_list;
+    size_t offset = 0;
+    if (request == EASELCOMM_IOC_SENDDMA) {
+        for (uint32_t i = 0; i < list->count; i++) {
+            memcpy(bounce + offset, list->segments[i].buf,
+                   list->segments[i].buf_size);
+            offset += list->segments[i].buf_size;
+        }
+    }
+
+    buf_desc->buf = bounce;
+    buf_desc->buf_type = EASELCOMM_DMA_BUFFER_USER;
+    int ret = easelcomm_ioctl(fd, request, buf_desc);
+    int err_saved = errno;
+
+    if (ret == 0 && request == EASELCOMM_IOC_RECVDMA) {
+        for (uint32_t i = 0; i < list->count; i++) {
+            memcpy(list->segments[i].buf, bounce + offset,
+                   list->segments[i].buf_size);
+            offset += list->segments[i].buf_size;
+        }
+    }
+
+    free(bounce);
+    errno = err_saved;
+    return ret;
+}
+
+/*
+ * If ALOG* is called inside sendAMessage(), on Easel side it might be calling
+ * sendAMessage() again by liblog, creating an infinite loop.
+ * Only print ALOG* on the client side or when the server is not sending the
+ * log back to AP logcat.
+ */
+static bool is_alog_ok(void) {
+    return is_easelcomm_client() || !is_server_logging_to_logcat();
+}
+
+/*
+ * Holds the lane of a send until it is left or the object goes out of scope,
+ * counting its wait.
+ */
+class LaneGuard {
+public:
+    LaneGuard(EaselCommLaneGate *gate, int lane, EaselCommTelemetry *telemetry)
+            : mGate(gate), mLane(lane), mEntered(true) {
+        telemetry->addQueueWait(mGate->enter(mLane));
+    }
+    ~LaneGuard() { leave(); }
+
+    // Leave the lane early, once the message is posted.
+    void leave() {
+        if (mEntered) {
+            mEntered = false;
+            mGate->leave(mLane);
+        }
+    }
+
+    LaneGuard(const LaneGuard &) = delete;
+    LaneGuard &operator=(const LaneGuard &) = delete;
+
+private:
+    EaselCommLaneGate *mGate;
+    int mLane;
+    bool mEntered;
+};
+
+/*
+ * Helper for posting a message, the first half of sendAMessage().
+ *
+ * Sends the kernel message descriptor via the SENDMSG ioctl, which updates
+ * kmsg_desc with the assigned message_id, followed by the message data via
+ * the WRITEDATA ioctl.  Once this returns the message is dispatched to the
+ * remote and the message buffer may be reused, but a DMA transfer requested
+ * by the message has not started yet.  The caller must follow up with
+ * sendADma() if msg->dma_buf_size is non-zero.
+ *
+ * The message is counted in telemetry.
+ *
+ * Returns zero for success or a negative errno value for failure.
+ */
+static int postAMessage(int fd, struct easelcomm_kmsg_desc *kmsg_desc,
+                        const EaselComm::EaselMessage *msg,
+                        EaselCommTelemetry *telemetry)
+{
+    easelcomm_kbuf_desc buf_desc;
+
+    /*
+     * Send the kernel message descriptor, which starts the outgoing message,
+     * and read the updated descriptor with the assigned message ID.
+     */
+    if (easelcomm_ioctl(fd, EASELCOMM_IOC_SENDMSG, kmsg_desc) == -1) {
+        int err_saved = errno;
+        if (is_alog_ok()) {
+            ALOGE("%s: SENDMSG failed (%d)", __FUNCTION__, err_saved);
+        }
+        return -err_saved;
+    }
+
+    /*
+     * Fill out a kernel buffer descriptor for the message data and send
+     * to the kernel.  Note that this must happen even if the message
+     * buffer size is zero and even if no EaselMessage is supplied (to
+     * sendReply).
+     */
+    if (msg) {
+        fill_kbuf(&buf_desc, kmsg_desc->message_id, msg, KBUF_FILL_MSG);
+    } else {
+        fill_kbuf(&buf_desc, kmsg_desc->message_id, nullptr, KBUF_FILL_UNUSED);
+    }
+    if (easelcomm_ioctl(fd, EASELCOMM_IOC_WRITEDATA, &buf_desc) == -1) {
+        int err_saved = errno;
+        if (is_alog_ok()) {
+            ALOGE("%s: WRITEDATA failed (%d)", __FUNCTION__, err_saved);
+        }
+        return -err_saved;
+    }
+
+    telemetry->addMessage(EaselCommTelemetry::SENT, kmsg_desc->message_size);
+    return 0;
+}
+
+/*
+ * Helper for sending the DMA transfer of a posted message, the second half
+ * of sendAMessage().
+ *
+ * Sends the source DMA buffer descriptor.  This initiates the DMA transfer
+ * once the remote side is also ready with its destination DMA buffer
+ * descriptor (or the remote may discard the DMA transfer, in which case the
+ * transfer does not occur).  A successful call returns once the DMA transfer
+ * is completed.
+ *
+ * cache, if not null, supplies a registration of the source buffer.  The
+ * transfer is counted in telemetry.
+ *
+ * Returns zero for success or a negative errno value for failure.
+ */
+static int sendADma(int fd, easelcomm_msgid_t message_id,
+                    const EaselComm::EaselMessage *msg,
+                    EaselCommRegistrationCache *cache,
+                    EaselCommTelemetry *telemetry)
+{
+    easelcomm_kbuf_desc buf_desc;
+    EaselComm::BufferHandle handle = 0;
+
+    fill_kbuf(&buf_desc, message_id, msg, KBUF_FILL_DMA);
+    if (cache) {
+        handle = cache->acquire(fd, &buf_desc);
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    int ret = dma_ioctl(fd, EASELCOMM_IOC_SENDDMA, &buf_desc, msg);
+    int err_saved = errno;
+    auto end = std::chrono::steady_clock::now();
+    if (handle) {
+        cache->release(fd, handle);
+    }
+    if (ret == -1) {
+        if (is_alog_ok()) {
+            ALOGE("%s: SENDDMA failed (%d)", __FUNCTION__, err_saved);
+        }
+        return -err_saved;
+    }
+
+    telemetry->addDma(EaselCommTelemetry::SENT, msg->dma_buf_size,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          end - begin).count());
+    return 0;
+}
+
+/*
+ * Helper for sending a message, called for all APIs that send a message
+ * (sendMessage, sendMessageReceiveReply, sendReply).
+ *
+ * fd is the file descriptor from the EaselComm object opened for the easelcomm
+ * device.
+ *
+ * kmsg_desc is the kernel message descriptor filled out by the caller, sent
+ * to the kernel via the SENDMSG ioctl and updated by the ioctl (to add the
+ * assigned message_id).
+ *
+ * msg is the userspace-layer EaselMessage, which has the local buffer
+ * pointers for the message data and DMA source buffer (if any).  Can be NULL
+ * if there is no message supplied by the caller (that is, this is a reply with
+ * a replycode only, no accompanying message, which gets sent as a default
+ * message that includes the replycode in the kernel-layer descriptor).
+ *
+ * cache, if not null, supplies a registration of the DMA source buffer.
+ *
+ * telemetry counts the message and its DMA transfer.
+ *
+ * lane, if not null, is left once the message is posted, so the DMA
+ * transfer does not hold back messages of other lanes.
+ *
+ * Returns after the DMA transfer is complete, if a DMA transfer is requested,
+ * else returns once the message is dispatched to the remote.
+ *
+ * Returns zero for success or a negative errno value for failure.
+ * In all cases the kernel copy of the outgoing message is freed.
+ */
+static int sendAMessage(int fd, struct easelcomm_kmsg_desc *kmsg_desc,
+                        const EaselComm::EaselMessage *msg,
+                        EaselCommRegistrationCache *cache,
+                        EaselCommTelemetry *telemetry, LaneGuard *lane)
+{
+    int ret = postAMessage(fd, kmsg_desc, msg, telemetry);
+    if (lane) {
+        lane->leave();
+    }
+    if (ret) {
+        return ret;
+    }
+
+    if (msg && msg->dma_buf_size) {
+        return sendADma(fd, kmsg_desc->message_id, msg, cache, telemetry);
+    }
+
+    return 0;
+}
+
+/*
+ * Helper for sending a batch of messages with a single SENDMSGS ioctl.
+ *
+ * msgs points to count userspace-layer EaselMessages, count must not exceed
+ * EASELCOMM_MAX_BATCH_COUNT.  None of the messages may need a reply.
+ *
+ * sent returns the number of messages the kernel accepted and fully sent,
+ * including DMA transfers.
+ *
+ * cache, if not null, supplies registrations of the DMA source buffers.
+ *
+ * telemetry counts the messages sent and their DMA transfers, which are not
+ * timed individually.
+ *
+ * Returns zero for success or a negative errno value for failure.
+ * -ENOTTY with *sent == 0 means the driver does not support batched sends.
+ */
+static int sendMessageBatch(int fd, const EaselComm::EaselMessage *msgs,
+                            size_t count, size_t *sent,
+                            EaselCommRegistrationCache *cache,
+                            EaselCommTelemetry *telemetry)
+{
+    easelcomm_kmsg_batch_entry entries[EASELCOMM_MAX_BATCH_COUNT];
+    EaselComm::BufferHandle handles[EASELCOMM_MAX_BATCH_COUNT] = {};
+    easelcomm_kmsg_batch batch;
+
+    assert(count <= EASELCOMM_MAX_BATCH_COUNT);
+
+    for (size_t i = 0; i < count; i++) {
+        const EaselComm::EaselMessage *msg = &msgs[i];
+        easelcomm_kmsg_desc *kmsg_desc = &entries[i].kmsg;
+
+        kmsg_desc->message_size = msg->message_buf_size;
+        kmsg_desc->dma_buf_size = msg->dma_buf_size;
+        kmsg_desc->message_id = 0;
+        kmsg_desc->need_reply = false;
+        kmsg_desc->in_reply_to = 0;
+        kmsg_desc->replycode = 0;
+        kmsg_desc->wait.timeout_ms = msg->timeout_ms;
+
+        // Message IDs are assigned by the kernel as each entry is queued.
+        fill_kbuf(&entries[i].msg_buf, 0, msg, KBUF_FILL_MSG);
+        if (msg->dma_buf_size) {
+            fill_kbuf(&entries[i].dma_buf, 0, msg, KBUF_FILL_DMA);
+            if (cache) {
+                handles[i] = cache->acquire(fd, &entries[i].dma_buf);
+            }
+        } else {
+            fill_kbuf(&entries[i].dma_buf, 0, nullptr, KBUF_FILL_UNUSED);
+        }
+    }
+
+    batch.entries = entries;
+    batch.count = count;
+    batch.sent = 0;
+
+    int ret = easelcomm_ioctl(fd, EASELCOMM_IOC_SENDMSGS, &batch);
+    int err_saved = errno;
+    for (size_t i = 0; i < count; i++) {
+        if (handles[i]) {
+            cache->release(fd, handles[i]);
+        }
+    }
+    *sent = ret == -1 ? batch.sent : count;
+    for (size_t i = 0; i < *sent; i++) {
+        telemetry->addMessage(EaselCommTelemetry::SENT,
+                              msgs[i].message_buf_size);
+        if (msgs[i].dma_buf_size) {
+            telemetry->addUntimedDma(EaselCommTelemetry::SENT,
+                                     msgs[i].dma_buf_size);
+        }
+    }
+    return ret == -1 ? -err_saved : 0;
+}
+
+// EaselComm objects of the process, for EaselComm::dumpTelemetry().
+struct TelemetryRegistry {
+    std::mutex lock;
+    std::vector<EaselComm *> comms;  // Guarded by lock.
+};
+
+static TelemetryRegistry &telemetry_registry() {
+    static TelemetryRegistry registry;
+    return registry;
+}
+
+static bool is_credit_request(const EaselComm::EaselMessage *msg) {
+    return msg->need_reply && msg->message_buf != nullptr &&
+           msg->message_buf_size == sizeof(kCreditRequest) &&
+           memcmp(msg->message_buf, kCreditRequest,
+                  sizeof(kCreditRequest)) == 0;
+}
+
+static bool valid_priority(int priority) {
+    return priority >= 0 && priority < EaselComm::PRIORITY_COUNT;
+}
+
+static const size_t kHandshakeSignalLen = 10;
+static const int kHandshakeSeqNum = 3;
+const char *handshakeSeq[kHandshakeSeqNum] = {
+    "SYN",
+    "SYN-ACK",
+    "ACK",
+};
+
+static int composeHandshake(EaselComm::EaselMessage *msg, int seq) {
+    assert(msg != nullptr);
+    assert((seq >= 0) && (seq < kHandshakeSeqNum));
+
+    msg->message_buf = (void *)handshakeSeq[seq];
+    msg->message_buf_size = kHandshakeSignalLen;
+    msg->dma_buf = nullptr;
+    return 0;
+}
+
+static int verifyHandshake(EaselComm *comm, EaselComm::EaselMessage *msg,
+                           int seq) {
+    int ret = 0;
+
+    assert(msg != nullptr);
+    assert((seq >= 0) && (seq < kHandshakeSeqNum));
+
+    if (msg->message_buf_size < kHandshakeSignalLen) {
+        comm->releaseMessageBuffer(msg);
+        return -EINVAL;
+    }
+
+    if (strcmp((const char *)msg->message_buf, handshakeSeq[seq]) != 0) {
+        ret = -EINVAL;
+    }
+
+    comm->releaseMessageBuffer(msg);
+    return ret;
+}
+
+}  // anonymous namespace
+
+
+EaselComm::EaselComm() {
+    mEaselCommFd = -1;
+    mBatchSendSupported = true;
+    mClosed = true;
+    mAsyncDmaInFlight = 0;
+    mMaxAsyncDmaInFlight = kDefaultMaxAsyncDmaInFlight;
+    mAsyncDmaStopping = false;
+    mRxPoolEnabled = false;
+    mRxPool.resize(rx_pool_class_count());
+    mCreditWindow = 0;
+    mFlowStats = {};
+    mCreditStopping = false;
+    mCreditsToReturn = 0;
+    mServiceId = EASEL_SERVICE_SYSCTRL;
+    mServer = false;
+    mRecording = false;
+    mSpinMaxNs = 0;
+    mSpinBudgetNs = 0;
+    mSpinStats = {};
+    mRegistrationCache.reset(
+            new EaselCommRegistrationCache(kDefaultRegistrationCacheSize));
+    mTelemetry.reset(new EaselCommTelemetry());
+    mTelemetryOpened = false;
+    mLaneGate.reset(new EaselCommLaneGate());
+    pthread_rwlock_init(&mFdRwlock, nullptr);
+
+    TelemetryRegistry &registry = telemetry_registry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    registry.comms.push_back(this);
+}
+
+EaselComm::~EaselComm() {
+    {
+        TelemetryRegistry &registry = telemetry_registry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+        registry.comms.erase(std::remove(registry.comms.begin(),
+                                         registry.comms.end(), this),
+                             registry.comms.end());
+    }
+    // close() wakes up and joins the asynchronous DMA threads.
+    close();
+    stopAsyncDmaThreads();
+    stopCreditThread();
+    for (auto &freeList : mRxPool) {
+        for (void *buf : freeList) {
+            free(buf);
+        }
+    }
+    pthread_rwlock_destroy(&mFdRwlock);
+}
+
+void EaselComm::setReceiveBufferPooling(bool enable) {
+    std::lock_guard<std::mutex> lock(mRxPoolMutex);
+    mRxPoolEnabled = enable;
+}
+
+// Allocate msg->message_buf for msg->message_buf_size bytes.
+int EaselComm::allocMessageBuffer(EaselMessage *msg) {
+    int pool_class = -1;
+    void *buf = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mRxPoolMutex);
+        if (mRxPoolEnabled) {
+            pool_class = rx_pool_class_of(msg->message_buf_size);
+        }
+        if (pool_class >= 0 && !mRxPool[pool_class].empty()) {
+            buf = mRxPool[pool_class].back();
+            mRxPool[pool_class].pop_back();
+        }
+    }
+
+    if (buf == nullptr) {
+        buf = malloc(pool_class >= 0 ? rx_pool_class_size(pool_class)
+                                     : msg->message_buf_size);
+        if (buf == nullptr) {
+            return -errno;
+        }
+    }
+
+    msg->message_buf = buf;
+    msg->message_buf_pool_class = pool_class;
+    return 0;
+}
+
+// Return msg->message_buf to the pool it came from, or free it.
+void EaselComm::releaseMessageBuffer(EaselMessage *msg) {
+    if (msg->message_buf == nullptr) {
+        return;
+    }
+
+    int pool_class = msg->message_buf_pool_class;
+    void *buf = msg->message_buf;
+    msg->message_buf = nullptr;
+    msg->message_buf_pool_class = -1;
+
+    if (pool_class >= 0) {
+        std::lock_guard<std::mutex> lock(mRxPoolMutex);
+        if (mRxPool[pool_class].size() < kRxPoolMaxFreePerClass) {
+            mRxPool[pool_class].push_back(buf);
+            return;
+        }
+    }
+    free(buf);
+}
+
+// Send a message without waiting for a reply.
+int EaselComm::sendMessage(const EaselMessage *msg) {
+    takeCredits(1);
+    int ret = sendMessageUncredited(msg);
+    if (ret) {
+        returnCredits(1);
+    }
+    return ret;
+}
+
+int EaselComm::sendMessageUncredited(const EaselMessage *msg) {
+    struct easelcomm_kmsg_desc kmsg_desc;
+    int ret = 0;
+
+    kmsg_desc.message_size = msg->message_buf_size;
+    kmsg_desc.dma_buf_size = msg->dma_buf_size;
+    kmsg_desc.message_id = 0;
+    kmsg_desc.need_reply = false;
+    kmsg_desc.in_reply_to = 0;
+    kmsg_desc.replycode = 0;
+
+    if (!valid_priority(msg->priority)) {
+        return -EINVAL;
+    }
+    LaneGuard lane(mLaneGate.get(), msg->priority, mTelemetry.get());
+    uint64_t begin_ns = mRecording ? EaselCommTraceWriter::now() : 0;
+
+    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+    ret = sendAMessage(mEaselCommFd, &kmsg_desc, msg,
+                       mRegistrationCache.get(), mTelemetry.get(), &lane);
+    pthread_rwlock_unlock(&mFdRwlock);
+
+    if (ret == 0 && mRecording) {
+        recordEvent(EASELCOMM_TRACE_SEND, msg, kmsg_desc.message_id, 0, 0,
+                    begin_ns);
+    }
+    return ret;
+}
+
+// Send a batch of messages without waiting for replies.
+int EaselComm::sendMessages(const EaselMessage *msgs, size_t count,
+                            size_t *sent) {
+    size_t done = 0;
+    int ret = 0;
+
+    int priority = PRIORITY_BULK;
+    bool has_dma = false;
+    for (size_t i = 0; i < count; i++) {
+        // Replies are only waited for by sendMessageReceiveReply().
+        if (!valid_priority(msgs[i].priority) || msgs[i].need_reply) {
+            if (sent != nullptr) {
+                *sent = 0;
+            }
+            return -EINVAL;
+        }
+        priority = std::min<int>(priority, msgs[i].priority);
+        has_dma |= msgs[i].dma_buf_size != 0;
+    }
+    LaneGuard lane(mLaneGate.get(), priority, mTelemetry.get());
+    if (has_dma) {
+        /*
+         * SENDMSGS returns only once the DMA transfers of the batch are done,
+         * so such a batch waits for its turn but does not hold back other
+         * lanes while sending.
+         */
+        lane.leave();
+    }
+    takeCredits(count);
+    uint64_t begin_ns = mRecording ? EaselCommTraceWriter::now() : 0;
+
+    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+    while (done < count && mBatchSendSupported) {
+        size_t chunk = count - done;
+        if (chunk > EASELCOMM_MAX_BATCH_COUNT) {
+            chunk = EASELCOMM_MAX_BATCH_COUNT;
+        }
+
+        size_t chunk_sent = 0;
+        ret = sendMessageBatch(mEaselCommFd, &msgs[done], chunk, &chunk_sent,
+                               mRegistrationCache.get(), mTelemetry.get());
+        done += chunk_sent;
+        if (ret == 0) {
+            continue;
+        }
+        if (ret == -ENOTTY && chunk_sent == 0) {
+            // Older driver without SENDMSGS, fall back to per-message sends.
+            if (is_alog_ok()) {
+                ALOGI("%s: SENDMSGS not supported, sending one by one",
+                      __FUNCTION__);
+            }
+            mBatchSendSupported = false;
+            ret = 0;
+            break;
+        }
+        if (is_alog_ok()) {
+            ALOGE("%s: SENDMSGS failed (%d)", __FUNCTION__, -ret);
+        }
+        break;
+    }
+
+    while (ret == 0 && done < count) {
+        struct easelcomm_kmsg_desc kmsg_desc;
+
+        kmsg_desc.message_size = msgs[done].message_buf_size;
+        kmsg_desc.dma_buf_size = msgs[done].dma_buf_size;
+        kmsg_desc.message_id = 0;
+        kmsg_desc.need_reply = false;
+        kmsg_desc.in_reply_to = 0;
+        kmsg_desc.replycode = 0;
+
+        ret = sendAMessage(mEaselCommFd, &kmsg_desc, &msgs[done],
+                           mRegistrationCache.get(), mTelemetry.get(),
+                           nullptr);
+        if (ret == 0) {
+            done++;
+        }
+    }
+    pthread_rwlock_unlock(&mFdRwlock);
+    returnCredits(count - done);
+
+    if (mRecording) {
+        // Message IDs of a batch are not returned by the driver.
+        for (size_t i = 0; i < done; i++) {
+            recordEvent(EASELCOMM_TRACE_SEND, &msgs[i], 0, 0, 0, begin_ns);
+        }
+    }
+
+    if (sent != nullptr) {
+        *sent = done;
+    }
+    return ret;
+}
+
+// Send a message and queue its DMA transfer, if any, to a sender thread.
+int EaselComm::sendMessageAsync(const EaselMessage *msg,
+                                SendCompletion completion) {
+    struct easelcomm_kmsg_desc kmsg_desc;
+    int ret = 0;
+
+    if (!valid_priority(msg->priority)) {
+        return -EINVAL;
+    }
+
+    if (msg->dma_buf_size) {
+        // Reserve a slot before posting so the DMA can always be queued.
+        std::unique_lock<std::mutex> lock(mAsyncDmaMutex);
+        mAsyncDmaCond.wait(lock, [&] {
+            return mAsyncDmaInFlight < mMaxAsyncDmaInFlight;
+        });
+        mAsyncDmaInFlight++;
+    }
+
+    kmsg_desc.message_size = msg->message_buf_size;
+    kmsg_desc.dma_buf_size = msg->dma_buf_size;
+    kmsg_desc.message_id = 0;
+    kmsg_desc.need_reply = false;
+    kmsg_desc.in_reply_to = 0;
+    kmsg_desc.replycode = 0;
+
+    takeCredits(1);
+    uint64_t begin_ns = mRecording ? EaselCommTraceWriter::now() : 0;
+    {
+        LaneGuard lane(mLaneGate.get(), msg->priority, mTelemetry.get());
+        pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+        ret = postAMessage(mEaselCommFd, &kmsg_desc, msg, mTelemetry.get());
+        pthread_rwlock_unlock(&mFdRwlock);
+    }
+    if (ret) {
+        returnCredits(1);
+    } else if (mRecording) {
+        recordEvent(EASELCOMM_TRACE_SEND, msg, kmsg_desc.message_id, 0, 0,
+                    begin_ns);
+    }
+
+    if (msg->dma_buf_size == 0) {
+        if (ret == 0 && completion) {
+            completion(0);
+        }
+        return ret;
+    }
+
+    std::lock_guard<std::mutex> lock(mAsyncDmaMutex);
+    if (ret) {
+        mAsyncDmaInFlight--;
+        mAsyncDmaCond.notify_all();
+        return ret;
+    }
+
+    mAsyncDmaQueue.push_back({kmsg_desc.message_id, *msg, completion});
+    // Start sender threads lazily, one per outstanding transfer.
+    if (mAsyncDmaThreads.size() < mAsyncDmaInFlight) {
+        mAsyncDmaStopping = false;
+        mAsyncDmaThreads.emplace_back(&EaselComm::asyncDmaThreadLoop, this);
+    }
+    mAsyncDmaCond.notify_all();
+    return 0;
+}
+
+std::future<int> EaselComm::sendMessageAsync(const EaselMessage *msg) {
+    auto promise = std::make_shared<std::promise<int>>();
+    std::future<int> future = promise->get_future();
+
+    int ret = sendMessageAsync(msg, [promise](int result) {
+        promise->set_value(result);
+    });
+    if (ret) {
+        promise->set_value(ret);
+    }
+    return future;
+}
+
+void EaselComm::setMaxAsyncDmaInFlight(size_t max) {
+    assert(max > 0);
+    std::lock_guard<std::mutex> lock(mAsyncDmaMutex);
+    mMaxAsyncDmaInFlight = max;
+    mAsyncDmaCond.notify_all();
+}
+
+size_t EaselComm::getMaxAsyncDmaInFlight() {
+    std::lock_guard<std::mutex> lock(mAsyncDmaMutex);
+    return mMaxAsyncDmaInFlight;
+}
+
+void EaselComm::setSendCredits(size_t window) {
+    std::lock_guard<std::mutex> lock(mCreditMutex);
+    mCreditWindow = window;
+    mFlowStats.outstanding = 0;
+    if (window == 0) {
+        mFlowStats.dropped += mCoalesced.size();
+        mCoalesced.clear();
+    } else if (!mCreditThread.joinable()) {
+        mCreditStopping = false;
+        mCreditThread = std::thread(&EaselComm::creditThreadLoop, this);
+    }
+    mCreditCond.notify_all();
+}
+
+void EaselComm::takeCredits(size_t count) {
+    if (mCreditWindow == 0 || count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mCreditMutex);
+    mFlowStats.outstanding += count;
+    mCreditCond.notify_all();
+}
+
+void EaselComm::returnCredits(size_t count) {
+    if (mCreditWindow == 0 || count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mCreditMutex);
+    mFlowStats.outstanding -= std::min(mFlowStats.outstanding, count);
+}
+
+int EaselComm::trySendMessage(const EaselMessage *msg, int coalesce_key) {
+    if (coalesce_key >= 0 && msg->dma_buf_size) {
+        return -EINVAL;
+    }
+
+    std::unique_lock<std::mutex> lock(mCreditMutex);
+    size_t window = mCreditWindow;
+    if (window > 0 && mFlowStats.outstanding >= window) {
+        mFlowStats.throttled++;
+        if (coalesce_key < 0) {
+            mFlowStats.dropped++;
+            return -EAGAIN;
+        }
+
+        auto queued = std::find_if(
+            mCoalesced.begin(), mCoalesced.end(),
+            [&](const CoalescedMessage &m) { return m.key == coalesce_key; });
+        if (queued == mCoalesced.end()) {
+            queued = mCoalesced.insert(mCoalesced.end(), CoalescedMessage());
+            queued->key = coalesce_key;
+            mFlowStats.coalesced++;
+        } else {
+            mFlowStats.dropped++;
+        }
+        const char *buf = static_cast<const char *>(msg->message_buf);
+        queued->msg = *msg;
+        queued->buf.assign(buf, buf + msg->message_buf_size);
+        return 0;
+    }
+
+    if (window > 0) {
+        mFlowStats.outstanding++;
+        mCreditCond.notify_all();
+    }
+    lock.unlock();
+
+    int ret = sendMessageUncredited(msg);
+    if (ret && window > 0) {
+        returnCredits(1);
+    }
+    return ret;
+}
+
+void EaselComm::getFlowStats(FlowStats *stats) {
+    std::lock_guard<std::mutex> lock(mCreditMutex);
+    *stats = mFlowStats;
+    stats->window = mCreditWindow;
+}
+
+void EaselComm::creditThreadLoop() {
+    std::unique_lock<std::mutex> lock(mCreditMutex);
+    while (1) {
+        // Ask for credits once half the window is outstanding.
+        mCreditCond.wait(lock, [&] {
+            size_t window = mCreditWindow;
+            return mCreditStopping ||
+                   (window > 0 && mFlowStats.outstanding >= (window + 1) / 2);
+        });
+        if (mCreditStopping) {
+            return;
+        }
+        lock.unlock();
+
+        EaselMessage request;
+        request.message_buf = const_cast<char *>(kCreditRequest);
+        request.message_buf_size = sizeof(kCreditRequest);
+        request.need_reply = true;
+        request.timeout_ms = kCreditRequestTimeoutMs;
+        request.priority = PRIORITY_CONTROL;
+        int credits = 0;
+        int ret = sendMessageReceiveReplyImpl(&request, &credits, nullptr,
+                                              /*take_credit=*/false);
+
+        lock.lock();
+        if (ret || credits <= 0) {
+            mCreditCond.wait_for(
+                lock, ret ? kCreditRetryInterval : kCreditPollInterval,
+                [&] { return mCreditStopping; });
+            continue;
+        }
+        mFlowStats.outstanding -=
+            std::min(mFlowStats.outstanding, static_cast<size_t>(credits));
+
+        // Spend the returned credits on coalesced messages, oldest first.
+        while (!mCreditStopping && !mCoalesced.empty() &&
+               mFlowStats.outstanding < mCreditWindow) {
+            CoalescedMessage queued = std::move(mCoalesced.front());
+            mCoalesced.pop_front();
+            mFlowStats.outstanding++;
+            lock.unlock();
+
+            queued.msg.message_buf = queued.buf.data();
+            ret = sendMessageUncredited(&queued.msg);
+
+            lock.lock();
+            if (ret) {
+                mFlowStats.outstanding -= std::min<size_t>(
+                    mFlowStats.outstanding, 1);
+                mFlowStats.dropped++;
+            }
+        }
+    }
+}
+
+void EaselComm::stopCreditThread() {
+    {
+        std::lock_guard<std::mutex> lock(mCreditMutex);
+        mCreditStopping = true;
+        mCreditCond.notify_all();
+    }
+    if (mCreditThread.joinable()) {
+        mCreditThread.join();
+    }
+}
+
+int EaselComm::registerBuffer(int buf_type, void *buf, int dma_buf_fd,
+                              size_t size, BufferHandle *handle) {
+    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+    int ret = mEaselCommFd < 0 ? -ESHUTDOWN :
+            mRegistrationCache->registerBuffer(mEaselCommFd, buf_type, buf,
+                                               dma_buf_fd, size, handle);
+    pthread_rwlock_unlock(&mFdRwlock);
+    return ret;
+}
+
+int EaselComm::unregisterBuffer(BufferHandle handle) {
+    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+    int ret = mRegistrationCache->unregisterBuffer(mEaselCommFd, handle);
+    pthread_rwlock_unlock(&mFdRwlock);
+    return ret;
+}
+
+void EaselComm::setRegistrationCacheSize(size_t entries) {
+    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+    mRegistrationCache->setCapacity(mEaselCommFd, entries);
+    pthread_rwlock_unlock(&mFdRwlock);
+}
 
-    switch (fill_type) {
-        case KBUF_FILL_MSG:
-            buf_desc->buf = msg->message_buf;
-            buf_desc->dma_buf_fd = msg->dma_buf_fd;
-            buf_desc->buf_type = msg->dma_buf_type;
-            buf_desc->buf_size = msg->message_buf_size;
-            break;
-        case KBUF_FILL_DMA:
-            buf_desc->buf = msg->dma_buf;
-            buf_desc->dma_buf_fd = msg->dma_buf_fd;
-            buf_desc->buf_type = msg->dma_buf_type;
-            buf_desc->buf_size = msg->dma_buf_size;
-            break;
-    }
+void EaselComm::getRegistrationStats(RegistrationStats *stats) {
+    mRegistrationCache->getStats(stats);
 }
 
-/*
- * If ALOG* is called inside sendAMessage(), on Easel side it might be calling
- * sendAMessage() again by liblog, creating an infinite loop.
- * Only print ALOG* on the client side or when the server is not sending the
- * log back to AP logcat.
- */
-static bool is_alog_ok(void) {
-    return is_easelcomm_client() || !is_server_logging_to_logcat();
+void EaselComm::setSpinWait(uint32_t max_spin_us) {
+    std::lock_guard<std::mutex> lock(mSpinMutex);
+    mSpinMaxNs = static_cast<uint64_t>(max_spin_us) * 1000;
+    mSpinBudgetNs = mSpinMaxNs;
 }
 
-/*
- * Helper for sending a message, called for all APIs that send a message
- * (sendMessage, sendMessageReceiveReply, sendReply).
- *
- * fd is the file descriptor from the EaselComm object opened for the easelcomm
- * device.
- *
- * kmsg_desc is the kernel message descriptor filled out by the caller, sent
- * to the kernel via the SENDMSG ioctl and updated by the ioctl (to add the
- * assigned message_id).
- *
- * msg is the userspace-layer EaselMessage, which has the local buffer
- * pointers for the message data and DMA source buffer (if any).  Can be NULL
- * if there is no message supplied by the caller (that is, this is a reply with
- * a replycode only, no accompanying message, which gets sent as a default
- * message that includes the replycode in the kernel-layer descriptor).
- *
- * Returns after the DMA transfer is complete, if a DMA transfer is requested,
- * else returns once the message is dispatched to the remote.
- *
- * Returns zero for success or a negative errno value for failure.
- * In all cases the kernel copy of the outgoing message is freed.
- */
-static int sendAMessage(int fd, struct easelcomm_kmsg_desc *kmsg_desc,
-                        const EaselComm::EaselMessage *msg)
-{
-    easelcomm_kbuf_desc buf_desc;
+void EaselComm::getSpinWaitStats(SpinWaitStats *stats) {
+    std::lock_guard<std::mutex> lock(mSpinMutex);
+    *stats = mSpinStats;
+    stats->budget_us = mSpinBudgetNs / 1000;
+}
 
-    /*
-     * Send the kernel message descriptor, which starts the outgoing message,
-     * and read the updated descriptor with the assigned message ID.
-     */
-    if (ioctl(fd, EASELCOMM_IOC_SENDMSG, kmsg_desc) == -1) {
-        int err_saved = errno;
-        if (is_alog_ok()) {
-            ALOGE("%s: SENDMSG failed (%d)", __FUNCTION__, err_saved);
-        }
-        return -err_saved;
+int EaselComm::waitMessageIoctl(easelcomm_kmsg_desc *kmsg_desc) {
+    uint64_t max_ns, budget_ns;
+    {
+        std::lock_guard<std::mutex> lock(mSpinMutex);
+        max_ns = mSpinMaxNs;
+        budget_ns = mSpinBudgetNs;
+    }
+    int32_t timeout_ms = kmsg_desc->wait.timeout_ms;
+    if (max_ns == 0 || timeout_ms == 0) {
+        return easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_WAITMSG, kmsg_desc);
     }
 
-    /*
-     * Fill out a kernel buffer descriptor for the message data and send
-     * to the kernel.  Note that this must happen even if the message
-     * buffer size is zero and even if no EaselMessage is supplied (to
-     * sendReply).
-     */
-    if (msg) {
-        fill_kbuf(&buf_desc, kmsg_desc->message_id, msg, KBUF_FILL_MSG);
-    } else {
-        fill_kbuf(&buf_desc, kmsg_desc->message_id, nullptr, KBUF_FILL_UNUSED);
+    auto begin = std::chrono::steady_clock::now();
+    auto spin_end = begin + std::chrono::nanoseconds(budget_ns);
+    auto now = begin;
+    int ret;
+    bool spun = false;
+
+    // Poll with non-blocking waits until the budget runs out.
+    easelcomm_wait wait = kmsg_desc->wait;
+    while (now < spin_end) {
+        kmsg_desc->wait.timeout_ms = 0;
+        ret = easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_WAITMSG, kmsg_desc);
+        now = std::chrono::steady_clock::now();
+        if (ret == 0 || errno != ETIMEDOUT) {
+            spun = true;
+            break;
+        }
     }
-    if (ioctl(fd, EASELCOMM_IOC_WRITEDATA, &buf_desc) == -1) {
-        int err_saved = errno;
-        if (is_alog_ok()) {
-            ALOGE("%s: WRITEDATA failed (%d)", __FUNCTION__, err_saved);
+    auto block_begin = now;
+
+    if (!spun) {
+        // Block for what is left of the caller's timeout.
+        if (timeout_ms > 0) {
+            auto spun_ms = std::chrono::duration_cast<
+                    std::chrono::milliseconds>(now - begin).count();
+            kmsg_desc->wait.timeout_ms =
+                    std::max<int32_t>(timeout_ms - spun_ms, 1);
+        } else {
+            kmsg_desc->wait = wait;
         }
-        return -err_saved;
+        ret = easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_WAITMSG, kmsg_desc);
+        now = std::chrono::steady_clock::now();
     }
+    int err_saved = errno;
+    kmsg_desc->wait = wait;
 
-    /*
-     * If the message includes a DMA transfer then send the source DMA buffer
-     * descriptor.  This initiates the DMA transfer once the remote side is
-     * also ready with its destination DMA buffer descriptor (or the remote
-     * may discard the DMA transfer, in which case the transfer does not occur).
-     * A successful call returns once the DMA transfer is completed.
-     */
-    if (msg && msg->dma_buf_size) {
-        fill_kbuf(&buf_desc, kmsg_desc->message_id, msg, KBUF_FILL_DMA);
-
-        if (ioctl(fd, EASELCOMM_IOC_SENDDMA, &buf_desc) == -1) {
-            int err_saved = errno;
-            if (is_alog_ok()) {
-                ALOGE("%s: SENDDMA failed (%d)", __FUNCTION__, err_saved);
+    uint64_t spin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            block_begin - begin).count();
+    uint64_t block_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - block_begin).count();
+    {
+        std::lock_guard<std::mutex> lock(mSpinMutex);
+        mSpinStats.spin_ns += spin_ns;
+        mSpinStats.block_ns += block_ns;
+        if (ret == 0) {
+            if (spun) {
+                mSpinStats.spin_wakeups++;
+            } else {
+                mSpinStats.blocked_wakeups++;
             }
-            return -err_saved;
+        }
+
+        /*
+         * Grow the budget to twice a wait that spinning caught or could have
+         * caught, and halve it after a wait too long to spin through.
+         */
+        uint64_t waited_ns = spin_ns + block_ns;
+        if (ret == 0 && spun) {
+            mSpinBudgetNs = std::min(mSpinMaxNs,
+                                     std::max(mSpinBudgetNs, 2 * waited_ns));
+        } else if (ret == 0 && waited_ns <= mSpinMaxNs) {
+            mSpinBudgetNs = std::min(mSpinMaxNs, 2 * waited_ns);
+        } else {
+            mSpinBudgetNs /= 2;
         }
     }
 
-    return 0;
+    errno = err_saved;
+    return ret;
 }
 
-static const size_t kHandshakeSignalLen = 10;
-static const int kHandshakeSeqNum = 3;
-const char *handshakeSeq[kHandshakeSeqNum] = {
-    "SYN",
-    "SYN-ACK",
-    "ACK",
-};
+int EaselComm::startRecording(const char *path, bool payloads) {
+    int ret = mTrace.open(path, payloads);
+    if (ret == 0) {
+        mRecording = true;
+    }
+    return ret;
+}
 
-static int composeHandshake(EaselComm::EaselMessage *msg, int seq) {
-    assert(msg != nullptr);
-    assert((seq >= 0) && (seq < kHandshakeSeqNum));
+void EaselComm::stopRecording() {
+    mRecording = false;
+    mTrace.close();
+}
 
-    msg->message_buf = (void *)handshakeSeq[seq];
-    msg->message_buf_size = kHandshakeSignalLen;
-    msg->dma_buf = nullptr;
-    return 0;
+void EaselComm::startRecordingFromEnv() {
+    std::string dir = get_env(kRecordDirEnv);
+    if (dir.empty() || mRecording) {
+        return;
+    }
+    std::string path = dir + "/easelcomm-" + std::to_string(mServiceId) +
+            (mServer ? "-server-" : "-client-") + std::to_string(getpid()) +
+            ".trace";
+    int ret = startRecording(path.c_str(),
+                             get_env(kRecordPayloadsEnv) == "1");
+    if (ret) {
+        ALOGE("%s: Failed to record to %s (%d)", __FUNCTION__, path.c_str(),
+              ret);
+    }
 }
 
-static int verifyHandshake(EaselComm::EaselMessage *msg, int seq) {
-    int ret = 0;
+void EaselComm::recordEvent(int event, const EaselMessage *msg,
+                            easelcomm_msgid_t message_id,
+                            easelcomm_msgid_t in_reply_to, int replycode,
+                            uint64_t time_ns) {
+    EaselCommTraceRecord record = {};
+    const void *data = nullptr;
+
+    record.message_id = message_id;
+    record.in_reply_to = in_reply_to;
+    record.replycode = replycode;
+    record.service_id = mServiceId;
+    record.event = event;
+    record.flags = mServer ? EASELCOMM_TRACE_SERVER : 0;
+    if (msg) {
+        record.message_size = msg->message_buf_size;
+        record.dma_size = msg->dma_buf_size;
+        if (msg->need_reply) {
+            record.flags |= EASELCOMM_TRACE_NEED_REPLY;
+        }
+        data = msg->message_buf;
+    }
+    mTrace.write(&record, data, time_ns);
+}
 
-    assert(msg != nullptr);
-    assert((seq >= 0) && (seq < kHandshakeSeqNum));
+void EaselComm::getTelemetry(Telemetry *telemetry) {
+    mTelemetry->getTelemetry(telemetry);
+    telemetry->service_id = mServiceId;
+    telemetry->server = mServer;
+    telemetry->connected = isConnected();
+}
 
-    if (msg->message_buf_size < kHandshakeSignalLen) {
-        free(msg->message_buf);
-        return -EINVAL;
-    }
+void EaselComm::resetTelemetry() {
+    mTelemetry->reset();
+}
 
-    if (strcmp((const char *)msg->message_buf, handshakeSeq[seq]) != 0) {
-        ret = -EINVAL;
+void EaselComm::dumpTelemetry(int fd) {
+    TelemetryRegistry &registry = telemetry_registry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    dprintf(fd, "EaselComm telemetry of pid %d:\n", getpid());
+    for (EaselComm *comm : registry.comms) {
+        if (!comm->mTelemetryOpened) {
+            continue;
+        }
+        Telemetry telemetry;
+        comm->getTelemetry(&telemetry);
+        EaselCommTelemetry::dump(fd, telemetry);
     }
+}
 
-    free(msg->message_buf);
-    return ret;
+void EaselComm::getLaneStats(Priority priority, LaneStats *stats) {
+    assert(valid_priority(priority));
+    mLaneGate->getStats(priority, stats);
 }
 
-}  // anonymous namespace
+void EaselComm::asyncDmaThreadLoop() {
+    while (1) {
+        AsyncDma dma;
+        {
+            std::unique_lock<std::mutex> lock(mAsyncDmaMutex);
+            mAsyncDmaCond.wait(lock, [&] {
+                return mAsyncDmaStopping || !mAsyncDmaQueue.empty();
+            });
+            if (mAsyncDmaQueue.empty()) {
+                return;
+            }
+            dma = std::move(mAsyncDmaQueue.front());
+            mAsyncDmaQueue.pop_front();
+        }
 
+        /*
+         * The message is already posted and the remote may be waiting for
+         * this transfer, so it is not held back for other lanes.
+         */
+        pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+        int ret = sendADma(mEaselCommFd, dma.message_id, &dma.msg,
+                           mRegistrationCache.get(), mTelemetry.get());
+        pthread_rwlock_unlock(&mFdRwlock);
 
-EaselComm::EaselComm() {
-    mEaselCommFd = -1;
-    mClosed = true;
-    pthread_rwlock_init(&mFdRwlock, nullptr);
-}
+        if (dma.completion) {
+            dma.completion(ret);
+        }
 
-EaselComm::~EaselComm() {
-    close();
-    pthread_rwlock_destroy(&mFdRwlock);
+        std::lock_guard<std::mutex> lock(mAsyncDmaMutex);
+        mAsyncDmaInFlight--;
+        mAsyncDmaCond.notify_all();
+    }
 }
 
-// Send a message without waiting for a reply.
-int EaselComm::sendMessage(const EaselMessage *msg) {
-    struct easelcomm_kmsg_desc kmsg_desc;
-    int ret = 0;
-
-    kmsg_desc.message_size = msg->message_buf_size;
-    kmsg_desc.dma_buf_size = msg->dma_buf_size;
-    kmsg_desc.message_id = 0;
-    kmsg_desc.need_reply = false;
-    kmsg_desc.in_reply_to = 0;
-    kmsg_desc.replycode = 0;
+void EaselComm::stopAsyncDmaThreads() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mAsyncDmaMutex);
+        mAsyncDmaStopping = true;
+        threads.swap(mAsyncDmaThreads);
+        mAsyncDmaCond.notify_all();
+    }
 
-    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
-    ret = sendAMessage(mEaselCommFd, &kmsg_desc, msg);
-    pthread_rwlock_unlock(&mFdRwlock);
-    return ret;
+    for (auto &thread : threads) {
+        // A completion may close this object from a DMA thread.
+        if (thread.get_id() == std::this_thread::get_id()) {
+            thread.detach();
+        } else {
+            thread.join();
+        }
+    }
 }
 
 // Send a message and wait for a reply.
 int EaselComm::sendMessageReceiveReply(
     const EaselMessage *msg, int *replycode, EaselMessage *reply) {
+    return sendMessageReceiveReplyImpl(msg, replycode, reply,
+                                       /*take_credit=*/true);
+}
+
+int EaselComm::sendMessageReceiveReplyImpl(
+    const EaselMessage *msg, int *replycode, EaselMessage *reply,
+    bool take_credit) {
     struct easelcomm_kmsg_desc kmsg_desc;
     struct easelcomm_kbuf_desc buf_desc;
     int ret;
@@ -279,11 +1431,33 @@ int EaselComm::sendMessageReceiveReply(
     // Wait for timeout_ms
     kmsg_desc.wait.timeout_ms = msg->timeout_ms;
 
-    pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
-    ret = sendAMessage(mEaselCommFd, &kmsg_desc, msg);
-    pthread_rwlock_unlock(&mFdRwlock);
-    if (ret)
+    if (!valid_priority(msg->priority)) {
+        return -EINVAL;
+    }
+
+    if (take_credit) {
+        takeCredits(1);
+    }
+    bool record = mRecording && !is_credit_request(msg);
+    uint64_t begin_ns = record ? EaselCommTraceWriter::now() : 0;
+    auto sent = std::chrono::steady_clock::now();
+    {
+        LaneGuard lane(mLaneGate.get(), msg->priority, mTelemetry.get());
+        pthread_rwlock_rdlock(&mFdRwlock);   // Acquire rwlock as a reader
+        ret = sendAMessage(mEaselCommFd, &kmsg_desc, msg,
+                           mRegistrationCache.get(), mTelemetry.get(), &lane);
+        pthread_rwlock_unlock(&mFdRwlock);
+    }
+    if (ret) {
+        if (take_credit) {
+            returnCredits(1);
+        }
         return ret;
+    }
+    easelcomm_msgid_t message_id = kmsg_desc.message_id;
+    if (record) {
+        recordEvent(EASELCOMM_TRACE_SEND, msg, message_id, 0, 0, begin_ns);
+    }
 
     /*
      * Wait for and return the reply message descriptor.  If the remote
@@ -291,10 +1465,19 @@ int EaselComm::sendMessageReceiveReply(
      * zero-lenth message data and no DMA transfer is returned, with the
      * remote's replycode.
      */
-    if (ioctl(mEaselCommFd, EASELCOMM_IOC_WAITREPLY, &kmsg_desc) == -1) {
+    if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_WAITREPLY,
+                        &kmsg_desc) == -1) {
         ALOGE("%s: WAITREPLY failed (%d)", __FUNCTION__, errno);
         return -errno;
     }
+    if (take_credit) {
+        // Credit requests are left out, they wait for remote to receive.
+        mTelemetry->addReply(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - sent).count());
+    }
+    mTelemetry->addMessage(EaselCommTelemetry::RECEIVED,
+                           kmsg_desc.message_size);
 
     // Acquire rwlock as a reader; WAITREPLY does not need to acquire rdlock
     pthread_rwlock_rdlock(&mFdRwlock);
@@ -316,9 +1499,8 @@ int EaselComm::sendMessageReceiveReply(
         assert(reply->need_reply == false);
 
         if (reply->message_buf_size) {
-            reply->message_buf = malloc(reply->message_buf_size);
-            if (reply->message_buf == nullptr) {
-                ret = -errno;
+            ret = allocMessageBuffer(reply);
+            if (ret) {
                 pthread_rwlock_unlock(&mFdRwlock);
                 return ret;
             }
@@ -326,11 +1508,11 @@ int EaselComm::sendMessageReceiveReply(
             fill_kbuf(&buf_desc, reply->message_id, reply, KBUF_FILL_MSG);
 
 
-            if (ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA, &buf_desc) == -1) {
+            if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA,
+                                &buf_desc) == -1) {
                 ALOGE("%s: READDATA failed (%d)", __FUNCTION__, errno);
-                free(reply->message_buf);
-                reply->message_buf = nullptr;
                 ret = -errno;
+                releaseMessageBuffer(reply);
             }
         }
     } else {
@@ -343,13 +1525,15 @@ int EaselComm::sendMessageReceiveReply(
             ret = -EIO;
         fill_kbuf(&buf_desc, kmsg_desc.message_id, nullptr, KBUF_FILL_UNUSED);
 
-        if (ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA, &buf_desc) == -1) {
+        if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA,
+                            &buf_desc) == -1) {
             ALOGE("%s: READDATA failed (%d)", __FUNCTION__, errno);
             pthread_rwlock_unlock(&mFdRwlock);
             return -errno;
         }
         if (kmsg_desc.dma_buf_size) {
-            if (ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA, &buf_desc) == -1) {
+            if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA,
+                                &buf_desc) == -1) {
                 ALOGE("%s: RECVDMA failed (%d)", __FUNCTION__, errno);
                 pthread_rwlock_unlock(&mFdRwlock);
                 return -errno;
@@ -358,12 +1542,45 @@ int EaselComm::sendMessageReceiveReply(
     }
     pthread_rwlock_unlock(&mFdRwlock);
 
+    if (record) {
+        EaselMessage recorded;
+        recorded.message_buf = (ret == 0 && reply) ? reply->message_buf
+                                                   : nullptr;
+        recorded.message_buf_size = kmsg_desc.message_size;
+        recorded.dma_buf_size = kmsg_desc.dma_buf_size;
+        recordEvent(EASELCOMM_TRACE_REPLY_RECEIVE, &recorded,
+                    kmsg_desc.message_id, message_id, kmsg_desc.replycode, 0);
+    }
+
     *replycode = kmsg_desc.replycode;
     return ret;
 }
 
 // Wait for and return next incoming Easel Message.
 int EaselComm::receiveMessage(EaselMessage *msg) {
+    while (1) {
+        int ret = receiveAMessage(msg);
+        if (ret) {
+            return ret;
+        }
+        if (!is_credit_request(msg)) {
+            mCreditsToReturn++;
+            if (mRecording) {
+                recordEvent(EASELCOMM_TRACE_RECEIVE, msg, msg->message_id, 0,
+                            0, 0);
+            }
+            return 0;
+        }
+
+        // Return the credits of the messages received since the last request.
+        int credits = mCreditsToReturn.exchange(0);
+        sendReply(msg, credits, nullptr);
+        releaseMessageBuffer(msg);
+    }
+}
+
+// Wait for and return next incoming Easel Message or credit request.
+int EaselComm::receiveAMessage(EaselMessage *msg) {
     struct easelcomm_kmsg_desc kmsg_desc;
     struct easelcomm_kbuf_desc buf_desc;
     int ret = 0;
@@ -376,7 +1593,7 @@ int EaselComm::receiveMessage(EaselMessage *msg) {
 
     // Wait for timeout_ms
     kmsg_desc.wait.timeout_ms = msg->timeout_ms;
-    if (ioctl(mEaselCommFd, EASELCOMM_IOC_WAITMSG, &kmsg_desc) == -1) {
+    if (waitMessageIoctl(&kmsg_desc) == -1) {
         /*
          * If close() method was called by another thread in parallel the
          * fd may be invalid.  Treat the same as evicting a WAITMSG waiter and
@@ -396,11 +1613,12 @@ int EaselComm::receiveMessage(EaselMessage *msg) {
     msg->dma_buf_size = kmsg_desc.dma_buf_size;
     msg->message_id = kmsg_desc.message_id;
     msg->need_reply = kmsg_desc.need_reply;
+    mTelemetry->addMessage(EaselCommTelemetry::RECEIVED,
+                           kmsg_desc.message_size);
 
     if (kmsg_desc.message_size) {
-        msg->message_buf = malloc(msg->message_buf_size);
-        if (msg->message_buf == nullptr) {
-            ret = -errno;
+        ret = allocMessageBuffer(msg);
+        if (ret) {
             return ret;
         }
     }
@@ -408,11 +1626,11 @@ int EaselComm::receiveMessage(EaselMessage *msg) {
     fill_kbuf(&buf_desc, msg->message_id, msg, KBUF_FILL_MSG);
     // Acquire rwlock as a reader; WAITMSG does not need to acquire rdlock
     pthread_rwlock_rdlock(&mFdRwlock);
-    if (ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA, &buf_desc) == -1) {
+    if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_READDATA,
+                        &buf_desc) == -1) {
         ALOGE("%s: READDATA failed (%d)", __FUNCTION__, errno);
         ret = -errno;
-        free(msg->message_buf);
-        msg->message_buf = nullptr;
+        releaseMessageBuffer(msg);
         msg->message_buf_size = 0;
     }
 
@@ -422,7 +1640,8 @@ int EaselComm::receiveMessage(EaselMessage *msg) {
      */
     if (ret && kmsg_desc.dma_buf_size) {
         fill_kbuf(&buf_desc, kmsg_desc.message_id, nullptr, KBUF_FILL_UNUSED);
-        if (ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA, &buf_desc) == -1) {
+        if (easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA,
+                            &buf_desc) == -1) {
             ALOGE("%s: RECVDMA failed (%d)", __FUNCTION__, errno);
         }
         msg->dma_buf_size = 0;
@@ -453,9 +1672,25 @@ int EaselComm::sendReply(EaselMessage *origmessage, int replycode,
         kmsg_desc.dma_buf_size = 0;
     }
 
+    int priority = replymessage ? replymessage->priority
+                                : PRIORITY_LATENCY_SENSITIVE;
+    if (!valid_priority(priority)) {
+        return -EINVAL;
+    }
+    LaneGuard lane(mLaneGate.get(), priority, mTelemetry.get());
+    bool record = mRecording && !is_credit_request(origmessage);
+    uint64_t begin_ns = record ? EaselCommTraceWriter::now() : 0;
+
     pthread_rwlock_rdlock(&mFdRwlock);
-    ret = sendAMessage(mEaselCommFd, &kmsg_desc, replymessage);
+    ret = sendAMessage(mEaselCommFd, &kmsg_desc, replymessage,
+                       mRegistrationCache.get(), mTelemetry.get(), &lane);
     pthread_rwlock_unlock(&mFdRwlock);
+
+    if (ret == 0 && record) {
+        recordEvent(EASELCOMM_TRACE_REPLY_SEND, replymessage,
+                    kmsg_desc.message_id, origmessage->message_id, replycode,
+                    begin_ns);
+    }
     return ret;
 }
 
@@ -463,14 +1698,11 @@ int EaselComm::sendReply(EaselMessage *origmessage, int replycode,
 // Returns 0 on success, -errno on EASELCOMM_IOC_RECVDMA failure
 int EaselComm::receiveDMAImpl(const EaselMessage *msg, bool cancel) {
     struct easelcomm_kbuf_desc buf_desc;
+    BufferHandle handle = 0;
 
 #ifdef PROFILE_DMA
     ALOGD("%s: receiveDMA begin, size=%zu",
           __FUNCTION__, msg->dma_buf_size);
-
-    struct timespec begin, end;
-    long diff_us;
-    clock_gettime(CLOCK_MONOTONIC, &begin);
 #endif
 
     if (cancel) {
@@ -482,19 +1714,33 @@ int EaselComm::receiveDMAImpl(const EaselMessage *msg, bool cancel) {
 
     // Acquire rwlock as a reader
     pthread_rwlock_rdlock(&mFdRwlock);
-    if (ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA, &buf_desc) == -1) {
-        pthread_rwlock_unlock(&mFdRwlock);
-        ALOGE("%s: RECVDMA failed (%d)", __FUNCTION__, errno);
-        return -errno;
+    if (!cancel) {
+        handle = mRegistrationCache->acquire(mEaselCommFd, &buf_desc);
+    }
+    auto begin = std::chrono::steady_clock::now();
+    int ret = dma_ioctl(mEaselCommFd, EASELCOMM_IOC_RECVDMA, &buf_desc,
+                        cancel ? nullptr : msg);
+    int err_saved = errno;
+    auto end = std::chrono::steady_clock::now();
+    if (handle) {
+        mRegistrationCache->release(mEaselCommFd, handle);
     }
     pthread_rwlock_unlock(&mFdRwlock);
+    if (ret == -1) {
+        ALOGE("%s: RECVDMA failed (%d)", __FUNCTION__, err_saved);
+        return -err_saved;
+    }
+
+    uint64_t duration_ns = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(end - begin).count();
+    if (!cancel) {
+        mTelemetry->addDma(EaselCommTelemetry::RECEIVED, msg->dma_buf_size,
+                           duration_ns);
+    }
 
 #ifdef PROFILE_DMA
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    diff_us = (end.tv_sec - begin.tv_sec) * 1000000
-            + (end.tv_nsec - begin.tv_nsec) / 1000;
-    ALOGD("%s: receiveDMA done in %ld us, size=%zu",
-          __FUNCTION__, diff_us, msg->dma_buf_size);
+    ALOGD("%s: receiveDMA done in %" PRIu64 " us, size=%zu",
+          __FUNCTION__, duration_ns / 1000, msg->dma_buf_size);
 #endif
 
     return 0;
@@ -512,6 +1758,11 @@ int EaselComm::cancelReceiveDMA(const EaselMessage *msg) {
     return receiveDMAImpl(msg, /*cancel=*/true);
 }
 
+// Returns whether a scatter-gather DMA transfer has succeeded in this process.
+bool EaselComm::isSgDmaSupported() {
+    return sg_dma_support == SG_DMA_SUPPORTED;
+}
+
 bool EaselComm::isConnected() {
     std::lock_guard<std::mutex> lock(mStatusMutex);
     return !mClosed;
@@ -521,6 +1772,12 @@ bool EaselComm::isConnected() {
  * Open communications, register the Easel service ID.
  */
 int EaselCommClient::open(EaselService service_id, long timeout_ms) {
+    const char *emulator_dir = EaselCommEmulator::getDirFromEnv();
+    if (emulator_dir != nullptr) {
+        return openEmulator(emulator_dir, service_id, timeout_ms,
+                            /*server=*/false);
+    }
+
     struct timespec begin;
     clock_gettime(CLOCK_MONOTONIC, &begin);
 
@@ -568,12 +1825,22 @@ int EaselCommClient::open(EaselService service_id, long timeout_ms) {
         return ret;
     }
     pthread_rwlock_unlock(&mFdRwlock);
+    mServiceId = service_id;
+    mServer = false;
     mClosed = false;
+    mTelemetryOpened = true;
+    startRecordingFromEnv();
 
     return 0;
 }
 
 int EaselCommServer::open(EaselService service_id, long timeout_ms) {
+    const char *emulator_dir = EaselCommEmulator::getDirFromEnv();
+    if (emulator_dir != nullptr) {
+        return openEmulator(emulator_dir, service_id, timeout_ms,
+                            /*server=*/true);
+    }
+
     struct timespec begin;
     clock_gettime(CLOCK_MONOTONIC, &begin);
 
@@ -621,13 +1888,77 @@ int EaselCommServer::open(EaselService service_id, long timeout_ms) {
         return ret;
     }
     pthread_rwlock_unlock(&mFdRwlock);
+    mServiceId = service_id;
+    mServer = true;
+    mClosed = false;
+    mTelemetryOpened = true;
+    startRecordingFromEnv();
+
+    return 0;
+}
+
+/*
+ * Open communications on the userspace easelcomm emulator.
+ */
+int EaselComm::openEmulator(const char *dir, EaselService service_id,
+                            long timeout_ms, bool server) {
+    std::lock_guard<std::mutex> lock(mStatusMutex);
+
+    if (!mClosed) {
+        return -EBUSY;
+    }
+
+    int fd = EaselCommEmulator::open(dir, service_id, server, timeout_ms);
+    if (fd < 0) {
+        ALOGE("%s: Failed to open emulated service %d in %s (%d)",
+              __FUNCTION__, service_id, dir, fd);
+        return fd;
+    }
+
+    // Acquire rwlock as a writer
+    pthread_rwlock_wrlock(&mFdRwlock);
+    mEaselCommFd = fd;
+    pthread_rwlock_unlock(&mFdRwlock);
+    mServiceId = service_id;
+    mServer = server;
     mClosed = false;
+    mTelemetryOpened = true;
+    startRecordingFromEnv();
 
     return 0;
 }
 
+int EaselCommClientEmulator::open(EaselService service_id, long timeout_ms) {
+    const char *dir = EaselCommEmulator::getDirFromEnv();
+    return openEmulator(dir ? dir : EaselCommEmulator::kDefaultDir,
+                        service_id, timeout_ms, /*server=*/false);
+}
+
+int EaselCommServerEmulator::open(EaselService service_id, long timeout_ms) {
+    const char *dir = EaselCommEmulator::getDirFromEnv();
+    return openEmulator(dir ? dir : EaselCommEmulator::kDefaultDir,
+                        service_id, timeout_ms, /*server=*/true);
+}
+
 // Close connection.
 void EaselComm::close() {
+    {
+        std::lock_guard<std::mutex> lock(mStatusMutex);
+        if (mClosed) {
+            return;
+        }
+        /*
+         * Asynchronous DMA threads hold the rwlock as readers while blocked
+         * in SENDDMA.  Shut down as a reader to wake them up, so they can be
+         * joined before the rwlock is acquired as a writer.
+         */
+        pthread_rwlock_rdlock(&mFdRwlock);
+        easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_SHUTDOWN);
+        pthread_rwlock_unlock(&mFdRwlock);
+    }
+
+    stopAsyncDmaThreads();
+
     {
         std::lock_guard<std::mutex> lock(mStatusMutex);
         if (mClosed) {
@@ -635,13 +1966,23 @@ void EaselComm::close() {
         }
         // Acquire rwlock as a writer
         pthread_rwlock_wrlock(&mFdRwlock);
-        ioctl(mEaselCommFd, EASELCOMM_IOC_SHUTDOWN);
         ::close(mEaselCommFd);
         mEaselCommFd = -1;
+        // The driver drops registrations along with the device.
+        mRegistrationCache->reset();
         pthread_rwlock_unlock(&mFdRwlock);
         mClosed = true;
     }
 
+    {
+        // Credits and coalesced messages do not outlive the connection.
+        std::lock_guard<std::mutex> lock(mCreditMutex);
+        mFlowStats.outstanding = 0;
+        mFlowStats.dropped += mCoalesced.size();
+        mCoalesced.clear();
+    }
+    mCreditsToReturn = 0;
+
     joinMessageHandlerThread();
 }
 
@@ -649,8 +1990,9 @@ void EaselComm::close() {
 void EaselComm::flush() {
     // Acquire rwlock as a reader
     pthread_rwlock_rdlock(&mFdRwlock);
-    ioctl(mEaselCommFd, EASELCOMM_IOC_FLUSH);
+    easelcomm_ioctl(mEaselCommFd, EASELCOMM_IOC_FLUSH);
     pthread_rwlock_unlock(&mFdRwlock);
+    mTelemetry->addFlush();
 }
 
 int EaselComm::startMessageHandlerThread(
@@ -695,10 +2037,7 @@ void EaselComm::handleReceivedMessages(
           continue;
         }
         callback(&msg);
-        if (msg.message_buf != nullptr) {
-            free(msg.message_buf);
-            msg.message_buf = nullptr;
-        }
+        releaseMessageBuffer(&msg);
     }
 }
 
@@ -720,7 +2059,7 @@ int EaselCommClient::initialHandshake() {
     if (ret) {
         return ret;
     }
-    ret = verifyHandshake(&msg, 1);
+    ret = verifyHandshake(this, &msg, 1);
     if (ret) {
         return ret;
     }
@@ -742,7 +2081,7 @@ int EaselCommServer::initialHandshake() {
     if (ret) {
         return ret;
     }
-    ret = verifyHandshake(&msg, 0);
+    ret = verifyHandshake(this, &msg, 0);
     if (ret) {
         return ret;
     }
@@ -758,5 +2097,5 @@ int EaselCommServer::initialHandshake() {
     if (ret) {
         return ret;
     }
-    return verifyHandshake(&msg, 2);
+    return verifyHandshake(this, &msg, 2);
 }
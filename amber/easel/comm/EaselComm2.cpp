@@ -10,4 +10,14 @@ std::unique_ptr<Comm> Comm::create(Comm::Mode mode) {
   return std::make_unique<CommImpl>(mode);
 }
 
+std::unique_ptr<Comm> Comm::create(Comm::Mode mode,
+                                   size_t handlerThreadCount) {
+  return std::make_unique<CommImpl>(mode, handlerThreadCount);
+}
+
+std::unique_ptr<Comm> Comm::create(Comm::Mode mode, size_t handlerThreadCount,
+                                   Comm::Transport transport) {
+  return std::make_unique<CommImpl>(mode, handlerThreadCount, transport);
+}
+
 }  // namespace EaselComm2
\ No newline at end of file
@@ -32,6 +32,26 @@ HardwareBuffer::HardwareBuffer(const std::string& filePath, int id) {
   mId = id;
 }
 
+HardwareBuffer::HardwareBuffer(const HardwareBuffer& other)
+    : mVaddr(other.mVaddr),
+      mIonFd(other.mIonFd),
+      mSize(other.mSize),
+      mId(other.mId),
+      mAllocBuffer(false) {}
+
+HardwareBuffer& HardwareBuffer::operator=(const HardwareBuffer& other) {
+  if (this == &other) return *this;
+  if (mAllocBuffer && (mVaddr != nullptr)) {
+    free(mVaddr);
+  }
+  mVaddr = other.mVaddr;
+  mIonFd = other.mIonFd;
+  mSize = other.mSize;
+  mId = other.mId;
+  mAllocBuffer = false;
+  return *this;
+}
+
 HardwareBuffer::~HardwareBuffer() {
   if (mAllocBuffer && (mVaddr != nullptr)) {
     free(mVaddr);
@@ -0,0 +1,82 @@
+#define LOG_TAG "EaselComm2::Dispatcher"
+
+#include "EaselComm2Dispatcher.h"
+
+#include "log/log.h"
+
+namespace EaselComm2 {
+
+Dispatcher::Dispatcher(size_t threadCount)
+    : mPendingTasks(0), mStopping(false) {
+  ALOG_ASSERT(threadCount > 0);
+  for (size_t i = 0; i < threadCount; i++) {
+    mThreads.emplace_back(&Dispatcher::workerLoop, this);
+  }
+}
+
+Dispatcher::~Dispatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mStopping = true;
+  }
+  mReadyCond.notify_all();
+  for (auto& thread : mThreads) {
+    thread.join();
+  }
+}
+
+void Dispatcher::dispatch(int key, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto& queue = mQueues[key];
+    queue.tasks.push_back(std::move(task));
+    mPendingTasks++;
+    if (queue.scheduled) return;
+    queue.scheduled = true;
+    mReadyKeys.push_back(key);
+  }
+  mReadyCond.notify_one();
+}
+
+void Dispatcher::drain() {
+  std::unique_lock<std::mutex> lock(mLock);
+  mIdleCond.wait(lock, [&] { return mPendingTasks == 0; });
+}
+
+void Dispatcher::workerLoop() {
+  std::unique_lock<std::mutex> lock(mLock);
+  while (true) {
+    mReadyCond.wait(lock, [&] { return mStopping || !mReadyKeys.empty(); });
+    if (mReadyKeys.empty()) {
+      // Stopping and no work left.
+      return;
+    }
+
+    int key = mReadyKeys.front();
+    mReadyKeys.pop_front();
+    auto& queue = mQueues[key];
+    Task task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+
+    lock.unlock();
+    task();
+    lock.lock();
+
+    // Requeue behind other ready keys so one busy channel cannot starve
+    // the others.
+    auto& ranQueue = mQueues[key];
+    if (ranQueue.tasks.empty()) {
+      ranQueue.scheduled = false;
+    } else {
+      mReadyKeys.push_back(key);
+      mReadyCond.notify_one();
+    }
+
+    mPendingTasks--;
+    if (mPendingTasks == 0) {
+      mIdleCond.notify_all();
+    }
+  }
+}
+
+}  // namespace EaselComm2
@@ -0,0 +1,61 @@
+#ifndef PAINTBOX_EASELCOMM2_DISPATCHER_H
+#define PAINTBOX_EASELCOMM2_DISPATCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace EaselComm2 {
+
+// Runs tasks on a pool of worker threads with one serial queue per key.
+// Tasks sharing a key run one at a time in dispatch order, while tasks of
+// different keys may run concurrently on different workers.
+class Dispatcher {
+ public:
+  using Task = std::function<void()>;
+
+  // Starts threadCount worker threads. threadCount must be at least 1.
+  explicit Dispatcher(size_t threadCount);
+
+  // Runs the remaining tasks and joins the worker threads.
+  ~Dispatcher();
+
+  Dispatcher(const Dispatcher&) = delete;
+  Dispatcher& operator=(const Dispatcher&) = delete;
+
+  // Queues task on the serial queue of key.
+  void dispatch(int key, Task task);
+
+  // Blocks until all dispatched tasks have run.
+  // Must not be called from a task.
+  void drain();
+
+ private:
+  struct SerialQueue {
+    std::deque<Task> tasks;
+    // True if the queue is in mReadyKeys or one of its tasks is running.
+    bool scheduled = false;
+  };
+
+  void workerLoop();
+
+  std::mutex mLock;
+  // Signaled when a key becomes ready or the dispatcher is stopping.
+  std::condition_variable mReadyCond;
+  // Signaled when mPendingTasks drops to zero.
+  std::condition_variable mIdleCond;
+  std::unordered_map<int, SerialQueue> mQueues;  // GUARDED_BY(mLock)
+  // Keys with queued tasks and no running task, in FIFO order.
+  std::deque<int> mReadyKeys;  // GUARDED_BY(mLock)
+  size_t mPendingTasks;        // GUARDED_BY(mLock)
+  bool mStopping;              // GUARDED_BY(mLock)
+  std::vector<std::thread> mThreads;
+};
+
+}  // namespace EaselComm2
+
+#endif  // PAINTBOX_EASELCOMM2_DISPATCHER_H
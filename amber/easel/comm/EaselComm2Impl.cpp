@@ -7,29 +7,81 @@
 namespace EaselComm2 {
 
 namespace {
+void ConvertBufferToEaselMessage(const HardwareBuffer& buffer,
+                                 EaselComm::EaselMessage* easelMessage) {
+  easelMessage->dma_buf = const_cast<void*>(buffer.vaddr());
+  easelMessage->dma_buf_fd = buffer.ionFd();
+  easelMessage->dma_buf_size = buffer.size();
+  easelMessage->dma_buf_type = buffer.isIonBuffer()
+                                   ? EASELCOMM_DMA_BUFFER_DMA_BUF
+                                   : EASELCOMM_DMA_BUFFER_USER;
+}
+
 void ConvertMessageToEaselMessage(const Message& message,
                                   EaselComm::EaselMessage* easelMessage) {
   easelMessage->message_buf = message.getMessageBuf();
   easelMessage->message_buf_size = message.getMessageBufSize();
-  auto payload = message.getPayload();
-  easelMessage->dma_buf = const_cast<void*>(payload.vaddr());
-  easelMessage->dma_buf_fd = payload.ionFd();
-  easelMessage->dma_buf_size = payload.size();
-  easelMessage->dma_buf_type = payload.isIonBuffer()
-                                   ? EASELCOMM_DMA_BUFFER_DMA_BUF
-                                   : EASELCOMM_DMA_BUFFER_USER;
+  ConvertBufferToEaselMessage(message.getPayload(), easelMessage);
+}
+
+bool HasIonBuffer(const std::vector<HardwareBuffer>& buffers) {
+  for (auto& buffer : buffers) {
+    if (buffer.isIonBuffer()) return true;
+  }
+  return false;
+}
+
+// Describes buffers as a scatter-gather list in easelMessage.
+// segments provides the storage and must outlive easelMessage.
+void ConvertBuffersToSgList(const std::vector<HardwareBuffer>& buffers,
+                            std::vector<easelcomm_dma_segment>* segments,
+                            EaselComm::EaselMessage* easelMessage) {
+  segments->clear();
+  size_t totalSize = 0;
+  for (auto& buffer : buffers) {
+    easelcomm_dma_segment segment;
+    segment.buf = const_cast<void*>(buffer.vaddr());
+    segment.dma_buf_fd = buffer.ionFd();
+    segment.buf_type = buffer.isIonBuffer() ? EASELCOMM_DMA_BUFFER_DMA_BUF
+                                            : EASELCOMM_DMA_BUFFER_USER;
+    segment.buf_size = buffer.size();
+    segments->push_back(segment);
+    totalSize += buffer.size();
+  }
+  easelMessage->dma_buf = nullptr;
+  easelMessage->dma_buf_fd = -1;
+  easelMessage->dma_buf_type = EASELCOMM_DMA_BUFFER_SG_LIST;
+  easelMessage->dma_sg_list.segments = segments->data();
+  easelMessage->dma_sg_list.count = segments->size();
+  easelMessage->dma_buf_size = totalSize;
 }
 }  // namespace
 
-CommImpl::CommImpl(Mode mode) {
-  if (mode == Mode::CLIENT) {
+CommImpl::CommImpl(Mode mode, size_t handlerThreadCount, Transport transport)
+    : mHandlerMap(std::make_shared<HandlerMap>()) {
+  if (handlerThreadCount > 0) {
+    mDispatcher = std::make_unique<Dispatcher>(handlerThreadCount);
+  }
+  if (transport == Transport::EMULATOR) {
+    if (mode == Mode::CLIENT) {
+      mComm = std::make_unique<EaselCommClientEmulator>();
+    } else {
+      mComm = std::make_unique<EaselCommServerEmulator>();
+    }
+  } else if (mode == Mode::CLIENT) {
     mComm = std::make_unique<EaselCommClient>();
   } else {
     mComm = std::make_unique<EaselCommServer>();
   }
+  // Messages are only received by the handler thread, which releases them.
+  mComm->setReceiveBufferPooling(true);
 }
 
-CommImpl::~CommImpl() { mComm->close(); }
+CommImpl::~CommImpl() {
+  mComm->close();
+  // Dispatched handlers use mComm, finish them first.
+  mDispatcher.reset();
+}
 
 int CommImpl::open(EaselService service_id, long timeout_ms) {
   return mComm->open(service_id, timeout_ms);
@@ -67,20 +119,123 @@ void CommImpl::close() { mComm->close(); }
 
 void CommImpl::registerHandler(int channelId, Handler handler) {
   std::lock_guard<std::mutex> lock(mHandlerMapMutex);
-  mHandlerMap[channelId] = handler;
+  auto handlerMap =
+      std::make_shared<HandlerMap>(*std::atomic_load(&mHandlerMap));
+  (*handlerMap)[channelId] = handler;
+  std::atomic_store(&mHandlerMap,
+                    std::shared_ptr<const HandlerMap>(std::move(handlerMap)));
+}
+
+void CommImpl::handleMessage(const EaselComm::EaselMessage& easelMessage,
+                             const HardwareBuffer* spilledBody) {
+  Message message(easelMessage.message_buf, easelMessage.message_buf_size,
+                  easelMessage.dma_buf_size, easelMessage.message_id,
+                  spilledBody);
+  if (!message.isValid()) {
+    LOG(ERROR) << __FUNCTION__ << " dropping malformed message";
+    if (easelMessage.dma_buf_size > 0) mComm->cancelReceiveDMA(&easelMessage);
+    return;
+  }
+  int channelId = message.getHeader()->channelId;
+  auto handlerMap = std::atomic_load(&mHandlerMap);
+  auto it = handlerMap->find(channelId);
+  if (it == handlerMap->end() || !it->second) {
+    LOG(WARNING) << __FUNCTION__ << " no handler for channel " << channelId;
+    return;
+  }
+  it->second(message);
+}
+
+bool CommImpl::receiveSpilledBody(EaselComm::EaselMessage* msg,
+                                  std::shared_ptr<HardwareBuffer>* body) {
+  auto header = static_cast<const Message::Header*>(msg->message_buf);
+  if (header->spilledBodySize == 0) return true;
+  int channelId = header->channelId;
+
+  if (header->type != Message::SPILL && header->spillSequence != 0) {
+    // The body went ahead in a SPILL message. A body left by a message that
+    // failed to send has another sequence number and is dropped.
+    auto it = mSpilledBodies.find(channelId);
+    if (it != mSpilledBodies.end()) {
+      if (it->second.sequence == header->spillSequence) {
+        *body = std::move(it->second.body);
+      }
+      mSpilledBodies.erase(it);
+    }
+    if (*body != nullptr) return true;
+    // The body is lost, drop the message along with its payload.
+    LOG(ERROR) << __FUNCTION__ << " channel " << channelId
+               << " lost the spilled body of message "
+               << header->spillSequence;
+    if (msg->dma_buf_size > 0) mComm->cancelReceiveDMA(msg);
+    return false;
+  }
+
+  // The body is the DMA transfer of this message.
+  auto buffer = std::make_shared<HardwareBuffer>(
+      static_cast<size_t>(header->spilledBodySize));
+  int ret = -EINVAL;
+  if (buffer->valid() && msg->dma_buf_size == buffer->size()) {
+    EaselComm::EaselMessage dmaMessage;
+    dmaMessage.message_id = msg->message_id;
+    ConvertBufferToEaselMessage(*buffer, &dmaMessage);
+    ret = mComm->receiveDMA(&dmaMessage);
+  } else {
+    mComm->cancelReceiveDMA(msg);
+  }
+  if (ret != 0) {
+    LOG(ERROR) << __FUNCTION__ << " channel " << channelId
+               << " failed to receive body of " << header->spilledBodySize
+               << " bytes, error " << ret;
+    buffer.reset();
+  }
+
+  if (header->type == Message::SPILL) {
+    mSpilledBodies[channelId] = {header->spillSequence, std::move(buffer)};
+    return false;
+  }
+  // The DMA transfer is consumed, the handler sees no payload.
+  msg->dma_buf_size = 0;
+  *body = std::move(buffer);
+  return *body != nullptr;
 }
 
 int CommImpl::startReceiving() {
+  // Bodies left over from a previous connection belong to no message.
+  mSpilledBodies.clear();
   return mComm->startMessageHandlerThread([&](EaselComm::EaselMessage* msg) {
-    Message message(msg->message_buf, msg->message_buf_size, msg->dma_buf_size,
-                    msg->message_id);
-    std::lock_guard<std::mutex> lock(mHandlerMapMutex);
-    auto& handler = mHandlerMap[message.getHeader()->channelId];
-    handler(message);
+    if (msg->message_buf_size < sizeof(Message::Header)) {
+      LOG(ERROR) << __FUNCTION__ << " dropping message of "
+                 << msg->message_buf_size << " bytes";
+      if (msg->dma_buf_size > 0) mComm->cancelReceiveDMA(msg);
+      return;
+    }
+    std::shared_ptr<HardwareBuffer> spilledBody;
+    if (!receiveSpilledBody(msg, &spilledBody)) return;
+
+    if (mDispatcher == nullptr) {
+      handleMessage(*msg, spilledBody.get());
+      return;
+    }
+
+    // Take over the message buffer; it is released once the handler ran.
+    auto easelMessage = std::make_shared<EaselComm::EaselMessage>(*msg);
+    msg->message_buf = nullptr;
+    int channelId = static_cast<const Message::Header*>(
+        easelMessage->message_buf)->channelId;
+    mDispatcher->dispatch(channelId, [this, easelMessage, spilledBody]() {
+      handleMessage(*easelMessage, spilledBody.get());
+      mComm->releaseMessageBuffer(easelMessage.get());
+    });
   });
 }
 
-void CommImpl::joinReceiving() { return mComm->joinMessageHandlerThread(); }
+void CommImpl::joinReceiving() {
+  mComm->joinMessageHandlerThread();
+  if (mDispatcher != nullptr) {
+    mDispatcher->drain();
+  }
+}
 
 int CommImpl::receivePayload(const Message& message, HardwareBuffer* buffer) {
   if (buffer == nullptr) return -EINVAL;
@@ -94,54 +249,224 @@ int CommImpl::receivePayload(const Message& message, HardwareBuffer* buffer) {
 
   EaselComm::EaselMessage easelMessage;
   easelMessage.message_id = message.getMessageId();
-  easelMessage.dma_buf = const_cast<void*>(buffer->vaddr());
-  easelMessage.dma_buf_fd = buffer->ionFd();
-  easelMessage.dma_buf_type = buffer->isIonBuffer()
-                                  ? EASELCOMM_DMA_BUFFER_DMA_BUF
-                                  : EASELCOMM_DMA_BUFFER_USER;
-  easelMessage.dma_buf_size = buffer->size();
+  ConvertBufferToEaselMessage(*buffer, &easelMessage);
   return mComm->receiveDMA(&easelMessage);
 }
 
-int CommImpl::send(int channelId, const HardwareBuffer* payload) {
-  Message message(channelId, payload);
+int CommImpl::receivePayload(const Message& message,
+                             std::vector<HardwareBuffer>* buffers) {
+  if (buffers == nullptr) return -EINVAL;
+  auto& segments = message.getPayloads();
+  if (segments.size() != buffers->size()) return -EINVAL;
+
+  for (size_t i = 0; i < buffers->size(); i++) {
+    auto& buffer = (*buffers)[i];
+    if (!buffer.valid() || buffer.size() != segments[i].size()) {
+      return -EINVAL;
+    }
+  }
+
+  for (size_t i = 0; i < buffers->size(); i++) {
+    (*buffers)[i].setId(segments[i].id());
+  }
+
+  EaselComm::EaselMessage easelMessage;
+  std::vector<easelcomm_dma_segment> sgSegments;
+  easelMessage.message_id = message.getMessageId();
+  ConvertBuffersToSgList(*buffers, &sgSegments, &easelMessage);
+  return mComm->receiveDMA(&easelMessage);
+}
+
+void CommImpl::setSendCredits(size_t window) {
+  mComm->setSendCredits(window);
+}
+
+int CommImpl::trySend(int channelId, const void* body, size_t body_size,
+                      bool coalesce) {
+  Message message(channelId, body, body_size, nullptr);
+  return trySendMessage(message, coalesce);
+}
+
+int CommImpl::trySend(int channelId,
+                      const ::google::protobuf::MessageLite& proto,
+                      bool coalesce) {
+  Message message(channelId, proto, nullptr);
+  return trySendMessage(message, coalesce);
+}
+
+int CommImpl::trySendMessage(const Message& message, bool coalesce) {
+  // Spilling the body would need a DMA transfer, which cannot be coalesced.
+  if (message.getMessageBufSize() > EASELCOMM_MAX_MESSAGE_SIZE) {
+    return -EMSGSIZE;
+  }
+  int channelId = message.getHeader()->channelId;
+  EaselComm::EaselMessage easelMessage;
+  ConvertMessageToEaselMessage(message, &easelMessage);
+  easelMessage.priority = getChannelPriority(channelId);
+  return mComm->trySendMessage(&easelMessage, coalesce ? channelId : -1);
+}
+
+int CommImpl::startRecording(const char* path, bool payloads) {
+  return mComm->startRecording(path, payloads);
+}
+
+void CommImpl::stopRecording() { mComm->stopRecording(); }
+
+void CommImpl::setChannelPriority(int channelId, Priority priority) {
+  EaselComm::Priority lane = EaselComm::PRIORITY_LATENCY_SENSITIVE;
+  switch (priority) {
+    case Priority::CONTROL:
+      lane = EaselComm::PRIORITY_CONTROL;
+      break;
+    case Priority::LATENCY_SENSITIVE:
+      lane = EaselComm::PRIORITY_LATENCY_SENSITIVE;
+      break;
+    case Priority::BULK:
+      lane = EaselComm::PRIORITY_BULK;
+      break;
+  }
+  std::lock_guard<std::mutex> lock(mChannelPrioritiesMutex);
+  mChannelPriorities[channelId] = lane;
+}
+
+EaselComm::Priority CommImpl::getChannelPriority(int channelId) {
+  std::lock_guard<std::mutex> lock(mChannelPrioritiesMutex);
+  auto it = mChannelPriorities.find(channelId);
+  return it == mChannelPriorities.end() ? EaselComm::PRIORITY_LATENCY_SENSITIVE
+                                        : it->second;
+}
+
+int CommImpl::sendMessage(const Message& message,
+                          const Completion* completion) {
   EaselComm::EaselMessage easelMessage;
   ConvertMessageToEaselMessage(message, &easelMessage);
-  return mComm->sendMessage(&easelMessage);
+  easelMessage.priority = getChannelPriority(message.getHeader()->channelId);
+  if (message.getMessageBufSize() <= EASELCOMM_MAX_MESSAGE_SIZE) {
+    return completion == nullptr
+               ? mComm->sendMessage(&easelMessage)
+               : mComm->sendMessageAsync(&easelMessage, *completion);
+  }
+
+  // Only the header stays in the message buffer, the body moves by DMA.
+  Message::Header header = *message.getHeader();
+  header.spilledBodySize = message.getBodySize();
+  header.spillSequence = 0;
+  easelMessage.message_buf = &header;
+  easelMessage.message_buf_size = sizeof(header);
+  HardwareBuffer body(const_cast<void*>(message.getBody()),
+                      message.getBodySize());
+
+  if (!message.hasPayload()) {
+    ConvertBufferToEaselMessage(body, &easelMessage);
+    int ret = mComm->sendMessage(&easelMessage);
+    if (ret == 0 && completion != nullptr && *completion) (*completion)(0);
+    return ret;
+  }
+
+  // The payload keeps the DMA transfer of the message, so the body goes
+  // ahead in a SPILL message on the same channel, tagged with a sequence
+  // number shared with the message.
+  std::lock_guard<std::mutex> lock(mSpillMutex);
+  if (++mSpillSequence == 0) mSpillSequence = 1;
+  header.spillSequence = mSpillSequence;
+  Message::Header spillHeader = header;
+  spillHeader.type = Message::SPILL;
+  spillHeader.payloadId = 0;
+  EaselComm::EaselMessage spillMessage;
+  spillMessage.priority = easelMessage.priority;
+  spillMessage.message_buf = &spillHeader;
+  spillMessage.message_buf_size = sizeof(spillHeader);
+  ConvertBufferToEaselMessage(body, &spillMessage);
+
+  int ret = mComm->sendMessage(&spillMessage);
+  if (ret != 0) return ret;
+  return completion == nullptr
+             ? mComm->sendMessage(&easelMessage)
+             : mComm->sendMessageAsync(&easelMessage, *completion);
+}
+
+int CommImpl::send(int channelId, const HardwareBuffer* payload) {
+  Message message(channelId, payload);
+  return sendMessage(message, nullptr);
 }
 
 int CommImpl::send(int channelId, const void* body, size_t body_size,
                    const HardwareBuffer* payload) {
   Message message(channelId, body, body_size, payload);
-  EaselComm::EaselMessage easelMessage;
-  ConvertMessageToEaselMessage(message, &easelMessage);
-  return mComm->sendMessage(&easelMessage);
+  return sendMessage(message, nullptr);
 }
 
 int CommImpl::send(int channelId, const std::string& s,
                    const HardwareBuffer* payload) {
   Message message(channelId, s, payload);
-  EaselComm::EaselMessage easelMessage;
-  ConvertMessageToEaselMessage(message, &easelMessage);
-  return mComm->sendMessage(&easelMessage);
+  return sendMessage(message, nullptr);
 }
 
 int CommImpl::send(int channelId, const ::google::protobuf::MessageLite& proto,
                    const HardwareBuffer* payload) {
   Message message(channelId, proto, payload);
-  EaselComm::EaselMessage easelMessage;
-  ConvertMessageToEaselMessage(message, &easelMessage);
-  return mComm->sendMessage(&easelMessage);
+  return sendMessage(message, nullptr);
+}
+
+// The message buffer is copied into the kernel before sendMessageAsync returns,
+// so only the payload needs to outlive the call.
+int CommImpl::sendAsync(int channelId, const HardwareBuffer* payload,
+                        Completion completion) {
+  Message message(channelId, payload);
+  return sendMessage(message, &completion);
+}
+
+int CommImpl::sendAsync(int channelId, const void* body, size_t body_size,
+                        const HardwareBuffer* payload, Completion completion) {
+  Message message(channelId, body, body_size, payload);
+  return sendMessage(message, &completion);
+}
+
+int CommImpl::sendAsync(int channelId,
+                        const ::google::protobuf::MessageLite& proto,
+                        const HardwareBuffer* payload, Completion completion) {
+  Message message(channelId, proto, payload);
+  return sendMessage(message, &completion);
 }
 
 int CommImpl::send(int channelId, const std::vector<HardwareBuffer>& buffers,
                    int* lastId) {
-  for (auto& buffer : buffers) {
-    int ret = send(channelId, &buffer);
+  EaselComm::Priority priority = getChannelPriority(channelId);
+  std::vector<easelcomm_dma_segment> segments;
+  // Each message moves up to EASELCOMM_MAX_DMA_SEGMENTS buffers at once.
+  for (size_t first = 0; first < buffers.size();
+       first += EASELCOMM_MAX_DMA_SEGMENTS) {
+    size_t last =
+        std::min(buffers.size(), first + EASELCOMM_MAX_DMA_SEGMENTS);
+    std::vector<HardwareBuffer> chunk(buffers.begin() + first,
+                                      buffers.begin() + last);
+
+    // Without scatter-gather DMA in the driver, only user buffers can be
+    // gathered, through a bounce buffer. Send other buffers one by one.
+    if (!EaselComm::isSgDmaSupported() && HasIonBuffer(chunk)) {
+      for (auto& buffer : chunk) {
+        int ret = send(channelId, &buffer);
+        if (ret != 0) {
+          return ret;
+        } else if (lastId != nullptr) {
+          *lastId = buffer.id();
+        }
+      }
+      continue;
+    }
+
+    Message message(channelId, chunk);
+    EaselComm::EaselMessage easelMessage;
+    easelMessage.priority = priority;
+    easelMessage.message_buf = message.getMessageBuf();
+    easelMessage.message_buf_size = message.getMessageBufSize();
+    ConvertBuffersToSgList(chunk, &segments, &easelMessage);
+
+    int ret = mComm->sendMessage(&easelMessage);
     if (ret != 0) {
       return ret;
     } else if (lastId != nullptr) {
-      *lastId = buffer.id();
+      *lastId = chunk.back().id();
     }
   }
   return 0;
@@ -3,15 +3,20 @@
 
 #include "EaselComm2.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
+#include "EaselComm2Dispatcher.h"
 #include "easelcomm.h"
 
 namespace EaselComm2 {
 
 class CommImpl : public Comm {
  public:
-  CommImpl(Mode mode);
+  CommImpl(Mode mode, size_t handlerThreadCount = 0,
+           Transport transport = Transport::DEFAULT);
   ~CommImpl();
 
   int open(EaselService service_id, long timeout_ms = 0) override;
@@ -38,15 +43,86 @@ class CommImpl : public Comm {
   int send(int channelId, const std::vector<HardwareBuffer>& buffers,
            int* lastId) override;
 
+  int sendAsync(int channelId, const HardwareBuffer* payload,
+                Completion completion) override;
+
+  int sendAsync(int channelId, const void* body, size_t body_size,
+                const HardwareBuffer* payload, Completion completion) override;
+
+  int sendAsync(int channelId, const ::google::protobuf::MessageLite& proto,
+                const HardwareBuffer* payload, Completion completion) override;
+
+  void setSendCredits(size_t window) override;
+
+  int trySend(int channelId, const void* body, size_t body_size,
+              bool coalesce) override;
+
+  int trySend(int channelId, const ::google::protobuf::MessageLite& proto,
+              bool coalesce) override;
+
+  int startRecording(const char* path, bool payloads) override;
+  void stopRecording() override;
+
+  void setChannelPriority(int channelId, Priority priority) override;
+
   void registerHandler(int channelId, Handler handler) override;
 
   int receivePayload(const Message& message, HardwareBuffer* buffer) override;
 
+  int receivePayload(const Message& message,
+                     std::vector<HardwareBuffer>* buffers) override;
+
  private:
+  using HandlerMap = std::unordered_map<int, Handler>;
+
+  // Runs the handler registered for the channel of easelMessage.
+  // spilledBody holds the spilled message body, or is nullptr.
+  void handleMessage(const EaselComm::EaselMessage& easelMessage,
+                     const HardwareBuffer* spilledBody);
+
+  // Returns the EaselComm lane of messages sent on channelId.
+  EaselComm::Priority getChannelPriority(int channelId);
+
+  // Sends message without payload if a flow control credit is available.
+  int trySendMessage(const Message& message, bool coalesce);
+
+  // Sends message, synchronously if completion is nullptr.
+  // Bodies that do not fit in an easelcomm message are spilled into a DMA
+  // transfer, which is always sent synchronously.
+  int sendMessage(const Message& message, const Completion* completion);
+
+  // Receives the spilled body of msg into *body, if it has one.
+  // Called on the receiving thread in message order.
+  // Returns false if msg must not be handled, either because it only carried
+  // the body of a later message or because its body was lost.
+  bool receiveSpilledBody(EaselComm::EaselMessage* msg,
+                          std::shared_ptr<HardwareBuffer>* body);
+
   std::unique_ptr<EaselComm> mComm;
+  // Serializes registerHandler calls.
   std::mutex mHandlerMapMutex;
-  std::unordered_map<int, Handler>
-      mHandlerMap;  // GUARDED_BY(mHandlerMapMutex);
+  // Immutable snapshot of the registered handlers. Readers load it
+  // atomically without locking; registerHandler publishes a modified copy.
+  std::shared_ptr<const HandlerMap> mHandlerMap;
+  // Runs handlers off the receiving thread, nullptr to run them inline.
+  std::unique_ptr<Dispatcher> mDispatcher;
+  std::mutex mChannelPrioritiesMutex;
+  // Lanes of channels set by setChannelPriority.
+  // GUARDED_BY(mChannelPrioritiesMutex)
+  std::unordered_map<int, EaselComm::Priority> mChannelPriorities;
+  // A body received in a SPILL message, waiting for its message.
+  struct SpilledBody {
+    uint32_t sequence;  // spillSequence of the SPILL message.
+    std::shared_ptr<HardwareBuffer> body;  // nullptr if it failed to arrive.
+  };
+
+  // Keeps a SPILL message and the message it belongs to back to back.
+  std::mutex mSpillMutex;
+  // Last spillSequence sent. GUARDED_BY(mSpillMutex)
+  uint32_t mSpillSequence = 0;
+  // Bodies received in SPILL messages, keyed by channel.
+  // Only accessed on the receiving thread.
+  std::unordered_map<int, SpilledBody> mSpilledBodies;
 };
 
 }  // namespace EaselComm2
@@ -2,6 +2,7 @@
 
 #include "EaselComm2Message.h"
 
+#include "easelcomm.h"
 #include "log/log.h"
 
 #include <fstream>
@@ -59,15 +60,50 @@ Message::Message(int channelId, const HardwareBuffer* payload) {
   }
 }
 
+Message::Message(int channelId, const std::vector<HardwareBuffer>& payloads) {
+  ALOG_ASSERT(allocMessage(payloads.size() * sizeof(Segment)));
+  mMessageId = 0;
+  initializeHeader(channelId, PING);
+  attachPayloads(payloads);
+}
+
 Message::Message(void* messageBuf, size_t messageBufSize, size_t dmaBufSize,
-                 uint64_t messageId) {
+                 uint64_t messageId, const HardwareBuffer* spilledBody) {
   mMessageBuf = messageBuf;
   mMessageBufSize = messageBufSize;
-  mPayload = HardwareBuffer(nullptr, dmaBufSize, getHeader()->payloadId);
   mAllocMessage = false;
   mMessageId = messageId;
+  mValid = false;
+  if (spilledBody != nullptr) {
+    mSpilledBody = *spilledBody;
+  }
+
+  // The header and segment table come from the peer.
+  if (messageBufSize < sizeof(Header)) {
+    ALOGE("%s: message of %zu bytes has no header", __FUNCTION__,
+          messageBufSize);
+    return;
+  }
+  int segmentCount = getHeader()->segmentCount;
+  if (segmentCount < 0 || segmentCount > EASELCOMM_MAX_DMA_SEGMENTS ||
+      segmentCount * sizeof(Segment) > messageBufSize - sizeof(Header)) {
+    ALOGE("%s: %d segments do not fit in a message of %zu bytes",
+          __FUNCTION__, segmentCount, messageBufSize);
+    return;
+  }
+  mValid = true;
+  mPayload = HardwareBuffer(nullptr, dmaBufSize, getHeader()->payloadId);
+
+  const Segment* segments = reinterpret_cast<const Segment*>(
+      static_cast<const char*>(messageBuf) + sizeof(Header) +
+      getInlineBodySize());
+  for (int i = 0; i < segmentCount; i++) {
+    mPayloads.emplace_back(nullptr, segments[i].size, segments[i].id);
+  }
 }
 
+bool Message::isValid() const { return mValid; }
+
 Message::~Message() {
   if (mAllocMessage) free(mMessageBuf);
 }
@@ -77,6 +113,9 @@ void Message::initializeHeader(int channelId, Type type) {
   header->channelId = channelId;
   header->type = type;
   header->payloadId = 0;
+  header->segmentCount = 0;
+  header->spilledBodySize = 0;
+  header->spillSequence = 0;
 }
 
 std::string Message::toString() const {
@@ -105,15 +144,41 @@ void Message::attachPayload(const HardwareBuffer& payload) {
   mPayload = payload;
 }
 
+void Message::attachPayloads(const std::vector<HardwareBuffer>& payloads) {
+  if (payloads.empty()) return;
+
+  // The segment table takes the tail of the allocated body.
+  auto header = getMutableHeader();
+  header->segmentCount = payloads.size();
+  header->payloadId = payloads.front().id();
+
+  Segment* segments = getMutableSegments();
+  size_t totalSize = 0;
+  for (size_t i = 0; i < payloads.size(); i++) {
+    segments[i].id = payloads[i].id();
+    segments[i].size = payloads[i].size();
+    totalSize += payloads[i].size();
+  }
+  mPayloads = payloads;
+  mPayload = HardwareBuffer(nullptr, totalSize, header->payloadId);
+}
+
+Message::Segment* Message::getMutableSegments() {
+  return reinterpret_cast<Segment*>(static_cast<char*>(getMutableBody()) +
+                                    getInlineBodySize());
+}
+
 bool Message::allocMessage(size_t bodySize) {
   size_t size = sizeof(Header) + bodySize;
   mMessageBuf = malloc(sizeof(Header) + bodySize);
   if (mMessageBuf != nullptr) {
     mMessageBufSize = size;
     mAllocMessage = true;
+    mValid = true;
     return true;
   }
   mAllocMessage = false;
+  mValid = false;
   return false;
 }
 
@@ -126,6 +191,7 @@ Message::Header* Message::getMutableHeader() {
 }
 
 const void* Message::getBody() const {
+  if (mSpilledBody.valid()) return mSpilledBody.vaddr();
   return static_cast<char*>(mMessageBuf) + sizeof(Header);
 }
 
@@ -133,7 +199,16 @@ void* Message::getMutableBody() {
   return static_cast<char*>(mMessageBuf) + sizeof(Header);
 }
 
-size_t Message::getBodySize() const { return mMessageBufSize - sizeof(Header); }
+size_t Message::getBodySize() const {
+  if (mSpilledBody.valid()) return mSpilledBody.size();
+  return getInlineBodySize();
+}
+
+size_t Message::getInlineBodySize() const {
+  if (!mValid) return 0;
+  return mMessageBufSize - sizeof(Header) -
+         getHeader()->segmentCount * sizeof(Segment);
+}
 
 void* Message::getMessageBuf() const { return mMessageBuf; }
 
@@ -141,6 +216,10 @@ size_t Message::getMessageBufSize() const { return mMessageBufSize; }
 
 HardwareBuffer Message::getPayload() const { return mPayload; }
 
+const std::vector<HardwareBuffer>& Message::getPayloads() const {
+  return mPayloads;
+}
+
 uint64_t Message::getMessageId() const { return mMessageId; }
 
 bool Message::hasPayload() const { return mPayload.size() > 0; }
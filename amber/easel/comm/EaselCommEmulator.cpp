@@ -0,0 +1,1260 @@
+/*
+ * Userspace emulation of the easelcomm kernel driver.
+ *
+ * Header file EaselCommEmulator.h describes the emulated device.
+ */
+
+#define LOG_TAG "EaselCommEmulator"
+
+#include "EaselCommEmulator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <log/log.h>
+
+namespace EaselCommEmulator {
+
+const char *const kDirEnv = "EASELCOMM_EMULATOR_DIR";
+const char *const kDefaultDir = "/tmp/easelcomm";
+
+namespace {
+
+static const useconds_t kConnectPollIntervalUs = 1000;  // Poll interval 1 ms
+// Maximum number of idle memfds kept for gathering user DMA source buffers.
+static const size_t kMaxIdleStagingBuffers = 4;
+
+enum PacketType : uint32_t {
+    PACKET_MSG,         // A message, followed by its message data.
+    PACKET_DMA_DATA,    // The DMA source of a message, attached as an fd.
+    PACKET_DMA_DONE,    // The DMA transfer of a message was received or
+                        // discarded by the remote.
+    PACKET_FLUSH,       // Request to discard incoming messages.
+    PACKET_FLUSH_DONE,  // The remote discarded its incoming messages.
+    PACKET_ACCEPTED,    // The server accepted the client connection.
+};
+
+struct Packet {
+    uint32_t type;
+    int32_t result;            // PACKET_DMA_DONE: 0 or -errno.
+    easelcomm_kmsg_desc desc;  // PACKET_MSG: the message descriptor.
+                               // PACKET_DMA_*: message_id and dma_buf_size.
+};
+
+static const size_t kMaxPacketSize =
+        sizeof(Packet) + EASELCOMM_MAX_MESSAGE_SIZE;
+
+// A message received from the remote.
+struct Incoming {
+    easelcomm_kmsg_desc desc;
+    std::vector<char> data;
+};
+
+// A DMA source buffer received from the remote.
+struct DmaSource {
+    int fd;
+    size_t size;
+};
+
+// A memfd mapped for gathering user DMA source buffers.
+struct StagingBuffer {
+    int fd;
+    void *addr;
+    size_t size;
+};
+
+/*
+ * A DMA buffer registered with EASELCOMM_IOC_REGBUF.  A dma-buf is held and
+ * mapped for as long as it is registered, so transfers skip mapping it.
+ */
+struct Registration {
+    void *buf;       // The user buffer, or the mapped dma-buf.
+    int dma_buf_fd;  // Duplicate of the dma-buf fd, -1 for a user buffer.
+    size_t size;
+
+    ~Registration() {
+        if (dma_buf_fd >= 0) {
+            munmap(buf, size);
+            ::close(dma_buf_fd);
+        }
+    }
+};
+
+static bool is_dma_discard(const easelcomm_kbuf_desc *buf_desc) {
+    return buf_desc->buf_type == EASELCOMM_DMA_BUFFER_UNUSED ||
+           (buf_desc->buf_type == EASELCOMM_DMA_BUFFER_USER &&
+            buf_desc->buf == nullptr);
+}
+
+/*
+ * Copy size bytes between mapped and a buffer of type buf_type, given by buf
+ * for a user buffer or by dma_buf_fd for a dma-buf.  Copies into the buffer if
+ * to_buf is true, otherwise out of it.
+ *
+ * Returns 0 for success, -errno for failure.
+ */
+static int copy_buffer(char *mapped, size_t size, int buf_type, void *buf,
+                       int dma_buf_fd, bool to_buf) {
+    switch (buf_type) {
+        case EASELCOMM_DMA_BUFFER_USER:
+            if (buf == nullptr) {
+                return -EINVAL;
+            }
+            if (to_buf) {
+                memcpy(buf, mapped, size);
+            } else {
+                memcpy(mapped, buf, size);
+            }
+            return 0;
+        case EASELCOMM_DMA_BUFFER_DMA_BUF: {
+            void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, dma_buf_fd, 0);
+            if (addr == MAP_FAILED) {
+                return -errno;
+            }
+            if (to_buf) {
+                memcpy(addr, mapped, size);
+            } else {
+                memcpy(mapped, addr, size);
+            }
+            munmap(addr, size);
+            return 0;
+        }
+        default:
+            return -EINVAL;
+    }
+}
+
+/*
+ * Same as copy_buffer() for the DMA buffer described by buf_desc, which may
+ * be a scatter-gather list.  buf_desc must describe at least size bytes.
+ */
+static int copy_kbuf(char *mapped, size_t size,
+                     const easelcomm_kbuf_desc *buf_desc, bool to_buf) {
+    if (buf_desc->buf_size < size) {
+        return -EINVAL;
+    }
+    if (buf_desc->buf_type != EASELCOMM_DMA_BUFFER_SG_LIST) {
+        return copy_buffer(mapped, size, buf_desc->buf_type, buf_desc->buf,
+                           buf_desc->dma_buf_fd, to_buf);
+    }
+
+    const easelcomm_dma_sg_list *list =
+            static_cast<const easelcomm_dma_sg_list *>(buf_desc->buf);
+    if (list == nullptr || list->count > EASELCOMM_MAX_DMA_SEGMENTS) {
+        return -EINVAL;
+    }
+    size_t offset = 0;
+    for (uint32_t i = 0; i < list->count && offset < size; i++) {
+        const easelcomm_dma_segment *segment = &list->segments[i];
+        size_t len = std::min<size_t>(segment->buf_size, size - offset);
+        int ret = copy_buffer(mapped + offset, len, segment->buf_type,
+                              segment->buf, segment->dma_buf_fd, to_buf);
+        if (ret) {
+            return ret;
+        }
+        offset += len;
+    }
+    return offset == size ? 0 : -EINVAL;
+}
+
+/*
+ * Wait for the server to accept the connection on sock, for up to timeout_ms
+ * unless negative.  Returns 0 for success, -errno for failure.
+ */
+static int wait_accepted(int sock, int timeout_ms) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return -errno;
+    }
+    if (ret == 0) {
+        return -ETIME;
+    }
+
+    Packet packet;
+    ssize_t n = recv(sock, &packet, sizeof(packet), 0);
+    if (n != sizeof(packet) || packet.type != PACKET_ACCEPTED) {
+        return -ECONNREFUSED;
+    }
+    return 0;
+}
+
+static void release_staging_buffer(const StagingBuffer &buffer) {
+    munmap(buffer.addr, buffer.size);
+    ::close(buffer.fd);
+}
+
+/*
+ * One side of an emulated link, standing in for an open easelcomm device.
+ *
+ * A reader thread accepts the connection (server side) and queues incoming
+ * packets.  ioctls run on the caller threads and wait on mCond for the
+ * packets they need.
+ *
+ * When the connection is lost, waiters are evicted with ESHUTDOWN and the
+ * state of the link is dropped.  The server then waits for the next client
+ * connection, while the client stays shut down until reopened, as with the
+ * easelcomm driver.
+ */
+class Endpoint {
+public:
+    explicit Endpoint(bool server);
+    ~Endpoint();
+
+    /*
+     * Listen on (server) or connect to (client) the socket at path.
+     * Returns 0 for success, -errno for failure.
+     */
+    int start(const std::string &path, long timeout_ms);
+
+    // Handle an easelcomm ioctl.  Returns 0 for success, -errno for failure.
+    int ioctl(unsigned long request, void *arg);
+
+    // Shut the link down and join the reader thread.
+    void shutdown();
+
+private:
+    int sendMsg(easelcomm_kmsg_desc *kmsg_desc);
+    int sendMsgs(easelcomm_kmsg_batch *batch);
+    int writeData(const easelcomm_kbuf_desc *buf_desc);
+    int readData(const easelcomm_kbuf_desc *buf_desc);
+    int sendDma(const easelcomm_kbuf_desc *buf_desc);
+    int recvDma(const easelcomm_kbuf_desc *buf_desc);
+    int waitMsg(easelcomm_kmsg_desc *kmsg_desc);
+    int waitReply(easelcomm_kmsg_desc *kmsg_desc);
+    int flush();
+    int registerBuffer(easelcomm_buf_registration *reg);
+    int unregisterBuffer(uint32_t handle);
+
+    /*
+     * Resolve a DMA buffer descriptor of type EASELCOMM_DMA_BUFFER_REGISTERED
+     * into *resolved, a user buffer descriptor of the registered memory, and
+     * *reg, which keeps the registration alive during the transfer.  Other
+     * descriptors are copied as is and *reg is left null.
+     * Returns 0 for success, -errno for failure.
+     */
+    int resolveKbuf(const easelcomm_kbuf_desc *buf_desc,
+                    easelcomm_kbuf_desc *resolved,
+                    std::shared_ptr<Registration> *reg);
+
+    /*
+     * Wait on mCond until ready() returns true, for up to timeout_ms unless
+     * negative.  Returns 0 if ready, -ETIMEDOUT on timeout or -ESHUTDOWN if
+     * the link went down.
+     */
+    int waitLocked(std::unique_lock<std::mutex> &lock, int32_t timeout_ms,
+                   const std::function<bool()> &ready);
+
+    // Return an incoming message from WAITMSG or WAITREPLY.
+    void takeIncomingLocked(Incoming *incoming,
+                            easelcomm_kmsg_desc *kmsg_desc);
+
+    /*
+     * Send a packet followed by size bytes of data, attaching fd unless
+     * negative.  The server waits for a client to connect.
+     */
+    int sendPacket(const Packet &packet, const void *data, size_t size,
+                   int fd);
+
+    // Discard the DMA transfer of an incoming message.
+    void discardDmaLocked(easelcomm_msgid_t message_id);
+    int sendDmaDone(easelcomm_msgid_t message_id, int result);
+
+    // Discard incoming messages not returned by WAITMSG yet.
+    void discardInbox();
+
+    void readerLoop();
+    void receivePackets(int sock);
+    void handlePacket(const Packet &packet, const char *data, size_t size,
+                      int fd);
+    void linkDown();
+
+    int getStagingBuffer(size_t size, StagingBuffer *buffer);
+    void putStagingBuffer(const StagingBuffer &buffer);
+
+    const bool mServer;
+    std::string mPath;
+    int mListenFd;
+    std::thread mReaderThread;
+
+    // Serializes packet writes, and closing mSockFd against them.
+    std::mutex mSendMutex;
+
+    std::mutex mLock;
+    // Signaled whenever state guarded by mLock changes.
+    std::condition_variable mCond;
+    int mSockFd;              // Guarded by mLock, -1 while not connected.
+    bool mShutdown;           // Guarded by mLock.
+    uint64_t mLinkId;         // Guarded by mLock, bumped on link down.
+    easelcomm_msgid_t mNextMessageId;  // Guarded by mLock.
+    // Sent descriptors waiting for WRITEDATA, by local message ID.
+    std::map<easelcomm_msgid_t, easelcomm_kmsg_desc> mOutgoing;
+    // Incoming messages waiting for WAITMSG.
+    std::deque<Incoming> mInbox;
+    // Incoming replies waiting for WAITREPLY, by local ID replied to.
+    std::map<easelcomm_msgid_t, Incoming> mReplies;
+    // Local IDs whose WAITREPLY timed out, their replies are dropped.
+    std::set<easelcomm_msgid_t> mAbandonedReplies;
+    // Message data waiting for READDATA, by remote message ID.
+    std::map<easelcomm_msgid_t, std::vector<char>> mReading;
+    // DMA sources waiting for RECVDMA, by remote message ID.
+    std::map<easelcomm_msgid_t, DmaSource> mDmaSources;
+    // Remote message IDs whose DMA sources are discarded on arrival.
+    std::set<easelcomm_msgid_t> mDiscardedDma;
+    // Results of outgoing DMA transfers, by local message ID.
+    std::map<easelcomm_msgid_t, int> mDmaResults;
+    uint64_t mFlushRequests;  // Guarded by mLock.
+    uint64_t mFlushAcks;      // Guarded by mLock.
+    std::vector<StagingBuffer> mIdleStaging;  // Guarded by mLock.
+    // Registered DMA buffers by handle.  Kept across links, as the driver
+    // keeps them until the device is closed.  Guarded by mLock.
+    std::map<uint32_t, std::shared_ptr<Registration>> mRegistrations;
+    uint32_t mNextHandle;  // Guarded by mLock.
+};
+
+Endpoint::Endpoint(bool server)
+    : mServer(server),
+      mListenFd(-1),
+      mSockFd(-1),
+      mShutdown(false),
+      mLinkId(0),
+      mNextMessageId(0),
+      mFlushRequests(0),
+      mFlushAcks(0),
+      mNextHandle(0) {}
+
+Endpoint::~Endpoint() {
+    shutdown();
+    if (mListenFd >= 0) {
+        ::close(mListenFd);
+        unlink(mPath.c_str());
+    }
+    if (mSockFd >= 0) {
+        ::close(mSockFd);
+    }
+    for (auto &it : mDmaSources) {
+        ::close(it.second.fd);
+    }
+    for (auto &buffer : mIdleStaging) {
+        release_staging_buffer(buffer);
+    }
+}
+
+int Endpoint::start(const std::string &path, long timeout_ms) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    mPath = path;
+
+    if (mServer) {
+        mListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (mListenFd < 0) {
+            return -errno;
+        }
+        unlink(path.c_str());
+        if (bind(mListenFd, reinterpret_cast<struct sockaddr *>(&addr),
+                 sizeof(addr)) != 0 ||
+            listen(mListenFd, 1) != 0) {
+            int ret = -errno;
+            ALOGE("%s: Failed to listen on %s (%d)", __FUNCTION__,
+                  path.c_str(), ret);
+            return ret;
+        }
+    } else {
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        while (true) {
+            int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (sock < 0) {
+                return -errno;
+            }
+            int ret = 0;
+            if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr),
+                        sizeof(addr)) != 0) {
+                ret = -errno;
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long diff_ms = (now.tv_sec - begin.tv_sec) * 1000
+                           + (now.tv_nsec - begin.tv_nsec) / 1000000;
+
+            if (ret == 0) {
+                /*
+                 * The server accepts one client at a time; wait for it so
+                 * that it sees the link up once open() returns.
+                 */
+                long remaining_ms = timeout_ms - diff_ms;
+                ret = wait_accepted(sock, timeout_ms > 0
+                                    ? std::max(remaining_ms, 1L) : -1);
+                if (ret == 0) {
+                    mSockFd = sock;
+                    break;
+                }
+                ::close(sock);
+                return ret;
+            }
+
+            ::close(sock);
+            if (ret != -ENOENT && ret != -ECONNREFUSED) {
+                return ret;
+            }
+            if (diff_ms > timeout_ms) {
+                return -ETIME;
+            }
+            usleep(kConnectPollIntervalUs);  // Sleep to reduce retry attempts
+        }
+    }
+
+    mReaderThread = std::thread(&Endpoint::readerLoop, this);
+    return 0;
+}
+
+void Endpoint::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mShutdown = true;
+        if (mListenFd >= 0) {
+            ::shutdown(mListenFd, SHUT_RDWR);
+        }
+        if (mSockFd >= 0) {
+            ::shutdown(mSockFd, SHUT_RDWR);
+        }
+    }
+    mCond.notify_all();
+    if (mReaderThread.joinable()) {
+        mReaderThread.join();
+    }
+}
+
+int Endpoint::ioctl(unsigned long request, void *arg) {
+    switch (request) {
+        case EASELCOMM_IOC_REGISTER:
+            // Registered by open().
+            return 0;
+        case EASELCOMM_IOC_SENDMSG:
+            return sendMsg(static_cast<easelcomm_kmsg_desc *>(arg));
+        case EASELCOMM_IOC_SENDMSGS:
+            return sendMsgs(static_cast<easelcomm_kmsg_batch *>(arg));
+        case EASELCOMM_IOC_WRITEDATA:
+            return writeData(static_cast<easelcomm_kbuf_desc *>(arg));
+        case EASELCOMM_IOC_READDATA:
+            return readData(static_cast<easelcomm_kbuf_desc *>(arg));
+        case EASELCOMM_IOC_SENDDMA:
+            return sendDma(static_cast<easelcomm_kbuf_desc *>(arg));
+        case EASELCOMM_IOC_RECVDMA:
+            return recvDma(static_cast<easelcomm_kbuf_desc *>(arg));
+        case EASELCOMM_IOC_WAITMSG:
+            return waitMsg(static_cast<easelcomm_kmsg_desc *>(arg));
+        case EASELCOMM_IOC_WAITREPLY:
+            return waitReply(static_cast<easelcomm_kmsg_desc *>(arg));
+        case EASELCOMM_IOC_FLUSH:
+            return flush();
+        case EASELCOMM_IOC_REGBUF:
+            return registerBuffer(
+                    static_cast<easelcomm_buf_registration *>(arg));
+        case EASELCOMM_IOC_UNREGBUF:
+            return unregisterBuffer(
+                    static_cast<uint32_t>(reinterpret_cast<uintptr_t>(arg)));
+        case EASELCOMM_IOC_SHUTDOWN:
+            shutdown();
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+int Endpoint::waitLocked(std::unique_lock<std::mutex> &lock,
+                         int32_t timeout_ms,
+                         const std::function<bool()> &ready) {
+    uint64_t link_id = mLinkId;
+    auto done = [&] { return ready() || mShutdown || mLinkId != link_id; };
+    if (timeout_ms < 0) {
+        mCond.wait(lock, done);
+    } else if (!mCond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               done)) {
+        return -ETIMEDOUT;
+    }
+    return ready() ? 0 : -ESHUTDOWN;
+}
+
+int Endpoint::sendMsg(easelcomm_kmsg_desc *kmsg_desc) {
+    if (kmsg_desc->message_size > EASELCOMM_MAX_MESSAGE_SIZE) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mShutdown) {
+        return -ESHUTDOWN;
+    }
+    kmsg_desc->message_id = ++mNextMessageId;
+    mOutgoing[kmsg_desc->message_id] = *kmsg_desc;
+    return 0;
+}
+
+int Endpoint::sendMsgs(easelcomm_kmsg_batch *batch) {
+    if (batch->count > EASELCOMM_MAX_BATCH_COUNT) {
+        return -EINVAL;
+    }
+    batch->sent = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        easelcomm_kmsg_batch_entry *entry = &batch->entries[i];
+        if (entry->kmsg.need_reply) {
+            return -EINVAL;
+        }
+        int ret = sendMsg(&entry->kmsg);
+        if (ret) {
+            return ret;
+        }
+        entry->msg_buf.message_id = entry->kmsg.message_id;
+        ret = writeData(&entry->msg_buf);
+        if (ret) {
+            return ret;
+        }
+        if (entry->kmsg.dma_buf_size) {
+            entry->dma_buf.message_id = entry->kmsg.message_id;
+            ret = sendDma(&entry->dma_buf);
+            if (ret) {
+                return ret;
+            }
+        }
+        batch->sent = i + 1;
+    }
+    return 0;
+}
+
+int Endpoint::writeData(const easelcomm_kbuf_desc *buf_desc) {
+    easelcomm_kmsg_desc kmsg_desc;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mOutgoing.find(buf_desc->message_id);
+        if (it == mOutgoing.end()) {
+            return mShutdown ? -ESHUTDOWN : -EINVAL;
+        }
+        kmsg_desc = it->second;
+        mOutgoing.erase(it);
+    }
+    if (kmsg_desc.message_size &&
+        (buf_desc->buf == nullptr ||
+         buf_desc->buf_size < kmsg_desc.message_size)) {
+        return -EINVAL;
+    }
+
+    Packet packet = {};
+    packet.type = PACKET_MSG;
+    packet.desc = kmsg_desc;
+    return sendPacket(packet, buf_desc->buf, kmsg_desc.message_size, -1);
+}
+
+int Endpoint::readData(const easelcomm_kbuf_desc *buf_desc) {
+    std::vector<char> data;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mReading.find(buf_desc->message_id);
+        if (it == mReading.end()) {
+            // Messages without data are not kept around.
+            return buf_desc->buf_size == 0 ? 0 : -EINVAL;
+        }
+        data = std::move(it->second);
+        mReading.erase(it);
+    }
+    if (buf_desc->buf == nullptr) {
+        // Discarded.
+        return 0;
+    }
+    if (buf_desc->buf_size < data.size()) {
+        return -EINVAL;
+    }
+    memcpy(buf_desc->buf, data.data(), data.size());
+    return 0;
+}
+
+int Endpoint::sendDma(const easelcomm_kbuf_desc *orig_buf_desc) {
+    easelcomm_msgid_t message_id = orig_buf_desc->message_id;
+    StagingBuffer staging = {-1, nullptr, 0};
+    easelcomm_kbuf_desc resolved;
+    std::shared_ptr<Registration> reg;
+    int fd;
+
+    int ret = resolveKbuf(orig_buf_desc, &resolved, &reg);
+    if (ret) {
+        return ret;
+    }
+    const easelcomm_kbuf_desc *buf_desc = &resolved;
+
+    if (buf_desc->buf_type == EASELCOMM_DMA_BUFFER_DMA_BUF) {
+        // Shared with the remote as is.
+        fd = buf_desc->dma_buf_fd;
+    } else if (reg != nullptr && reg->dma_buf_fd >= 0) {
+        // A registered dma-buf, shared from its start.
+        fd = reg->dma_buf_fd;
+    } else {
+        ret = getStagingBuffer(buf_desc->buf_size, &staging);
+        if (ret) {
+            return ret;
+        }
+        ret = copy_kbuf(static_cast<char *>(staging.addr),
+                        buf_desc->buf_size, buf_desc, /*to_buf=*/false);
+        if (ret) {
+            putStagingBuffer(staging);
+            return ret;
+        }
+        fd = staging.fd;
+    }
+
+    Packet packet = {};
+    packet.type = PACKET_DMA_DATA;
+    packet.desc.message_id = message_id;
+    packet.desc.dma_buf_size = buf_desc->buf_size;
+    ret = sendPacket(packet, nullptr, 0, fd);
+    bool done = false;
+    if (ret == 0) {
+        std::unique_lock<std::mutex> lock(mLock);
+        ret = waitLocked(lock, buf_desc->wait.timeout_ms, [&] {
+            return mDmaResults.count(message_id) != 0;
+        });
+        if (ret == 0) {
+            done = true;
+            ret = mDmaResults[message_id];
+            mDmaResults.erase(message_id);
+        }
+    }
+
+    if (staging.fd >= 0) {
+        if (done || ret == -EINVAL) {
+            putStagingBuffer(staging);
+        } else {
+            // The remote may still read it.
+            release_staging_buffer(staging);
+        }
+    }
+    return ret;
+}
+
+int Endpoint::recvDma(const easelcomm_kbuf_desc *orig_buf_desc) {
+    easelcomm_msgid_t message_id = orig_buf_desc->message_id;
+    bool discard = is_dma_discard(orig_buf_desc);
+    easelcomm_kbuf_desc resolved;
+    std::shared_ptr<Registration> reg;
+    DmaSource source;
+
+    int ret = resolveKbuf(orig_buf_desc, &resolved, &reg);
+    if (ret) {
+        return ret;
+    }
+    const easelcomm_kbuf_desc *buf_desc = &resolved;
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        if (discard) {
+            discardDmaLocked(message_id);
+            lock.unlock();
+            return sendDmaDone(message_id, 0);
+        }
+        ret = waitLocked(lock, buf_desc->wait.timeout_ms, [&] {
+            return mDmaSources.count(message_id) != 0;
+        });
+        if (ret) {
+            return ret;
+        }
+        source = mDmaSources[message_id];
+        mDmaSources.erase(message_id);
+    }
+
+    int result = 0;
+    void *mapped = mmap(nullptr, source.size, PROT_READ, MAP_SHARED,
+                        source.fd, 0);
+    if (mapped == MAP_FAILED) {
+        result = -errno;
+    } else {
+        result = copy_kbuf(static_cast<char *>(mapped), source.size,
+                           buf_desc, /*to_buf=*/true);
+        munmap(mapped, source.size);
+    }
+    ::close(source.fd);
+
+    ret = sendDmaDone(message_id, result);
+    return result ? result : ret;
+}
+
+int Endpoint::registerBuffer(easelcomm_buf_registration *reg) {
+    if (reg->buf_size == 0) {
+        return -EINVAL;
+    }
+
+    auto registration = std::make_shared<Registration>();
+    registration->size = reg->buf_size;
+    switch (reg->buf_type) {
+        case EASELCOMM_DMA_BUFFER_USER:
+            if (reg->buf == nullptr) {
+                return -EINVAL;
+            }
+            registration->buf = reg->buf;
+            registration->dma_buf_fd = -1;
+            break;
+        case EASELCOMM_DMA_BUFFER_DMA_BUF: {
+            int fd = fcntl(reg->dma_buf_fd, F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                return -errno;
+            }
+            void *addr = mmap(nullptr, reg->buf_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                int ret = -errno;
+                ::close(fd);
+                return ret;
+            }
+            registration->buf = addr;
+            registration->dma_buf_fd = fd;
+            break;
+        }
+        default:
+            return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    do {
+        mNextHandle++;
+    } while (mNextHandle == 0 || mRegistrations.count(mNextHandle));
+    mRegistrations[mNextHandle] = registration;
+    reg->handle = mNextHandle;
+    return 0;
+}
+
+int Endpoint::unregisterBuffer(uint32_t handle) {
+    std::shared_ptr<Registration> registration;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mRegistrations.find(handle);
+        if (it == mRegistrations.end()) {
+            return -EINVAL;
+        }
+        // Released here, or after the transfers still using it.
+        registration = std::move(it->second);
+        mRegistrations.erase(it);
+    }
+    return 0;
+}
+
+int Endpoint::resolveKbuf(const easelcomm_kbuf_desc *buf_desc,
+                          easelcomm_kbuf_desc *resolved,
+                          std::shared_ptr<Registration> *reg) {
+    *resolved = *buf_desc;
+    if (buf_desc->buf_type != EASELCOMM_DMA_BUFFER_REGISTERED) {
+        return 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mRegistrations.find(
+                static_cast<uint32_t>(buf_desc->dma_buf_fd));
+        if (it == mRegistrations.end()) {
+            return -EINVAL;
+        }
+        *reg = it->second;
+    }
+
+    // A user registration is addressed by buf, a dma-buf from its start.
+    char *base = static_cast<char *>((*reg)->buf);
+    char *start = (*reg)->dma_buf_fd >= 0
+            ? base : static_cast<char *>(buf_desc->buf);
+    if (start < base || buf_desc->buf_size > (*reg)->size ||
+        static_cast<size_t>(start - base) >
+                (*reg)->size - buf_desc->buf_size) {
+        return -EINVAL;
+    }
+    resolved->buf = start;
+    resolved->dma_buf_fd = -1;
+    resolved->buf_type = EASELCOMM_DMA_BUFFER_USER;
+    return 0;
+}
+
+void Endpoint::takeIncomingLocked(Incoming *incoming,
+                                  easelcomm_kmsg_desc *kmsg_desc) {
+    easelcomm_wait wait = kmsg_desc->wait;
+    *kmsg_desc = incoming->desc;
+    kmsg_desc->wait = wait;
+    if (!incoming->data.empty()) {
+        mReading[kmsg_desc->message_id] = std::move(incoming->data);
+    }
+}
+
+int Endpoint::waitMsg(easelcomm_kmsg_desc *kmsg_desc) {
+    std::unique_lock<std::mutex> lock(mLock);
+    int ret = waitLocked(lock, kmsg_desc->wait.timeout_ms,
+                         [&] { return !mInbox.empty(); });
+    if (ret) {
+        return ret;
+    }
+    Incoming incoming = std::move(mInbox.front());
+    mInbox.pop_front();
+    takeIncomingLocked(&incoming, kmsg_desc);
+    return 0;
+}
+
+int Endpoint::waitReply(easelcomm_kmsg_desc *kmsg_desc) {
+    easelcomm_msgid_t message_id = kmsg_desc->message_id;
+    std::unique_lock<std::mutex> lock(mLock);
+    int ret = waitLocked(lock, kmsg_desc->wait.timeout_ms, [&] {
+        return mReplies.count(message_id) != 0;
+    });
+    if (ret == -ETIMEDOUT) {
+        // Like the driver, forget the waiter so a late reply is not kept.
+        mAbandonedReplies.insert(message_id);
+    }
+    if (ret) {
+        return ret;
+    }
+    Incoming incoming = std::move(mReplies[message_id]);
+    mReplies.erase(message_id);
+    takeIncomingLocked(&incoming, kmsg_desc);
+    return 0;
+}
+
+int Endpoint::flush() {
+    uint64_t target = 0;
+    bool connected;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        connected = mSockFd >= 0;
+        if (connected) {
+            target = ++mFlushRequests;
+        }
+    }
+
+    if (connected) {
+        /*
+         * Once the remote acknowledges, every message it sent before
+         * flushing is in the inbox and is discarded below.
+         */
+        Packet packet = {};
+        packet.type = PACKET_FLUSH;
+        int ret = sendPacket(packet, nullptr, 0, -1);
+        if (ret == 0) {
+            std::unique_lock<std::mutex> lock(mLock);
+            ret = waitLocked(lock, -1, [&] { return mFlushAcks >= target; });
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+
+    discardInbox();
+    return 0;
+}
+
+void Endpoint::discardDmaLocked(easelcomm_msgid_t message_id) {
+    auto it = mDmaSources.find(message_id);
+    if (it != mDmaSources.end()) {
+        ::close(it->second.fd);
+        mDmaSources.erase(it);
+    } else {
+        mDiscardedDma.insert(message_id);
+    }
+}
+
+int Endpoint::sendDmaDone(easelcomm_msgid_t message_id, int result) {
+    Packet packet = {};
+    packet.type = PACKET_DMA_DONE;
+    packet.result = result;
+    packet.desc.message_id = message_id;
+    return sendPacket(packet, nullptr, 0, -1);
+}
+
+void Endpoint::discardInbox() {
+    std::vector<easelcomm_msgid_t> dma_ids;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto &incoming : mInbox) {
+            if (incoming.desc.dma_buf_size) {
+                discardDmaLocked(incoming.desc.message_id);
+                dma_ids.push_back(incoming.desc.message_id);
+            }
+        }
+        mInbox.clear();
+    }
+    for (auto message_id : dma_ids) {
+        sendDmaDone(message_id, 0);
+    }
+}
+
+int Endpoint::sendPacket(const Packet &packet, const void *data, size_t size,
+                         int fd) {
+    uint64_t link_id;
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait(lock, [&] { return mShutdown || mSockFd >= 0; });
+        if (mShutdown) {
+            return -ESHUTDOWN;
+        }
+        link_id = mLinkId;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<Packet *>(&packet);
+    iov[0].iov_len = sizeof(packet);
+    iov[1].iov_base = const_cast<void *>(data);
+    iov[1].iov_len = size;
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size ? 2 : 1;
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    std::lock_guard<std::mutex> send_lock(mSendMutex);
+    int sock;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mLinkId != link_id || mSockFd < 0) {
+            return -ESHUTDOWN;
+        }
+        sock = mSockFd;
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EPIPE || errno == ECONNRESET) {
+            return -ESHUTDOWN;
+        }
+        return -errno;
+    }
+    return 0;
+}
+
+void Endpoint::readerLoop() {
+    while (true) {
+        int sock;
+        if (mServer) {
+            sock = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mLock);
+            if (mShutdown) {
+                ::close(sock);
+                break;
+            }
+            mSockFd = sock;
+            mCond.notify_all();
+            Packet accepted = {};
+            accepted.type = PACKET_ACCEPTED;
+            send(sock, &accepted, sizeof(accepted), MSG_NOSIGNAL);
+        } else {
+            std::lock_guard<std::mutex> lock(mLock);
+            sock = mSockFd;
+        }
+
+        receivePackets(sock);
+        linkDown();
+        if (!mServer) {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mShutdown = true;
+    mCond.notify_all();
+}
+
+void Endpoint::receivePackets(int sock) {
+    std::vector<char> buf(kMaxPacketSize);
+    while (true) {
+        struct iovec iov;
+        iov.iov_base = buf.data();
+        iov.iov_len = buf.size();
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+
+        int fd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            static_cast<size_t>(n) < sizeof(Packet)) {
+            ALOGE("%s: Malformed packet of %zd bytes", __FUNCTION__, n);
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return;
+        }
+
+        Packet packet;
+        memcpy(&packet, buf.data(), sizeof(packet));
+        handlePacket(packet, buf.data() + sizeof(packet), n - sizeof(packet),
+                     fd);
+    }
+}
+
+void Endpoint::handlePacket(const Packet &packet, const char *data,
+                            size_t size, int fd) {
+    easelcomm_msgid_t message_id = packet.desc.message_id;
+
+    switch (packet.type) {
+        case PACKET_MSG: {
+            if (size != packet.desc.message_size) {
+                ALOGE("%s: Message %" PRIu64 " has %zu of %u bytes",
+                      __FUNCTION__, static_cast<uint64_t>(message_id), size,
+                      packet.desc.message_size);
+                break;
+            }
+            Incoming incoming;
+            incoming.desc = packet.desc;
+            incoming.data.assign(data, data + size);
+            std::unique_lock<std::mutex> lock(mLock);
+            if (packet.desc.in_reply_to &&
+                mAbandonedReplies.erase(packet.desc.in_reply_to)) {
+                // Nobody waits for this reply any more.
+                if (packet.desc.dma_buf_size) {
+                    discardDmaLocked(message_id);
+                    lock.unlock();
+                    sendDmaDone(message_id, 0);
+                }
+                break;
+            }
+            if (packet.desc.in_reply_to) {
+                mReplies[packet.desc.in_reply_to] = std::move(incoming);
+            } else {
+                mInbox.push_back(std::move(incoming));
+            }
+            mCond.notify_all();
+            break;
+        }
+        case PACKET_DMA_DATA: {
+            if (fd < 0) {
+                ALOGE("%s: DMA source of message %" PRIu64 " has no fd",
+                      __FUNCTION__, static_cast<uint64_t>(message_id));
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mLock);
+            if (mDiscardedDma.erase(message_id)) {
+                break;
+            }
+            mDmaSources[message_id] = {fd, packet.desc.dma_buf_size};
+            fd = -1;
+            mCond.notify_all();
+            break;
+        }
+        case PACKET_DMA_DONE: {
+            std::lock_guard<std::mutex> lock(mLock);
+            mDmaResults[message_id] = packet.result;
+            mCond.notify_all();
+            break;
+        }
+        case PACKET_FLUSH: {
+            discardInbox();
+            Packet done = {};
+            done.type = PACKET_FLUSH_DONE;
+            sendPacket(done, nullptr, 0, -1);
+            break;
+        }
+        case PACKET_FLUSH_DONE: {
+            std::lock_guard<std::mutex> lock(mLock);
+            mFlushAcks++;
+            mCond.notify_all();
+            break;
+        }
+        default:
+            ALOGE("%s: Unknown packet type %u", __FUNCTION__, packet.type);
+            break;
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void Endpoint::linkDown() {
+    std::lock_guard<std::mutex> send_lock(mSendMutex);
+    std::lock_guard<std::mutex> lock(mLock);
+    ::close(mSockFd);
+    mSockFd = -1;
+    mLinkId++;
+    if (!mServer) {
+        mShutdown = true;
+    }
+
+    // Messages of the lost link are dropped along with their DMA sources.
+    mOutgoing.clear();
+    mInbox.clear();
+    mReplies.clear();
+    mAbandonedReplies.clear();
+    mReading.clear();
+    for (auto &it : mDmaSources) {
+        ::close(it.second.fd);
+    }
+    mDmaSources.clear();
+    mDiscardedDma.clear();
+    mDmaResults.clear();
+    mFlushAcks = mFlushRequests;
+    mCond.notify_all();
+}
+
+int Endpoint::getStagingBuffer(size_t size, StagingBuffer *buffer) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto it = mIdleStaging.begin(); it != mIdleStaging.end(); ++it) {
+            if (it->size >= size) {
+                *buffer = *it;
+                mIdleStaging.erase(it);
+                return 0;
+            }
+        }
+    }
+
+    int fd = syscall(__NR_memfd_create, "easelcomm-dma", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (ftruncate(fd, size) != 0) {
+        int ret = -errno;
+        ::close(fd);
+        return ret;
+    }
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        int ret = -errno;
+        ::close(fd);
+        return ret;
+    }
+    *buffer = {fd, addr, size};
+    return 0;
+}
+
+void Endpoint::putStagingBuffer(const StagingBuffer &buffer) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mIdleStaging.size() < kMaxIdleStagingBuffers) {
+            mIdleStaging.push_back(buffer);
+            return;
+        }
+    }
+    release_staging_buffer(buffer);
+}
+
+std::mutex gEndpointsMutex;
+// Open emulated devices by handle fd.  Guarded by gEndpointsMutex.
+std::map<int, std::shared_ptr<Endpoint>> gEndpoints;
+// Number of entries in gEndpoints, to skip the lookup when none is open.
+std::atomic<int> gEndpointCount(0);
+
+}  // anonymous namespace
+
+const char *getDirFromEnv() {
+    const char *dir = getenv(kDirEnv);
+    return (dir == nullptr || dir[0] == '\0') ? nullptr : dir;
+}
+
+int open(const char *dir, EaselService service_id, bool server,
+         long timeout_ms) {
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        int ret = -errno;
+        ALOGE("%s: Failed to create %s (%d)", __FUNCTION__, dir, ret);
+        return ret;
+    }
+
+    std::string path =
+            std::string(dir) + "/easelcomm-" + std::to_string(service_id);
+    auto endpoint = std::make_shared<Endpoint>(server);
+    int ret = endpoint->start(path, timeout_ms);
+    if (ret) {
+        return ret;
+    }
+
+    int handle = eventfd(0, EFD_CLOEXEC);
+    if (handle < 0) {
+        return -errno;
+    }
+    std::lock_guard<std::mutex> lock(gEndpointsMutex);
+    gEndpoints[handle] = endpoint;
+    gEndpointCount++;
+    return handle;
+}
+
+int ioctl(int fd, unsigned long request, void *arg) {
+    std::shared_ptr<Endpoint> endpoint;
+    if (gEndpointCount > 0) {
+        std::lock_guard<std::mutex> lock(gEndpointsMutex);
+        auto it = gEndpoints.find(fd);
+        if (it != gEndpoints.end()) {
+            endpoint = it->second;
+            if (request == EASELCOMM_IOC_SHUTDOWN) {
+                // The handle is closed next and its number may be reused.
+                gEndpoints.erase(it);
+                gEndpointCount--;
+            }
+        }
+    }
+    if (endpoint == nullptr) {
+        return ::ioctl(fd, request, arg);
+    }
+
+    int ret = endpoint->ioctl(request, arg);
+    if (ret) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+}  // namespace EaselCommEmulator
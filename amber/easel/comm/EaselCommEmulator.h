@@ -0,0 +1,66 @@
+#ifndef GOOGLE_PAINTBOX_EASELCOMM_EMULATOR_H
+#define GOOGLE_PAINTBOX_EASELCOMM_EMULATOR_H
+
+/*
+ * Userspace emulation of the easelcomm kernel driver, for running the AP and
+ * Easel sides of a service as two processes on one Linux host.
+ *
+ * An emulated device is a handle fd accepted by EaselCommEmulator::ioctl()
+ * in place of an fd for /dev/easelcomm-{client,server}.  It implements the
+ * same ioctls with the same semantics: replies, WAITMSG/WAITREPLY timeouts,
+ * FLUSH, SHUTDOWN, DMA, discarded DMA and DMA buffer registration.
+ *
+ * The client and server of a service meet on a SOCK_SEQPACKET Unix socket
+ * named easelcomm-<service_id> in the emulator directory.  Message data is
+ * carried on the socket.  A DMA source buffer is passed to the receiver as
+ * an fd: dma-buf fds are passed as is, user buffers are first gathered into
+ * a memfd.  The receiver maps the fd and copies into its destination buffer,
+ * so a DMA transfer costs one copy as with the DMA engine.
+ */
+
+#include "EaselService.h"
+
+namespace EaselCommEmulator {
+
+/*
+ * Environment variable naming the emulator directory.  When set,
+ * EaselCommClient and EaselCommServer open the emulator instead of the
+ * easelcomm driver.
+ */
+extern const char *const kDirEnv;
+
+// Emulator directory used when kDirEnv is not set.
+extern const char *const kDefaultDir;
+
+/*
+ * Returns the emulator directory from the environment, or nullptr if the
+ * emulator is not selected.
+ */
+const char *getDirFromEnv();
+
+/*
+ * Open an emulated easelcomm device registered for service_id, as the server
+ * if server is true, otherwise as the client.
+ *
+ * The server listens for the client and returns right away.  The client
+ * connects to the server, retrying for up to timeout_ms if the server is not
+ * listening yet.  Once either side shuts down, the other sees the link go
+ * down and must reopen.
+ *
+ * Returns a handle fd for ioctl(), or -errno for failure.  The handle is
+ * closed with ::close() after EASELCOMM_IOC_SHUTDOWN.
+ */
+int open(const char *dir, EaselService service_id, bool server,
+         long timeout_ms);
+
+/*
+ * Same as ::ioctl(), handling requests on emulated devices in userspace and
+ * passing the others to the kernel.
+ *
+ * Returns 0 for success, or -1 with errno set for failure.
+ */
+int ioctl(int fd, unsigned long request, void *arg);
+
+}  // namespace EaselCommEmulator
+
+#endif  // GOOGLE_PAINTBOX_EASELCOMM_EMULATOR_H
@@ -0,0 +1,289 @@
+/*
+ * Cache of DMA buffers registered with the easelcomm driver.
+ *
+ * Header file EaselCommRegistrationCache.h describes the cache.
+ */
+
+#define LOG_TAG "EaselComm"
+
+#include "EaselCommRegistrationCache.h"
+
+#include "EaselCommEmulator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/kcmp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <log/log.h>
+
+namespace {
+
+// False once kcmp() turned out to be unavailable, e.g. blocked by seccomp.
+static std::atomic<bool> kcmp_supported(true);
+
+/*
+ * Returns 1 if fd1 and fd2 refer to the same open file, 0 if not, or -errno
+ * if that cannot be told.
+ */
+static int same_file(int fd1, int fd2) {
+    pid_t pid = getpid();
+    long ret = syscall(__NR_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == 0;
+}
+
+// Returns the size of the dma-buf fd, or 0 if unknown.
+static size_t dma_buf_size(int fd) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    return size > 0 ? size : 0;
+}
+
+}  // anonymous namespace
+
+EaselCommRegistrationCache::EaselCommRegistrationCache(size_t capacity)
+    : mCapacity(capacity), mCached(0), mStats{}, mSupported(true) {}
+
+EaselCommRegistrationCache::~EaselCommRegistrationCache() {
+    reset();
+}
+
+int EaselCommRegistrationCache::registerBuffer(int fd, int buf_type,
+                                               void *buf, int dma_buf_fd,
+                                               size_t size,
+                                               BufferHandle *handle) {
+    if ((buf_type == EASELCOMM_DMA_BUFFER_USER && buf == nullptr) ||
+        (buf_type == EASELCOMM_DMA_BUFFER_DMA_BUF && dma_buf_fd < 0) ||
+        (buf_type != EASELCOMM_DMA_BUFFER_USER &&
+         buf_type != EASELCOMM_DMA_BUFFER_DMA_BUF) ||
+        size == 0 || handle == nullptr) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSupported) {
+        return -ENOTTY;
+    }
+    Iterator it;
+    int ret = addLocked(fd, buf_type, buf, dma_buf_fd, size, /*pinned=*/true,
+                        &it);
+    if (ret) {
+        return ret;
+    }
+    *handle = it->handle;
+    return 0;
+}
+
+int EaselCommRegistrationCache::unregisterBuffer(int fd,
+                                                 BufferHandle handle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto it = mRegistrations.begin(); it != mRegistrations.end(); ++it) {
+        if (it->handle != handle || !it->pinned) {
+            continue;
+        }
+        if (it->users) {
+            return -EBUSY;
+        }
+        removeLocked(fd, it);
+        return 0;
+    }
+    return -EINVAL;
+}
+
+void EaselCommRegistrationCache::setCapacity(int fd, size_t capacity) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCapacity = capacity;
+    evictLocked(fd);
+}
+
+void EaselCommRegistrationCache::getStats(RegistrationStats *stats) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    *stats = mStats;
+    stats->entries = mRegistrations.size();
+}
+
+EaselCommRegistrationCache::BufferHandle EaselCommRegistrationCache::acquire(
+        int fd, easelcomm_kbuf_desc *buf_desc) {
+    bool user = buf_desc->buf_type == EASELCOMM_DMA_BUFFER_USER;
+    if ((!user && buf_desc->buf_type != EASELCOMM_DMA_BUFFER_DMA_BUF) ||
+        (user && buf_desc->buf == nullptr) || buf_desc->buf_size == 0) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSupported) {
+        return 0;
+    }
+
+    Iterator it = findLocked(fd, buf_desc);
+    if (it != mRegistrations.end()) {
+        mStats.hits++;
+        mRegistrations.splice(mRegistrations.begin(), mRegistrations, it);
+    } else {
+        mStats.misses++;
+        if (user || mCapacity == 0 || !kcmp_supported) {
+            return 0;
+        }
+        size_t size = std::max<size_t>(dma_buf_size(buf_desc->dma_buf_fd),
+                                       buf_desc->buf_size);
+        if (addLocked(fd, EASELCOMM_DMA_BUFFER_DMA_BUF, nullptr,
+                      buf_desc->dma_buf_fd, size, /*pinned=*/false, &it)) {
+            return 0;
+        }
+    }
+
+    it->users++;
+    evictLocked(fd);
+
+    buf_desc->buf = user ? buf_desc->buf : nullptr;
+    buf_desc->dma_buf_fd = it->handle;
+    buf_desc->buf_type = EASELCOMM_DMA_BUFFER_REGISTERED;
+    return it->handle;
+}
+
+void EaselCommRegistrationCache::release(int fd, BufferHandle handle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &registration : mRegistrations) {
+        if (registration.handle == handle) {
+            registration.users--;
+            break;
+        }
+    }
+    evictLocked(fd);
+}
+
+void EaselCommRegistrationCache::reset() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &registration : mRegistrations) {
+        if (registration.dup_fd >= 0) {
+            close(registration.dup_fd);
+        }
+    }
+    mRegistrations.clear();
+    mCached = 0;
+}
+
+int EaselCommRegistrationCache::addLocked(int fd, int buf_type, void *buf,
+                                          int dma_buf_fd, size_t size,
+                                          bool pinned, Iterator *it) {
+    if (size > UINT32_MAX) {
+        return -EINVAL;
+    }
+
+    int dup_fd = -1;
+    if (buf_type == EASELCOMM_DMA_BUFFER_DMA_BUF) {
+        /*
+         * Held to tell the dma-buf apart from another one reusing its fd
+         * number later.  That takes kcmp(), without which only explicitly
+         * registered dma-bufs are cached.
+         */
+        dup_fd = fcntl(dma_buf_fd, F_DUPFD_CLOEXEC, 0);
+        if (dup_fd < 0) {
+            return -errno;
+        }
+        if (!pinned && same_file(dup_fd, dma_buf_fd) != 1) {
+            ALOGW("%s: kcmp unavailable, not caching dma-bufs", __FUNCTION__);
+            kcmp_supported = false;
+            close(dup_fd);
+            return -EOPNOTSUPP;
+        }
+    }
+
+    easelcomm_buf_registration reg = {};
+    reg.buf = buf;
+    reg.dma_buf_fd = dma_buf_fd;
+    reg.buf_type = buf_type;
+    reg.buf_size = size;
+    if (EaselCommEmulator::ioctl(fd, EASELCOMM_IOC_REGBUF, &reg) == -1) {
+        int ret = -errno;
+        if (dup_fd >= 0) {
+            close(dup_fd);
+        }
+        if (ret == -ENOTTY) {
+            // Transfers describe their buffers as before.
+            mSupported = false;
+        } else {
+            ALOGE("%s: REGBUF failed (%d)", __FUNCTION__, ret);
+        }
+        mStats.failures++;
+        return ret;
+    }
+
+    mRegistrations.push_front({reg.handle, buf_type, static_cast<char *>(buf),
+                               dma_buf_fd, dup_fd, size, pinned, 0});
+    if (!pinned) {
+        mCached++;
+    }
+    *it = mRegistrations.begin();
+    return 0;
+}
+
+void EaselCommRegistrationCache::removeLocked(int fd, Iterator it) {
+    if (EaselCommEmulator::ioctl(
+                fd, EASELCOMM_IOC_UNREGBUF,
+                reinterpret_cast<void *>(static_cast<uintptr_t>(it->handle)))
+        == -1) {
+        ALOGE("%s: UNREGBUF failed (%d)", __FUNCTION__, errno);
+    }
+    if (it->dup_fd >= 0) {
+        close(it->dup_fd);
+    }
+    if (!it->pinned) {
+        mCached--;
+    }
+    mRegistrations.erase(it);
+}
+
+void EaselCommRegistrationCache::evictLocked(int fd) {
+    auto it = mRegistrations.end();
+    while (mCached > mCapacity && it != mRegistrations.begin()) {
+        --it;
+        if (it->pinned || it->users) {
+            continue;
+        }
+        auto victim = it++;
+        removeLocked(fd, victim);
+        mStats.evictions++;
+    }
+}
+
+EaselCommRegistrationCache::Iterator EaselCommRegistrationCache::findLocked(
+        int fd, const easelcomm_kbuf_desc *buf_desc) {
+    for (auto it = mRegistrations.begin(); it != mRegistrations.end(); ++it) {
+        if (it->buf_type != buf_desc->buf_type ||
+            buf_desc->buf_size > it->size) {
+            continue;
+        }
+
+        if (it->buf_type == EASELCOMM_DMA_BUFFER_USER) {
+            char *start = static_cast<char *>(buf_desc->buf);
+            if (start >= it->buf &&
+                static_cast<size_t>(start - it->buf) <=
+                        it->size - buf_desc->buf_size) {
+                return it;
+            }
+            continue;
+        }
+
+        if (it->dma_buf_fd != buf_desc->dma_buf_fd) {
+            continue;
+        }
+        int same = same_file(it->dup_fd, buf_desc->dma_buf_fd);
+        if (same == 1 || (same < 0 && it->pinned)) {
+            return it;
+        }
+        if (same == 0 && !it->pinned && it->users == 0) {
+            // The fd number now refers to another dma-buf.
+            removeLocked(fd, it);
+            return mRegistrations.end();
+        }
+    }
+    return mRegistrations.end();
+}
@@ -0,0 +1,109 @@
+#ifndef GOOGLE_PAINTBOX_EASELCOMM_REGISTRATION_CACHE_H
+#define GOOGLE_PAINTBOX_EASELCOMM_REGISTRATION_CACHE_H
+
+/*
+ * Cache of DMA buffers registered with the easelcomm driver.
+ *
+ * The driver pins and maps a DMA buffer each time a transfer describes it by
+ * address or dma-buf fd.  A registered buffer is pinned and mapped once, and
+ * transfers name it with an EASELCOMM_DMA_BUFFER_REGISTERED descriptor
+ * carrying its handle instead.
+ *
+ * Buffers registered explicitly stay registered until unregistered.  In
+ * addition, dma-bufs used for transfers are registered on first use and kept
+ * in a least recently used cache of bounded size.  User buffers are only
+ * cached when registered explicitly, since the library cannot tell when
+ * their memory is unmapped and reused.
+ *
+ * Methods taking fd issue registration ioctls on it and are called with the
+ * EaselComm fd lock held as a reader.
+ */
+
+#include "easelcomm.h"
+
+#include <list>
+#include <mutex>
+
+class EaselCommRegistrationCache {
+public:
+    typedef EaselComm::BufferHandle BufferHandle;
+    typedef EaselComm::RegistrationStats RegistrationStats;
+
+    explicit EaselCommRegistrationCache(size_t capacity);
+    ~EaselCommRegistrationCache();
+
+    /*
+     * Register a DMA buffer, see EaselComm::registerBuffer().
+     * Returns 0 for success, -errno for failure.
+     */
+    int registerBuffer(int fd, int buf_type, void *buf, int dma_buf_fd,
+                       size_t size, BufferHandle *handle);
+
+    /*
+     * Unregister a buffer registered with registerBuffer().
+     * Returns 0 for success, -EINVAL if handle is unknown or -EBUSY if a
+     * transfer is using it.
+     */
+    int unregisterBuffer(int fd, BufferHandle handle);
+
+    // Set the number of cached dma-bufs, evicting idle ones over capacity.
+    void setCapacity(int fd, size_t capacity);
+
+    void getStats(RegistrationStats *stats);
+
+    /*
+     * Rewrite the DMA buffer descriptor buf_desc to use a registration of its
+     * buffer, registering a dma-buf on a miss.
+     *
+     * Returns the handle to pass to release() once the transfer is done, or
+     * 0 if buf_desc is left as is.
+     */
+    BufferHandle acquire(int fd, easelcomm_kbuf_desc *buf_desc);
+    void release(int fd, BufferHandle handle);
+
+    /*
+     * Forget all registrations, once the device they were made on is
+     * closed.  Statistics are kept.
+     */
+    void reset();
+
+private:
+    struct Registration {
+        BufferHandle handle;
+        int buf_type;
+        char *buf;          // Start of a user buffer.
+        int dma_buf_fd;     // dma-buf fd number given by the caller.
+        int dup_fd;         // Duplicate of the dma-buf, -1 for a user buffer.
+        size_t size;
+        bool pinned;        // Registered explicitly, never evicted.
+        uint32_t users;     // Transfers in progress using it.
+    };
+    typedef std::list<Registration>::iterator Iterator;
+
+    /*
+     * Register a buffer with the driver and insert it at the front of
+     * mRegistrations.  Returns 0 for success, -errno for failure.
+     */
+    int addLocked(int fd, int buf_type, void *buf, int dma_buf_fd,
+                  size_t size, bool pinned, Iterator *it);
+
+    // Unregister it from the driver and remove it.
+    void removeLocked(int fd, Iterator it);
+
+    // Evict idle cached dma-bufs, least recently used first, over capacity.
+    void evictLocked(int fd);
+
+    // Returns the registration covering buf_desc, or mRegistrations.end().
+    Iterator findLocked(int fd, const easelcomm_kbuf_desc *buf_desc);
+
+    std::mutex mMutex;
+    // Most recently used first.  Guarded by mMutex.
+    std::list<Registration> mRegistrations;
+    size_t mCapacity;           // Guarded by mMutex.
+    size_t mCached;             // Entries not pinned.  Guarded by mMutex.
+    RegistrationStats mStats;   // Guarded by mMutex; entries is unused.
+    // False once the driver has rejected EASELCOMM_IOC_REGBUF.
+    bool mSupported;            // Guarded by mMutex.
+};
+
+#endif  // GOOGLE_PAINTBOX_EASELCOMM_REGISTRATION_CACHE_H
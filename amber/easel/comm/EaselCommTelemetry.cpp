@@ -0,0 +1,181 @@
+/*
+ * Transport counters and latency histograms of an EaselComm object.
+ *
+ * Header file EaselCommTelemetry.h describes the counters.
+ */
+
+#define LOG_TAG "EaselComm"
+
+#include "EaselCommTelemetry.h"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace {
+
+static const int kBuckets = EaselComm::kTelemetryBuckets;
+
+// Bucket of a sample of us microseconds, see EaselComm::LatencyHistogram.
+static int bucket_of(uint64_t us) {
+    if (us == 0) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll(us);
+    return bucket < kBuckets ? bucket : kBuckets - 1;
+}
+
+/*
+ * Returns an upper bound of the percentile (0 to 1) of histogram, the upper
+ * end of the bucket it falls in.
+ */
+static uint64_t percentile_us(const EaselComm::LatencyHistogram &histogram,
+                              double percentile) {
+    if (histogram.count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percentile * histogram.count);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets - 1; i++) {
+        seen += histogram.buckets[i];
+        if (seen > rank) {
+            return std::min<uint64_t>(1ULL << i, histogram.max_us);
+        }
+    }
+    return histogram.max_us;
+}
+
+static void dump_histogram(int fd, const char *name,
+                           const EaselComm::LatencyHistogram &histogram) {
+    if (histogram.count == 0) {
+        dprintf(fd, "    %s: none\n", name);
+        return;
+    }
+    dprintf(fd, "    %s: %" PRIu64 " samples, avg %" PRIu64 " us, "
+            "p50 <= %" PRIu64 " us, p99 <= %" PRIu64 " us, max %" PRIu64
+            " us\n", name, histogram.count,
+            histogram.total_us / histogram.count,
+            percentile_us(histogram, 0.50), percentile_us(histogram, 0.99),
+            histogram.max_us);
+}
+
+static void dump_transfers(int fd, const char *name,
+                           const EaselComm::TransferStats &stats) {
+    dprintf(fd, "    %s: %" PRIu64 " messages, %" PRIu64 " bytes; %" PRIu64
+            " DMA transfers, %" PRIu64 " bytes\n", name, stats.messages,
+            stats.message_bytes, stats.dma_transfers, stats.dma_bytes);
+}
+
+}  // anonymous namespace
+
+void EaselCommTelemetry::Histogram::add(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_us.fetch_add(us, std::memory_order_relaxed);
+    buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = max_us.load(std::memory_order_relaxed);
+    while (us > max &&
+           !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void EaselCommTelemetry::Histogram::get(LatencyHistogram *histogram) const {
+    histogram->count = count.load(std::memory_order_relaxed);
+    histogram->total_us = total_us.load(std::memory_order_relaxed);
+    histogram->max_us = max_us.load(std::memory_order_relaxed);
+    for (int i = 0; i < kBuckets; i++) {
+        histogram->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+void EaselCommTelemetry::Histogram::reset() {
+    count = 0;
+    total_us = 0;
+    max_us = 0;
+    for (auto &bucket : buckets) {
+        bucket = 0;
+    }
+}
+
+EaselCommTelemetry::EaselCommTelemetry() {
+    reset();
+}
+
+void EaselCommTelemetry::addMessage(Direction direction,
+                                    uint64_t message_bytes) {
+    Transfers &transfers = mTransfers[direction];
+    transfers.messages.fetch_add(1, std::memory_order_relaxed);
+    transfers.message_bytes.fetch_add(message_bytes,
+                                      std::memory_order_relaxed);
+}
+
+void EaselCommTelemetry::addDma(Direction direction, uint64_t dma_bytes,
+                                uint64_t duration_ns) {
+    addUntimedDma(direction, dma_bytes);
+    mTransfers[direction].dma_us.add(duration_ns);
+}
+
+void EaselCommTelemetry::addUntimedDma(Direction direction,
+                                       uint64_t dma_bytes) {
+    Transfers &transfers = mTransfers[direction];
+    transfers.dma_transfers.fetch_add(1, std::memory_order_relaxed);
+    transfers.dma_bytes.fetch_add(dma_bytes, std::memory_order_relaxed);
+}
+
+void EaselCommTelemetry::addReply(uint64_t latency_ns) {
+    mReplyUs.add(latency_ns);
+}
+
+void EaselCommTelemetry::addQueueWait(uint64_t wait_ns) {
+    mQueueWaitUs.add(wait_ns);
+}
+
+void EaselCommTelemetry::addFlush() {
+    mFlushes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void EaselCommTelemetry::getTelemetry(Telemetry *telemetry) const {
+    TransferStats *stats[DIRECTION_COUNT] = {&telemetry->sent,
+                                             &telemetry->received};
+    for (int i = 0; i < DIRECTION_COUNT; i++) {
+        const Transfers &transfers = mTransfers[i];
+        stats[i]->messages = transfers.messages.load(std::memory_order_relaxed);
+        stats[i]->message_bytes =
+            transfers.message_bytes.load(std::memory_order_relaxed);
+        stats[i]->dma_transfers =
+            transfers.dma_transfers.load(std::memory_order_relaxed);
+        stats[i]->dma_bytes =
+            transfers.dma_bytes.load(std::memory_order_relaxed);
+        transfers.dma_us.get(&stats[i]->dma_us);
+    }
+    mReplyUs.get(&telemetry->reply_us);
+    mQueueWaitUs.get(&telemetry->queue_wait_us);
+    telemetry->flushes = mFlushes.load(std::memory_order_relaxed);
+}
+
+void EaselCommTelemetry::reset() {
+    for (auto &transfers : mTransfers) {
+        transfers.messages = 0;
+        transfers.message_bytes = 0;
+        transfers.dma_transfers = 0;
+        transfers.dma_bytes = 0;
+        transfers.dma_us.reset();
+    }
+    mReplyUs.reset();
+    mQueueWaitUs.reset();
+    mFlushes = 0;
+}
+
+void EaselCommTelemetry::dump(int fd, const Telemetry &telemetry) {
+    dprintf(fd, "  service %d (%s, %s):\n", telemetry.service_id,
+            telemetry.server ? "server" : "client",
+            telemetry.connected ? "connected" : "closed");
+    dump_transfers(fd, "sent", telemetry.sent);
+    dump_histogram(fd, "sent DMA", telemetry.sent.dma_us);
+    dump_transfers(fd, "received", telemetry.received);
+    dump_histogram(fd, "received DMA", telemetry.received.dma_us);
+    dump_histogram(fd, "reply latency", telemetry.reply_us);
+    dump_histogram(fd, "queue wait", telemetry.queue_wait_us);
+    dprintf(fd, "    flushes: %" PRIu64 "\n", telemetry.flushes);
+}
@@ -0,0 +1,79 @@
+#ifndef GOOGLE_PAINTBOX_EASELCOMM_TELEMETRY_H
+#define GOOGLE_PAINTBOX_EASELCOMM_TELEMETRY_H
+
+/*
+ * Transport counters and latency histograms of an EaselComm object.
+ *
+ * Always on, so every update is a few relaxed atomic operations without
+ * locking.  A snapshot taken while traffic flows may mix counters from
+ * before and after a concurrent update.
+ */
+
+#include "easelcomm.h"
+
+#include <atomic>
+
+class EaselCommTelemetry {
+public:
+    typedef EaselComm::LatencyHistogram LatencyHistogram;
+    typedef EaselComm::TransferStats TransferStats;
+    typedef EaselComm::Telemetry Telemetry;
+
+    enum Direction {
+        SENT = 0,
+        RECEIVED,
+        DIRECTION_COUNT,
+    };
+
+    EaselCommTelemetry();
+
+    // Count a message of message_bytes of message data.
+    void addMessage(Direction direction, uint64_t message_bytes);
+
+    // Count a DMA transfer of dma_bytes that took duration_ns.
+    void addDma(Direction direction, uint64_t dma_bytes, uint64_t duration_ns);
+
+    // Count a message sent in a batch of transfers whose time is unknown.
+    void addUntimedDma(Direction direction, uint64_t dma_bytes);
+
+    void addReply(uint64_t latency_ns);
+    void addQueueWait(uint64_t wait_ns);
+    void addFlush();
+
+    // Fill in all of *telemetry but service_id, server and connected.
+    void getTelemetry(Telemetry *telemetry) const;
+    void reset();
+
+    /*
+     * Write telemetry as text to fd, in the format of
+     * EaselComm::dumpTelemetry().
+     */
+    static void dump(int fd, const Telemetry &telemetry);
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total_us;
+        std::atomic<uint64_t> max_us;
+        std::atomic<uint64_t> buckets[EaselComm::kTelemetryBuckets];
+
+        void add(uint64_t ns);
+        void get(LatencyHistogram *histogram) const;
+        void reset();
+    };
+
+    struct Transfers {
+        std::atomic<uint64_t> messages;
+        std::atomic<uint64_t> message_bytes;
+        std::atomic<uint64_t> dma_transfers;
+        std::atomic<uint64_t> dma_bytes;
+        Histogram dma_us;
+    };
+
+    Transfers mTransfers[DIRECTION_COUNT];
+    Histogram mReplyUs;
+    Histogram mQueueWaitUs;
+    std::atomic<uint64_t> mFlushes;
+};
+
+#endif  // GOOGLE_PAINTBOX_EASELCOMM_TELEMETRY_H
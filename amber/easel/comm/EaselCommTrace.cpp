@@ -0,0 +1,158 @@
+/*
+ * Binary trace of EaselComm traffic.
+ *
+ * Header file EaselCommTrace.h describes the trace format.
+ */
+
+#define LOG_TAG "EaselComm"
+
+#include "EaselCommTrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+static_assert(sizeof(EaselCommTraceRecord) == 48,
+              "trace record layout must not change");
+
+namespace {
+
+// Write buffer of a trace file, so records rarely cost a system call.
+static const size_t kTraceBufferSize = 256 * 1024;
+
+}  // anonymous namespace
+
+EaselCommTraceWriter::EaselCommTraceWriter()
+    : mFile(nullptr), mPayloads(false), mStartNs(0) {}
+
+EaselCommTraceWriter::~EaselCommTraceWriter() {
+    close();
+}
+
+int EaselCommTraceWriter::open(const char *path, bool payloads) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFile != nullptr) {
+        return -EBUSY;
+    }
+
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int ret = -errno;
+        ALOGE("%s: Failed to create %s (%d)", __FUNCTION__, path, ret);
+        return ret;
+    }
+    mFile = fdopen(fd, "w");
+    if (mFile == nullptr) {
+        int ret = -errno;
+        ::close(fd);
+        return ret;
+    }
+    setvbuf(mFile, nullptr, _IOFBF, kTraceBufferSize);
+
+    mPayloads = payloads;
+    mStartNs = now();
+    EaselCommTraceHeader header = {EASELCOMM_TRACE_MAGIC,
+                                   EASELCOMM_TRACE_VERSION, mStartNs};
+    if (fwrite(&header, sizeof(header), 1, mFile) != 1) {
+        int ret = -errno;
+        fclose(mFile);
+        mFile = nullptr;
+        return ret ? ret : -EIO;
+    }
+    return 0;
+}
+
+void EaselCommTraceWriter::close() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFile != nullptr) {
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+bool EaselCommTraceWriter::isOpen() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFile != nullptr;
+}
+
+void EaselCommTraceWriter::write(EaselCommTraceRecord *record,
+                                 const void *data, uint64_t time_ns) {
+    if (time_ns == 0) {
+        time_ns = now();
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mFile == nullptr) {
+        return;
+    }
+    record->timestamp_ns = time_ns > mStartNs ? time_ns - mStartNs : 0;
+    record->payload_size =
+            (mPayloads && data != nullptr) ? record->message_size : 0;
+    record->reserved = 0;
+    if (fwrite(record, sizeof(*record), 1, mFile) != 1 ||
+        (record->payload_size &&
+         fwrite(data, record->payload_size, 1, mFile) != 1)) {
+        // Stop at a partial record rather than corrupting the rest.
+        ALOGE("%s: Failed to write trace (%d), recording stopped",
+              __FUNCTION__, -errno);
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+uint64_t EaselCommTraceWriter::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+EaselCommTraceReader::EaselCommTraceReader() : mFile(nullptr), mHeader{} {}
+
+EaselCommTraceReader::~EaselCommTraceReader() {
+    close();
+}
+
+int EaselCommTraceReader::open(const char *path) {
+    close();
+    mFile = fopen(path, "re");
+    if (mFile == nullptr) {
+        return -errno;
+    }
+    if (fread(&mHeader, sizeof(mHeader), 1, mFile) != 1 ||
+        mHeader.magic != EASELCOMM_TRACE_MAGIC ||
+        mHeader.version != EASELCOMM_TRACE_VERSION) {
+        close();
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void EaselCommTraceReader::close() {
+    if (mFile != nullptr) {
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+int EaselCommTraceReader::next(EaselCommTraceRecord *record,
+                               std::vector<char> *payload) {
+    if (mFile == nullptr) {
+        return -EBADF;
+    }
+    size_t n = fread(record, 1, sizeof(*record), mFile);
+    if (n == 0 && feof(mFile)) {
+        return 0;
+    }
+    if (n != sizeof(*record)) {
+        return -EIO;
+    }
+    payload->resize(record->payload_size);
+    if (record->payload_size &&
+        fread(payload->data(), record->payload_size, 1, mFile) != 1) {
+        return -EIO;
+    }
+    return 1;
+}
@@ -19,8 +19,30 @@ class Comm {
     SERVER,
   };
 
+  // Transport under the communication instance.
+  enum class Transport {
+    // The easelcomm driver, or the userspace emulator if selected by the
+    // EASELCOMM_EMULATOR_DIR environment variable.
+    DEFAULT,
+    // The userspace easelcomm emulator, for running both sides on one
+    // Linux host.
+    EMULATOR,
+  };
+
+  // Priority lane of outgoing messages, see EaselComm::Priority.
+  // Messages of more urgent lanes overtake queued bulk messages.
+  enum class Priority {
+    CONTROL,
+    LATENCY_SENSITIVE,
+    BULK,
+  };
+
   using Handler = std::function<void(const Message& message)>;
 
+  // Completion of an asynchronous send.
+  // result is 0 if the payload was transferred, otherwise the error code.
+  using Completion = std::function<void(int result)>;
+
   Comm(const Comm&) = delete;
   Comm& operator=(const Comm&) = delete;
 
@@ -73,11 +95,21 @@ class Comm {
                    const HardwareBuffer* payload = nullptr) = 0;
 
   // Sends a protobuf and an optional payload to the other side.
+  // Protobufs larger than an easelcomm message are moved by DMA and parsed
+  // from the received buffer; the handler sees the same Message either way.
   // Returns the error code.
   virtual int send(int channelId, const ::google::protobuf::MessageLite& proto,
                    const HardwareBuffer* payload = nullptr) = 0;
 
-  // Sends a group of buffers as payloads to the other side.
+  // Sends a group of buffers as one scatter-gather payload to the other side.
+  // The receiver gets a single message and may land the segments in as many
+  // buffers with receivePayload(message, buffers), or in one buffer of the
+  // total size with receivePayload(message, buffer).
+  // Groups larger than EASELCOMM_MAX_DMA_SEGMENTS are split into several
+  // messages.
+  // Until the driver is known to support scatter-gather DMA, groups with ion
+  // buffers are sent as one message per buffer, as send(channelId, &buffer)
+  // does.
   // Returns the error code and remaining buffers will not be sent if previous
   // buffer fails in sending. lastId will be set to the latest successful
   // buffer id if not null.
@@ -85,6 +117,67 @@ class Comm {
                    int* lastId = nullptr) = 0;
 
   // -------------------------------------------------------
+  // The following functions send a message without waiting for the payload
+  // DMA transfer. They return the error code once the message is dispatched.
+  // The payload must stay valid until completion is called from an internal
+  // sender thread. Without a payload, completion is called before returning.
+  // completion is not called if sending fails.
+  // Several payload transfers could be in flight; once the limit is reached
+  // these functions block until one of them completes.
+
+  // Sends an empty message and a payload asynchronously.
+  virtual int sendAsync(int channelId, const HardwareBuffer* payload,
+                        Completion completion) = 0;
+
+  // Sends a struct and a payload asynchronously.
+  virtual int sendAsync(int channelId, const void* body, size_t body_size,
+                        const HardwareBuffer* payload,
+                        Completion completion) = 0;
+
+  // Sends a protobuf and a payload asynchronously.
+  virtual int sendAsync(int channelId,
+                        const ::google::protobuf::MessageLite& proto,
+                        const HardwareBuffer* payload,
+                        Completion completion) = 0;
+
+  // -------------------------------------------------------
+  // Enables credit-based flow control of messages sent to the other side
+  // with a window of window credits, or disables it with window 0.
+  // Credits return as the other side receives messages, see
+  // EaselComm::setSendCredits().
+  virtual void setSendCredits(size_t window) = 0;
+
+  // Sends a struct without payload if a flow control credit is available.
+  // Otherwise returns -EAGAIN, or if coalesce is true queues the message
+  // until credits return, replacing a queued message of the same channel.
+  // The body must fit in an easelcomm message.
+  // Returns the error code.
+  virtual int trySend(int channelId, const void* body, size_t body_size,
+                      bool coalesce) = 0;
+
+  // Sends a protobuf without payload if a flow control credit is available,
+  // otherwise the same as trySend(channelId, body, body_size, coalesce).
+  // Returns the error code.
+  virtual int trySend(int channelId,
+                      const ::google::protobuf::MessageLite& proto,
+                      bool coalesce) = 0;
+
+  // -------------------------------------------------------
+  // Records the traffic to a new trace file at path, with message bodies if
+  // payloads is true; see EaselComm::startRecording().
+  // Returns the error code.
+  virtual int startRecording(const char* path, bool payloads) = 0;
+
+  // Stops recording and closes the trace file.
+  virtual void stopRecording() = 0;
+
+  // -------------------------------------------------------
+  // Sends the messages of channelId on the priority lane.
+  // Channels default to Priority::LATENCY_SENSITIVE.
+  // Messages of one channel keep their order only within one lane, so set
+  // the priority before sending on the channel.
+  virtual void setChannelPriority(int channelId, Priority priority) = 0;
+
   // Registers a message handler to channelId.
   virtual void registerHandler(int channelId, Handler handler) = 0;
 
@@ -96,10 +189,30 @@ class Comm {
   virtual int receivePayload(const Message& message,
                              HardwareBuffer* buffer) = 0;
 
+  // Receives a scatter-gather payload in DMA to buffers.
+  // buffers must match Message::getPayloads() in count and sizes.
+  // Returns the error code.
+  // Could be called inside handler function.
+  // It will also override the buffer ids to match the source buffer ids.
+  virtual int receivePayload(const Message& message,
+                             std::vector<HardwareBuffer>* buffers) = 0;
+
   // Returns an Comm instance.
   // instance could be either client or server based on mode.
+  // Handlers run one at a time on the receiving thread.
   static std::unique_ptr<Comm> create(Mode mode);
 
+  // Returns an Comm instance whose handlers run on handlerThreadCount worker
+  // threads. Handlers of the same channel run one at a time in message
+  // order, while handlers of different channels may run concurrently.
+  // handlerThreadCount 0 is the same as create(mode).
+  static std::unique_ptr<Comm> create(Mode mode, size_t handlerThreadCount);
+
+  // Returns an Comm instance on transport, with handlers run as for
+  // create(mode, handlerThreadCount).
+  static std::unique_ptr<Comm> create(Mode mode, size_t handlerThreadCount,
+                                      Transport transport);
+
  protected:
   Comm();
 };
@@ -26,6 +26,9 @@ class HardwareBuffer {
   // This malloc buffer is owned by the HardwareBuffer object and will be freed
   // in destructor. User don't manage the internal malloced buffer.
   HardwareBuffer(const std::string& filePath, int id = 0);
+  // Copies are views of the same buffer and never own it.
+  HardwareBuffer(const HardwareBuffer& other);
+  HardwareBuffer& operator=(const HardwareBuffer& other);
   // Frees the malloc buffer if allocated and owned.
   ~HardwareBuffer();
 
@@ -2,6 +2,7 @@
 #define PAINTBOX_EASELCOMM2_MESSAGE
 
 #include <string>
+#include <vector>
 
 #include <google/protobuf/message_lite.h>
 
@@ -13,7 +14,10 @@ namespace EaselComm2 {
 // 1) raw pointer
 // 2) string
 // 3) proto buffer
-// EaselComm2::Message also supports appending an optional image buffer payload.
+// EaselComm2::Message also supports appending an optional image buffer payload,
+// or a scatter-gather payload of several buffers moved in one DMA transfer.
+// Bodies too large for one easelcomm message are spilled by Comm into a DMA
+// transfer and restored before the message reaches its handler.
 class Message {
  public:
   // Type of the message.
@@ -22,13 +26,26 @@ class Message {
     STRING = 1,
     PROTO = 2,
     PING = 3,
+    SPILL = 4,  // Carries the spilled body of the next message on the channel.
   };
 
   // Message header.
   struct Header {
-    int channelId;  // Message channel ID.
-    Type type;      // Message type.
-    int payloadId;  // Payload ID to note buffer sequence.
+    int channelId;     // Message channel ID.
+    Type type;         // Message type.
+    int payloadId;     // Payload ID to note buffer sequence.
+    int segmentCount;  // Number of scatter-gather payload segments, or 0.
+    uint32_t spilledBodySize;  // Size of the body moved out of the message
+                               // buffer into a DMA transfer, or 0.
+    uint32_t spillSequence;    // Pairs a message with the SPILL message
+                               // carrying its body, or 0 if it has none.
+  };
+
+  // Describes one segment of a scatter-gather payload.
+  // segmentCount segments follow the message body.
+  struct Segment {
+    int id;         // Buffer ID of the segment.
+    uint32_t size;  // Size of the segment in bytes.
   };
 
   Message(int channelId, const std::string& s,
@@ -42,11 +59,23 @@ class Message {
 
   Message(int channelId, const HardwareBuffer* payload = nullptr);
 
+  // Creates an empty message with a scatter-gather payload of payloads,
+  // transferred in order as one DMA transfer.
+  Message(int channelId, const std::vector<HardwareBuffer>& payloads);
+
+  // Wraps a received message.
+  // spilledBody, if not nullptr, holds the spilled body of the message and
+  // must outlive it.
   Message(void* messageBuf, size_t messageBufSize, size_t dmaBufSize,
-          uint64_t messageId);
+          uint64_t messageId, const HardwareBuffer* spilledBody = nullptr);
 
   ~Message();
 
+  // Returns false if a received message is malformed: it is shorter than its
+  // header, or its segment table does not fit in the message buffer. Such a
+  // message must be dropped without reading its header, body or payloads.
+  bool isValid() const;
+
   // Converts message to string.
   // Returns the converted string if successful, otherwise empty string.
   std::string toString() const;
@@ -82,9 +111,14 @@ class Message {
   // Returns the message buffer size in bytes.
   size_t getMessageBufSize() const;
 
-  // Returns the payload
+  // Returns the payload.
+  // For a scatter-gather payload, this spans all segments.
   HardwareBuffer getPayload() const;
 
+  // Returns the segments of a scatter-gather payload, or an empty vector.
+  // On the receiving side, segments carry size and id only.
+  const std::vector<HardwareBuffer>& getPayloads() const;
+
   // Returns the message id.
   // Used in Comm::receivePayload to match the message.
   uint64_t getMessageId() const;
@@ -97,6 +131,15 @@ class Message {
 
   void attachPayload(const HardwareBuffer& srcBuffer);
 
+  // Attaches payloads as a scatter-gather payload.
+  // Requires allocMessage() to reserve room for the segment table.
+  void attachPayloads(const std::vector<HardwareBuffer>& payloads);
+
+  Segment* getMutableSegments();
+
+  // Returns the size of the body stored in the message buffer.
+  size_t getInlineBodySize() const;
+
   void* getMutableBody();
 
   Header* getMutableHeader();
@@ -106,6 +149,9 @@ class Message {
   void* mMessageBuf;
   size_t mMessageBufSize;
   HardwareBuffer mPayload;
+  std::vector<HardwareBuffer> mPayloads;  // Scatter-gather payload segments.
+  HardwareBuffer mSpilledBody;  // Received body spilled into a DMA transfer.
+  bool mValid;  // False if the received header or segment table is malformed.
   bool mAllocMessage;  // Flag to indicate if mMessageBuf is allocated and owned
                        // by this message.
   uint64_t
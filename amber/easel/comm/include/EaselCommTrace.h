@@ -0,0 +1,117 @@
+#ifndef GOOGLE_PAINTBOX_EASELCOMM_TRACE_H
+#define GOOGLE_PAINTBOX_EASELCOMM_TRACE_H
+
+/*
+ * Binary trace of EaselComm traffic, recorded by EaselComm::startRecording()
+ * and replayed by the easelcomm_replay tool.
+ *
+ * A trace file is an EaselCommTraceHeader followed by EaselCommTraceRecords,
+ * in the byte order of the recording host.  A record with payload_size set
+ * is followed by that many bytes of message data.  DMA transfers are
+ * recorded by size only.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#define EASELCOMM_TRACE_MAGIC 0x52544345  // "ECTR"
+#define EASELCOMM_TRACE_VERSION 1
+
+struct EaselCommTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;  // CLOCK_MONOTONIC time the recording started
+};
+
+enum EaselCommTraceEvent {
+    EASELCOMM_TRACE_SEND = 0,       // message sent
+    EASELCOMM_TRACE_RECEIVE,        // message received
+    EASELCOMM_TRACE_REPLY_SEND,     // reply sent to a received message
+    EASELCOMM_TRACE_REPLY_RECEIVE,  // reply received to a sent message
+};
+
+// Record flags.
+#define EASELCOMM_TRACE_NEED_REPLY 0x1  // sender waits for a reply
+#define EASELCOMM_TRACE_SERVER 0x2      // recorded on the server side
+
+struct EaselCommTraceRecord {
+    uint64_t timestamp_ns;   // time since start_ns
+    uint64_t message_id;     // ID assigned by the sending side
+    uint64_t in_reply_to;    // reply events: ID of the message replied to
+    uint32_t message_size;   // message data size in bytes
+    uint32_t dma_size;       // DMA transfer size in bytes, 0 if none
+    uint32_t payload_size;   // message data bytes following the record
+    int32_t replycode;       // reply events: the reply code
+    uint16_t service_id;
+    uint8_t event;           // EaselCommTraceEvent
+    uint8_t flags;           // EASELCOMM_TRACE_* flags
+    uint32_t reserved;
+};
+
+/*
+ * Writes a trace file.  Thread safe; records from concurrent threads are
+ * written whole, in the order they are added.
+ */
+class EaselCommTraceWriter {
+public:
+    EaselCommTraceWriter();
+    ~EaselCommTraceWriter();
+
+    /*
+     * Start a trace in a new file at path, recording message data if
+     * payloads is true.  Returns 0 for success, -errno for failure.
+     */
+    int open(const char *path, bool payloads);
+
+    // Flush and close the trace.
+    void close();
+
+    bool isOpen();
+
+    /*
+     * Append a record of an event at CLOCK_MONOTONIC time time_ns, or now if
+     * 0, with message data data of record->message_size bytes if recording
+     * payloads and data is not null.  Fields timestamp_ns and payload_size
+     * are filled in.
+     */
+    void write(EaselCommTraceRecord *record, const void *data,
+               uint64_t time_ns = 0);
+
+    // Returns the CLOCK_MONOTONIC time in nanoseconds.
+    static uint64_t now();
+
+private:
+    std::mutex mMutex;
+    FILE *mFile;          // Guarded by mMutex, null if not open.
+    bool mPayloads;       // Guarded by mMutex.
+    uint64_t mStartNs;    // Guarded by mMutex.
+};
+
+// Reads a trace file written by EaselCommTraceWriter.
+class EaselCommTraceReader {
+public:
+    EaselCommTraceReader();
+    ~EaselCommTraceReader();
+
+    // Open the trace at path.  Returns 0 for success, -errno for failure.
+    int open(const char *path);
+
+    void close();
+
+    const EaselCommTraceHeader &header() const { return mHeader; }
+
+    /*
+     * Read the next record into *record and its message data, if any, into
+     * *payload.  Returns 1 for a record, 0 at the end of the trace, or
+     * -errno for failure.
+     */
+    int next(EaselCommTraceRecord *record, std::vector<char> *payload);
+
+private:
+    FILE *mFile;
+    EaselCommTraceHeader mHeader;
+};
+
+#endif  // GOOGLE_PAINTBOX_EASELCOMM_TRACE_H
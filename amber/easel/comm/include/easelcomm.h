@@ -22,17 +22,28 @@
  * Paintbox IPU.
  */
 
+#include <atomic>
+#include <condition_variable>
 #include <cstddef> // size_t
 #include <cstdint> // uint64_t
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include <uapi/linux/google-easel-comm.h>
 
+#include "EaselCommTrace.h"
 #include "EaselService.h"
 
 #define DEFAULT_OPEN_TIMEOUT_MS 5000
 
+class EaselCommLaneGate;
+class EaselCommRegistrationCache;
+class EaselCommTelemetry;
+
 /* Defines and data types used by API clients and servers. */
 class EaselComm {
 public:
@@ -42,24 +53,137 @@ public:
      */
     typedef uint64_t EaselMessageId;
 
+    /*
+     * Priority lane of an outgoing message.
+     *
+     * Lanes order the messages of one EaselComm object.  A message waits to
+     * be posted while messages of a more urgent lane are waiting or being
+     * posted, so control and latency-sensitive messages overtake queued bulk
+     * messages.  A message never waits for a less urgent lane, and only
+     * posting is ordered: DMA transfers and reply waits do not hold back
+     * other lanes.  A waiting message is posted anyway once a few more
+     * urgent messages went ahead of it, so it is not starved.
+     */
+    enum Priority {
+        PRIORITY_CONTROL = 0,        // heartbeats and link control
+        PRIORITY_LATENCY_SENSITIVE,  // notifications and requests (default)
+        PRIORITY_BULK,               // large DMA transfers
+        PRIORITY_COUNT,
+    };
+
+    /* Counters of a priority lane, cumulative for the EaselComm object. */
+    struct LaneStats {
+        uint64_t messages;         // messages sent on the lane
+        uint32_t queue_depth;      // senders waiting right now
+        uint32_t max_queue_depth;  // most senders ever waiting at once
+        uint64_t total_wait_ns;    // time spent waiting, summed
+        uint64_t max_wait_ns;      // longest single wait
+    };
+
+    /* Counters of send flow control, see setSendCredits(). */
+    struct FlowStats {
+        size_t window;        // credit window, 0 if flow control is off
+        size_t outstanding;   // messages sent and not yet credited back
+        uint64_t throttled;   // trySendMessage() calls finding no credit
+        uint64_t coalesced;   // messages queued until credits return
+        uint64_t dropped;     // messages rejected, or replaced while queued
+    };
+
+    /* Counters of the spin-then-block wait, see setSpinWait(). */
+    struct SpinWaitStats {
+        uint64_t spin_wakeups;     // waits satisfied while spinning
+        uint64_t blocked_wakeups;  // waits satisfied after blocking
+        uint64_t spin_ns;          // time spent spinning, summed
+        uint64_t block_ns;         // time spent blocked, summed
+        uint32_t budget_us;        // current spin budget
+    };
+
+    /* Handle of a DMA buffer registered with registerBuffer(). */
+    typedef uint32_t BufferHandle;
+
+    /* Counters of DMA buffer registrations, see registerBuffer(). */
+    struct RegistrationStats {
+        uint64_t hits;        // transfers using a registered buffer
+        uint64_t misses;      // transfers finding no registration
+        uint64_t evictions;   // cached dma-bufs unregistered to make room
+        uint64_t failures;    // registrations rejected by the driver
+        size_t entries;       // buffers registered right now
+    };
+
+    /* Number of buckets of a LatencyHistogram. */
+    static const int kTelemetryBuckets = 24;
+
+    /*
+     * Histogram of latencies in microseconds.  buckets[0] counts samples
+     * under 1 us and buckets[i] those from 2^(i-1) to under 2^i us; the last
+     * bucket also counts all longer samples.
+     */
+    struct LatencyHistogram {
+        uint64_t count;     // samples
+        uint64_t total_us;  // samples summed
+        uint64_t max_us;    // longest sample
+        uint64_t buckets[kTelemetryBuckets];
+    };
+
+    /* Traffic in one direction, see Telemetry. */
+    struct TransferStats {
+        uint64_t messages;       // messages, replies included
+        uint64_t message_bytes;  // message data bytes
+        uint64_t dma_transfers;  // DMA transfers completed
+        uint64_t dma_bytes;      // DMA bytes transferred
+        // Durations of DMA transfers, except those of batched sends.
+        LatencyHistogram dma_us;
+    };
+
+    /*
+     * Transport telemetry of an EaselComm object, cumulative across close()
+     * and open() until resetTelemetry().
+     */
+    struct Telemetry {
+        int service_id;      // service last opened
+        bool server;         // opened as the server
+        bool connected;      // open right now
+        TransferStats sent;
+        TransferStats received;
+        // Time from sending to receiving the reply, sendMessageReceiveReply().
+        LatencyHistogram reply_us;
+        // Time sends waited for more urgent priority lanes.
+        LatencyHistogram queue_wait_us;
+        uint64_t flushes;    // flush() calls
+    };
+
     /* An Easel message */
     struct EaselMessage {
         void  *message_buf;        // pointer to the message buffer
         size_t message_buf_size;   // size in bytes of the message buffer
         void *dma_buf;             // Type A: pointer to local DMA buffer source or dest
         int dma_buf_fd;            // Type B: fd for dma_buf handle
-        int dma_buf_type;          // specify Type A or B
+        int dma_buf_type;          // specify Type A, B or C
+        // Type C: segments of a scatter-gather DMA buffer, in transfer order.
+        // dma_buf_size is the sum of all segment sizes.
+        easelcomm_dma_sg_list dma_sg_list;
         size_t dma_buf_size;       // size of the DMA buffer transfer
         EaselMessageId message_id; // message ID
         bool need_reply;           // true if originator is waiting on a reply
         int32_t timeout_ms;
+        int message_buf_pool_class; // receive pool size class, -1 if malloc'ed
+        Priority priority;         // lane of an outgoing message
         EaselMessage(): message_buf_size(0),
                         dma_buf(nullptr), dma_buf_fd(-1),
                         dma_buf_type(EASELCOMM_DMA_BUFFER_USER),
+                        dma_sg_list{nullptr, 0},
                         dma_buf_size(0),
-                        message_id(0), need_reply(false), timeout_ms(-1) {};
+                        message_id(0), need_reply(false), timeout_ms(-1),
+                        message_buf_pool_class(-1),
+                        priority(PRIORITY_LATENCY_SENSITIVE) {};
     };
 
+    /*
+     * Completion of an asynchronous send.  result is 0 for success or -errno
+     * for failure.
+     */
+    typedef std::function<void(int result)> SendCompletion;
+
     virtual ~EaselComm();
 
     /*
@@ -70,12 +194,208 @@ public:
      * msg->message_buf_size is the size of the message buffer in bytes.
      * msg->dma_buf_size is the size of the DMA transfer in bytes, or zero if
      *    none.
+     * msg->priority is the lane the message is sent on.
      * Other *msg fields are not used by this function.
      *
      * Returns 0 for success, -1 for failure.
      */
     virtual int sendMessage(const EaselMessage *msg);
 
+    /*
+     * Send a batch of messages to remote without waiting for replies.
+     * Returns once all messages are sent and the remote has received all DMA
+     * transfers, if any.
+     *
+     * msgs points to an array of count messages, each filled out the same
+     * way as for sendMessage.  need_reply must be false for every message.
+     * Messages are delivered to the remote in array order, on the most
+     * urgent lane among their priorities.
+     *
+     * If the driver supports EASELCOMM_IOC_SENDMSGS, up to
+     * EASELCOMM_MAX_BATCH_COUNT messages are submitted per kernel call.
+     * Otherwise the messages are sent one by one as with sendMessage.
+     *
+     * sent optionally returns the number of messages sent.  On failure the
+     * messages preceding msgs[*sent] have been sent and the rest have not.
+     *
+     * Returns 0 for success, -errno for failure.  Returns -EINVAL without
+     * sending anything if a message has need_reply set.
+     */
+    virtual int sendMessages(const EaselMessage *msgs, size_t count,
+                             size_t *sent = nullptr);
+
+    /*
+     * Send a message to remote without waiting for its DMA transfer.
+     * Returns once the message is dispatched to the remote.  The message
+     * buffer may be reused right away; the DMA source buffer must stay valid
+     * until completion is called.
+     *
+     * msg fields are used the same way as for sendMessage.
+     *
+     * completion is called with the result of the DMA transfer once the
+     * remote has received or discarded it, from an internal sender thread.
+     * If the message has no DMA transfer, completion is called with 0 before
+     * this function returns.  completion is not called if this function
+     * fails.
+     *
+     * At most getMaxAsyncDmaInFlight() DMA transfers are outstanding at a
+     * time; once the limit is reached this function blocks until one of them
+     * completes.
+     *
+     * Returns 0 for success, -errno for failure.
+     */
+    virtual int sendMessageAsync(const EaselMessage *msg,
+                                 SendCompletion completion);
+
+    /*
+     * Same as above, with the DMA transfer result delivered through the
+     * returned future.
+     */
+    std::future<int> sendMessageAsync(const EaselMessage *msg);
+
+    /*
+     * Set the maximum number of outstanding asynchronous DMA transfers.
+     * Must be at least 1.
+     */
+    void setMaxAsyncDmaInFlight(size_t max);
+
+    // Returns the maximum number of outstanding asynchronous DMA transfers.
+    size_t getMaxAsyncDmaInFlight();
+
+    /*
+     * Return the counters of the priority lane in *stats.  Wait times cover
+     * the time a send waited for more urgent lanes to clear.
+     */
+    void getLaneStats(Priority priority, LaneStats *stats);
+
+    /*
+     * Enable credit-based flow control of messages sent to remote with a
+     * window of window credits, or disable it with window 0 (the default).
+     *
+     * Every message sent to remote other than a reply takes a credit, and
+     * remote returns credits for the messages it has received.  Once half
+     * the window is outstanding, an internal thread asks remote for its
+     * credits with a credit request, which receiveMessage() on remote
+     * answers without returning it to the caller.  So credits only come back
+     * while remote keeps receiving messages.
+     *
+     * Plain sends take credits but never wait for them.  trySendMessage()
+     * does not send without one.
+     */
+    void setSendCredits(size_t window);
+
+    /*
+     * Send a message to remote if a credit is available, without waiting.
+     *
+     * msg fields are used the same way as for sendMessage.  A message with a
+     * DMA transfer returns once the transfer is done.
+     *
+     * If no credit is available and coalesce_key is negative, returns
+     * -EAGAIN and the message is dropped.  Otherwise the message is copied
+     * and queued, replacing a queued message with the same coalesce_key, and
+     * sent by the internal thread once credits return.  Coalesced messages
+     * must not have a DMA transfer.
+     *
+     * Without flow control, the same as sendMessage.
+     *
+     * Returns 0 for success, -errno for failure.
+     */
+    int trySendMessage(const EaselMessage *msg, int coalesce_key = -1);
+
+    // Return the counters of send flow control in *stats.
+    void getFlowStats(FlowStats *stats);
+
+    /*
+     * Register a DMA buffer with the driver, which pins and maps it once
+     * instead of on every transfer.
+     *
+     * buf_type is EASELCOMM_DMA_BUFFER_USER for the user buffer of size bytes
+     * at buf, or EASELCOMM_DMA_BUFFER_DMA_BUF for the first size bytes of the
+     * dma-buf dma_buf_fd.  Until unregistered, transfers sent or received by
+     * this object in the buffer use the registration: any range of a user
+     * buffer, or a dma-buf given by the same fd.  The buffer must stay
+     * valid, and a dma-buf fd open, until unregisterBuffer().
+     *
+     * handle returns the handle for unregisterBuffer().  Registrations are
+     * dropped by close().
+     *
+     * Returns 0 for success, -ENOTTY if the driver does not support
+     * registration, or another -errno for failure.
+     */
+    int registerBuffer(int buf_type, void *buf, int dma_buf_fd, size_t size,
+                       BufferHandle *handle);
+
+    /*
+     * Unregister a buffer registered with registerBuffer().
+     * Returns 0 for success, -EBUSY if a transfer is using it, or -EINVAL if
+     * handle is not registered.
+     */
+    int unregisterBuffer(BufferHandle handle);
+
+    /*
+     * Set the number of dma-bufs kept registered after a transfer, least
+     * recently used first out, 0 to disable caching.  Cached dma-bufs stay
+     * referenced by the driver until evicted or close().  Explicitly
+     * registered buffers do not count.
+     */
+    void setRegistrationCacheSize(size_t entries);
+
+    // Return the counters of DMA buffer registrations in *stats.
+    void getRegistrationStats(RegistrationStats *stats);
+
+    /*
+     * Enable spinning for up to max_spin_us before blocking, or disable it
+     * with 0 (the default).
+     *
+     * While enabled, receiveMessage() polls the driver with non-blocking
+     * waits before blocking, saving the sleep and wakeup of a message that
+     * arrives soon.  The spin budget adapts to recent waits: it grows
+     * towards max_spin_us while messages arrive within it and halves while
+     * they do not.  Spinning keeps a CPU busy, so this suits threads that
+     * serve short request/reply round trips.
+     *
+     * sendMessageReceiveReply() does not spin: the driver does not promise
+     * to keep a pending reply after a WAITREPLY times out, so its wait is
+     * never split into polls.
+     */
+    void setSpinWait(uint32_t max_spin_us);
+
+    // Return the counters of the spin-then-block wait in *stats.
+    void getSpinWaitStats(SpinWaitStats *stats);
+
+    /*
+     * Get the transport telemetry of this object: messages, bytes and DMA
+     * transfers sent and received, and latency histograms.  Always
+     * collected.
+     */
+    void getTelemetry(Telemetry *telemetry);
+
+    // Zero the counters of getTelemetry().
+    void resetTelemetry();
+
+    /*
+     * Write the telemetry of every EaselComm object of the process that has
+     * been opened to fd as text, e.g. from a dumpsys handler.
+     */
+    static void dumpTelemetry(int fd);
+
+    /*
+     * Record the traffic of this object to a new trace file at path, in the
+     * format of EaselCommTrace.h: messages sent and received, replies, DMA
+     * transfer sizes and, if payloads is true, message data.  Recording
+     * continues across close() and open() until stopRecording().
+     *
+     * If environment variable EASELCOMM_RECORD_DIR names a directory, open()
+     * starts recording to easelcomm-<service>-<client|server>-<pid>.trace
+     * there, with message data if EASELCOMM_RECORD_PAYLOADS is 1.
+     *
+     * Returns 0 for success, -errno for failure.
+     */
+    int startRecording(const char *path, bool payloads);
+
+    // Stop recording and close the trace file.
+    void stopRecording();
+
     /*
      * Send a message to remote and wait for a reply.
      *
@@ -83,6 +403,7 @@ public:
      * msg->message_buf_size is the size of the message buffer in bytes.
      * msg->dma_buf_size is the size of the DMA transfer in bytes, or zero if
      *    none.
+     * msg->priority is the lane the message is sent on.
      * Other *msg fields are not used by this function.
      *
      * replycode returns the application-specific replycode from the
@@ -91,9 +412,10 @@ public:
      * reply optionally receives the EaselMessage sent in reply.  If used, it
      * may have have a message buffer (if reply->message_buf is not nullptr)
      * and/or may request a DMA transfer (if reply->dma_buf_size is non-zero).
-     * If reply->message_buf is not nullptr, callers frees it when done
-     * processing the message buffer.  If the receiver does not return a reply
-     * message then this parameter can be nullptr.
+     * If reply->message_buf is not nullptr, callers release it with
+     * releaseMessageBuffer() when done processing the message buffer.  If the
+     * receiver does not return a reply message then this parameter can be
+     * nullptr.
      *
      * Returns 0 for success, -1 for failure.
      */
@@ -104,7 +426,8 @@ public:
      * Wait for the next message from remote to arrive.
      *
      * msg->message_buf points to the message received.
-     *   message_buf needs to be manually freed after consumption.
+     *   message_buf needs to be released with releaseMessageBuffer() after
+     *   consumption.
      * msg->message_buf_size is the size of the message in bytes.
      * msg->dma_buf_size is the size of the DMA transfer in bytes, or zero if
      *   none.  If non-zero, receiveDMA must be called to receive or discard
@@ -112,14 +435,32 @@ public:
      *   outstanding DMA transfer.
      * msg->needreply is true if sender is waiting for a reply.
      * Other *msg fields are not used or used internally by this function.
-     * The caller frees msg->message_buf when done processing the message
-     * buffer.
+     * The caller releases msg->message_buf with releaseMessageBuffer() when
+     * done processing the message buffer.
      *
      * Returns 0 for success, -1 for failure.  On failure:
      *    errno == ESHUTDOWN means the connection is being shut down
      */
     virtual int receiveMessage(EaselMessage *msg);
 
+    /*
+     * Release a message buffer returned by receiveMessage() or
+     * sendMessageReceiveReply().  Pooled buffers go back to the receive
+     * buffer pool, others are freed.  Sets msg->message_buf to nullptr.
+     */
+    void releaseMessageBuffer(EaselMessage *msg);
+
+    /*
+     * Enable or disable the receive buffer pool.
+     *
+     * When enabled, received message buffers are taken from a size-classed
+     * pool owned by this object and must be released with
+     * releaseMessageBuffer().  When disabled (the default, for compatibility
+     * with callers that free() message buffers), received message buffers
+     * are malloc'ed and may be released either way.
+     */
+    void setReceiveBufferPooling(bool enable);
+
     /*
      * Send a reply to a message for which the remote is waiting on a reply.
      * msg is the originally received message being replied to.
@@ -143,7 +484,9 @@ public:
      *
      * msg points to the message returned by receiveMessage(), with field
      * msg->dma_buf set to the DMA destination buffer address.  That buffer must
-     * have at least msg->dbusz bytes.
+     * have at least msg->dbusz bytes.  Alternatively msg->dma_buf_type may be
+     * EASELCOMM_DMA_BUFFER_SG_LIST with msg->dma_sg_list describing
+     * destination segments that add up to msg->dma_buf_size bytes.
      *
      * Returns 0 for success, -errno for failure.
      */
@@ -162,6 +505,14 @@ public:
      */
     virtual int cancelReceiveDMA(const EaselMessage *msg);
 
+    /*
+     * Returns true once the driver has accepted a DMA transfer with an
+     * EASELCOMM_DMA_BUFFER_SG_LIST buffer in this process.  Until then, or if
+     * the driver rejected one, only scatter-gather lists of user buffers can
+     * be transferred, through a bounce buffer.
+     */
+    static bool isSgDmaSupported();
+
     /*
      * Open communications for the specified service.
      *
@@ -175,8 +526,9 @@ public:
 
     /*
      * Close down communication via this object.  Cancel any pending
-     * receiveMessage() on our registered service ID.  Can re-use this
-     * same object to call init() again.
+     * receiveMessage() on our registered service ID, and fail DMA transfers
+     * still queued by sendMessageAsync().  Can re-use this same object to
+     * call init() again.
      */
     virtual void close();
 
@@ -226,6 +578,26 @@ protected:
      */
     pthread_rwlock_t mFdRwlock;
 
+    // False once the driver has rejected EASELCOMM_IOC_SENDMSGS.
+    std::atomic<bool> mBatchSendSupported;
+
+    // Service ID and side of the open device, for recording.
+    EaselService mServiceId;
+    bool mServer;
+
+    // Start recording if requested by the environment, see startRecording().
+    void startRecordingFromEnv();
+
+    // Registered DMA buffers of the open device.
+    std::unique_ptr<EaselCommRegistrationCache> mRegistrationCache;
+
+    std::unique_ptr<EaselCommTelemetry> mTelemetry;
+    // True once opened, so dumpTelemetry() includes this object.
+    std::atomic<bool> mTelemetryOpened;
+
+    // Orders posting of outgoing messages by priority lane.
+    std::unique_ptr<EaselCommLaneGate> mLaneGate;
+
     std::thread mHandlerThread;
     bool mClosed;
     std::mutex mStatusMutex;  // Guards mClosed.
@@ -244,11 +616,138 @@ protected:
      */
     virtual int receiveDMAImpl(const EaselMessage *msg, bool cancel = false);
 
+    /*
+     * Open communications for service_id on the userspace easelcomm
+     * emulator in directory dir, as the server if server is true, otherwise
+     * as the client.
+     *
+     * Returns 0 for success, -errno for failure.
+     */
+    int openEmulator(const char *dir, EaselService service_id,
+                     long timeout_ms, bool server);
+
     /*
      * Thread function for mHandlerThread.
      * Each valid received message is handled by callback.
      */
     void handleReceivedMessages(std::function<void(EaselMessage *msg)> callback);
+
+private:
+    /*
+     * Same as receiveMessage(), but returning credit requests from remote to
+     * the caller.
+     */
+    int receiveAMessage(EaselMessage *msg);
+
+    /*
+     * Issue a WAITMSG ioctl for kmsg_desc, spinning first if enabled by
+     * setSpinWait().  Returns 0 for success, or -1 with errno set for
+     * failure.
+     */
+    int waitMessageIoctl(easelcomm_kmsg_desc *kmsg_desc);
+
+    /*
+     * Append an EaselCommTraceEvent for msg to the trace, at CLOCK_MONOTONIC
+     * time time_ns or now if 0.  msg may be null for a reply without a
+     * message.  Only called while mRecording.
+     */
+    void recordEvent(int event, const EaselMessage *msg,
+                     easelcomm_msgid_t message_id,
+                     easelcomm_msgid_t in_reply_to, int replycode,
+                     uint64_t time_ns);
+
+    EaselCommTraceWriter mTrace;
+    std::atomic<bool> mRecording;  // True while mTrace is open.
+
+    std::mutex mSpinMutex;
+    uint64_t mSpinMaxNs;         // Guarded by mSpinMutex, 0 if disabled.
+    uint64_t mSpinBudgetNs;      // Guarded by mSpinMutex.
+    SpinWaitStats mSpinStats;    // Guarded by mSpinMutex; budget_us unused.
+
+    // Same as sendMessage() without taking a credit.
+    int sendMessageUncredited(const EaselMessage *msg);
+
+    // Same as sendMessageReceiveReply(), taking a credit if take_credit.
+    int sendMessageReceiveReplyImpl(const EaselMessage *msg, int *replycode,
+                                    EaselMessage *reply, bool take_credit);
+
+    /*
+     * Take count credits for messages about to be sent, if flow control is
+     * enabled.  Credits of messages that fail to send are given back with
+     * returnCredits().
+     */
+    void takeCredits(size_t count);
+    void returnCredits(size_t count);
+
+    /*
+     * Thread function for mCreditThread.
+     * Requests credits from remote and sends coalesced messages until
+     * stopCreditThread() is called.
+     */
+    void creditThreadLoop();
+
+    // Stops and joins mCreditThread.
+    void stopCreditThread();
+
+    // A message queued by trySendMessage() until credits return.
+    struct CoalescedMessage {
+        int key;
+        EaselMessage msg;
+        std::vector<char> buf;  // Copy of the message buffer.
+    };
+
+    std::mutex mCreditMutex;
+    // Signaled when credits are taken or flow control stops.
+    std::condition_variable mCreditCond;
+    // Credit window, 0 if flow control is off.  Written under mCreditMutex.
+    std::atomic<size_t> mCreditWindow;
+    // Counters and outstanding credits; window is unused.  Guarded by
+    // mCreditMutex.
+    FlowStats mFlowStats;
+    std::deque<CoalescedMessage> mCoalesced;  // Guarded by mCreditMutex.
+    bool mCreditStopping;  // Guarded by mCreditMutex.
+    std::thread mCreditThread;
+    // Messages received since remote last requested credits.
+    std::atomic<uint32_t> mCreditsToReturn;
+
+    /*
+     * Allocate msg->message_buf for msg->message_buf_size bytes, from the
+     * receive buffer pool if enabled.
+     * Returns 0 for success, -errno for failure.
+     */
+    int allocMessageBuffer(EaselMessage *msg);
+
+    std::mutex mRxPoolMutex;
+    bool mRxPoolEnabled;  // Guarded by mRxPoolMutex.
+    // Idle buffers per size class.  Guarded by mRxPoolMutex.
+    std::vector<std::vector<void *>> mRxPool;
+
+    // A posted message waiting for its DMA transfer to be sent.
+    struct AsyncDma {
+        easelcomm_msgid_t message_id;
+        EaselMessage msg;
+        SendCompletion completion;
+    };
+
+    /*
+     * Thread function for mAsyncDmaThreads.
+     * Sends queued DMA transfers until stopAsyncDmaThreads() is called and
+     * the queue is drained.
+     */
+    void asyncDmaThreadLoop();
+
+    // Drains the asynchronous DMA queue and joins mAsyncDmaThreads.
+    void stopAsyncDmaThreads();
+
+    std::mutex mAsyncDmaMutex;
+    // Signaled when a DMA transfer is queued or completed.
+    std::condition_variable mAsyncDmaCond;
+    std::deque<AsyncDma> mAsyncDmaQueue;  // Guarded by mAsyncDmaMutex.
+    // Queued plus transferring DMAs.  Guarded by mAsyncDmaMutex.
+    size_t mAsyncDmaInFlight;
+    size_t mMaxAsyncDmaInFlight;  // Guarded by mAsyncDmaMutex.
+    bool mAsyncDmaStopping;  // Guarded by mAsyncDmaMutex.
+    std::vector<std::thread> mAsyncDmaThreads;  // Guarded by mAsyncDmaMutex.
 };
 
 class EaselCommClient : public EaselComm {
@@ -281,4 +780,27 @@ public:
     virtual int initialHandshake();
 };
 
+/*
+ * EaselCommClient and EaselCommServer open the easelcomm driver, or the
+ * userspace easelcomm emulator if environment variable
+ * EASELCOMM_EMULATOR_DIR names the emulator directory.  The classes below
+ * always open the emulator, in EASELCOMM_EMULATOR_DIR if set, otherwise in
+ * /tmp/easelcomm.
+ *
+ * The emulator lets a client and a server process on one Linux host talk
+ * with the same semantics as over the driver.  DMA buffers given as fds
+ * (e.g. memfds) are shared with the remote without copying them first.
+ */
+class EaselCommClientEmulator : public EaselCommClient {
+public:
+    virtual int open(EaselService service_id,
+                     long timeout_ms = DEFAULT_OPEN_TIMEOUT_MS) override;
+};
+
+class EaselCommServerEmulator : public EaselCommServer {
+public:
+    virtual int open(EaselService service_id,
+                     long timeout_ms = DEFAULT_OPEN_TIMEOUT_MS) override;
+};
+
 #endif // GOOGLE_PAINTBOX_EASELCOMM_H
@@ -38,8 +38,21 @@ struct easelcomm_kmsg_desc {
 enum easelcomm_dma_buffer_type {
   EASELCOMM_DMA_BUFFER_UNUSED = 0,
   EASELCOMM_DMA_BUFFER_USER,
-  EASELCOMM_DMA_BUFFER_DMA_BUF
+  EASELCOMM_DMA_BUFFER_DMA_BUF,
+  EASELCOMM_DMA_BUFFER_SG_LIST,
+  EASELCOMM_DMA_BUFFER_REGISTERED
 };
+struct easelcomm_dma_segment {
+  void __user * buf;
+  int dma_buf_fd;
+  int buf_type;
+  __u32 buf_size;
+};
+struct easelcomm_dma_sg_list {
+  struct easelcomm_dma_segment __user * segments;
+  __u32 count;
+};
+#define EASELCOMM_MAX_DMA_SEGMENTS 256
 struct easelcomm_kbuf_desc {
   easelcomm_msgid_t message_id;
   void __user * buf;
@@ -48,6 +61,24 @@ struct easelcomm_kbuf_desc {
   __u32 buf_size;
   struct easelcomm_wait wait;
 };
+struct easelcomm_buf_registration {
+  void __user * buf;
+  int dma_buf_fd;
+  int buf_type;
+  __u32 buf_size;
+  __u32 handle;
+};
+#define EASELCOMM_MAX_BATCH_COUNT 64
+struct easelcomm_kmsg_batch_entry {
+  struct easelcomm_kmsg_desc kmsg;
+  struct easelcomm_kbuf_desc msg_buf;
+  struct easelcomm_kbuf_desc dma_buf;
+};
+struct easelcomm_kmsg_batch {
+  struct easelcomm_kmsg_batch_entry __user * entries;
+  __u32 count;
+  __u32 sent;
+};
 #define EASELCOMM_IOC_MAGIC 0xEA
 #define EASELCOMM_IOC_REGISTER _IOW(EASELCOMM_IOC_MAGIC, 0, int)
 #define EASELCOMM_IOC_SENDMSG _IOWR(EASELCOMM_IOC_MAGIC, 1, struct easelcomm_kmsg_desc *)
@@ -59,4 +90,7 @@ struct easelcomm_kbuf_desc {
 #define EASELCOMM_IOC_WAITMSG _IOWR(EASELCOMM_IOC_MAGIC, 7, struct easelcomm_kmsg_desc *)
 #define EASELCOMM_IOC_SHUTDOWN _IO(EASELCOMM_IOC_MAGIC, 8)
 #define EASELCOMM_IOC_FLUSH _IO(EASELCOMM_IOC_MAGIC, 9)
+#define EASELCOMM_IOC_SENDMSGS _IOWR(EASELCOMM_IOC_MAGIC, 10, struct easelcomm_kmsg_batch *)
+#define EASELCOMM_IOC_REGBUF _IOWR(EASELCOMM_IOC_MAGIC, 11, struct easelcomm_buf_registration *)
+#define EASELCOMM_IOC_UNREGBUF _IOW(EASELCOMM_IOC_MAGIC, 12, __u32)
 #endif
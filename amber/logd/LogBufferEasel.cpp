@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -16,6 +17,9 @@
 #define LOG_FILE "LOG_FILE"
 #define LOG_LEVEL_DEFAULT ANDROID_LOG_INFO
 
+// Log messages in flight to the AP before further logs are dropped.
+static const size_t kLogCreditWindow = 256;
+
 static std::vector<std::string> PRIO_LIST = {
   "UNKNOWN",
   "DEFAULT",
@@ -77,6 +81,9 @@ LogBufferEasel::LogBufferEasel()
     // Falls back to LogDest::FILE if mCommServer open fails.
     if (ret != 0) {
       mLogDest = LogDest::FILE;
+    } else {
+      // Drop logs under a burst rather than stall the logging threads.
+      mCommServer.setSendCredits(kLogCreditWindow);
     }
   }
 
@@ -121,9 +128,9 @@ int LogBufferEasel::log(
     easelMsg.message_buf_size = logMessage.size();
     easelMsg.dma_buf = 0;
     easelMsg.dma_buf_size = 0;
-    int ret = mCommServer.sendMessage(&easelMsg);
-    if (ret != 0) {
-      fprintf(stderr, "Could not send log errno %d.\n", errno);
+    int ret = mCommServer.trySendMessage(&easelMsg);
+    if (ret != 0 && ret != -EAGAIN) {
+      fprintf(stderr, "Could not send log errno %d.\n", -ret);
     }
   } else {
     LogEntry entry = parseEntry(msg, len);
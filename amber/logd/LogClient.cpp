@@ -54,6 +54,8 @@ void LogClient::receiveLogThread() {
         "did you have two LogClient running at the same time? "
         "e.g. ezlsh and camera app", ret, errno);
   } else {
+    // Log messages are only received by the handler thread.
+    mCommClient.setReceiveBufferPooling(true);
     ret = mCommClient.startMessageHandlerThread(
         [this](EaselComm::EaselMessage *msg) {
       char textBuf[LOGGER_ENTRY_MAX_PAYLOAD];
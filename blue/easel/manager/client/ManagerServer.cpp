@@ -10,6 +10,7 @@
 #include "EaselManager.h"
 #include "EaselManagerCommon.h"
 #include "control/ManagerControlClient.h"
+#include "easelcomm.h"
 #include "vendor/google_paintbox/blue/easel/manager/shared/proto/easelmanager.pb.h"
 
 namespace android {
@@ -257,6 +258,11 @@ binder::Status ManagerServer::resume(int32_t service, int32_t* _aidl_return) {
   return binder::Status::ok();
 }
 
+status_t ManagerServer::dump(int fd, const Vector<String16>& /*args*/) {
+  EaselComm::dumpTelemetry(fd);
+  return NO_ERROR;
+}
+
 void ManagerServer::serviceStatusHandler(const easel::Message& message) {
   EaselManagerService::ServiceStatusResponse response;
   if (!easel::MessageToProto(message, &response)) {
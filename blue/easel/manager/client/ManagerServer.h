@@ -30,6 +30,8 @@ class ManagerServer : public BinderService<ManagerServer>,
   binder::Status stopService(int32_t service, int32_t* _aidl_return) override;
   binder::Status suspend(int32_t service, int32_t* _aidl_return) override;
   binder::Status resume(int32_t service, int32_t* _aidl_return) override;
+  // Writes the EaselComm transport telemetry of the process for dumpsys.
+  status_t dump(int fd, const Vector<String16>& args) override;
 
  private:
   int powerOn();
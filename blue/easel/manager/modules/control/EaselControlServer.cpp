@@ -120,6 +120,8 @@ static void sendHeartbeatMessage() {
   EaselComm::EaselMessage msg;
   msg.message_buf = &heartbeatMsg;
   msg.message_buf_size = sizeof(heartbeatMsg);
+  // Overtake queued bulk transfers so a busy link never looks dead.
+  msg.priority = EaselComm::PRIORITY_CONTROL;
 
   int ret = easel_conn.sendMessage(&msg);
   if (ret) {
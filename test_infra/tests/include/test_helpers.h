@@ -0,0 +1,212 @@
+/*
+ * Helpers shared by the host tests and microbenchmarks.
+ *
+ * YuvTestImage is the semi-planar YUV 4:2:0 image the YuvCopier and
+ * YuvResampler tests and benchmarks work on.  The rest is the skeleton of a
+ * microbenchmark: the --json and --iterations=N options, timing a case, and
+ * printing results as CSV or JSON on stdout.
+ */
+
+#ifndef TEST_INFRA_TESTS_TEST_HELPERS_H
+#define TEST_INFRA_TESTS_TEST_HELPERS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace test_helpers {
+
+// Value that marks bytes of a YuvTestImage that code under test must not
+// write.
+const uint8_t kPadding = 0xA5;
+
+/*
+ * A semi-planar YUV 4:2:0 image (NV12 or NV21) with padded rows, initially
+ * filled with kPadding.  The chroma plane has height / 2 rows and is followed
+ * by a guard row that code under test must not write.
+ */
+struct YuvTestImage {
+    YuvTestImage(uint32_t w, uint32_t h, size_t rowPadding)
+        : width(w),
+          height(h),
+          padding(rowPadding),
+          lumaStride(w + rowPadding),
+          chromaStride((w + 1) / 2 * 2 + rowPadding),
+          luma(lumaStride * h, kPadding),
+          chroma(chromaStride * (h / 2 + 1), kPadding) {}
+
+    // Fill the pixels with a pattern that depends on seed.
+    void fill(uint8_t seed) {
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                luma[y * lumaStride + x] =
+                    static_cast<uint8_t>(seed + x * 7 + y * 13);
+            }
+        }
+        for (uint32_t y = 0; y < height / 2; y++) {
+            for (uint32_t x = 0; x < chromaRowBytes(); x++) {
+                chroma[y * chromaStride + x] =
+                    static_cast<uint8_t>(seed + x * 3 + y * 11 + 1);
+            }
+        }
+    }
+
+    // Fill the pixels with a smooth pattern that depends on seed, for code
+    // that filters the image.
+    void fillSmooth(uint32_t seed) {
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                luma[y * lumaStride + x] = static_cast<uint8_t>(
+                    128 + 100 * sinf((x + seed) * 0.05f) * cosf(y * 0.03f));
+            }
+        }
+        for (uint32_t y = 0; y < height / 2; y++) {
+            for (uint32_t x = 0; x < chromaRowBytes(); x++) {
+                chroma[y * chromaStride + x] = static_cast<uint8_t>(
+                    (x % 2 ? 60 : 180) +
+                    50 * sinf((y + seed) * 0.07f + x * 0.02f));
+            }
+        }
+    }
+
+    // Bytes of the chroma samples in a row of the chroma plane.
+    size_t chromaRowBytes() const { return (width + 1) / 2 * 2; }
+
+    // Bytes of the chroma plane, not counting the guard row.
+    size_t chromaPlaneBytes() const { return chromaStride * (height / 2); }
+
+    // Return the image as an image struct of the code under test, e.g.
+    // YuvCopySource or YuvCopyDest.
+    template <typename YuvImage>
+    YuvImage as() {
+        return {width, height, luma.data(), lumaStride, chroma.data(),
+                chromaStride};
+    }
+
+    uint32_t width;
+    uint32_t height;
+    size_t padding;  // Bytes after each row.
+    size_t lumaStride;
+    size_t chromaStride;
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> chroma;
+};
+
+// Options every benchmark takes.
+struct BenchOptions {
+    bool json = false;
+    int iterations = 20;
+};
+
+// Parse arg if it is one of the options in BenchOptions. Returns whether it
+// was.
+inline bool parseBenchOption(const char *arg, BenchOptions *options) {
+    if (strcmp(arg, "--json") == 0) {
+        options->json = true;
+    } else if (strncmp(arg, "--iterations=", 13) == 0) {
+        options->iterations = atoi(arg + 13);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Return the value at percentile (0 to 1) of sorted values, or 0 if there are
+// none.
+inline double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+// Run fn once to warm up, so page faults of first touch are not counted, then
+// time it iterations times. Returns the sorted wall times in microseconds.
+inline std::vector<double> timeRuns(int iterations,
+                                    const std::function<void()> &fn) {
+    fn();
+
+    std::vector<double> timesUs;
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        timesUs.push_back(
+            std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    std::sort(timesUs.begin(), timesUs.end());
+    return timesUs;
+}
+
+// Format a number for BenchPrinter::printRow() with a number of decimals.
+inline std::string formatNumber(double value, int decimals) {
+    char text[64];
+    snprintf(text, sizeof(text), "%.*f", decimals, value);
+    return text;
+}
+
+/*
+ * Prints benchmark results, a row per case, as CSV with a header line or as a
+ * JSON array of objects.
+ */
+class BenchPrinter {
+public:
+    BenchPrinter(bool json, std::vector<const char *> columns)
+        : mJson(json), mColumns(std::move(columns)) {}
+
+    // Close the JSON array.
+    ~BenchPrinter() {
+        if (mJson) {
+            printf("%s\n]\n", mRows == 0 ? "[" : "");
+        }
+    }
+
+    // Print a row with a value for each column. Values that are not numbers
+    // are quoted in JSON.
+    void printRow(const std::vector<std::string> &values) {
+        if (mJson) {
+            printf("%s\n  {", mRows == 0 ? "[" : ",");
+            for (size_t i = 0; i < mColumns.size(); i++) {
+                const std::string &value = values[i];
+                printf(isNumber(value) ? "%s\"%s\": %s" : "%s\"%s\": \"%s\"",
+                       i == 0 ? "" : ", ", mColumns[i], value.c_str());
+            }
+            printf("}");
+        } else {
+            if (mRows == 0) {
+                for (size_t i = 0; i < mColumns.size(); i++) {
+                    printf("%s%s", i == 0 ? "" : ",", mColumns[i]);
+                }
+                printf("\n");
+            }
+            for (size_t i = 0; i < mColumns.size(); i++) {
+                printf("%s%s", i == 0 ? "" : ",", values[i].c_str());
+            }
+            printf("\n");
+        }
+        mRows++;
+        fflush(stdout);
+    }
+
+private:
+    static bool isNumber(const std::string &value) {
+        char *end = nullptr;
+        strtod(value.c_str(), &end);
+        return !value.empty() && *end == '\0';
+    }
+
+    bool mJson;
+    std::vector<const char *> mColumns;
+    size_t mRows = 0;
+};
+
+}  // namespace test_helpers
+
+#endif  // TEST_INFRA_TESTS_TEST_HELPERS_H
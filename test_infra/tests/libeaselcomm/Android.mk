@@ -16,6 +16,64 @@ LOCAL_SRC_FILES := easelcomm_test.cpp
 LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
 include $(BUILD_NATIVE_TEST)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_emulator_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := easelcomm_emulator_test.cpp
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -DAP_CLIENT
+LOCAL_SRC_FILES := easelcomm_bench.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog libnativewindow
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_bench_server
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -DEASEL_SERVER
+LOCAL_SRC_FILES := easelcomm_bench.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -DAP_CLIENT
+LOCAL_SRC_FILES := easelcomm_bench.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_bench_server
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -DEASEL_SERVER
+LOCAL_SRC_FILES := easelcomm_bench.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_replay
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := easelcomm_replay.cpp
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := easelcomm_replay
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := easelcomm_replay.cpp
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := easelcomm2_impl_test_proto
 LOCAL_MODULE_OWNER := google
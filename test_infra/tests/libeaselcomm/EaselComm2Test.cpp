@@ -44,6 +44,60 @@ EaselComm2::HardwareBuffer convertToHardwareBuffer(AHardwareBufferHandle buffer,
 }
 }  // namespace
 
+TEST(EaselComm2MessageTest, ReceivedSegmentTable) {
+  struct {
+    EaselComm2::Message::Header header;
+    EaselComm2::Message::Segment segments[2];
+  } buf = {};
+  buf.header.type = EaselComm2::Message::PING;
+  buf.header.segmentCount = 2;
+  buf.segments[0] = {1, 100};
+  buf.segments[1] = {2, 200};
+
+  EaselComm2::Message message(&buf, sizeof(buf), 300, /*messageId=*/0);
+  ASSERT_TRUE(message.isValid());
+  EXPECT_EQ(message.getBodySize(), 0u);
+  ASSERT_EQ(message.getPayloads().size(), 2u);
+  EXPECT_EQ(message.getPayloads()[1].id(), 2);
+  EXPECT_EQ(message.getPayloads()[1].size(), 200u);
+}
+
+TEST(EaselComm2MessageTest, RejectsMalformedSegmentTable) {
+  struct {
+    EaselComm2::Message::Header header;
+    EaselComm2::Message::Segment segments[2];
+  } buf = {};
+  buf.header.type = EaselComm2::Message::PING;
+
+  // The table is larger than the message buffer.
+  buf.header.segmentCount = 3;
+  EaselComm2::Message tooMany(&buf, sizeof(buf), 0, /*messageId=*/0);
+  EXPECT_FALSE(tooMany.isValid());
+  EXPECT_EQ(tooMany.getBodySize(), 0u);
+  EXPECT_TRUE(tooMany.getPayloads().empty());
+
+  buf.header.segmentCount = -1;
+  EaselComm2::Message negative(&buf, sizeof(buf), 0, /*messageId=*/0);
+  EXPECT_FALSE(negative.isValid());
+
+  // Shorter than the header.
+  EaselComm2::Message truncated(&buf, sizeof(buf.header) - 1, 0,
+                                /*messageId=*/0);
+  EXPECT_FALSE(truncated.isValid());
+}
+
+TEST(EaselComm2MessageTest, RejectsTooManySegments) {
+  const int kSegments = EASELCOMM_MAX_DMA_SEGMENTS + 1;
+  std::vector<char> buf(sizeof(EaselComm2::Message::Header) +
+                        kSegments * sizeof(EaselComm2::Message::Segment));
+  auto header = reinterpret_cast<EaselComm2::Message::Header*>(buf.data());
+  header->type = EaselComm2::Message::PING;
+  header->segmentCount = kSegments;
+
+  EaselComm2::Message message(buf.data(), buf.size(), 0, /*messageId=*/0);
+  EXPECT_FALSE(message.isValid());
+}
+
 // Test class for easelcomm2 usecases
 class EaselComm2Test : public ::testing::Test {
  public:
@@ -310,6 +364,96 @@ TEST_F(EaselComm2Test, MultipleAHardareBufferEaselLoopback) {
   releaseAHardwareBuffer(rxBuffer);
 }
 
+TEST_F(EaselComm2Test, MultipleMallocBufferAsyncEaselLoopback) {
+  const uint32_t kWidth = 32;
+  const uint32_t kHeight = 24;
+  const uint32_t kSeed = 23;
+  const int kSize = 8;
+  const size_t kBufferSize =
+      getBufferSize(kWidth, kHeight, AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM);
+
+  int count = 0;
+  comm()->registerHandler(
+      kMallocBufferChannel, [&](const EaselComm2::Message& message) {
+        ASSERT_TRUE(message.hasPayload());
+        EaselComm2::HardwareBuffer rxHardwareBuffer(kBufferSize);
+        ASSERT_EQ(comm()->receivePayload(message, &rxHardwareBuffer), NO_ERROR);
+        EXPECT_TRUE(checkPattern(kSeed, patternSimple, kWidth, kWidth, kHeight,
+                                 AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM,
+                                 rxHardwareBuffer.vaddr()));
+        count++;
+        if (count >= kSize) signal();
+      });
+
+  std::vector<uint8_t> txData(kBufferSize);
+  writePattern(kSeed, patternSimple, kWidth, kWidth, kHeight,
+               AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM, txData.data());
+
+  std::mutex completionLock;
+  std::condition_variable completionCond;
+  int completed = 0;
+  for (int i = 0; i < kSize; i++) {
+    EaselComm2::HardwareBuffer txHardwareBuffer(txData.data(), kBufferSize, i);
+    ASSERT_EQ(comm()->sendAsync(kMallocBufferChannel, &txHardwareBuffer,
+                                [&](int result) {
+                                  EXPECT_EQ(result, NO_ERROR);
+                                  std::lock_guard<std::mutex> lock(
+                                      completionLock);
+                                  completed++;
+                                  completionCond.notify_one();
+                                }),
+              NO_ERROR);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(completionLock);
+    completionCond.wait(lock, [&] { return completed == kSize; });
+  }
+  wait();
+}
+
+TEST_F(EaselComm2Test, ScatterGatherMallocEaselLoopback) {
+  const uint32_t kWidth = 32;
+  const uint32_t kHeight = 24;
+  const uint32_t kSeed = 29;
+  const int kSize = 4;
+  const size_t kBufferSize =
+      getBufferSize(kWidth, kHeight, AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM);
+
+  // The server gathers all segments into one buffer and echoes it back.
+  comm()->registerHandler(
+      kMallocBufferChannel, [&](const EaselComm2::Message& message) {
+        ASSERT_TRUE(message.hasPayload());
+        ASSERT_EQ(message.getPayload().size(), kBufferSize * kSize);
+        EaselComm2::HardwareBuffer rxHardwareBuffer(kBufferSize * kSize);
+        ASSERT_EQ(comm()->receivePayload(message, &rxHardwareBuffer), NO_ERROR);
+        for (int i = 0; i < kSize; i++) {
+          EXPECT_TRUE(checkPattern(
+              kSeed + i, patternSimple, kWidth, kWidth, kHeight,
+              AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM,
+              static_cast<uint8_t*>(rxHardwareBuffer.vaddr()) +
+                  i * kBufferSize));
+        }
+        signal();
+      });
+
+  std::vector<std::vector<uint8_t>> txData;
+  std::vector<EaselComm2::HardwareBuffer> txBuffers;
+  for (int i = 0; i < kSize; i++) {
+    txData.emplace_back(kBufferSize);
+  }
+  for (int i = 0; i < kSize; i++) {
+    writePattern(kSeed + i, patternSimple, kWidth, kWidth, kHeight,
+                 AHARDWAREBUFFER_FORMAT_R8G8B8_UNORM, txData[i].data());
+    txBuffers.emplace_back(txData[i].data(), kBufferSize, kSeed + i);
+  }
+
+  int lastId = 0;
+  ASSERT_EQ(comm()->send(kMallocBufferChannel, txBuffers, &lastId), NO_ERROR);
+  EXPECT_EQ(lastId, static_cast<int>(kSeed) + kSize - 1);
+  wait();
+}
+
 TEST_F(EaselComm2Test, MathRpc) {
   test::Request request;
   auto mathOp = request.add_operations();
@@ -361,6 +505,35 @@ TEST_F(EaselComm2Test, MathRpc) {
   wait();
 }
 
+// Request and response exceed EASELCOMM_MAX_MESSAGE_SIZE, so both bodies
+// are spilled into DMA transfers.
+TEST_F(EaselComm2Test, LargeMathRpc) {
+  const int kNumOperations = 4096;
+  test::Request request;
+  for (int i = 0; i < kNumOperations; i++) {
+    auto mathOp = request.add_operations();
+    mathOp->set_op(test::MathOperation::ADD);
+    mathOp->set_operand1(i);
+    mathOp->set_operand2(i);
+  }
+  ASSERT_GT(request.ByteSize(), EASELCOMM_MAX_MESSAGE_SIZE);
+
+  comm()->registerHandler(kProtoChannel,
+                          [&](const EaselComm2::Message& message) {
+                            test::Response response;
+                            ASSERT_TRUE(message.toProto(&response));
+
+                            ASSERT_EQ(response.results_size(), kNumOperations);
+                            for (int i = 0; i < kNumOperations; i++) {
+                              EXPECT_EQ(response.results(i).result(), i * 2);
+                            }
+                            signal();
+                          });
+
+  ASSERT_EQ(comm()->send(kProtoChannel, request), NO_ERROR);
+  wait();
+}
+
 TEST_F(EaselComm2Test, SyncAck) {
   comm()->registerHandler(kStringChannel,
                           [&](const EaselComm2::Message& message) {
@@ -77,9 +77,41 @@ void handleStructMessage(const EaselComm2::Message& message2) {
   CHECK_EQ(server->send(kStructChannel, &reverse, sizeof(reverse)), NO_ERROR);
 }
 
+// Handles scatter-gather DMA ion buffers and echo each buffer back.
+void handleIonBufferSgMessage(const EaselComm2::Message& message2) {
+  std::vector<ImxDeviceBufferHandle> imxBuffers;
+  std::vector<EaselComm2::HardwareBuffer> hardwareBuffers;
+  for (auto& segment : message2.getPayloads()) {
+    ImxDeviceBufferHandle buffer;
+    CHECK_EQ(ImxCreateDeviceBufferManaged(
+                 allocator, segment.size(), kImxDefaultDeviceBufferAlignment,
+                 kImxDefaultDeviceBufferHeap, 0, &buffer),
+             IMX_SUCCESS);
+    int fd;
+    CHECK_EQ(ImxShareDeviceBuffer(buffer, &fd), IMX_SUCCESS);
+    imxBuffers.push_back(buffer);
+    hardwareBuffers.emplace_back(fd, segment.size(), 0);
+  }
+
+  // Receives all segments to ImxDeviceBuffers in one DMA transfer.
+  CHECK_EQ(server->receivePayload(message2, &hardwareBuffers), NO_ERROR);
+  // Replies each buffer in its own message.
+  for (auto& hardwareBuffer : hardwareBuffers) {
+    CHECK_EQ(server->send(kIonBufferChannel, &hardwareBuffer), NO_ERROR);
+  }
+
+  for (auto buffer : imxBuffers) {
+    CHECK_EQ(ImxDeleteDeviceBuffer(buffer), IMX_SUCCESS);
+  }
+}
+
 // Handles DMA ion buffer and echo same buffer back.
 void handleIonBufferMessage(const EaselComm2::Message& message2) {
   CHECK(message2.hasPayload());
+  if (!message2.getPayloads().empty()) {
+    handleIonBufferSgMessage(message2);
+    return;
+  }
   size_t size = message2.getPayload().size();
   ImxDeviceBufferHandle buffer;
   CHECK_EQ(ImxCreateDeviceBufferManaged(
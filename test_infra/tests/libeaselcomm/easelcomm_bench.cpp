@@ -0,0 +1,477 @@
+/*
+ * EaselComm transport microbenchmark.
+ *
+ * If compiled with AP_CLIENT defined then the benchmark driver is compiled;
+ * If compiled with EASEL_SERVER defined then the echo server it talks to is
+ * compiled.  Start the server first.  Both run on a Linux host against the
+ * easelcomm emulator when EASELCOMM_EMULATOR_DIR is set.
+ *
+ * The driver sweeps message sizes up to EASELCOMM_MAX_MESSAGE_SIZE and DMA
+ * sizes from 4 KB to 64 MB, from user or dma-buf source buffers, sent with
+ * sendMessageReceiveReply() (sync) or sendMessage() (async), from 1 to N
+ * concurrent sender threads.  Each case reports p50/p99/p999 latency of one
+ * send and the achieved bandwidth, as CSV or JSON on stdout.
+ *
+ * Driver usage:
+ *   easelcomm_bench [--json] [--iterations=N] [--threads=N] [--max-dma=BYTES]
+ */
+
+#define LOG_TAG "easelcomm_bench"
+
+#include <errno.h>
+#include <linux/memfd.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(AP_CLIENT) && defined(__ANDROID__)
+#include <android/hardware_buffer.h>
+#endif
+
+#include "easelcomm.h"
+#include "test_helpers.h"
+
+namespace {
+
+// Command carried at the start of every benchmark message.
+enum BenchCommand : uint32_t {
+    BENCH_CMD_DATA = 0,  // Receive the DMA transfer, reply if asked.
+    BENCH_CMD_QUIT = 1,  // Reply if asked and exit.
+};
+
+struct BenchHeader {
+    uint32_t command;
+    uint32_t reserved;
+};
+
+#ifdef EASEL_SERVER
+EaselCommServer easelcomm_server;
+
+/*
+ * Echo server: receives every DMA transfer into a reused user buffer and
+ * sends an empty reply when one is needed.
+ */
+static int runServer() {
+    int ret = easelcomm_server.open(EASEL_SERVICE_TEST);
+    if (ret) {
+        ALOGE("%s: open failed (%d)", __FUNCTION__, ret);
+        return ret;
+    }
+    easelcomm_server.flush();
+
+    std::vector<char> dmaBuffer;
+    bool quit = false;
+    while (!quit) {
+        EaselComm::EaselMessage req;
+        ret = easelcomm_server.receiveMessage(&req);
+        if (ret) {
+            ALOGE("%s: receiveMessage failed (%d)", __FUNCTION__, ret);
+            break;
+        }
+
+        if (req.message_buf_size >= sizeof(BenchHeader)) {
+            const BenchHeader *header =
+                static_cast<const BenchHeader *>(req.message_buf);
+            quit = header->command == BENCH_CMD_QUIT;
+        }
+
+        if (req.dma_buf_size) {
+            if (dmaBuffer.size() < req.dma_buf_size) {
+                dmaBuffer.resize(req.dma_buf_size);
+            }
+            req.dma_buf = dmaBuffer.data();
+            ret = easelcomm_server.receiveDMA(&req);
+            if (ret) {
+                ALOGE("%s: receiveDMA failed (%d)", __FUNCTION__, ret);
+            }
+        }
+
+        if (req.need_reply) {
+            EaselComm::EaselMessage reply;
+            ret = easelcomm_server.sendReply(&req, 0, &reply);
+            if (ret) {
+                ALOGE("%s: sendReply failed (%d)", __FUNCTION__, ret);
+            }
+        }
+        easelcomm_server.releaseMessageBuffer(&req);
+    }
+
+    easelcomm_server.close();
+    return ret;
+}
+#endif  // EASEL_SERVER
+
+#ifdef AP_CLIENT
+EaselCommClient easelcomm_client;
+
+const size_t kMessageSizes[] = {
+    sizeof(BenchHeader), 256, 1024, 4096, EASELCOMM_MAX_MESSAGE_SIZE,
+};
+const size_t kMinDmaSize = 4 * 1024;
+const size_t kMaxDmaSize = 64 * 1024 * 1024;
+// Iterations of a case are capped so each moves about this many bytes.
+const size_t kBytesPerCase = 1024 * 1024 * 1024;
+const int kMinIterations = 16;
+
+enum class BufferType { NONE, USER, DMA_BUF };
+enum class SendMode { SYNC, ASYNC };
+
+const int kDefaultIterations = 1000;
+
+struct ClientOptions {
+    test_helpers::BenchOptions bench;
+    int maxThreads = 4;
+    size_t maxDmaSize = kMaxDmaSize;
+};
+
+struct BenchCase {
+    size_t messageSize;
+    size_t dmaSize;
+    BufferType bufferType;
+    SendMode mode;
+    int threads;
+    int iterations;  // Per thread.
+};
+
+struct BenchResult {
+    double p50Us;
+    double p99Us;
+    double p999Us;
+    double gbPerSec;
+    int errors;
+};
+
+const char *bufferTypeName(BufferType type) {
+    switch (type) {
+        case BufferType::NONE:
+            return "none";
+        case BufferType::USER:
+            return "user";
+        case BufferType::DMA_BUF:
+            return "dmabuf";
+    }
+    return "unknown";
+}
+
+const char *sendModeName(SendMode mode) {
+    return mode == SendMode::SYNC ? "sync" : "async";
+}
+
+/*
+ * DMA source buffer of one sender thread, in user memory or in a dma-buf
+ * that is mapped for filling.
+ */
+class SourceBuffer {
+public:
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+    ~SourceBuffer() { release(); }
+
+    // Returns 0 for success, or -errno for failure.
+    int allocate(BufferType type, size_t size) {
+        mType = type;
+        mSize = size;
+        if (type == BufferType::USER) {
+            mUser.assign(size, 0x5a);
+            return 0;
+        }
+        if (type != BufferType::DMA_BUF) {
+            return 0;
+        }
+
+#ifdef __ANDROID__
+        AHardwareBuffer_Desc desc = {
+            .width = static_cast<uint32_t>(size),
+            .height = 1,
+            .layers = 1,
+            .format = AHARDWAREBUFFER_FORMAT_BLOB,
+            .usage = AHARDWAREBUFFER_USAGE_CPU_READ_RARELY |
+                     AHARDWAREBUFFER_USAGE_CPU_WRITE_RARELY,
+        };
+        int ret = AHardwareBuffer_allocate(&desc, &mHardwareBuffer);
+        if (ret) {
+            return ret;
+        }
+        mFd = AHardwareBuffer_getNativeHandle(mHardwareBuffer)->data[0];
+        void *data = nullptr;
+        ret = AHardwareBuffer_lock(mHardwareBuffer,
+                                   AHARDWAREBUFFER_USAGE_CPU_WRITE_RARELY, -1,
+                                   nullptr, &data);
+        if (ret) {
+            return ret;
+        }
+        memset(data, 0x5a, size);
+        return AHardwareBuffer_unlock(mHardwareBuffer, nullptr);
+#else
+        // The emulator takes any mappable fd in place of a dma-buf.
+        mFd = syscall(__NR_memfd_create, "easelcomm_bench", MFD_CLOEXEC);
+        if (mFd < 0) {
+            return -errno;
+        }
+        if (ftruncate(mFd, size)) {
+            return -errno;
+        }
+        return 0;
+#endif
+    }
+
+    // Points msg's DMA buffer at this buffer.
+    void fill(EaselComm::EaselMessage *msg) {
+        msg->dma_buf_size = mSize;
+        if (mType == BufferType::USER) {
+            msg->dma_buf = mUser.data();
+        } else if (mType == BufferType::DMA_BUF) {
+            msg->dma_buf = nullptr;
+            msg->dma_buf_fd = mFd;
+            msg->dma_buf_type = EASELCOMM_DMA_BUFFER_DMA_BUF;
+        }
+    }
+
+private:
+    void release() {
+#ifdef __ANDROID__
+        if (mHardwareBuffer != nullptr) {
+            AHardwareBuffer_release(mHardwareBuffer);
+            mHardwareBuffer = nullptr;
+        }
+#else
+        if (mFd >= 0) {
+            close(mFd);
+        }
+#endif
+        mFd = -1;
+    }
+
+    BufferType mType = BufferType::NONE;
+    size_t mSize = 0;
+    std::vector<char> mUser;
+    int mFd = -1;
+#ifdef __ANDROID__
+    AHardwareBuffer *mHardwareBuffer = nullptr;
+#endif
+};
+
+// Sends one message with command and no DMA, and waits for the reply.
+int sendCommand(BenchCommand command) {
+    BenchHeader header = {command, 0};
+    EaselComm::EaselMessage msg;
+    msg.message_buf = &header;
+    msg.message_buf_size = sizeof(header);
+    msg.need_reply = true;
+
+    EaselComm::EaselMessage reply;
+    int replycode;
+    int ret = easelcomm_client.sendMessageReceiveReply(&msg, &replycode, &reply);
+    free(reply.message_buf);
+    return ret;
+}
+
+/*
+ * Runs iterations sends of one sender thread, appending the latency of each
+ * to latencies.  Returns the number of failed sends.
+ */
+int runSender(const BenchCase &benchCase, std::vector<int64_t> *latencies) {
+    SourceBuffer source;
+    if (source.allocate(benchCase.bufferType, benchCase.dmaSize)) {
+        ALOGE("%s: failed to allocate %zu byte %s buffer", __FUNCTION__,
+              benchCase.dmaSize, bufferTypeName(benchCase.bufferType));
+        return benchCase.iterations;
+    }
+
+    std::vector<char> messageBuf(benchCase.messageSize, 0);
+    BenchHeader header = {BENCH_CMD_DATA, 0};
+    memcpy(messageBuf.data(), &header, sizeof(header));
+
+    int errors = 0;
+    for (int i = 0; i < benchCase.iterations; i++) {
+        EaselComm::EaselMessage msg;
+        msg.message_buf = messageBuf.data();
+        msg.message_buf_size = messageBuf.size();
+        source.fill(&msg);
+
+        auto start = std::chrono::steady_clock::now();
+        int ret;
+        if (benchCase.mode == SendMode::SYNC) {
+            msg.need_reply = true;
+            EaselComm::EaselMessage reply;
+            int replycode;
+            ret = easelcomm_client.sendMessageReceiveReply(&msg, &replycode,
+                                                           &reply);
+            free(reply.message_buf);
+        } else {
+            ret = easelcomm_client.sendMessage(&msg);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        if (ret) {
+            errors++;
+            continue;
+        }
+        latencies->push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                .count());
+    }
+    return errors;
+}
+
+BenchResult runCase(const BenchCase &benchCase) {
+    std::vector<std::vector<int64_t>> latencies(benchCase.threads);
+    std::vector<int> errors(benchCase.threads, 0);
+    std::vector<std::thread> senders;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < benchCase.threads; t++) {
+        latencies[t].reserve(benchCase.iterations);
+        senders.emplace_back([&, t] {
+            errors[t] = runSender(benchCase, &latencies[t]);
+        });
+    }
+    for (auto &sender : senders) {
+        sender.join();
+    }
+    // Async sends may still be queued at the server; count them in.
+    int barrierRet = sendCommand(BENCH_CMD_DATA);
+    auto end = std::chrono::steady_clock::now();
+
+    BenchResult result = {};
+    std::vector<double> all;
+    for (int t = 0; t < benchCase.threads; t++) {
+        for (int64_t latency : latencies[t]) {
+            all.push_back(latency / 1000.0);
+        }
+        result.errors += errors[t];
+    }
+    if (barrierRet) {
+        result.errors++;
+    }
+    std::sort(all.begin(), all.end());
+    result.p50Us = test_helpers::percentile(all, 0.50);
+    result.p99Us = test_helpers::percentile(all, 0.99);
+    result.p999Us = test_helpers::percentile(all, 0.999);
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double bytes = static_cast<double>(all.size()) *
+                   (benchCase.messageSize + benchCase.dmaSize);
+    result.gbPerSec = seconds > 0 ? bytes / seconds / 1e9 : 0;
+    return result;
+}
+
+int iterationsFor(const ClientOptions &options, size_t bytes) {
+    size_t capped = kBytesPerCase / std::max<size_t>(bytes, 1);
+    return static_cast<int>(std::max<size_t>(
+        kMinIterations, std::min<size_t>(options.bench.iterations, capped)));
+}
+
+// Builds the case matrix: messages only, then DMA from each buffer type.
+std::vector<BenchCase> buildCases(const ClientOptions &options) {
+    std::vector<BenchCase> cases;
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < options.maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(options.maxThreads);
+
+    for (SendMode mode : {SendMode::SYNC, SendMode::ASYNC}) {
+        for (int threads : threadCounts) {
+            for (size_t messageSize : kMessageSizes) {
+                cases.push_back({messageSize, 0, BufferType::NONE, mode,
+                                 threads,
+                                 iterationsFor(options, messageSize)});
+            }
+            for (BufferType type : {BufferType::USER, BufferType::DMA_BUF}) {
+                for (size_t dmaSize = kMinDmaSize;
+                     dmaSize <= options.maxDmaSize; dmaSize *= 4) {
+                    cases.push_back({sizeof(BenchHeader), dmaSize, type, mode,
+                                     threads,
+                                     iterationsFor(options, dmaSize)});
+                }
+            }
+        }
+    }
+    return cases;
+}
+
+void printResult(test_helpers::BenchPrinter *printer,
+                 const BenchCase &benchCase, const BenchResult &result) {
+    printer->printRow({sendModeName(benchCase.mode),
+                       bufferTypeName(benchCase.bufferType),
+                       std::to_string(benchCase.threads),
+                       std::to_string(benchCase.messageSize),
+                       std::to_string(benchCase.dmaSize),
+                       std::to_string(benchCase.iterations),
+                       test_helpers::formatNumber(result.p50Us, 1),
+                       test_helpers::formatNumber(result.p99Us, 1),
+                       test_helpers::formatNumber(result.p999Us, 1),
+                       test_helpers::formatNumber(result.gbPerSec, 3),
+                       std::to_string(result.errors)});
+}
+
+bool parseOptions(int argc, char **argv, ClientOptions *options) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--threads=", 10) == 0) {
+            options->maxThreads = atoi(arg + 10);
+        } else if (strncmp(arg, "--max-dma=", 10) == 0) {
+            options->maxDmaSize = strtoull(arg + 10, nullptr, 0);
+        } else if (!test_helpers::parseBenchOption(arg, &options->bench)) {
+            return false;
+        }
+    }
+    return options->bench.iterations > 0 && options->maxThreads > 0;
+}
+
+int runClient(const ClientOptions &options) {
+    int ret = easelcomm_client.open(EASEL_SERVICE_TEST);
+    if (ret) {
+        ALOGE("%s: open failed (%d)", __FUNCTION__, ret);
+        return ret;
+    }
+
+    {
+        test_helpers::BenchPrinter printer(
+            options.bench.json,
+            {"mode", "buffer", "threads", "message_bytes", "dma_bytes",
+             "iterations", "p50_us", "p99_us", "p999_us", "gb_per_s",
+             "errors"});
+        for (const BenchCase &benchCase : buildCases(options)) {
+            printResult(&printer, benchCase, runCase(benchCase));
+        }
+    }
+
+    ret = sendCommand(BENCH_CMD_QUIT);
+    easelcomm_client.close();
+    return ret;
+}
+#endif  // AP_CLIENT
+
+}  // anonymous namespace
+
+int main(int argc, char **argv) {
+#ifdef EASEL_SERVER
+    (void)argc;
+    (void)argv;
+    return runServer() ? EXIT_FAILURE : EXIT_SUCCESS;
+#endif
+
+#ifdef AP_CLIENT
+    ClientOptions options;
+    options.bench.iterations = kDefaultIterations;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "usage: %s [--json] [--iterations=N] [--threads=N] "
+                "[--max-dma=BYTES]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    return runClient(options) ? EXIT_FAILURE : EXIT_SUCCESS;
+#endif
+}
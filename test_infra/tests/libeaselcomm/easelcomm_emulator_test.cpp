@@ -0,0 +1,678 @@
+/*
+ * EaselComm tests over the userspace easelcomm emulator.
+ *
+ * Client and server run in the same process, each on its own emulated
+ * device, so these tests run on a Linux host without Easel.
+ */
+
+#define LOG_TAG "easelcomm_emulator_test"
+
+#include <errno.h>
+#include <linux/memfd.h>
+#include <log/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EaselCommTrace.h"
+#include "easelcomm.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const char kMessage[] = "emulated message";
+const size_t kDmaSize = 1024 * 1024;
+
+// Creates a memfd of size bytes standing in for a dma-buf.
+int createMemfd(size_t size) {
+    int fd = syscall(__NR_memfd_create, "easelcomm_emulator_test",
+                     MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::vector<char> makePattern(size_t size, char seed) {
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<char>(seed + i * 7);
+    }
+    return data;
+}
+
+class EaselCommEmulatorTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char dir[] = "/tmp/easelcomm_emulator_test.XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        mDir = dir;
+        setenv("EASELCOMM_EMULATOR_DIR", mDir.c_str(), 1);
+
+        ASSERT_EQ(mServer.open(EASEL_SERVICE_TEST), 0);
+        ASSERT_EQ(mClient.open(EASEL_SERVICE_TEST), 0);
+    }
+
+    void TearDown() override {
+        mClient.close();
+        mServer.close();
+        rmdir(mDir.c_str());
+        unsetenv("EASELCOMM_EMULATOR_DIR");
+    }
+
+    // Sends kMessage from the client with an optional DMA buffer.
+    int sendFromClient(void *dma_buf, size_t dma_buf_size) {
+        EaselComm::EaselMessage msg;
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+        msg.dma_buf = dma_buf;
+        msg.dma_buf_size = dma_buf_size;
+        return mClient.sendMessage(&msg);
+    }
+
+    std::string mDir;
+    EaselCommServerEmulator mServer;
+    EaselCommClientEmulator mClient;
+};
+
+TEST_F(EaselCommEmulatorTest, MessageAndReply) {
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        EXPECT_TRUE(msg.need_reply);
+        EXPECT_STREQ(static_cast<char *>(msg.message_buf), kMessage);
+        mServer.releaseMessageBuffer(&msg);
+
+        char reply_text[] = "reply";
+        EaselComm::EaselMessage reply;
+        reply.message_buf = reply_text;
+        reply.message_buf_size = sizeof(reply_text);
+        EXPECT_EQ(mServer.sendReply(&msg, 42, &reply), 0);
+    });
+
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.need_reply = true;
+    EaselComm::EaselMessage reply;
+    int replycode = 0;
+    ASSERT_EQ(mClient.sendMessageReceiveReply(&msg, &replycode, &reply), 0);
+    EXPECT_EQ(replycode, 42);
+    EXPECT_STREQ(static_cast<char *>(reply.message_buf), "reply");
+    mClient.releaseMessageBuffer(&reply);
+    server.join();
+}
+
+TEST_F(EaselCommEmulatorTest, UserDma) {
+    std::vector<char> src = makePattern(kDmaSize, 1);
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        ASSERT_EQ(msg.dma_buf_size, kDmaSize);
+        std::vector<char> dst(kDmaSize);
+        msg.dma_buf = dst.data();
+        EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+        EXPECT_EQ(dst, src);
+        mServer.releaseMessageBuffer(&msg);
+    });
+
+    EXPECT_EQ(sendFromClient(src.data(), src.size()), 0);
+    server.join();
+}
+
+TEST_F(EaselCommEmulatorTest, MemfdDma) {
+    std::vector<char> pattern = makePattern(kDmaSize, 2);
+    int src_fd = createMemfd(kDmaSize);
+    int dst_fd = createMemfd(kDmaSize);
+    ASSERT_GE(src_fd, 0);
+    ASSERT_GE(dst_fd, 0);
+    ASSERT_EQ(pwrite(src_fd, pattern.data(), kDmaSize, 0),
+              static_cast<ssize_t>(kDmaSize));
+
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        msg.dma_buf = nullptr;
+        msg.dma_buf_fd = dst_fd;
+        msg.dma_buf_type = EASELCOMM_DMA_BUFFER_DMA_BUF;
+        EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+        mServer.releaseMessageBuffer(&msg);
+    });
+
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.dma_buf_fd = src_fd;
+    msg.dma_buf_type = EASELCOMM_DMA_BUFFER_DMA_BUF;
+    msg.dma_buf_size = kDmaSize;
+    EXPECT_EQ(mClient.sendMessage(&msg), 0);
+    server.join();
+
+    std::vector<char> dst(kDmaSize);
+    ASSERT_EQ(pread(dst_fd, dst.data(), kDmaSize, 0),
+              static_cast<ssize_t>(kDmaSize));
+    EXPECT_EQ(dst, pattern);
+    close(src_fd);
+    close(dst_fd);
+}
+
+TEST_F(EaselCommEmulatorTest, RegisteredBuffers) {
+    const int kTransfers = 3;
+    std::vector<char> dst(kDmaSize);
+    EaselComm::BufferHandle handle = 0;
+    ASSERT_EQ(mServer.registerBuffer(EASELCOMM_DMA_BUFFER_USER, dst.data(), -1,
+                                     dst.size(), &handle),
+              0);
+
+    std::vector<std::vector<char>> received;
+    std::thread server([&] {
+        for (int i = 0; i < kTransfers + 1; i++) {
+            EaselComm::EaselMessage msg;
+            ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+            // Received into the second half of the registered buffer.
+            msg.dma_buf = dst.data() + kDmaSize / 2;
+            EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+            received.emplace_back(dst.begin() + kDmaSize / 2, dst.end());
+            mServer.releaseMessageBuffer(&msg);
+        }
+    });
+
+    std::vector<std::vector<char>> sent;
+    int src_fd = createMemfd(kDmaSize / 2);
+    ASSERT_GE(src_fd, 0);
+    for (int i = 0; i < kTransfers + 1; i++) {
+        if (i == kTransfers) {
+            // A new dma-buf reusing the fd number must not hit the cache.
+            close(src_fd);
+            src_fd = createMemfd(kDmaSize / 2);
+            ASSERT_GE(src_fd, 0);
+        }
+        sent.push_back(makePattern(kDmaSize / 2, i));
+        ASSERT_EQ(pwrite(src_fd, sent.back().data(), kDmaSize / 2, 0),
+                  static_cast<ssize_t>(kDmaSize / 2));
+
+        EaselComm::EaselMessage msg;
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+        msg.dma_buf_fd = src_fd;
+        msg.dma_buf_type = EASELCOMM_DMA_BUFFER_DMA_BUF;
+        msg.dma_buf_size = kDmaSize / 2;
+        EXPECT_EQ(mClient.sendMessage(&msg), 0);
+    }
+    server.join();
+    close(src_fd);
+    EXPECT_EQ(received, sent);
+
+    EaselComm::RegistrationStats stats;
+    mServer.getRegistrationStats(&stats);
+    EXPECT_EQ(stats.hits, static_cast<uint64_t>(kTransfers + 1));
+    EXPECT_EQ(stats.misses, 0u);
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_EQ(mServer.unregisterBuffer(handle), 0);
+    EXPECT_EQ(mServer.unregisterBuffer(handle), -EINVAL);
+
+    mClient.getRegistrationStats(&stats);
+    EXPECT_EQ(stats.hits, static_cast<uint64_t>(kTransfers - 1));
+    EXPECT_EQ(stats.misses, 2u);
+    EXPECT_EQ(stats.entries, 1u);
+    mClient.setRegistrationCacheSize(0);
+    mClient.getRegistrationStats(&stats);
+    EXPECT_EQ(stats.entries, 0u);
+    EXPECT_EQ(stats.evictions, 1u);
+}
+
+TEST_F(EaselCommEmulatorTest, ScatterGatherDma) {
+    std::vector<char> src = makePattern(kDmaSize, 3);
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        std::vector<char> dst(kDmaSize);
+        easelcomm_dma_segment segments[2] = {
+            {dst.data(), -1, EASELCOMM_DMA_BUFFER_USER, kDmaSize / 4},
+            {dst.data() + kDmaSize / 4, -1, EASELCOMM_DMA_BUFFER_USER,
+             kDmaSize - kDmaSize / 4},
+        };
+        msg.dma_buf_type = EASELCOMM_DMA_BUFFER_SG_LIST;
+        msg.dma_sg_list = {segments, 2};
+        EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+        EXPECT_EQ(dst, src);
+        mServer.releaseMessageBuffer(&msg);
+    });
+
+    EXPECT_EQ(sendFromClient(src.data(), src.size()), 0);
+    server.join();
+    // The emulator takes scatter-gather lists without a bounce buffer.
+    EXPECT_TRUE(EaselComm::isSgDmaSupported());
+}
+
+TEST_F(EaselCommEmulatorTest, CancelDma) {
+    std::vector<char> src = makePattern(kDmaSize, 4);
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        EXPECT_EQ(mServer.cancelReceiveDMA(&msg), 0);
+        mServer.releaseMessageBuffer(&msg);
+    });
+
+    EXPECT_EQ(sendFromClient(src.data(), src.size()), 0);
+    server.join();
+}
+
+TEST_F(EaselCommEmulatorTest, AsyncDma) {
+    std::vector<char> src = makePattern(kDmaSize, 5);
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        std::vector<char> dst(kDmaSize);
+        msg.dma_buf = dst.data();
+        EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+        EXPECT_EQ(dst, src);
+        mServer.releaseMessageBuffer(&msg);
+    });
+
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.dma_buf = src.data();
+    msg.dma_buf_size = src.size();
+    std::future<int> result = mClient.sendMessageAsync(&msg);
+    EXPECT_EQ(result.get(), 0);
+    server.join();
+}
+
+TEST_F(EaselCommEmulatorTest, CloseWakesAsyncDma) {
+    std::vector<char> src = makePattern(kDmaSize, 6);
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.dma_buf = src.data();
+    msg.dma_buf_size = src.size();
+    std::future<int> result = mClient.sendMessageAsync(&msg);
+
+    // The server takes the message but never the DMA transfer, so the DMA
+    // thread stays blocked in SENDDMA until close() shuts the link down.
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    usleep(50000);
+    mClient.close();
+    EXPECT_NE(result.get(), 0);
+    mServer.releaseMessageBuffer(&received);
+}
+
+TEST_F(EaselCommEmulatorTest, BatchedSend) {
+    const size_t kCount = 8;
+    std::vector<EaselComm::EaselMessage> msgs(kCount);
+    for (auto &msg : msgs) {
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+    }
+    size_t sent = 0;
+    ASSERT_EQ(mClient.sendMessages(msgs.data(), kCount, &sent), 0);
+    EXPECT_EQ(sent, kCount);
+
+    for (size_t i = 0; i < kCount; i++) {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        EXPECT_STREQ(static_cast<char *>(msg.message_buf), kMessage);
+        mServer.releaseMessageBuffer(&msg);
+    }
+}
+
+TEST_F(EaselCommEmulatorTest, BatchedSendRejectsInvalidMessages) {
+    const size_t kCount = 4;
+    std::vector<EaselComm::EaselMessage> msgs(kCount);
+    for (auto &msg : msgs) {
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+    }
+
+    // Replies can't be waited for in a batch.
+    size_t sent = kCount;
+    msgs[1].need_reply = true;
+    EXPECT_EQ(mClient.sendMessages(msgs.data(), kCount, &sent), -EINVAL);
+    EXPECT_EQ(sent, 0u);
+    msgs[1].need_reply = false;
+
+    // The driver rejects an oversized message.
+    std::vector<char> large(EASELCOMM_MAX_MESSAGE_SIZE + 1);
+    msgs[0].message_buf = large.data();
+    msgs[0].message_buf_size = large.size();
+    EXPECT_EQ(mClient.sendMessages(msgs.data(), kCount, &sent), -EINVAL);
+    EXPECT_EQ(sent, 0u);
+
+    // Later batches are still sent.
+    msgs[0].message_buf = const_cast<char *>(kMessage);
+    msgs[0].message_buf_size = sizeof(kMessage);
+    ASSERT_EQ(mClient.sendMessages(msgs.data(), kCount, &sent), 0);
+    EXPECT_EQ(sent, kCount);
+    for (size_t i = 0; i < kCount; i++) {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        EXPECT_STREQ(static_cast<char *>(msg.message_buf), kMessage);
+        mServer.releaseMessageBuffer(&msg);
+    }
+}
+
+TEST_F(EaselCommEmulatorTest, WaitTimeout) {
+    EaselComm::EaselMessage msg;
+    msg.timeout_ms = 10;
+    EXPECT_EQ(mServer.receiveMessage(&msg), -ETIMEDOUT);
+}
+
+TEST_F(EaselCommEmulatorTest, Flush) {
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(sendFromClient(nullptr, 0), 0);
+    }
+    mServer.flush();
+
+    char last[] = "after flush";
+    EaselComm::EaselMessage msg;
+    msg.message_buf = last;
+    msg.message_buf_size = sizeof(last);
+    ASSERT_EQ(mClient.sendMessage(&msg), 0);
+
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    EXPECT_STREQ(static_cast<char *>(received.message_buf), last);
+    mServer.releaseMessageBuffer(&received);
+}
+
+TEST_F(EaselCommEmulatorTest, DmaDoesNotHoldLane) {
+    std::vector<char> src = makePattern(kDmaSize, 6);
+    std::thread control([&] {
+        EaselComm::EaselMessage msg;
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+        msg.dma_buf = src.data();
+        msg.dma_buf_size = src.size();
+        msg.priority = EaselComm::PRIORITY_CONTROL;
+        EXPECT_EQ(mClient.sendMessage(&msg), 0);
+    });
+
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    ASSERT_EQ(received.dma_buf_size, kDmaSize);
+
+    // The control message is posted, so the bulk message goes out while the
+    // control DMA is still pending.
+    std::thread bulk([&] {
+        EaselComm::EaselMessage msg;
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+        msg.priority = EaselComm::PRIORITY_BULK;
+        EXPECT_EQ(mClient.sendMessage(&msg), 0);
+    });
+    EaselComm::EaselMessage early;
+    early.timeout_ms = 1000;
+    ASSERT_EQ(mServer.receiveMessage(&early), 0);
+    mServer.releaseMessageBuffer(&early);
+    bulk.join();
+
+    std::vector<char> dst(kDmaSize);
+    received.dma_buf = dst.data();
+    EXPECT_EQ(mServer.receiveDMA(&received), 0);
+    mServer.releaseMessageBuffer(&received);
+    control.join();
+
+    // Lanes are counted per object.
+    EaselComm::LaneStats stats;
+    mClient.getLaneStats(EaselComm::PRIORITY_BULK, &stats);
+    EXPECT_EQ(stats.messages, 1u);
+    EXPECT_EQ(stats.queue_depth, 0u);
+    mServer.getLaneStats(EaselComm::PRIORITY_BULK, &stats);
+    EXPECT_EQ(stats.messages, 0u);
+}
+
+TEST_F(EaselCommEmulatorTest, CreditFlowControl) {
+    const size_t kWindow = 4;
+    mClient.setSendCredits(kWindow);
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    for (size_t i = 0; i < kWindow; i++) {
+        ASSERT_EQ(mClient.trySendMessage(&msg), 0);
+    }
+
+    // The server has not received anything, so no credits are back yet.
+    EXPECT_EQ(mClient.trySendMessage(&msg), -EAGAIN);
+
+    char first[] = "coalesced 1";
+    char second[] = "coalesced 2";
+    msg.message_buf = first;
+    msg.message_buf_size = sizeof(first);
+    EXPECT_EQ(mClient.trySendMessage(&msg, /*coalesce_key=*/7), 0);
+    msg.message_buf = second;
+    msg.message_buf_size = sizeof(second);
+    EXPECT_EQ(mClient.trySendMessage(&msg, /*coalesce_key=*/7), 0);
+
+    // Receiving returns credits, which send the latest coalesced message.
+    for (size_t i = 0; i < kWindow; i++) {
+        EaselComm::EaselMessage received;
+        ASSERT_EQ(mServer.receiveMessage(&received), 0);
+        EXPECT_STREQ(static_cast<char *>(received.message_buf), kMessage);
+        mServer.releaseMessageBuffer(&received);
+    }
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    EXPECT_STREQ(static_cast<char *>(received.message_buf), second);
+    mServer.releaseMessageBuffer(&received);
+
+    EaselComm::FlowStats stats;
+    mClient.getFlowStats(&stats);
+    EXPECT_EQ(stats.window, kWindow);
+    EXPECT_EQ(stats.throttled, 3u);
+    EXPECT_EQ(stats.coalesced, 1u);
+    EXPECT_EQ(stats.dropped, 2u);
+}
+
+TEST_F(EaselCommEmulatorTest, SpinWait) {
+    const int kRoundTrips = 20;
+    mClient.setSpinWait(1000);
+    mServer.setSpinWait(1000);
+
+    std::thread server([&] {
+        for (int i = 0; i < kRoundTrips; i++) {
+            EaselComm::EaselMessage msg;
+            ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+            mServer.releaseMessageBuffer(&msg);
+            EXPECT_EQ(mServer.sendReply(&msg, i, nullptr), 0);
+        }
+    });
+
+    for (int i = 0; i < kRoundTrips; i++) {
+        EaselComm::EaselMessage msg;
+        msg.message_buf = const_cast<char *>(kMessage);
+        msg.message_buf_size = sizeof(kMessage);
+        msg.need_reply = true;
+        int replycode = -1;
+        ASSERT_EQ(mClient.sendMessageReceiveReply(&msg, &replycode, nullptr),
+                  0);
+        EXPECT_EQ(replycode, i);
+    }
+    server.join();
+
+    // Only receiving spins, replies are waited for in one blocking wait.
+    EaselComm::SpinWaitStats stats;
+    mClient.getSpinWaitStats(&stats);
+    EXPECT_EQ(stats.spin_wakeups + stats.blocked_wakeups, 0u);
+    mServer.getSpinWaitStats(&stats);
+    EXPECT_EQ(stats.spin_wakeups + stats.blocked_wakeups,
+              static_cast<uint64_t>(kRoundTrips));
+    EXPECT_LE(stats.budget_us, 1000u);
+
+    // A timeout still applies while spinning.
+    EaselComm::EaselMessage msg;
+    msg.timeout_ms = 10;
+    EXPECT_EQ(mClient.receiveMessage(&msg), -ETIMEDOUT);
+
+    mClient.setSpinWait(0);
+    mClient.getSpinWaitStats(&stats);
+    EXPECT_EQ(stats.budget_us, 0u);
+}
+
+TEST_F(EaselCommEmulatorTest, LateReplyIsDropped) {
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.need_reply = true;
+    msg.timeout_ms = 10;
+    int replycode = 0;
+    EXPECT_EQ(mClient.sendMessageReceiveReply(&msg, &replycode, nullptr),
+              -ETIMEDOUT);
+
+    // The DMA of a reply nobody waits for is discarded, not left pending.
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    mServer.releaseMessageBuffer(&received);
+    std::vector<char> src = makePattern(kDmaSize, 5);
+    EaselComm::EaselMessage reply;
+    reply.dma_buf = src.data();
+    reply.dma_buf_size = src.size();
+    EXPECT_EQ(mServer.sendReply(&received, 0, &reply), 0);
+}
+
+TEST_F(EaselCommEmulatorTest, RecordTrace) {
+    std::string path = mDir + "/client.trace";
+    ASSERT_EQ(mClient.startRecording(path.c_str(), /*payloads=*/true), 0);
+
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        mServer.releaseMessageBuffer(&msg);
+        EXPECT_EQ(mServer.sendReply(&msg, 7, nullptr), 0);
+    });
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.need_reply = true;
+    int replycode = 0;
+    ASSERT_EQ(mClient.sendMessageReceiveReply(&msg, &replycode, nullptr), 0);
+    server.join();
+    mClient.stopRecording();
+    // Not recorded once stopped.
+    ASSERT_EQ(sendFromClient(nullptr, 0), 0);
+
+    EaselCommTraceReader trace;
+    ASSERT_EQ(trace.open(path.c_str()), 0);
+    EaselCommTraceRecord record;
+    std::vector<char> payload;
+    ASSERT_EQ(trace.next(&record, &payload), 1);
+    EXPECT_EQ(record.event, EASELCOMM_TRACE_SEND);
+    EXPECT_EQ(record.service_id, EASEL_SERVICE_TEST);
+    EXPECT_EQ(record.flags, EASELCOMM_TRACE_NEED_REPLY);
+    EXPECT_EQ(record.message_size, sizeof(kMessage));
+    ASSERT_EQ(payload.size(), sizeof(kMessage));
+    EXPECT_STREQ(payload.data(), kMessage);
+    uint64_t sent_id = record.message_id;
+    uint64_t sent_ns = record.timestamp_ns;
+
+    ASSERT_EQ(trace.next(&record, &payload), 1);
+    EXPECT_EQ(record.event, EASELCOMM_TRACE_REPLY_RECEIVE);
+    EXPECT_EQ(record.in_reply_to, sent_id);
+    EXPECT_EQ(record.replycode, 7);
+    EXPECT_GE(record.timestamp_ns, sent_ns);
+    EXPECT_EQ(trace.next(&record, &payload), 0);
+    unlink(path.c_str());
+
+    EaselComm::EaselMessage received;
+    ASSERT_EQ(mServer.receiveMessage(&received), 0);
+    mServer.releaseMessageBuffer(&received);
+}
+
+TEST_F(EaselCommEmulatorTest, Telemetry) {
+    std::vector<char> src = makePattern(kDmaSize, 5);
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        std::vector<char> dst(kDmaSize);
+        msg.dma_buf = dst.data();
+        EXPECT_EQ(mServer.receiveDMA(&msg), 0);
+        mServer.releaseMessageBuffer(&msg);
+
+        ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+        mServer.releaseMessageBuffer(&msg);
+        EXPECT_EQ(mServer.sendReply(&msg, 0, nullptr), 0);
+    });
+    ASSERT_EQ(sendFromClient(src.data(), src.size()), 0);
+    EaselComm::EaselMessage msg;
+    msg.message_buf = const_cast<char *>(kMessage);
+    msg.message_buf_size = sizeof(kMessage);
+    msg.need_reply = true;
+    int replycode = -1;
+    ASSERT_EQ(mClient.sendMessageReceiveReply(&msg, &replycode, nullptr), 0);
+    server.join();
+    mClient.flush();
+
+    EaselComm::Telemetry telemetry;
+    mClient.getTelemetry(&telemetry);
+    EXPECT_EQ(telemetry.service_id, EASEL_SERVICE_TEST);
+    EXPECT_FALSE(telemetry.server);
+    EXPECT_TRUE(telemetry.connected);
+    EXPECT_EQ(telemetry.sent.messages, 2u);
+    EXPECT_EQ(telemetry.sent.message_bytes, 2 * sizeof(kMessage));
+    EXPECT_EQ(telemetry.sent.dma_transfers, 1u);
+    EXPECT_EQ(telemetry.sent.dma_bytes, kDmaSize);
+    EXPECT_EQ(telemetry.sent.dma_us.count, 1u);
+    EXPECT_EQ(telemetry.received.messages, 1u);
+    EXPECT_EQ(telemetry.reply_us.count, 1u);
+    EXPECT_EQ(telemetry.queue_wait_us.count, 2u);
+    EXPECT_EQ(telemetry.flushes, 1u);
+
+    mServer.getTelemetry(&telemetry);
+    EXPECT_TRUE(telemetry.server);
+    EXPECT_EQ(telemetry.received.messages, 2u);
+    EXPECT_EQ(telemetry.received.dma_bytes, kDmaSize);
+    EXPECT_EQ(telemetry.sent.messages, 1u);
+    uint64_t samples = 0;
+    for (uint64_t bucket : telemetry.received.dma_us.buckets) {
+        samples += bucket;
+    }
+    EXPECT_EQ(samples, 1u);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    EaselComm::dumpTelemetry(fds[1]);
+    close(fds[1]);
+    std::string dump;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+        dump.append(buf, n);
+    }
+    close(fds[0]);
+    std::string service = "service " + std::to_string(EASEL_SERVICE_TEST);
+    EXPECT_NE(dump.find(service + " (client, connected)"), std::string::npos);
+    EXPECT_NE(dump.find(service + " (server, connected)"), std::string::npos);
+
+    mClient.resetTelemetry();
+    mClient.getTelemetry(&telemetry);
+    EXPECT_EQ(telemetry.sent.messages, 0u);
+    EXPECT_EQ(telemetry.reply_us.count, 0u);
+}
+
+TEST_F(EaselCommEmulatorTest, LinkDownAndReconnect) {
+    std::thread server([&] {
+        EaselComm::EaselMessage msg;
+        EXPECT_EQ(mServer.receiveMessage(&msg), -ESHUTDOWN);
+    });
+    // Let the server wait before the link goes down.
+    usleep(10000);
+    mClient.close();
+    server.join();
+
+    ASSERT_EQ(mClient.open(EASEL_SERVICE_TEST), 0);
+    ASSERT_EQ(sendFromClient(nullptr, 0), 0);
+    EaselComm::EaselMessage msg;
+    ASSERT_EQ(mServer.receiveMessage(&msg), 0);
+    EXPECT_STREQ(static_cast<char *>(msg.message_buf), kMessage);
+    mServer.releaseMessageBuffer(&msg);
+}
+
+}  // namespace
@@ -0,0 +1,345 @@
+/*
+ * Replays EaselComm traffic recorded with EaselComm::startRecording() (or
+ * EASELCOMM_RECORD_DIR) against a service, and reports how its reply
+ * latency compares with the recording.
+ *
+ * The replayer opens the recorded service as the client and sends the
+ * messages the service received in the recording: those sent by a
+ * client-side trace, or received by a server-side trace.  Messages go out at
+ * the recorded pace divided by --speed, or back to back with --speed=0,
+ * with the recorded message data if the trace has payloads and zeros
+ * otherwise, and DMA transfers of the recorded sizes.  Messages waiting for
+ * a reply are sent one at a time, so a slow reply delays the messages after
+ * it; those are counted as late.  Messages from the service are received and
+ * their DMA transfers discarded.
+ *
+ * Latencies are grouped by message type, the first 32-bit word of the
+ * message data (the message type of EaselMessenger and the channel of
+ * EaselComm2).  A client-side trace records full round trips; a server-side
+ * trace records service time only.  Results go to stdout as CSV, or JSON
+ * with --json.  Both run on a Linux host against the easelcomm emulator
+ * when EASELCOMM_EMULATOR_DIR is set.
+ *
+ * Usage:
+ *   easelcomm_replay [--json] [--speed=X] [--service=ID] TRACE
+ */
+
+#define LOG_TAG "easelcomm_replay"
+
+#include <errno.h>
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EaselCommTrace.h"
+#include "easelcomm.h"
+
+namespace {
+
+// A replay is late if a message goes out this much after its time.
+const int64_t kLateNs = 1000 * 1000;
+// Message type of messages too short to carry one.
+const uint32_t kUnknownType = UINT32_MAX;
+
+struct ReplayOptions {
+    bool json = false;
+    double speed = 1.0;
+    int serviceId = -1;
+    const char *tracePath = nullptr;
+};
+
+// A message to send to the service.
+struct Request {
+    uint64_t timestampNs;
+    uint64_t messageId;
+    bool needReply;
+    bool server;  // Recorded on the server side.
+    uint32_t messageSize;
+    uint32_t dmaSize;
+    std::vector<char> payload;
+    int64_t recordedLatencyNs;  // -1 if no reply was recorded.
+};
+
+struct TypeResult {
+    std::vector<int64_t> recordedNs;
+    std::vector<int64_t> replayedNs;
+    int messages = 0;
+    int errors = 0;
+};
+
+uint32_t messageType(const Request &request) {
+    if (request.payload.size() < sizeof(uint32_t)) {
+        return kUnknownType;
+    }
+    uint32_t type;
+    memcpy(&type, request.payload.data(), sizeof(type));
+    return type;
+}
+
+/*
+ * Reads the messages the service received from trace, with the latency of
+ * their recorded replies.  Returns 0 for success, -errno for failure.
+ */
+int loadRequests(const ReplayOptions &options, EaselCommTraceReader *trace,
+                 std::vector<Request> *requests, int *serviceId) {
+    // Requests waiting for their reply, by recorded message ID.
+    std::map<uint64_t, size_t> waiting;
+    EaselCommTraceRecord record;
+    std::vector<char> payload;
+    int ret;
+
+    while ((ret = trace->next(&record, &payload)) == 1) {
+        if (options.serviceId >= 0 && record.service_id != options.serviceId) {
+            continue;
+        }
+        bool server = record.flags & EASELCOMM_TRACE_SERVER;
+
+        if ((!server && record.event == EASELCOMM_TRACE_SEND) ||
+            (server && record.event == EASELCOMM_TRACE_RECEIVE)) {
+            if (*serviceId < 0) {
+                *serviceId = record.service_id;
+            } else if (record.service_id != *serviceId) {
+                fprintf(stderr, "trace has several services, pick one with "
+                        "--service\n");
+                return -EINVAL;
+            }
+            bool needReply = record.flags & EASELCOMM_TRACE_NEED_REPLY;
+            if (needReply) {
+                waiting[record.message_id] = requests->size();
+            }
+            requests->push_back({record.timestamp_ns, record.message_id,
+                                 needReply, server, record.message_size,
+                                 record.dma_size, payload, -1});
+        } else if ((!server && record.event == EASELCOMM_TRACE_REPLY_RECEIVE) ||
+                   (server && record.event == EASELCOMM_TRACE_REPLY_SEND)) {
+            auto it = waiting.find(record.in_reply_to);
+            if (it == waiting.end()) {
+                continue;
+            }
+            Request &request = (*requests)[it->second];
+            request.recordedLatencyNs =
+                record.timestamp_ns - request.timestampNs;
+            waiting.erase(it);
+        }
+    }
+
+    // Sends are recorded once done, so their records may be out of order.
+    std::stable_sort(requests->begin(), requests->end(),
+                     [](const Request &a, const Request &b) {
+                         return a.timestampNs < b.timestampNs;
+                     });
+    return ret;
+}
+
+double percentileUs(std::vector<int64_t> values, double percentile) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(percentile * (values.size() - 1));
+    return values[index] / 1000.0;
+}
+
+// Discards messages from the service, replying to those waiting for one.
+void handleServiceMessage(EaselComm *comm, EaselComm::EaselMessage *msg) {
+    if (msg->dma_buf_size) {
+        comm->cancelReceiveDMA(msg);
+    }
+    if (msg->need_reply) {
+        comm->sendReply(msg, 0, nullptr);
+    }
+}
+
+int replay(const ReplayOptions &options, int serviceId,
+           const std::vector<Request> &requests,
+           std::map<uint32_t, TypeResult> *results, int *late) {
+    EaselCommClient client;
+    int ret = client.open(static_cast<EaselService>(serviceId));
+    if (ret) {
+        ALOGE("%s: open failed (%d)", __FUNCTION__, ret);
+        return ret;
+    }
+    ret = client.startMessageHandlerThread(
+        [&](EaselComm::EaselMessage *msg) {
+            handleServiceMessage(&client, msg);
+        });
+    if (ret) {
+        client.close();
+        return ret;
+    }
+
+    uint32_t maxDma = 0;
+    for (const Request &request : requests) {
+        maxDma = std::max(maxDma, request.dmaSize);
+    }
+    std::vector<char> dmaBuffer(maxDma);
+    std::vector<char> zeros;
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t firstNs = requests.empty() ? 0 : requests[0].timestampNs;
+    *late = 0;
+    for (const Request &request : requests) {
+        if (options.speed > 0) {
+            auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(
+                (request.timestampNs - firstNs) / options.speed));
+            std::this_thread::sleep_until(due);
+            if (std::chrono::steady_clock::now() - due >
+                std::chrono::nanoseconds(kLateNs)) {
+                (*late)++;
+            }
+        }
+
+        EaselComm::EaselMessage msg;
+        if (request.payload.size() == request.messageSize) {
+            msg.message_buf = const_cast<char *>(request.payload.data());
+        } else {
+            zeros.assign(request.messageSize, 0);
+            msg.message_buf = zeros.data();
+        }
+        msg.message_buf_size = request.messageSize;
+        msg.dma_buf = dmaBuffer.data();
+        msg.dma_buf_size = request.dmaSize;
+
+        TypeResult &result = (*results)[messageType(request)];
+        result.messages++;
+        if (!request.needReply) {
+            if (client.sendMessage(&msg)) {
+                result.errors++;
+            }
+            continue;
+        }
+
+        msg.need_reply = true;
+        EaselComm::EaselMessage reply;
+        int replycode;
+        auto sent = std::chrono::steady_clock::now();
+        ret = client.sendMessageReceiveReply(&msg, &replycode, &reply);
+        auto replied = std::chrono::steady_clock::now();
+        if (ret) {
+            result.errors++;
+            continue;
+        }
+        if (reply.dma_buf_size) {
+            client.cancelReceiveDMA(&reply);
+        }
+        client.releaseMessageBuffer(&reply);
+        if (request.recordedLatencyNs >= 0) {
+            result.recordedNs.push_back(request.recordedLatencyNs);
+            result.replayedNs.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    replied - sent).count());
+        }
+    }
+
+    client.close();
+    return 0;
+}
+
+void printResults(const ReplayOptions &options, bool serverTrace,
+                  const std::map<uint32_t, TypeResult> &results, int late) {
+    const char *latency = serverTrace ? "service" : "round_trip";
+    bool first = true;
+    for (const auto &it : results) {
+        const TypeResult &result = it.second;
+        double recordedP50 = percentileUs(result.recordedNs, 0.50);
+        double replayedP50 = percentileUs(result.replayedNs, 0.50);
+        double deltaPercent = recordedP50 > 0
+            ? (replayedP50 - recordedP50) * 100 / recordedP50 : 0;
+        std::string type = it.first == kUnknownType
+            ? "unknown" : std::to_string(it.first);
+
+        if (options.json) {
+            printf("%s\n  {\"type\": \"%s\", \"recorded_latency\": \"%s\", "
+                   "\"messages\": %d, \"replies\": %zu, "
+                   "\"recorded_p50_us\": %.1f, \"recorded_p99_us\": %.1f, "
+                   "\"replayed_p50_us\": %.1f, \"replayed_p99_us\": %.1f, "
+                   "\"p50_delta_percent\": %.1f, \"errors\": %d}",
+                   first ? "[" : ",", type.c_str(), latency, result.messages,
+                   result.replayedNs.size(), recordedP50,
+                   percentileUs(result.recordedNs, 0.99), replayedP50,
+                   percentileUs(result.replayedNs, 0.99), deltaPercent,
+                   result.errors);
+        } else {
+            if (first) {
+                printf("type,recorded_latency,messages,replies,"
+                       "recorded_p50_us,recorded_p99_us,replayed_p50_us,"
+                       "replayed_p99_us,p50_delta_percent,errors\n");
+            }
+            printf("%s,%s,%d,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%d\n",
+                   type.c_str(), latency, result.messages,
+                   result.replayedNs.size(), recordedP50,
+                   percentileUs(result.recordedNs, 0.99), replayedP50,
+                   percentileUs(result.replayedNs, 0.99), deltaPercent,
+                   result.errors);
+        }
+        first = false;
+    }
+    if (options.json) {
+        printf("%s\n]\n", first ? "[" : "");
+    }
+    fprintf(stderr, "%d messages sent late\n", late);
+}
+
+bool parseOptions(int argc, char **argv, ReplayOptions *options) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--json") == 0) {
+            options->json = true;
+        } else if (strncmp(arg, "--speed=", 8) == 0) {
+            options->speed = atof(arg + 8);
+        } else if (strncmp(arg, "--service=", 10) == 0) {
+            options->serviceId = atoi(arg + 10);
+        } else if (arg[0] != '-' && options->tracePath == nullptr) {
+            options->tracePath = arg;
+        } else {
+            return false;
+        }
+    }
+    return options->tracePath != nullptr && options->speed >= 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "usage: %s [--json] [--speed=X] [--service=ID] TRACE\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    EaselCommTraceReader trace;
+    int ret = trace.open(options.tracePath);
+    if (ret) {
+        fprintf(stderr, "cannot read trace %s (%d)\n", options.tracePath, ret);
+        return EXIT_FAILURE;
+    }
+    std::vector<Request> requests;
+    int serviceId = options.serviceId;
+    ret = loadRequests(options, &trace, &requests, &serviceId);
+    if (ret) {
+        fprintf(stderr, "cannot read trace %s (%d)\n", options.tracePath, ret);
+        return EXIT_FAILURE;
+    }
+    if (requests.empty()) {
+        fprintf(stderr, "no messages to replay\n");
+        return EXIT_FAILURE;
+    }
+
+    std::map<uint32_t, TypeResult> results;
+    int late = 0;
+    ret = replay(options, serviceId, requests, &results, &late);
+    if (ret) {
+        return EXIT_FAILURE;
+    }
+    printResults(options, requests[0].server, results, late);
+    return EXIT_SUCCESS;
+}
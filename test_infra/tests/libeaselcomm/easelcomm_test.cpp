@@ -18,6 +18,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <thread>
+#include <vector>
 
 #include "easelcomm.h"
 
@@ -133,7 +134,22 @@ int receiverXferIdx = 0;
 // How many messages the receiver processed across all iterations
 int receiverMsgCount = 0;
 
-static void msgSenderTestIteration(EaselComm *sender) {
+// Sends the pending no-reply messages in one batch and frees their DMA buffers.
+static void flushBatch(EaselComm *sender,
+                       std::vector<EaselComm::EaselMessage> *batch) {
+    size_t sent = 0;
+    EXPECT_EQ(sender->sendMessages(batch->data(), batch->size(), &sent), 0);
+    EXPECT_EQ(sent, batch->size());
+    for (auto &msg : *batch) {
+        free(msg.dma_buf);
+    }
+    batch->clear();
+}
+
+// If batched is true, consecutive no-reply messages are sent via sendMessages.
+static void msgSenderTestIteration(EaselComm *sender, bool batched) {
+    std::vector<EaselComm::EaselMessage> batch;
+
     for (int senderXferIdx = 0; senderXferIdx < NXFERS; senderXferIdx++) {
         EaselComm::EaselMessage msg;
         msg.message_buf = testxfers[senderXferIdx].msg;
@@ -164,6 +180,15 @@ static void msgSenderTestIteration(EaselComm *sender) {
         msg.dma_buf_size = testxfers[senderXferIdx].dmalen;
         msg.need_reply = testxfers[senderXferIdx].replymsg.msg;
 
+        if (batched && !msg.need_reply) {
+            // DMA buffer is freed once the batch is sent.
+            batch.push_back(msg);
+            continue;
+        }
+        if (!batch.empty()) {
+            flushBatch(sender, &batch);
+        }
+
         if (msg.need_reply) {
             int replycode;
             EaselComm::EaselMessage reply;
@@ -214,11 +239,16 @@ static void msgSenderTestIteration(EaselComm *sender) {
 
         free(msg.dma_buf);
     }
+
+    if (!batch.empty()) {
+        flushBatch(sender, &batch);
+    }
 }
 
 static void msgSenderTest(EaselComm *sender) {
     for (int i = 0; i < kMsgTestRepeatTimes; i++) {
-        msgSenderTestIteration(sender);
+        // The last iteration exercises the batched send path.
+        msgSenderTestIteration(sender, i == kMsgTestRepeatTimes - 1);
     }
 }
 
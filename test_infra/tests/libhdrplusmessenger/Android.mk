@@ -0,0 +1,28 @@
+LOCAL_PATH:= $(call my-dir)
+
+HDRPLUS_MESSENGER_PATH := $(LOCAL_PATH)/../../../amber/camera/libhdrplusmessenger
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := metadata_codec_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+    metadata_codec_bench.cpp \
+    ../../../amber/camera/libhdrplusmessenger/EaselMessenger.cpp \
+    ../../../amber/camera/libhdrplusmessenger/MessagePool.cpp
+LOCAL_C_INCLUDES := $(HDRPLUS_MESSENGER_PATH)/include
+LOCAL_HEADER_LIBRARIES := libhdrplusclient_headers
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := message_pool_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := \
+    message_pool_test.cpp \
+    ../../../amber/camera/libhdrplusmessenger/EaselMessenger.cpp \
+    ../../../amber/camera/libhdrplusmessenger/MessagePool.cpp
+LOCAL_C_INCLUDES := $(HDRPLUS_MESSENGER_PATH)/include
+LOCAL_HEADER_LIBRARIES := libhdrplusclient_headers
+LOCAL_SHARED_LIBRARIES := libeaselcomm liblog
+include $(BUILD_HOST_NATIVE_TEST)
@@ -0,0 +1,104 @@
+/*
+ * MessagePool tests.
+ *
+ * Checks that messages are recycled, that the pool grows up to its maximum,
+ * and that returning a message twice is rejected instead of putting the same
+ * slot on the free list twice.
+ */
+
+#define LOG_TAG "message_pool_test"
+
+#include <errno.h>
+#include <set>
+#include <vector>
+
+#include "EaselMessenger.h"
+#include "MessagePool.h"
+
+#include "gtest/gtest.h"
+
+using namespace pbcamera;
+
+namespace {
+
+const int kCapacity = 256;
+
+TEST(MessagePoolTest, RecyclesReturnedMessages) {
+    MessagePool pool;
+    ASSERT_EQ(0, pool.create(kCapacity, /*minMessages*/1, /*maxMessages*/1));
+
+    Message *first = nullptr, *second = nullptr;
+    ASSERT_EQ(0, pool.get(&first, /*timeoutMs*/0));
+    EXPECT_EQ(0, pool.put(first));
+    ASSERT_EQ(0, pool.get(&second, /*timeoutMs*/0));
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(0, pool.put(second));
+}
+
+TEST(MessagePoolTest, GrowsToMaximum) {
+    MessagePool pool;
+    ASSERT_EQ(0, pool.create(kCapacity, /*minMessages*/1, /*maxMessages*/3));
+
+    std::vector<Message*> messages(3);
+    for (auto &message : messages) {
+        ASSERT_EQ(0, pool.get(&message, /*timeoutMs*/0));
+    }
+    EXPECT_EQ(3u, std::set<Message*>(messages.begin(), messages.end()).size());
+
+    Message *extra = nullptr;
+    EXPECT_EQ(-ENOENT, pool.get(&extra, /*timeoutMs*/0));
+
+    for (auto message : messages) {
+        EXPECT_EQ(0, pool.put(message));
+    }
+    EXPECT_TRUE(pool.waitForReturns(/*timeoutMs*/0));
+}
+
+TEST(MessagePoolTest, DoublePutIsRejected) {
+    MessagePool pool;
+    ASSERT_EQ(0, pool.create(kCapacity, /*minMessages*/2, /*maxMessages*/2));
+
+    Message *message = nullptr;
+    ASSERT_EQ(0, pool.get(&message, /*timeoutMs*/0));
+    EXPECT_EQ(0, pool.put(message));
+    EXPECT_EQ(-EINVAL, pool.put(message));
+
+    MessagePool::Stats stats;
+    pool.getStats(&stats);
+    EXPECT_EQ(0, stats.inUse);
+
+    // Each slot is still handed out once.
+    Message *first = nullptr, *second = nullptr;
+    ASSERT_EQ(0, pool.get(&first, /*timeoutMs*/0));
+    ASSERT_EQ(0, pool.get(&second, /*timeoutMs*/0));
+    EXPECT_NE(first, second);
+    EXPECT_EQ(0, pool.put(first));
+    EXPECT_EQ(0, pool.put(second));
+}
+
+TEST(MessagePoolTest, PutAfterDestroy) {
+    MessagePool pool;
+    ASSERT_EQ(0, pool.create(kCapacity, /*minMessages*/1, /*maxMessages*/1));
+
+    Message *message = nullptr;
+    ASSERT_EQ(0, pool.get(&message, /*timeoutMs*/0));
+    pool.destroy();
+    EXPECT_EQ(0, pool.put(message));
+    EXPECT_EQ(-EINVAL, pool.put(message));
+
+    MessagePool::Stats stats;
+    pool.getStats(&stats);
+    EXPECT_EQ(0, stats.allocated);
+    EXPECT_EQ(0, stats.inUse);
+}
+
+TEST(MessagePoolTest, ForeignMessageIsRejected) {
+    MessagePool pool;
+    ASSERT_EQ(0, pool.create(kCapacity, /*minMessages*/1, /*maxMessages*/1));
+
+    Message message;
+    EXPECT_EQ(-EINVAL, pool.put(&message));
+    EXPECT_EQ(-EINVAL, pool.put(nullptr));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,492 @@
+/*
+ * HDR+ metadata serialization microbenchmark.
+ *
+ * Compares MetadataCodec, the packed encoding libhdrplusmessenger sends
+ * StaticMetadata, FrameMetadata and ResultMetadata with, against the previous
+ * field-by-field Message::write*() / read*() path, which is kept here as the
+ * baseline.  Each case encodes or decodes a typical struct (3 faces, a 17x13
+ * lens shading map) into a kMaxHdrPlusMessageSize message and reports the
+ * p50/p99 time of one operation and the encoded size, as CSV or JSON on
+ * stdout.  Decoded metadata is checked against the original before timing.
+ *
+ * The "delta" codec is MetadataDeltaCodec encoding a frame against the
+ * keyframe before it, with the fields that change every frame (timestamps,
+ * exposure, gains) changed.
+ *
+ * Usage:
+ *   metadata_codec_bench [--json] [--iterations=N]
+ */
+
+#define LOG_TAG "metadata_codec_bench"
+
+#include <log/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "HdrPlusMessageTypes.h"
+#include "HdrPlusMetadataCodec.h"
+
+using namespace pbcamera;
+
+namespace {
+
+const int kDefaultIterations = 100000;
+
+struct BenchOptions {
+    bool json = false;
+    int iterations = kDefaultIterations;
+};
+
+// Baseline: the field-by-field serialization the codec replaced.
+
+status_t legacyEncode(const StaticMetadata &metadata, Message *message) {
+    status_t res = 0;
+    res |= message->writeByte(metadata.flashInfoAvailable);
+    res |= message->writeInt32Array(metadata.sensitivityRange);
+    res |= message->writeInt32(metadata.maxAnalogSensitivity);
+    res |= message->writeInt32Array(metadata.pixelArraySize);
+    res |= message->writeInt32Array(metadata.activeArraySize);
+    res |= message->writeUint32(metadata.opticalBlackRegions.size());
+    for (auto &region : metadata.opticalBlackRegions) {
+        res |= message->writeInt32Array(region);
+    }
+    res |= message->writeUint32(metadata.availableStreamConfigurations.size());
+    for (auto &config : metadata.availableStreamConfigurations) {
+        res |= message->writeInt32Array(config);
+    }
+    res |= message->writeByte(metadata.referenceIlluminant1);
+    res |= message->writeByte(metadata.referenceIlluminant2);
+    res |= message->writeFloatArray(metadata.calibrationTransform1);
+    res |= message->writeFloatArray(metadata.calibrationTransform2);
+    res |= message->writeFloatArray(metadata.colorTransform1);
+    res |= message->writeFloatArray(metadata.colorTransform2);
+    res |= message->writeInt32(metadata.whiteLevel);
+    res |= message->writeByte(metadata.colorFilterArrangement);
+    res |= message->writeFloatVector(metadata.availableApertures);
+    res |= message->writeFloatVector(metadata.availableFocalLengths);
+    res |= message->writeInt32Array(metadata.shadingMapSize);
+    res |= message->writeByte(metadata.focusDistanceCalibration);
+    res |= message->writeInt32Array(metadata.aeCompensationRange);
+    res |= message->writeFloat(metadata.aeCompensationStep);
+    res |= message->writeUint32(metadata.debugParams);
+    return res;
+}
+
+status_t legacyDecode(Message *message, StaticMetadata *metadata) {
+    status_t res = 0;
+    uint32_t vectorSize = 0;
+    res |= message->readByte(&metadata->flashInfoAvailable);
+    res |= message->readInt32Array(&metadata->sensitivityRange);
+    res |= message->readInt32(&metadata->maxAnalogSensitivity);
+    res |= message->readInt32Array(&metadata->pixelArraySize);
+    res |= message->readInt32Array(&metadata->activeArraySize);
+    res |= message->readUint32(&vectorSize);
+    metadata->opticalBlackRegions.resize(vectorSize);
+    for (auto &region : metadata->opticalBlackRegions) {
+        res |= message->readInt32Array(&region);
+    }
+    res |= message->readUint32(&vectorSize);
+    metadata->availableStreamConfigurations.resize(vectorSize);
+    for (auto &config : metadata->availableStreamConfigurations) {
+        res |= message->readInt32Array(&config);
+    }
+    res |= message->readByte(&metadata->referenceIlluminant1);
+    res |= message->readByte(&metadata->referenceIlluminant2);
+    res |= message->readFloatArray(&metadata->calibrationTransform1);
+    res |= message->readFloatArray(&metadata->calibrationTransform2);
+    res |= message->readFloatArray(&metadata->colorTransform1);
+    res |= message->readFloatArray(&metadata->colorTransform2);
+    res |= message->readInt32(&metadata->whiteLevel);
+    res |= message->readByte(&metadata->colorFilterArrangement);
+    res |= message->readFloatVector(&metadata->availableApertures);
+    res |= message->readFloatVector(&metadata->availableFocalLengths);
+    res |= message->readInt32Array(&metadata->shadingMapSize);
+    res |= message->readByte(&metadata->focusDistanceCalibration);
+    res |= message->readInt32Array(&metadata->aeCompensationRange);
+    res |= message->readFloat(&metadata->aeCompensationStep);
+    res |= message->readUint32(&metadata->debugParams);
+    return res;
+}
+
+status_t legacyEncode(const FrameMetadata &metadata, Message *message) {
+    status_t res = 0;
+    res |= message->writeInt64(metadata.easelTimestamp);
+    res |= message->writeInt64(metadata.exposureTime);
+    res |= message->writeInt32(metadata.sensitivity);
+    res |= message->writeInt32(metadata.postRawSensitivityBoost);
+    res |= message->writeByte(metadata.flashMode);
+    res |= message->writeFloatArray(metadata.colorCorrectionGains);
+    res |= message->writeFloatArray(metadata.colorCorrectionTransform);
+    res |= message->writeFloatArray(metadata.neutralColorPoint);
+    res |= message->writeInt64(metadata.timestamp);
+    res |= message->writeByte(metadata.blackLevelLock);
+    res |= message->writeByte(metadata.faceDetectMode);
+    res |= message->writeInt32Vector(metadata.faceIds);
+    res |= message->writeUint32(metadata.faceLandmarks.size());
+    for (auto &landmarks : metadata.faceLandmarks) {
+        res |= message->writeInt32Array(landmarks);
+    }
+    res |= message->writeUint32(metadata.faceRectangles.size());
+    for (auto &rectangle : metadata.faceRectangles) {
+        res |= message->writeInt32Array(rectangle);
+    }
+    res |= message->writeByteVector(metadata.faceScores);
+    res |= message->writeByte(metadata.sceneFlicker);
+    res |= message->writeUint32(metadata.noiseProfile.size());
+    for (auto &noise : metadata.noiseProfile) {
+        res |= message->writeDoubleArray(noise);
+    }
+    res |= message->writeFloatArray(metadata.dynamicBlackLevel);
+    res |= message->writeFloatVector(metadata.lensShadingMap);
+    res |= message->writeFloat(metadata.focusDistance);
+    res |= message->writeInt32(metadata.aeExposureCompensation);
+    res |= message->writeByte(metadata.aeMode);
+    res |= message->writeByte(metadata.aeLock);
+    res |= message->writeByte(metadata.aeState);
+    res |= message->writeByte(metadata.aePrecaptureTrigger);
+    res |= message->writeUint32(metadata.aeRegions.size());
+    for (auto &region : metadata.aeRegions) {
+        res |= message->writeInt32Array(region);
+    }
+    return res;
+}
+
+status_t legacyDecode(Message *message, FrameMetadata *metadata) {
+    status_t res = 0;
+    uint32_t vectorSize = 0;
+    res |= message->readInt64(&metadata->easelTimestamp);
+    res |= message->readInt64(&metadata->exposureTime);
+    res |= message->readInt32(&metadata->sensitivity);
+    res |= message->readInt32(&metadata->postRawSensitivityBoost);
+    res |= message->readByte(&metadata->flashMode);
+    res |= message->readFloatArray(&metadata->colorCorrectionGains);
+    res |= message->readFloatArray(&metadata->colorCorrectionTransform);
+    res |= message->readFloatArray(&metadata->neutralColorPoint);
+    res |= message->readInt64(&metadata->timestamp);
+    res |= message->readByte(&metadata->blackLevelLock);
+    res |= message->readByte(&metadata->faceDetectMode);
+    res |= message->readInt32Vector(&metadata->faceIds);
+    res |= message->readUint32(&vectorSize);
+    metadata->faceLandmarks.resize(vectorSize);
+    for (auto &landmarks : metadata->faceLandmarks) {
+        res |= message->readInt32Array(&landmarks);
+    }
+    res |= message->readUint32(&vectorSize);
+    metadata->faceRectangles.resize(vectorSize);
+    for (auto &rectangle : metadata->faceRectangles) {
+        res |= message->readInt32Array(&rectangle);
+    }
+    res |= message->readByteVector(&metadata->faceScores);
+    res |= message->readByte(&metadata->sceneFlicker);
+    res |= message->readUint32(&vectorSize);
+    for (auto &noise : metadata->noiseProfile) {
+        res |= message->readDoubleArray(&noise);
+    }
+    res |= message->readFloatArray(&metadata->dynamicBlackLevel);
+    res |= message->readFloatVector(&metadata->lensShadingMap);
+    res |= message->readFloat(&metadata->focusDistance);
+    res |= message->readInt32(&metadata->aeExposureCompensation);
+    res |= message->readByte(&metadata->aeMode);
+    res |= message->readByte(&metadata->aeLock);
+    res |= message->readByte(&metadata->aeState);
+    res |= message->readByte(&metadata->aePrecaptureTrigger);
+    res |= message->readUint32(&vectorSize);
+    metadata->aeRegions.resize(vectorSize);
+    for (auto &region : metadata->aeRegions) {
+        res |= message->readInt32Array(&region);
+    }
+    return res;
+}
+
+status_t legacyEncode(const ResultMetadata &metadata, Message *message) {
+    status_t res = message->writeInt64(metadata.easelTimestamp);
+    return res | message->writeInt64(metadata.timestamp);
+}
+
+status_t legacyDecode(Message *message, ResultMetadata *metadata) {
+    status_t res = message->readInt64(&metadata->easelTimestamp);
+    return res | message->readInt64(&metadata->timestamp);
+}
+
+// Fills every field with values derived from seed.
+struct FillVisitor {
+    int seed;
+
+    template<typename T>
+    void fillBytes(T *value) {
+        uint8_t *bytes = reinterpret_cast<uint8_t*>(value);
+        for (size_t i = 0; i < sizeof(T); i++) {
+            bytes[i] = static_cast<uint8_t>(seed++);
+        }
+    }
+
+    template<typename T>
+    void operator()(T &value) { fillBytes(&value); }
+
+    template<typename T>
+    void operator()(std::vector<T> &values) {
+        for (auto &value : values) fillBytes(&value);
+    }
+};
+
+// Collects the bytes of each field, to compare metadata field by field.
+struct FieldBytesVisitor {
+    std::vector<std::vector<uint8_t>> fields;
+
+    template<typename T>
+    void operator()(const T &value) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&value);
+        fields.emplace_back(bytes, bytes + sizeof(T));
+    }
+
+    template<typename T>
+    void operator()(const std::vector<T> &values) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t*>(values.data());
+        fields.emplace_back(bytes, bytes + values.size() * sizeof(T));
+    }
+};
+
+template<typename Metadata>
+bool metadataEqual(const Metadata &a, const Metadata &b) {
+    FieldBytesVisitor visitorA, visitorB;
+    MetadataSchema<Metadata>::visit(a, visitorA);
+    MetadataSchema<Metadata>::visit(b, visitorB);
+    return visitorA.fields == visitorB.fields;
+}
+
+StaticMetadata makeStaticMetadata() {
+    StaticMetadata metadata = {};
+    metadata.opticalBlackRegions.resize(4);
+    metadata.availableStreamConfigurations.resize(40);
+    metadata.availableApertures.resize(1);
+    metadata.availableFocalLengths.resize(1);
+    FillVisitor filler = { 1 };
+    MetadataSchema<StaticMetadata>::visit(metadata, filler);
+    return metadata;
+}
+
+FrameMetadata makeFrameMetadata() {
+    FrameMetadata metadata = {};
+    metadata.faceIds.resize(3);
+    metadata.faceLandmarks.resize(3);
+    metadata.faceRectangles.resize(3);
+    metadata.faceScores.resize(3);
+    metadata.lensShadingMap.resize(17 * 13 * 4);
+    metadata.aeRegions.resize(1);
+    FillVisitor filler = { 2 };
+    MetadataSchema<FrameMetadata>::visit(metadata, filler);
+    return metadata;
+}
+
+ResultMetadata makeResultMetadata() {
+    ResultMetadata metadata = {};
+    FillVisitor filler = { 3 };
+    MetadataSchema<ResultMetadata>::visit(metadata, filler);
+    return metadata;
+}
+
+struct CaseResult {
+    const char *metadata;
+    const char *codec;
+    const char *operation;
+    int encodedBytes;
+    double p50Ns;
+    double p99Ns;
+};
+
+double percentileNs(std::vector<int64_t> *samples, double percentile) {
+    std::sort(samples->begin(), samples->end());
+    return (*samples)[static_cast<size_t>(percentile * (samples->size() - 1))];
+}
+
+// Times iterations of op, a batch of kBatch operations per sample.
+CaseResult timeCase(const BenchOptions &options, const std::function<void()> &op) {
+    const int kBatch = 16;
+    std::vector<int64_t> samples;
+    for (int i = 0; i < options.iterations; i += kBatch) {
+        auto start = std::chrono::steady_clock::now();
+        for (int j = 0; j < kBatch; j++) op();
+        auto end = std::chrono::steady_clock::now();
+        samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                end - start).count() / kBatch);
+    }
+    CaseResult result = {};
+    result.p50Ns = percentileNs(&samples, 0.50);
+    result.p99Ns = percentileNs(&samples, 0.99);
+    return result;
+}
+
+template<typename Metadata>
+bool benchMetadata(const BenchOptions &options, const char *name, const Metadata &metadata,
+        std::vector<CaseResult> *results) {
+    Message message;
+    if (message.create(kMaxHdrPlusMessageSize) != 0) return false;
+
+    struct Codec {
+        const char *name;
+        std::function<status_t(const Metadata&, Message*)> encode;
+        std::function<status_t(Message*, Metadata*)> decode;
+    };
+    Codec codecs[] = {
+        { "legacy",
+          [](const Metadata &m, Message *msg) { return legacyEncode(m, msg); },
+          [](Message *msg, Metadata *m) { return legacyDecode(msg, m); } },
+        { "packed",
+          [](const Metadata &m, Message *msg) { return MetadataCodec<Metadata>::encode(m, msg); },
+          [](Message *msg, Metadata *m) { return MetadataCodec<Metadata>::decode(msg, m); } },
+    };
+
+    for (auto &codec : codecs) {
+        // Check the round trip and keep the encoded bytes to decode.
+        message.clear();
+        if (codec.encode(metadata, &message) != 0) {
+            fprintf(stderr, "%s %s: encoding failed\n", name, codec.name);
+            return false;
+        }
+        std::vector<uint8_t> encoded(message.data(), message.data() + message.size());
+        message.setData(encoded.data(), encoded.size());
+        Metadata decoded = {};
+        if (codec.decode(&message, &decoded) != 0 || !metadataEqual(metadata, decoded)) {
+            fprintf(stderr, "%s %s: decoded metadata differs\n", name, codec.name);
+            return false;
+        }
+
+        CaseResult result = timeCase(options, [&]() {
+            message.clear();
+            codec.encode(metadata, &message);
+        });
+        result.operation = "encode";
+        results->push_back(result);
+
+        result = timeCase(options, [&]() {
+            message.setData(encoded.data(), encoded.size());
+            codec.decode(&message, &decoded);
+        });
+        result.operation = "decode";
+        results->push_back(result);
+
+        for (size_t i = results->size() - 2; i < results->size(); i++) {
+            (*results)[i].metadata = name;
+            (*results)[i].codec = codec.name;
+            (*results)[i].encodedBytes = encoded.size();
+        }
+    }
+    return true;
+}
+
+// Returns frame metadata as the next frame after keyframe usually is.
+FrameMetadata makeNextFrameMetadata(const FrameMetadata &keyframe) {
+    FrameMetadata metadata = keyframe;
+    metadata.easelTimestamp += 33333333;
+    metadata.timestamp += 33333333;
+    metadata.exposureTime += 1000;
+    metadata.sensitivity += 10;
+    metadata.colorCorrectionGains[0] += 0.01f;
+    metadata.focusDistance += 0.1f;
+    return metadata;
+}
+
+bool benchFrameDelta(const BenchOptions &options, std::vector<CaseResult> *results) {
+    Message message;
+    if (message.create(kMaxHdrPlusMessageSize) != 0) return false;
+
+    FrameMetadata keyframe = makeFrameMetadata();
+    FrameMetadata metadata = makeNextFrameMetadata(keyframe);
+
+    if (MetadataDeltaCodec<FrameMetadata>::encode(keyframe, metadata, &message) != 0) {
+        fprintf(stderr, "frame delta: encoding failed\n");
+        return false;
+    }
+    std::vector<uint8_t> encoded(message.data(), message.data() + message.size());
+    message.setData(encoded.data(), encoded.size());
+    FrameMetadata decoded = keyframe;
+    if (MetadataDeltaCodec<FrameMetadata>::decode(&message, &decoded) != 0 ||
+            !metadataEqual(metadata, decoded)) {
+        fprintf(stderr, "frame delta: decoded metadata differs\n");
+        return false;
+    }
+
+    CaseResult result = timeCase(options, [&]() {
+        message.clear();
+        MetadataDeltaCodec<FrameMetadata>::encode(keyframe, metadata, &message);
+    });
+    result.operation = "encode";
+    results->push_back(result);
+
+    // Decoding starts from a copy of the keyframe, as the receiver does.
+    result = timeCase(options, [&]() {
+        message.setData(encoded.data(), encoded.size());
+        decoded = keyframe;
+        MetadataDeltaCodec<FrameMetadata>::decode(&message, &decoded);
+    });
+    result.operation = "decode";
+    results->push_back(result);
+
+    for (size_t i = results->size() - 2; i < results->size(); i++) {
+        (*results)[i].metadata = "frame";
+        (*results)[i].codec = "delta";
+        (*results)[i].encodedBytes = encoded.size();
+    }
+    return true;
+}
+
+void printResults(const BenchOptions &options, const std::vector<CaseResult> &results) {
+    bool first = true;
+    for (const CaseResult &result : results) {
+        if (options.json) {
+            printf("%s\n  {\"metadata\": \"%s\", \"codec\": \"%s\", \"operation\": \"%s\", "
+                   "\"encoded_bytes\": %d, \"p50_ns\": %.0f, \"p99_ns\": %.0f}",
+                   first ? "[" : ",", result.metadata, result.codec, result.operation,
+                   result.encodedBytes, result.p50Ns, result.p99Ns);
+        } else {
+            if (first) {
+                printf("metadata,codec,operation,encoded_bytes,p50_ns,p99_ns\n");
+            }
+            printf("%s,%s,%s,%d,%.0f,%.0f\n", result.metadata, result.codec,
+                   result.operation, result.encodedBytes, result.p50Ns, result.p99Ns);
+        }
+        first = false;
+    }
+    if (options.json) {
+        printf("%s\n]\n", first ? "[" : "");
+    }
+}
+
+bool parseOptions(int argc, char **argv, BenchOptions *options) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--json") == 0) {
+            options->json = true;
+        } else if (strncmp(arg, "--iterations=", 13) == 0) {
+            options->iterations = atoi(arg + 13);
+        } else {
+            return false;
+        }
+    }
+    return options->iterations > 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    if (!parseOptions(argc, argv, &options)) {
+        fprintf(stderr, "usage: %s [--json] [--iterations=N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<CaseResult> results;
+    if (!benchMetadata(options, "static", makeStaticMetadata(), &results) ||
+            !benchMetadata(options, "frame", makeFrameMetadata(), &results) ||
+            !benchFrameDelta(options, &results) ||
+            !benchMetadata(options, "result", makeResultMetadata(), &results)) {
+        return EXIT_FAILURE;
+    }
+    printResults(options, results);
+    return EXIT_SUCCESS;
+}
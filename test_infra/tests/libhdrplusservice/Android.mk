@@ -0,0 +1,80 @@
+LOCAL_PATH:= $(call my-dir)
+
+HDRPLUS_SERVICE_PATH := $(LOCAL_PATH)/../../../amber/camera/services/libhdrplusservice
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := yuv_copier_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := \
+    yuv_copier_test.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvCopier.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH) \
+    $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := yuv_copier_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+    yuv_copier_bench.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvCopier.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH) \
+    $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := yuv_resampler_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := \
+    yuv_resampler_test.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvCopier.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvResampler.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH) \
+    $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := yuv_resampler_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+    yuv_resampler_bench.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvCopier.cpp \
+    ../../../amber/camera/services/libhdrplusservice/YuvResampler.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH) \
+    $(LOCAL_PATH)/../include
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := imx_buffer_pool_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := \
+    imx_buffer_pool_test.cpp \
+    ../../../amber/camera/services/libhdrplusservice/ImxBufferPool.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH) \
+    $(LOCAL_PATH)/../../../prebuilts/libs/include
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ipu_shot_tracker_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_SRC_FILES := \
+    ipu_shot_tracker_test.cpp \
+    ../../../amber/camera/services/libhdrplusservice/IpuShotTracker.cpp
+LOCAL_C_INCLUDES := \
+    $(HDRPLUS_SERVICE_PATH)
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_HOST_NATIVE_TEST)
@@ -0,0 +1,256 @@
+/*
+ * ImxBufferPool tests.
+ *
+ * IMX buffer allocation is replaced by a fake that tracks live buffers, so the
+ * tests check which acquires allocate, which releases free, and that the pool
+ * stays within its budget and frees everything it owns when destroyed.
+ */
+
+#define LOG_TAG "imx_buffer_pool_test"
+
+#include <errno.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+
+#include "ImxBufferPool.h"
+
+#include "gtest/gtest.h"
+
+using namespace pbcamera;
+
+namespace {
+
+// Sizes of live fake IMX buffers.
+std::map<ImxDeviceBufferHandle, uint64_t> gLiveBuffers;
+// Whether the next allocation fails.
+bool gFailAllocation = false;
+// Allocations fail once live buffers would exceed this many bytes.
+uint64_t gMemoryBytes = UINT64_MAX;
+
+const uint64_t kLarge = 18 * 1024 * 1024;
+const uint64_t kSmall = 1024 * 1024;
+
+uint64_t liveBytes() {
+    uint64_t bytes = 0;
+    for (auto &buffer : gLiveBuffers) {
+        bytes += buffer.second;
+    }
+    return bytes;
+}
+
+ImxBufferPool::ClassStats classStats(ImxBufferPool *pool, uint64_t bufferBytes) {
+    for (auto &stats : pool->getStats().classes) {
+        if (stats.bufferBytes == bufferBytes) return stats;
+    }
+    return {};
+}
+
+class ImxBufferPoolTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        gLiveBuffers.clear();
+        gFailAllocation = false;
+        gMemoryBytes = UINT64_MAX;
+    }
+
+    void TearDown() override {
+        // The pool frees all buffers it owns.
+        mPool = nullptr;
+        EXPECT_TRUE(gLiveBuffers.empty());
+    }
+
+    void createPool(int64_t budgetBytes) {
+        mPool = std::make_unique<ImxBufferPool>(/*allocator*/nullptr, budgetBytes);
+    }
+
+    std::unique_ptr<ImxBufferPool> mPool;
+};
+
+TEST_F(ImxBufferPoolTest, ConfigurePreallocatesWithinBudget) {
+    createPool(2 * kLarge + kSmall);
+    ASSERT_EQ(0, mPool->configure({ kLarge, kSmall }, /*buffersPerClass*/3));
+
+    // Small buffers are allocated first, then as many large buffers as fit.
+    EXPECT_EQ(3u, classStats(mPool.get(), kSmall).idleBuffers);
+    EXPECT_EQ(1u, classStats(mPool.get(), kLarge).idleBuffers);
+    EXPECT_EQ(kLarge + 3 * kSmall, liveBytes());
+    EXPECT_EQ(static_cast<int64_t>(liveBytes()), mPool->getStats().pooledBytes);
+}
+
+TEST_F(ImxBufferPoolTest, RecyclesReleasedBuffers) {
+    createPool(4 * kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle first, second;
+    ASSERT_EQ(0, mPool->acquire(kLarge, &first));
+    mPool->release(first);
+    ASSERT_EQ(0, mPool->acquire(kLarge, &second));
+    EXPECT_EQ(first, second);
+    mPool->release(second);
+
+    ImxBufferPool::ClassStats stats = classStats(mPool.get(), kLarge);
+    EXPECT_EQ(2u, stats.acquires);
+    EXPECT_EQ(1u, stats.allocations);   // Only the preallocated buffer.
+    EXPECT_EQ(1u, stats.idleBuffers);
+    EXPECT_EQ(0u, stats.usedBuffers);
+    EXPECT_EQ(1u, gLiveBuffers.size());
+}
+
+TEST_F(ImxBufferPoolTest, GrowsWhenAllBuffersAreUsed) {
+    createPool(4 * kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle buffers[3];
+    for (auto &buffer : buffers) {
+        ASSERT_EQ(0, mPool->acquire(kLarge, &buffer));
+    }
+    EXPECT_EQ(3u, classStats(mPool.get(), kLarge).usedBuffers);
+    for (auto &buffer : buffers) {
+        mPool->release(buffer);
+    }
+
+    // The grown class keeps all buffers.
+    EXPECT_EQ(3u, classStats(mPool.get(), kLarge).idleBuffers);
+    EXPECT_EQ(3u, gLiveBuffers.size());
+    EXPECT_EQ(0u, mPool->getStats().unpooledAcquires);
+}
+
+TEST_F(ImxBufferPoolTest, BuffersOverBudgetAreFreedWhenReleased) {
+    createPool(kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle pooled, unpooled;
+    ASSERT_EQ(0, mPool->acquire(kLarge, &pooled));
+    ASSERT_EQ(0, mPool->acquire(kLarge, &unpooled));
+    EXPECT_EQ(2u, gLiveBuffers.size());
+    EXPECT_EQ(1u, mPool->getStats().unpooledAcquires);
+
+    mPool->release(unpooled);
+    EXPECT_EQ(0u, gLiveBuffers.count(unpooled));
+    mPool->release(pooled);
+    EXPECT_EQ(1u, gLiveBuffers.count(pooled));
+    EXPECT_EQ(static_cast<int64_t>(kLarge), mPool->getStats().pooledBytes);
+}
+
+TEST_F(ImxBufferPoolTest, UnconfiguredSizesAreNotPooled) {
+    createPool(4 * kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge }, /*buffersPerClass*/0));
+
+    ImxDeviceBufferHandle buffer;
+    ASSERT_EQ(0, mPool->acquire(kSmall, &buffer));
+    mPool->release(buffer);
+    EXPECT_TRUE(gLiveBuffers.empty());
+    EXPECT_EQ(1u, mPool->getStats().unpooledAcquires);
+}
+
+TEST_F(ImxBufferPoolTest, GrowingEvictsIdleBuffersOfOtherClasses) {
+    createPool(kLarge + 2 * kSmall);
+    ASSERT_EQ(0, mPool->configure({ kLarge, kSmall }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle small[3];
+    for (auto &buffer : small) {
+        ASSERT_EQ(0, mPool->acquire(kSmall, &buffer));
+    }
+
+    // The third small buffer only fits in the budget by evicting the idle large buffer.
+    EXPECT_EQ(0u, classStats(mPool.get(), kLarge).idleBuffers);
+    EXPECT_EQ(3u, classStats(mPool.get(), kSmall).usedBuffers);
+    EXPECT_EQ(0u, mPool->getStats().unpooledAcquires);
+    EXPECT_EQ(3 * kSmall, liveBytes());
+
+    for (auto &buffer : small) {
+        mPool->release(buffer);
+    }
+}
+
+TEST_F(ImxBufferPoolTest, GrowingEvictsBeforeAllocating) {
+    // There is no memory beyond the budget, so the idle large buffer must be freed before the
+    // third small buffer can be allocated.
+    createPool(kLarge + 2 * kSmall);
+    gMemoryBytes = kLarge + 2 * kSmall;
+    ASSERT_EQ(0, mPool->configure({ kLarge, kSmall }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle small[3];
+    for (auto &buffer : small) {
+        ASSERT_EQ(0, mPool->acquire(kSmall, &buffer));
+    }
+    EXPECT_EQ(0u, mPool->getStats().unpooledAcquires);
+    EXPECT_EQ(3 * kSmall, liveBytes());
+
+    for (auto &buffer : small) {
+        mPool->release(buffer);
+    }
+}
+
+TEST_F(ImxBufferPoolTest, ReconfigureFreesPreviousClasses) {
+    createPool(4 * kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge, kSmall }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle used;
+    ASSERT_EQ(0, mPool->acquire(kLarge, &used));
+
+    ASSERT_EQ(0, mPool->configure({ kSmall }, /*buffersPerClass*/1));
+    EXPECT_EQ(1u, classStats(mPool.get(), kSmall).idleBuffers);
+    // The used buffer of the previous class is freed when it's released.
+    EXPECT_EQ(2u, gLiveBuffers.size());
+    mPool->release(used);
+    EXPECT_EQ(0u, gLiveBuffers.count(used));
+    EXPECT_EQ(1u, mPool->getStats().classes.size());
+    EXPECT_EQ(static_cast<int64_t>(kSmall), mPool->getStats().pooledBytes);
+}
+
+TEST_F(ImxBufferPoolTest, FreeIdleBuffers) {
+    createPool(4 * kLarge);
+    ASSERT_EQ(0, mPool->configure({ kLarge, kSmall }, /*buffersPerClass*/2));
+
+    ImxDeviceBufferHandle used;
+    ASSERT_EQ(0, mPool->acquire(kLarge, &used));
+    mPool->freeIdleBuffers();
+    EXPECT_EQ(1u, gLiveBuffers.size());
+    EXPECT_EQ(static_cast<int64_t>(kLarge), mPool->getStats().pooledBytes);
+
+    // Released buffers are pooled again.
+    mPool->release(used);
+    EXPECT_EQ(1u, classStats(mPool.get(), kLarge).idleBuffers);
+}
+
+TEST_F(ImxBufferPoolTest, AllocationFailure) {
+    createPool(4 * kLarge);
+    gFailAllocation = true;
+    EXPECT_EQ(-ENOMEM, mPool->configure({ kLarge }, /*buffersPerClass*/1));
+
+    ImxDeviceBufferHandle buffer;
+    gFailAllocation = true;
+    EXPECT_EQ(-ENOMEM, mPool->acquire(kLarge, &buffer));
+    EXPECT_EQ(-EINVAL, mPool->acquire(kLarge, nullptr));
+
+    ASSERT_EQ(0, mPool->acquire(kLarge, &buffer));
+    mPool->release(buffer);
+    EXPECT_EQ(1u, classStats(mPool.get(), kLarge).idleBuffers);
+}
+
+}  // anonymous namespace
+
+// Fake IMX buffer allocation.
+ImxError ImxCreateDeviceBufferManaged(ImxMemoryAllocatorHandle /*memory_allocator*/,
+        uint64_t size_bytes, uint32_t /*align_bytes*/, int /*heap_type*/, int /*flags*/,
+        ImxDeviceBufferHandle *buffer_handle_ptr) {
+    if (gFailAllocation) {
+        gFailAllocation = false;
+        return IMX_NOMEM;
+    }
+    if (liveBytes() + size_bytes > gMemoryBytes) return IMX_NOMEM;
+    *buffer_handle_ptr = reinterpret_cast<ImxDeviceBufferHandle>(new char);
+    gLiveBuffers[*buffer_handle_ptr] = size_bytes;
+    return IMX_SUCCESS;
+}
+
+ImxError ImxDeleteDeviceBuffer(ImxDeviceBufferHandle buffer_handle) {
+    if (gLiveBuffers.erase(buffer_handle) == 0) {
+        ADD_FAILURE() << "Deleting unknown buffer " << buffer_handle;
+        return IMX_INVALID;
+    }
+    delete reinterpret_cast<char*>(buffer_handle);
+    return IMX_SUCCESS;
+}
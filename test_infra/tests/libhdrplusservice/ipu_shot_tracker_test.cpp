@@ -0,0 +1,144 @@
+/*
+ * IpuShotTracker tests.
+ *
+ * FakeSourceCapture applies the tracker's decisions the way SourceCaptureBlock
+ * does, so the tests check when MIPI capture runs and when the clock goes back
+ * to capture mode as HDR+ shots start, hand off their payload frames and
+ * finish.
+ */
+
+#define LOG_TAG "ipu_shot_tracker_test"
+
+#include "IpuShotTracker.h"
+
+#include "gtest/gtest.h"
+
+using namespace pbcamera;
+
+namespace {
+
+// MIPI capture and clock state driven by an IpuShotTracker.
+struct FakeSourceCapture {
+    void notifyIpuProcessingStart() {
+        tracker.startShot();
+        capturing = false;
+        functionalClock = true;
+    }
+
+    void notifyIpuPayloadFramesAdded() {
+        if (tracker.payloadFramesAdded()) {
+            capturing = true;
+        }
+    }
+
+    void notifyIpuProcessingDone() {
+        if (tracker.finishShot()) {
+            capturing = true;
+            functionalClock = false;
+        }
+    }
+
+    IpuShotTracker tracker;
+    bool capturing = true;
+    bool functionalClock = false;
+};
+
+TEST(IpuShotTrackerTest, SingleShot) {
+    FakeSourceCapture source;
+
+    source.notifyIpuProcessingStart();
+    EXPECT_FALSE(source.capturing);
+    EXPECT_TRUE(source.functionalClock);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 1u);
+
+    source.notifyIpuPayloadFramesAdded();
+    EXPECT_TRUE(source.capturing);
+    EXPECT_TRUE(source.functionalClock);
+
+    source.notifyIpuProcessingDone();
+    EXPECT_TRUE(source.capturing);
+    EXPECT_FALSE(source.functionalClock);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 0u);
+}
+
+// Shot 2's frames are captured and handed off while shot 1 is processed, and
+// shot 1 finishing does not take the clock away from shot 2.
+TEST(IpuShotTrackerTest, TwoShotsOverlap) {
+    FakeSourceCapture source;
+
+    source.notifyIpuProcessingStart();
+    source.notifyIpuPayloadFramesAdded();
+    ASSERT_TRUE(source.capturing);
+
+    source.notifyIpuProcessingStart();
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 2u);
+    EXPECT_FALSE(source.capturing);
+
+    source.notifyIpuPayloadFramesAdded();
+    EXPECT_TRUE(source.capturing);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 2u);
+
+    source.notifyIpuProcessingDone();
+    EXPECT_TRUE(source.functionalClock);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 1u);
+
+    source.notifyIpuProcessingDone();
+    EXPECT_FALSE(source.functionalClock);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 0u);
+}
+
+// A shot finishing while the next one hands off its payload frames neither
+// resumes capture nor restores the clock.
+TEST(IpuShotTrackerTest, ShotDoneWhileAddingPayloadFrames) {
+    FakeSourceCapture source;
+
+    source.notifyIpuProcessingStart();
+    source.notifyIpuPayloadFramesAdded();
+    source.notifyIpuProcessingStart();
+
+    source.notifyIpuProcessingDone();
+    EXPECT_FALSE(source.capturing);
+    EXPECT_TRUE(source.functionalClock);
+
+    source.notifyIpuPayloadFramesAdded();
+    EXPECT_TRUE(source.capturing);
+    EXPECT_TRUE(source.functionalClock);
+
+    source.notifyIpuProcessingDone();
+    EXPECT_FALSE(source.functionalClock);
+}
+
+// A shot that fails to start is done right away and leaves the shot in flight
+// alone.
+TEST(IpuShotTrackerTest, ShotFailsToStart) {
+    FakeSourceCapture source;
+
+    source.notifyIpuProcessingStart();
+    source.notifyIpuPayloadFramesAdded();
+
+    source.notifyIpuProcessingStart();
+    source.notifyIpuPayloadFramesAdded();
+    source.notifyIpuProcessingDone();
+    EXPECT_TRUE(source.capturing);
+    EXPECT_TRUE(source.functionalClock);
+    EXPECT_EQ(source.tracker.getShotsInFlight(), 1u);
+
+    source.notifyIpuProcessingDone();
+    EXPECT_FALSE(source.functionalClock);
+}
+
+TEST(IpuShotTrackerTest, UnmatchedNotifications) {
+    IpuShotTracker tracker;
+
+    EXPECT_FALSE(tracker.payloadFramesAdded());
+    EXPECT_FALSE(tracker.finishShot());
+    EXPECT_EQ(tracker.getShotsInFlight(), 0u);
+
+    tracker.startShot();
+    EXPECT_TRUE(tracker.payloadFramesAdded());
+    EXPECT_FALSE(tracker.payloadFramesAdded());
+    EXPECT_TRUE(tracker.finishShot());
+    EXPECT_FALSE(tracker.finishShot());
+}
+
+}  // namespace
@@ -0,0 +1,99 @@
+/*
+ * YuvCopier microbenchmark.
+ *
+ * Times copying a 12MP NV12 final image to an output buffer with a padded
+ * stride, as HdrPlusProcessingBlock does for outputs the final image cannot be
+ * attached to.  The "row_memcpy" kernel is the previous row-by-row memcpy on
+ * the calling thread, kept here as the baseline.  "scalar" and "neon" are
+ * YuvCopier's kernels with 1 to --max-threads threads, copying the same format
+ * ("copy") or to NV21 ("swap_uv").  Reports the p50/p99 wall time of one copy
+ * and the resulting throughput, as CSV or JSON on stdout.
+ *
+ * Usage:
+ *   yuv_copier_bench [--json] [--iterations=N] [--max-threads=N]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <vector>
+
+#include "YuvCopier.h"
+#include "test_helpers.h"
+
+using namespace pbcamera;
+using namespace test_helpers;
+
+namespace {
+
+const uint32_t kDefaultMaxThreads = 4;
+const uint32_t kWidth = 4032;
+const uint32_t kHeight = 3024;
+const size_t kDstPadding = 64;
+
+// The previous HdrPlusProcessingBlock::copyBuffer().
+void rowMemcpy(const YuvCopySource &src, const YuvCopyDest &dst) {
+    for (uint32_t y = 0; y < src.height; y++) {
+        memcpy(dst.luma + y * dst.lumaStride, src.luma + y * src.lumaStride, src.width);
+    }
+    for (uint32_t y = 0; y < src.height / 2; y++) {
+        memcpy(dst.chroma + y * dst.chromaStride, src.chroma + y * src.chromaStride, src.width);
+    }
+}
+
+// Time copy and print its p50/p99 wall time and throughput.
+void runCase(const BenchOptions &options, BenchPrinter *printer, const char *kernel,
+        const char *operation, uint32_t threads, const std::function<void()> &copy) {
+    std::vector<double> timesUs = timeRuns(options.iterations, copy);
+    double p50Us = percentile(timesUs, 0.50);
+    // Each copy reads and writes the image once.
+    double imageBytes = kWidth * kHeight * 3 / 2;
+    printer->printRow({ kernel, operation, std::to_string(threads), formatNumber(p50Us, 0),
+            formatNumber(percentile(timesUs, 0.99), 0),
+            formatNumber(2 * imageBytes / (p50Us * 1000), 2) });
+}
+
+}  // anonymous namespace
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    uint32_t maxThreads = kDefaultMaxThreads;
+    bool validOptions = true;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--max-threads=", 14) == 0) {
+            maxThreads = atoi(argv[i] + 14);
+        } else if (!parseBenchOption(argv[i], &options)) {
+            validOptions = false;
+        }
+    }
+    if (!validOptions || options.iterations <= 0 || maxThreads == 0) {
+        fprintf(stderr, "usage: %s [--json] [--iterations=N] [--max-threads=N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    YuvTestImage src(kWidth, kHeight, /*padding*/0);
+    src.fill(31);
+    YuvTestImage dstImage(kWidth, kHeight, kDstPadding);
+    YuvCopyDest dst = dstImage.as<YuvCopyDest>();
+
+    BenchPrinter printer(options.json,
+            { "kernel", "operation", "threads", "p50_us", "p99_us", "gb_per_s" });
+    runCase(options, &printer, "row_memcpy", "copy", 1,
+            [&]() { rowMemcpy(src.as<YuvCopySource>(), dst); });
+
+    for (bool useNeon : { false, true }) {
+        if (useNeon && !YuvCopier::isNeonAvailable()) continue;
+        for (bool swapChroma : { false, true }) {
+            for (uint32_t threads = 1; threads <= maxThreads; threads *= 2) {
+                YuvCopier copier(threads, useNeon);
+                runCase(options, &printer, useNeon ? "neon" : "scalar",
+                        swapChroma ? "swap_uv" : "copy", threads,
+                        [&]() { copier.copy(src.as<YuvCopySource>(), dst, swapChroma); });
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/*
+ * YuvCopier tests.
+ *
+ * Checks copies with every thread count and kernel against a straightforward
+ * per-pixel reference, including odd sizes, padded strides, NV12 <-> NV21
+ * chroma swaps and copies from several threads at once.
+ */
+
+#define LOG_TAG "yuv_copier_test"
+
+#include <errno.h>
+#include <stdint.h>
+#include <algorithm>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "YuvCopier.h"
+
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+
+using namespace pbcamera;
+
+namespace {
+
+using test_helpers::YuvTestImage;
+using test_helpers::kPadding;
+
+// Per-pixel reference of YuvCopier::copy().
+void referenceCopy(const YuvTestImage &src, YuvTestImage *dst, bool swapChroma) {
+    uint32_t width = std::min(src.width, dst->width);
+    uint32_t height = std::min(src.height, dst->height);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            dst->luma[y * dst->lumaStride + x] = src.luma[y * src.lumaStride + x];
+        }
+    }
+    for (uint32_t y = 0; y < height / 2; y++) {
+        for (uint32_t x = 0; x < (width + 1) / 2 * 2; x++) {
+            uint32_t srcX = swapChroma ? (x ^ 1) : x;
+            dst->chroma[y * dst->chromaStride + x] = src.chroma[y * src.chromaStride + srcX];
+        }
+    }
+}
+
+struct CopyParams {
+    uint32_t width;
+    uint32_t height;
+    size_t padding;
+};
+
+const CopyParams kCopyParams[] = {
+    { 2, 2, 0 },
+    { 17, 9, 0 },       // Odd size, shorter than a NEON vector tail.
+    { 64, 64, 0 },
+    { 130, 67, 30 },    // Odd height with padding.
+    { 640, 480, 64 },
+    { 1023, 511, 1 },   // More rows than needed for several threads.
+};
+
+class YuvCopierTest : public ::testing::TestWithParam<std::tuple<uint32_t, bool, bool>> {};
+
+TEST_P(YuvCopierTest, MatchesReference) {
+    uint32_t threadCount = std::get<0>(GetParam());
+    bool useNeon = std::get<1>(GetParam());
+    bool swapChroma = std::get<2>(GetParam());
+
+    YuvCopier copier(threadCount, useNeon);
+    for (const CopyParams &params : kCopyParams) {
+        SCOPED_TRACE(testing::Message() << params.width << "x" << params.height << " padding "
+                << params.padding);
+        YuvTestImage src(params.width, params.height, params.padding);
+        src.fill(42);
+        YuvTestImage expected(src.width, src.height, src.padding);
+        YuvTestImage actual(src.width, src.height, src.padding);
+
+        referenceCopy(src, &expected, swapChroma);
+        ASSERT_EQ(0, copier.copy(src.as<YuvCopySource>(), actual.as<YuvCopyDest>(),
+                swapChroma));
+        EXPECT_EQ(expected.luma, actual.luma);
+        EXPECT_EQ(expected.chroma, actual.chroma);
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(AllKernels, YuvCopierTest, ::testing::Combine(
+        ::testing::Values(0u, 1u, 2u, 3u, 8u), ::testing::Bool(), ::testing::Bool()));
+
+TEST(YuvCopier, NeonMatchesScalar) {
+    YuvCopier scalar(/*threadCount*/1, /*useNeon*/false);
+    YuvCopier neon(/*threadCount*/4, /*useNeon*/true);
+
+    YuvTestImage src(4032, 3024, /*padding*/64);
+    src.fill(7);
+    for (bool swapChroma : { false, true }) {
+        YuvTestImage expected(src.width, src.height, src.padding);
+        YuvTestImage actual(src.width, src.height, src.padding);
+        ASSERT_EQ(0, scalar.copy(src.as<YuvCopySource>(), expected.as<YuvCopyDest>(),
+                swapChroma));
+        ASSERT_EQ(0, neon.copy(src.as<YuvCopySource>(), actual.as<YuvCopyDest>(), swapChroma));
+        EXPECT_EQ(expected.luma, actual.luma);
+        EXPECT_EQ(expected.chroma, actual.chroma);
+    }
+}
+
+TEST(YuvCopier, CopiesOverlappingRegion) {
+    YuvCopier copier(/*threadCount*/2);
+
+    // A larger source is cropped to the destination and a larger destination is only partially
+    // written.
+    YuvTestImage large(200, 150, /*padding*/8);
+    large.fill(3);
+    YuvTestImage small(120, 90, /*padding*/0);
+    small.fill(9);
+
+    YuvTestImage expectedSmall(small.width, small.height, small.padding);
+    YuvTestImage actualSmall(small.width, small.height, small.padding);
+    referenceCopy(large, &expectedSmall, /*swapChroma*/true);
+    ASSERT_EQ(0, copier.copy(large.as<YuvCopySource>(), actualSmall.as<YuvCopyDest>(),
+            /*swapChroma*/true));
+    EXPECT_EQ(expectedSmall.luma, actualSmall.luma);
+    EXPECT_EQ(expectedSmall.chroma, actualSmall.chroma);
+
+    YuvTestImage expectedLarge(large.width, large.height, large.padding);
+    YuvTestImage actualLarge(large.width, large.height, large.padding);
+    referenceCopy(small, &expectedLarge, /*swapChroma*/false);
+    ASSERT_EQ(0, copier.copy(small.as<YuvCopySource>(), actualLarge.as<YuvCopyDest>(),
+            /*swapChroma*/false));
+    EXPECT_EQ(expectedLarge.luma, actualLarge.luma);
+    EXPECT_EQ(expectedLarge.chroma, actualLarge.chroma);
+}
+
+TEST(YuvCopier, OddHeightStaysInChromaPlane) {
+    // Split 259 rows across 4 threads so the last chunk ends on the odd luma row, whose chroma row
+    // would be past the height / 2 rows of the chroma plane.
+    YuvCopier copier(/*threadCount*/4);
+    YuvTestImage src(96, 259, /*padding*/0);
+    src.fill(5);
+    // Mark the guard row of the source, so copying it shows up in the destination.
+    std::fill(src.chroma.begin() + src.chromaPlaneBytes(), src.chroma.end(), 0);
+    YuvTestImage dst(src.width, src.height, src.padding);
+
+    ASSERT_EQ(0, copier.copy(src.as<YuvCopySource>(), dst.as<YuvCopyDest>(),
+            /*swapChroma*/false));
+
+    size_t chromaBytes = dst.chromaPlaneBytes();
+    EXPECT_TRUE(std::equal(src.chroma.begin(), src.chroma.begin() + chromaBytes,
+            dst.chroma.begin()));
+    EXPECT_TRUE(std::all_of(dst.chroma.begin() + chromaBytes, dst.chroma.end(),
+            [](uint8_t value) { return value == kPadding; }));
+}
+
+TEST(YuvCopier, CopiesConcurrently) {
+    // Copies from several threads share the copier's workers.
+    YuvCopier copier(/*threadCount*/3);
+    YuvTestImage src(320, 241, /*padding*/16);
+    src.fill(11);
+    YuvTestImage expected(src.width, src.height, src.padding);
+    referenceCopy(src, &expected, /*swapChroma*/true);
+
+    std::vector<YuvTestImage> actual(4, YuvTestImage(src.width, src.height, src.padding));
+    std::vector<std::thread> threads;
+    for (auto &image : actual) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 20; i++) {
+                EXPECT_EQ(0, copier.copy(src.as<YuvCopySource>(), image.as<YuvCopyDest>(),
+                        /*swapChroma*/true));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto &image : actual) {
+        EXPECT_EQ(expected.luma, image.luma);
+        EXPECT_EQ(expected.chroma, image.chroma);
+    }
+}
+
+TEST(YuvCopier, RejectsInvalidImages) {
+    YuvCopier copier(/*threadCount*/1);
+    YuvTestImage src(64, 32, /*padding*/0);
+    src.fill(1);
+    YuvTestImage dst(src.width, src.height, src.padding);
+
+    YuvCopySource noLuma = src.as<YuvCopySource>();
+    noLuma.luma = nullptr;
+    EXPECT_EQ(-EINVAL, copier.copy(noLuma, dst.as<YuvCopyDest>(), /*swapChroma*/false));
+
+    YuvCopyDest noChroma = dst.as<YuvCopyDest>();
+    noChroma.chroma = nullptr;
+    EXPECT_EQ(-EINVAL, copier.copy(src.as<YuvCopySource>(), noChroma, /*swapChroma*/false));
+
+    YuvCopyDest shortStride = dst.as<YuvCopyDest>();
+    shortStride.lumaStride = dst.width - 1;
+    EXPECT_EQ(-EINVAL, copier.copy(src.as<YuvCopySource>(), shortStride, /*swapChroma*/false));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,97 @@
+/*
+ * YuvResampler microbenchmark.
+ *
+ * Times resampling a 12MP NV12 final image to the outputs of a typical
+ * capture request on the CPU: a 1080p postview cropped to 16:9, a 640x480
+ * preview-sized YUV and a 320x240 thumbnail.  "separate" resamples each output
+ * with its own call, reading the full source once per output as independent
+ * resamples do.  "cascade" resamples all outputs in one call that shares the
+ * 2x2-averaged levels.  Both run with the scalar and, when available, NEON
+ * kernels.  Reports the p50/p99 wall time of resampling all outputs, as CSV or
+ * JSON on stdout.
+ *
+ * Usage:
+ *   yuv_resampler_bench [--json] [--iterations=N]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <vector>
+
+#include "YuvResampler.h"
+#include "test_helpers.h"
+
+using namespace pbcamera;
+using namespace test_helpers;
+
+namespace {
+
+const uint32_t kWidth = 4032;
+const uint32_t kHeight = 3024;
+
+// Output sizes and the center crops of the source they are resampled from.
+const struct {
+    uint32_t width;
+    uint32_t height;
+    int32_t cropY0;
+    int32_t cropY1;
+} kOutputs[] = {
+    { 1920, 1080, 378, 2646 },
+    { 640, 480, 0, kHeight },
+    { 320, 240, 0, kHeight },
+};
+
+// Time resampling all outputs and print the p50/p99 wall time.
+void runCase(const BenchOptions &options, BenchPrinter *printer, const char *kernel,
+        const char *mode, const std::function<void()> &resample) {
+    std::vector<double> timesUs = timeRuns(options.iterations, resample);
+    printer->printRow({ kernel, mode, formatNumber(percentile(timesUs, 0.50), 0),
+            formatNumber(percentile(timesUs, 0.99), 0) });
+}
+
+}  // anonymous namespace
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    bool validOptions = true;
+    for (int i = 1; i < argc; i++) {
+        validOptions = validOptions && parseBenchOption(argv[i], &options);
+    }
+    if (!validOptions || options.iterations <= 0) {
+        fprintf(stderr, "usage: %s [--json] [--iterations=N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    YuvTestImage srcImage(kWidth, kHeight, /*padding*/0);
+    srcImage.fill(31);
+    YuvCopySource src = srcImage.as<YuvCopySource>();
+
+    std::vector<YuvTestImage> dstImages;
+    for (auto &output : kOutputs) {
+        dstImages.emplace_back(output.width, output.height, /*padding*/0);
+    }
+    std::vector<YuvResampleOutput> outputs;
+    for (size_t i = 0; i < dstImages.size(); i++) {
+        outputs.push_back({ dstImages[i].as<YuvCopyDest>(), /*swapChroma*/false, 0,
+                kOutputs[i].cropY0, kWidth, kOutputs[i].cropY1 });
+    }
+
+    BenchPrinter printer(options.json, { "kernel", "mode", "p50_us", "p99_us" });
+    for (bool useNeon : { false, true }) {
+        if (useNeon && !YuvCopier::isNeonAvailable()) continue;
+        YuvResampler resampler(useNeon);
+        const char *kernel = useNeon ? "neon" : "scalar";
+
+        runCase(options, &printer, kernel, "separate", [&]() {
+            for (auto &output : outputs) {
+                resampler.resample(src, { output });
+            }
+        });
+        runCase(options, &printer, kernel, "cascade",
+                [&]() { resampler.resample(src, outputs); });
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/*
+ * YuvResampler tests.
+ *
+ * Checks same-size resamples are exact copies, that downscales stay close to
+ * a per-pixel box filter of the source, that NEON matches the scalar kernels,
+ * that outputs sharing the cascade of 2x2-averaged levels match resampling each
+ * output on its own, and that invalid images and crops are rejected.
+ */
+
+#define LOG_TAG "yuv_resampler_test"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "YuvResampler.h"
+
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+
+using namespace pbcamera;
+
+namespace {
+
+using test_helpers::YuvTestImage;
+
+YuvResampleOutput makeOutput(YuvTestImage *image, const YuvTestImage &src,
+        bool swapChroma = false) {
+    return { image->as<YuvCopyDest>(), swapChroma, 0, 0, static_cast<int32_t>(src.width),
+            static_cast<int32_t>(src.height) };
+}
+
+// Return the max absolute difference between the pixels of two images of the same size, or 256
+// if any byte outside of the pixels differs.
+int maxDifference(const YuvTestImage &a, const YuvTestImage &b) {
+    int maxDiff = 0;
+    for (size_t i = 0; i < a.luma.size(); i++) {
+        bool pixel = i % a.lumaStride < a.width;
+        int diff = abs(a.luma[i] - b.luma[i]);
+        maxDiff = std::max(maxDiff, pixel ? diff : (diff == 0 ? 0 : 256));
+    }
+    for (size_t i = 0; i < a.chroma.size(); i++) {
+        bool pixel = i < a.chromaPlaneBytes() && i % a.chromaStride < a.chromaRowBytes();
+        int diff = abs(a.chroma[i] - b.chroma[i]);
+        maxDiff = std::max(maxDiff, pixel ? diff : (diff == 0 ? 0 : 256));
+    }
+    return maxDiff;
+}
+
+TEST(YuvResampler, SameSizeIsExactCopy) {
+    for (bool useNeon : { false, true }) {
+        YuvResampler resampler(useNeon);
+        YuvTestImage src(130, 67, /*padding*/6);
+        src.fillSmooth(3);
+        YuvTestImage dst(src.width, src.height, /*padding*/6);
+        ASSERT_EQ(0, resampler.resample(src.as<YuvCopySource>(), { makeOutput(&dst, src) }));
+        EXPECT_EQ(src.luma, dst.luma);
+        EXPECT_EQ(src.chroma, dst.chroma);
+    }
+}
+
+TEST(YuvResampler, SwapsChroma) {
+    YuvResampler resampler;
+    YuvTestImage src(64, 32, /*padding*/0);
+    src.fillSmooth(5);
+    YuvTestImage dst(src.width, src.height, /*padding*/0);
+    ASSERT_EQ(0, resampler.resample(src.as<YuvCopySource>(),
+            { makeOutput(&dst, src, /*swapChroma*/true) }));
+    EXPECT_EQ(src.luma, dst.luma);
+    for (size_t i = 0; i < src.chromaPlaneBytes(); i++) {
+        ASSERT_EQ(src.chroma[i ^ 1], dst.chroma[i]) << "at " << i;
+    }
+}
+
+TEST(YuvResampler, NeonMatchesScalar) {
+    YuvResampler scalar(/*useNeon*/false);
+    YuvResampler neon(/*useNeon*/true);
+
+    YuvTestImage src(1011, 757, /*padding*/13);
+    src.fillSmooth(11);
+    const uint32_t kSizes[][2] = { { 1011, 757 }, { 640, 480 }, { 321, 241 }, { 96, 72 } };
+    for (auto &size : kSizes) {
+        SCOPED_TRACE(testing::Message() << size[0] << "x" << size[1]);
+        YuvTestImage expected(size[0], size[1], /*padding*/3);
+        YuvTestImage actual(size[0], size[1], /*padding*/3);
+        ASSERT_EQ(0, scalar.resample(src.as<YuvCopySource>(),
+                { makeOutput(&expected, src, true) }));
+        ASSERT_EQ(0, neon.resample(src.as<YuvCopySource>(), { makeOutput(&actual, src, true) }));
+        EXPECT_EQ(expected.luma, actual.luma);
+        EXPECT_EQ(expected.chroma, actual.chroma);
+    }
+}
+
+// A shot's full-size, postview and thumbnail outputs resampled together should match
+// resampling each of them on its own.
+TEST(YuvResampler, SharedLevelsMatchSeparateResamples) {
+    YuvResampler resampler;
+    YuvTestImage src(2016, 1512, /*padding*/32);
+    src.fillSmooth(17);
+
+    YuvTestImage large(2016, 1512, 0), medium(960, 720, 16), small(320, 240, 0), tiny(160, 90, 0);
+    std::vector<YuvTestImage*> images = { &large, &medium, &small, &tiny };
+
+    // 16:9 output from a 4:3 source is center cropped.
+    auto outputFor = [&](YuvTestImage *image) {
+        YuvResampleOutput output = makeOutput(image, src);
+        if (image == &tiny) {
+            output.cropY0 = 188;
+            output.cropY1 = 1322;
+        }
+        return output;
+    };
+
+    std::vector<YuvResampleOutput> outputs;
+    for (YuvTestImage *image : images) {
+        outputs.push_back(outputFor(image));
+    }
+    ASSERT_EQ(0, resampler.resample(src.as<YuvCopySource>(), outputs));
+
+    for (YuvTestImage *image : images) {
+        SCOPED_TRACE(testing::Message() << image->width << "x" << image->height);
+        YuvTestImage separate(image->width, image->height, image->lumaStride - image->width);
+        YuvResampleOutput output = outputFor(image);
+        output.image = separate.as<YuvCopyDest>();
+        ASSERT_EQ(0, resampler.resample(src.as<YuvCopySource>(), { output }));
+        EXPECT_EQ(0, maxDifference(separate, *image));
+    }
+}
+
+// Downscaled outputs should be close to the source averaged over each output pixel.
+TEST(YuvResampler, DownscaleMatchesBoxFilter) {
+    YuvResampler resampler;
+    YuvTestImage src(1024, 768, /*padding*/0);
+    src.fillSmooth(23);
+
+    for (uint32_t factor : { 2u, 4u, 8u, 16u }) {
+        SCOPED_TRACE(testing::Message() << "factor " << factor);
+        YuvTestImage dst(src.width / factor, src.height / factor, /*padding*/0);
+        ASSERT_EQ(0, resampler.resample(src.as<YuvCopySource>(), { makeOutput(&dst, src) }));
+
+        int maxDiff = 0;
+        for (uint32_t y = 0; y < dst.height; y++) {
+            for (uint32_t x = 0; x < dst.width; x++) {
+                uint32_t sum = 0;
+                for (uint32_t j = 0; j < factor; j++) {
+                    for (uint32_t i = 0; i < factor; i++) {
+                        sum += src.luma[(y * factor + j) * src.lumaStride + x * factor + i];
+                    }
+                }
+                int expected = (sum + factor * factor / 2) / (factor * factor);
+                maxDiff = std::max(maxDiff, abs(expected - dst.luma[y * dst.lumaStride + x]));
+            }
+        }
+        EXPECT_LE(maxDiff, 2);
+    }
+}
+
+TEST(YuvResampler, RejectsInvalidImages) {
+    YuvResampler resampler;
+    YuvTestImage src(64, 32, /*padding*/0);
+    src.fillSmooth(1);
+    YuvTestImage dst(32, 16, /*padding*/0);
+
+    YuvCopySource noLuma = src.as<YuvCopySource>();
+    noLuma.luma = nullptr;
+    EXPECT_EQ(-EINVAL, resampler.resample(noLuma, { makeOutput(&dst, src) }));
+
+    // A single row has no chroma row.
+    YuvTestImage oneRow(64, 1, /*padding*/0);
+    oneRow.fillSmooth(1);
+    EXPECT_EQ(-EINVAL, resampler.resample(oneRow.as<YuvCopySource>(),
+            { makeOutput(&dst, oneRow) }));
+
+    YuvResampleOutput noChroma = makeOutput(&dst, src);
+    noChroma.image.chroma = nullptr;
+    EXPECT_EQ(-EINVAL, resampler.resample(src.as<YuvCopySource>(), { noChroma }));
+
+    YuvResampleOutput shortStride = makeOutput(&dst, src);
+    shortStride.image.chromaStride = dst.width - 2;
+    EXPECT_EQ(-EINVAL, resampler.resample(src.as<YuvCopySource>(), { shortStride }));
+
+    YuvResampleOutput outsideCrop = makeOutput(&dst, src);
+    outsideCrop.cropX1 = src.width + 2;
+    EXPECT_EQ(-EINVAL, resampler.resample(src.as<YuvCopySource>(), { outsideCrop }));
+
+    YuvResampleOutput emptyCrop = makeOutput(&dst, src);
+    emptyCrop.cropY1 = emptyCrop.cropY0;
+    EXPECT_EQ(-EINVAL, resampler.resample(src.as<YuvCopySource>(), { emptyCrop }));
+
+    // Nothing is written if any output is invalid.
+    YuvTestImage untouched(dst.width, dst.height, /*padding*/0);
+    EXPECT_EQ(-EINVAL, resampler.resample(src.as<YuvCopySource>(),
+            { makeOutput(&dst, src), emptyCrop }));
+    EXPECT_EQ(untouched.luma, dst.luma);
+    EXPECT_EQ(untouched.chroma, dst.chroma);
+}
+
+}  // anonymous namespace
@@ -1140,6 +1140,7 @@ int main(int argc, char **argv) {
     int ch;
     int client = 1;
     int server_needs_flush = 0;  // 0 is not to flush.  Default is 0.
+    int client_print_stats = 0;  // Print EaselComm telemetry when done.
 
     const char *short_opt = "dh";
     struct option long_opt[] =
@@ -1147,6 +1148,7 @@ int main(int argc, char **argv) {
           {"daemon",  no_argument,   0, 'd'},
           {"flush",   no_argument,   &server_needs_flush, 1},
           {"help",    no_argument,   0, 'h'},
+          {"stats",   no_argument,   &client_print_stats, 1},
           {0, 0, 0, 0}
         };
 
@@ -1172,6 +1174,8 @@ int main(int argc, char **argv) {
                     "       client: ezlsh push <local-path> <remote-path>\n"
                     "       cliect: ezlsh exec \"<cmd>\",\n"
                     "               to catch stderr, please append \"2>&1\" after cmd.\n"
+                    "       client: --stats before any command prints the link\n"
+                    "               telemetry of the client to stderr when done.\n"
                     );
             exit(1);
         }
@@ -1249,6 +1253,9 @@ int main(int argc, char **argv) {
             shell_client_session();
         }
         logClient.stop();
+        if (client_print_stats) {
+            EaselComm::dumpTelemetry(STDERR_FILENO);
+        }
     } else {
         server_run(server_needs_flush);
     }